@@ -0,0 +1,266 @@
+#include <algorithm>
+
+#include "activation_index.hpp"
+#include "entity.hpp"
+#include "foreach.hpp"
+
+namespace {
+//the size of the cells in the grid, in pixels. It's chosen so a typical
+//object, with its activation border, covers a few cells, and the screen
+//covers a few dozen.
+const int CellSize = 256;
+
+//entities which are active over an area covering more cells than this
+//are checked every time instead of being put in the grid.
+const int MaxCells = 64;
+
+//queries are numbered across all indexes, since an entity can be in the
+//index of the level being left and the one being entered at once.
+int query_counter = 0;
+
+int cell_coord(int n)
+{
+	return n >= 0 ? n/CellSize : -((-n - 1)/CellSize) - 1;
+}
+
+void erase_entity(std::vector<entity_ptr>& v, const entity* e)
+{
+	for(std::vector<entity_ptr>::iterator i = v.begin(); i != v.end(); ++i) {
+		if(i->get() == e) {
+			v.erase(i);
+			return;
+		}
+	}
+}
+}
+
+activation_index::activation_index() : size_(0)
+{
+}
+
+activation_index::activation_index(const activation_index& o) : size_(0)
+{
+}
+
+activation_index& activation_index::operator=(const activation_index& o)
+{
+	return *this;
+}
+
+activation_index::~activation_index()
+{
+	clear();
+}
+
+void activation_index::add(const entity_ptr& e)
+{
+	activation_record& rec = e->activation();
+	if(rec.index == this) {
+		return;
+	}
+
+	rec.index = this;
+	rec.everywhere = true;
+	rec.dirty = true;
+	everywhere_.push_back(e);
+	dirty_.push_back(e);
+	++size_;
+}
+
+void activation_index::remove(const entity_ptr& e)
+{
+	activation_record& rec = e->activation();
+	if(rec.index == this) {
+		unlink(*e);
+		rec.index = NULL;
+		rec.dirty = false;
+		--size_;
+		return;
+	}
+
+	//the entity has been added to another index since, so we no longer
+	//know where it is in this one.
+	const int before = everywhere_.size();
+	erase_entity(everywhere_, e.get());
+	if(everywhere_.size() != before) {
+		--size_;
+		return;
+	}
+
+	bool found = false;
+	for(cell_map::iterator i = cells_.begin(); i != cells_.end(); ) {
+		const int before = i->second.size();
+		erase_entity(i->second, e.get());
+		found = found || i->second.size() != before;
+		if(i->second.empty()) {
+			cells_.erase(i++);
+		} else {
+			++i;
+		}
+	}
+
+	if(found) {
+		--size_;
+	}
+}
+
+void activation_index::rebuild(const std::vector<entity_ptr>& chars)
+{
+	clear();
+	foreach(const entity_ptr& e, chars) {
+		if(e) {
+			add(e);
+		}
+	}
+}
+
+void activation_index::clear()
+{
+	foreach(const entity_ptr& e, everywhere_) {
+		if(e->activation().index == this) {
+			e->activation().reset();
+		}
+	}
+
+	for(cell_map::iterator i = cells_.begin(); i != cells_.end(); ++i) {
+		foreach(const entity_ptr& e, i->second) {
+			if(e->activation().index == this) {
+				e->activation().reset();
+			}
+		}
+	}
+
+	everywhere_.clear();
+	cells_.clear();
+	dirty_.clear();
+	size_ = 0;
+}
+
+void activation_index::mark_dirty(entity& e)
+{
+	activation_record& rec = e.activation();
+	if(rec.index == this && !rec.dirty) {
+		rec.dirty = true;
+		dirty_.push_back(entity_ptr(&e));
+	}
+}
+
+int activation_index::find_candidates(const std::vector<rect>& areas, std::vector<entity_ptr>* result)
+{
+	foreach(const entity_ptr& e, dirty_) {
+		//entities which were removed, or were marked more than once, are
+		//no longer dirty.
+		if(e->activation().index == this && e->activation().dirty) {
+			update(*e);
+		}
+	}
+
+	dirty_.clear();
+
+	const int query = ++query_counter;
+
+	foreach(const entity_ptr& e, everywhere_) {
+		e->activation().query = query;
+		result->push_back(e);
+	}
+
+	foreach(const rect& area, areas) {
+		const int x1 = cell_coord(area.x());
+		const int y1 = cell_coord(area.y());
+		const int x2 = cell_coord(area.x2());
+		const int y2 = cell_coord(area.y2());
+		for(int y = y1; y <= y2; ++y) {
+			for(int x = x1; x <= x2; ++x) {
+				cell_map::const_iterator i = cells_.find(cell_pos(x, y));
+				if(i == cells_.end()) {
+					continue;
+				}
+
+				foreach(const entity_ptr& e, i->second) {
+					activation_record& rec = e->activation();
+					if(rec.query != query) {
+						rec.query = query;
+						result->push_back(e);
+					}
+				}
+			}
+		}
+	}
+	return query;
+}
+
+void activation_index::update(entity& e)
+{
+	activation_record& rec = e.activation();
+	rec.dirty = false;
+
+	rect area;
+	bool everywhere = !e.activation_bounds(&area);
+
+	int x1 = 0, y1 = 0, x2 = -1, y2 = -1;
+	if(!everywhere) {
+		x1 = cell_coord(area.x());
+		y1 = cell_coord(area.y());
+		x2 = cell_coord(area.x2());
+		y2 = cell_coord(area.y2());
+		everywhere = (x2 - x1 + 1)*(y2 - y1 + 1) > MaxCells;
+	}
+
+	if(everywhere) {
+		if(!rec.everywhere) {
+			unlink(e);
+			rec.everywhere = true;
+			everywhere_.push_back(entity_ptr(&e));
+		}
+		return;
+	}
+
+	if(!rec.everywhere && rec.x1 == x1 && rec.y1 == y1 && rec.x2 == x2 && rec.y2 == y2) {
+		//most entities which move stay in the same cells.
+		return;
+	}
+
+	unlink(e);
+	rec.everywhere = false;
+	rec.x1 = x1;
+	rec.y1 = y1;
+	rec.x2 = x2;
+	rec.y2 = y2;
+	link(entity_ptr(&e));
+}
+
+void activation_index::link(const entity_ptr& e)
+{
+	const activation_record& rec = e->activation();
+	for(int y = rec.y1; y <= rec.y2; ++y) {
+		for(int x = rec.x1; x <= rec.x2; ++x) {
+			cells_[cell_pos(x, y)].push_back(e);
+		}
+	}
+}
+
+void activation_index::unlink(entity& e)
+{
+	activation_record& rec = e.activation();
+	if(rec.everywhere) {
+		erase_entity(everywhere_, &e);
+		return;
+	}
+
+	for(int y = rec.y1; y <= rec.y2; ++y) {
+		for(int x = rec.x1; x <= rec.x2; ++x) {
+			cell_map::iterator i = cells_.find(cell_pos(x, y));
+			if(i == cells_.end()) {
+				continue;
+			}
+
+			erase_entity(i->second, &e);
+			if(i->second.empty()) {
+				cells_.erase(i);
+			}
+		}
+	}
+
+	rec.x1 = rec.y1 = 0;
+	rec.x2 = rec.y2 = -1;
+}
@@ -0,0 +1,98 @@
+#ifndef ACTIVATION_INDEX_HPP_INCLUDED
+#define ACTIVATION_INDEX_HPP_INCLUDED
+
+#include <map>
+#include <vector>
+
+#include "entity_fwd.hpp"
+#include "geometry.hpp"
+
+class activation_index;
+
+//the bookkeeping an entity carries about its place in an activation index.
+//Copies of an entity start out not being in any index.
+struct activation_record
+{
+	activation_record() { reset(); }
+	activation_record(const activation_record&) { reset(); }
+	activation_record& operator=(const activation_record&) { return *this; }
+
+	void reset() {
+		index = NULL;
+		dirty = false;
+		everywhere = false;
+		x1 = y1 = 0;
+		x2 = y2 = -1;
+		query = selected = active = 0;
+	}
+
+	activation_index* index;
+	bool dirty;
+
+	//true if the entity has to be checked every cycle, otherwise the
+	//cells it's in are given by x1,y1 -> x2,y2, inclusive.
+	bool everywhere;
+	int x1, y1, x2, y2;
+
+	//the last query the entity was found by.
+	int query;
+
+	//used by the level when it builds its list of active entities: the
+	//last query the entity was found to be active by, and the last query
+	//after which it was in the level's list of active entities.
+	int selected, active;
+};
+
+//a spatial index of the entities in a level, used to find those which
+//might be active without asking every entity in the level. Entities which
+//can say where they'll be active are kept in a grid; the rest are checked
+//every time. Entities tell their index when they change, and it is brought
+//up to date when it's next queried, so the cost of a query depends on the
+//number of entities on and near the screen, not on the size of the level.
+class activation_index
+{
+public:
+	activation_index();
+
+	//copies of an index start out empty, since an entity can only be in
+	//one index at once.
+	activation_index(const activation_index& o);
+	activation_index& operator=(const activation_index& o);
+	~activation_index();
+
+	void add(const entity_ptr& e);
+	void remove(const entity_ptr& e);
+
+	//replaces the contents of the index with the given entities.
+	void rebuild(const std::vector<entity_ptr>& chars);
+	void clear();
+
+	//tells the index the entity may have changed where it's active.
+	void mark_dirty(entity& e);
+
+	//appends every entity which might be active with the screen at any of
+	//the given areas to result, each one once. Entities which aren't found
+	//are guaranteed to be inactive. Returns a number identifying the
+	//query, which is unique across all indexes.
+	int find_candidates(const std::vector<rect>& areas, std::vector<entity_ptr>* result);
+
+	int size() const { return size_; }
+
+private:
+	void update(entity& e);
+	void link(const entity_ptr& e);
+	void unlink(entity& e);
+
+	typedef std::pair<int, int> cell_pos;
+	typedef std::map<cell_pos, std::vector<entity_ptr> > cell_map;
+	cell_map cells_;
+
+	//entities which have to be checked every cycle.
+	std::vector<entity_ptr> everywhere_;
+
+	std::vector<entity_ptr> dirty_;
+
+	int size_;
+};
+
+#endif
@@ -10,6 +10,7 @@
 
 #include "background.hpp"
 #include "color_utils.hpp"
+#include "draw_stats.hpp"
 #include "filesystem.hpp"
 #include "foreach.hpp"
 #include "formatter.hpp"
@@ -283,12 +284,14 @@ void background::draw_layers(int x, int y, const rect& area_ref, const std::vect
 			if(!blit_queue.empty() && (i+1 == layers_.end() || i->texture != (i+1)->texture || (i+1)->foreground || i->blend != (i+1)->blend)) {
 				if(bg.blend == false) {
 					glDisable(GL_BLEND);
+					draw_stats::blend_change();
 				}
 				blit_queue.set_texture(bg.texture.get_id());
 				blit_queue.do_blit();
 				blit_queue.clear();
 				if(bg.blend == false) {
 					glEnable(GL_BLEND);
+					draw_stats::blend_change();
 				}
 			}
 
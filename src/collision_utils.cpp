@@ -1,9 +1,11 @@
 #include "asserts.hpp"
 #include "collision_utils.hpp"
+#include "custom_object.hpp"
 #include "foreach.hpp"
 #include "geometry.hpp"
 #include "level.hpp"
 #include "object_events.hpp"
+#include "unit_test.hpp"
 
 namespace {
 std::map<std::string, int> solid_dimensions;
@@ -332,6 +334,14 @@ bool place_entity_in_level_with_large_displacement(level& lvl, entity& e)
 	return true;
 }
 
+namespace {
+//a mask of the first n bits of a row, for rows compared 64 pixels at a time.
+uint64_t row_mask(int n)
+{
+	return n >= 64 ? ~uint64_t(0) : (uint64_t(1) << n) - 1;
+}
+}
+
 int entity_user_collision(const entity& a, const entity& b, collision_pair* areas_colliding, int buf_size)
 {
 	if(!rects_intersect(a.frame_rect(), b.frame_rect())) {
@@ -360,14 +370,22 @@ int entity_user_collision(const entity& a, const entity& b, collision_pair* area
 				const int time_b = b.time_in_frame();
 
 				//we only check every other pixel, since this gives us
-				//enough accuracy and is 4x faster.
+				//enough accuracy.
 				const int Stride = 2;
 				bool found = false;
 				const rect intersection = intersection_rect(rect_a, rect_b);
 				for(int y = intersection.y(); y <= intersection.y2() && !found; y += Stride) {
-					for(int x = intersection.x(); x <= intersection.x2(); x += Stride) {
-						if((area_a.no_alpha_check || !fa.is_alpha(x - a.x(), y - a.y(), time_a, a.face_right())) &&
-						   (area_b.no_alpha_check || !fb.is_alpha(x - b.x(), y - b.y(), time_b, b.face_right()))) {
+					for(int x = intersection.x(); x <= intersection.x2(); x += 64) {
+						uint64_t bits = row_mask(intersection.x2() - x + 1) & 0x5555555555555555ULL;
+						if(!area_a.no_alpha_check) {
+							bits &= fa.opaque_bits(x - a.x(), y - a.y(), time_a, a.face_right());
+						}
+
+						if(!area_b.no_alpha_check) {
+							bits &= fb.opaque_bits(x - b.x(), y - b.y(), time_b, b.face_right());
+						}
+
+						if(bits) {
 							found = true;
 							break;
 						}
@@ -447,9 +465,10 @@ bool entity_user_collision_specific_areas(const entity& a, const std::string& ar
 
 	const rect intersection = intersection_rect(rect_a, rect_b);
 	for(int y = intersection.y(); y <= intersection.y2(); ++y) {
-		for(int x = intersection.x(); x <= intersection.x2(); ++x) {
-			if(!fa.is_alpha(x - a.x(), y - a.y(), time_a, a.face_right()) &&
-			   !fb.is_alpha(x - b.x(), y - b.y(), time_b, b.face_right())) {
+		for(int x = intersection.x(); x <= intersection.x2(); x += 64) {
+			if(row_mask(intersection.x2() - x + 1) &
+			   fa.opaque_bits(x - a.x(), y - a.y(), time_a, a.face_right()) &
+			   fb.opaque_bits(x - b.x(), y - b.y(), time_b, b.face_right())) {
 				return true;
 			}
 		}
@@ -563,3 +582,24 @@ bool is_flightpath_clear(const level& lvl, const entity& e, const rect& area)
 
 	return true;
 }
+
+//checks for collisions between two sprites facing each other, at every
+//offset at which their frames overlap, as when objects pass through each
+//other.
+BENCHMARK(entity_user_collision_sprites)
+{
+	static const entity_ptr a(new custom_object("frogatto_playable", 0, 0, true));
+	static const entity_ptr b(new custom_object("frogatto_playable", 0, 0, false));
+	const int w = a->current_frame().width();
+	const int h = a->current_frame().height();
+
+	collision_pair areas[4];
+	BENCHMARK_LOOP {
+		for(int y = -h/2; y < h/2; y += 4) {
+			for(int x = -w/2; x < w/2; x += 4) {
+				b->set_pos(x, y);
+				entity_user_collision(*a, *b, areas, 4);
+			}
+		}
+	}
+}
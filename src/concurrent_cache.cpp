@@ -0,0 +1,181 @@
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "concurrent_cache.hpp"
+#include "foreach.hpp"
+#include "formatter.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+
+namespace {
+typedef concurrent_cache<std::string, boost::shared_ptr<int> > int_cache;
+
+boost::shared_ptr<int> make_int(int n)
+{
+	return boost::shared_ptr<int>(new int(n));
+}
+
+bool is_odd(const std::string& key, const boost::shared_ptr<int>& value)
+{
+	return *value%2 == 1;
+}
+
+void sum_values(int* sum, const std::string& key, const boost::shared_ptr<int>& value)
+{
+	*sum += *value;
+}
+
+size_t hundred_bytes(const std::string& key, const boost::shared_ptr<int>& value)
+{
+	return 100;
+}
+
+std::vector<std::string> make_keys(int count)
+{
+	std::vector<std::string> keys;
+	for(int n = 0; n != count; ++n) {
+		keys.push_back(formatter() << "images/tiles/key" << n << ".png");
+	}
+
+	return keys;
+}
+}
+
+UNIT_TEST(concurrent_cache_basic)
+{
+	int_cache cache;
+	for(int n = 0; n != 100; ++n) {
+		cache.put(formatter() << n, make_int(n));
+	}
+
+	CHECK_EQ(cache.size(), 100);
+	CHECK_EQ(*cache.get("42"), 42);
+	CHECK_EQ(cache.get("100").get() == NULL, true);
+	CHECK_EQ(cache.count("7"), 1);
+
+	cache.put("7", make_int(8));
+	CHECK_EQ(*cache.get("7"), 8);
+	CHECK_EQ(cache.size(), 100);
+
+	CHECK_EQ(*cache.take("8"), 8);
+	CHECK_EQ(cache.count("8"), 0);
+	cache.erase("9");
+	CHECK_EQ(cache.count("9"), 0);
+
+	cache.erase_if(is_odd);
+	CHECK_EQ(cache.size(), 50);
+
+	int sum = 0;
+	cache.for_each(boost::bind(sum_values, &sum, _1, _2));
+	CHECK_EQ(sum, 49*50 - 8 + 8);
+
+	const concurrent_cache_stats stats = cache.get_stats();
+	CHECK_EQ(stats.hits, 2);
+	CHECK_EQ(stats.misses, 1);
+
+	cache.clear();
+	CHECK_EQ(cache.size(), 0);
+}
+
+UNIT_TEST(concurrent_cache_budget)
+{
+	int_cache cache(int_cache::NumShards*300, hundred_bytes);
+	const std::vector<std::string> keys = make_keys(1000);
+	cache.put(keys[0], make_int(0));
+	for(int n = 1; n != keys.size(); ++n) {
+		cache.put(keys[n], make_int(n));
+
+		//an entry in constant use is never the one discarded.
+		CHECK(cache.get(keys[0]), "entry in use was discarded");
+		CHECK_LE(cache.size_in_bytes(), cache.budget());
+	}
+
+	CHECK_EQ(cache.count(keys.back()), 1);
+	CHECK_EQ(cache.size_in_bytes(), cache.size()*100);
+	CHECK_GE(cache.get_stats().evictions, 1000 - cache.size());
+
+	cache.take(keys[0]);
+	CHECK_EQ(cache.size_in_bytes(), cache.size()*100);
+}
+
+namespace {
+struct cache_reader {
+	cache_reader(int_cache& cache, const std::vector<std::string>& keys, threading::mutex& m, bool& done)
+	  : cache(cache), keys(keys), m(m), done(done)
+	{}
+
+	int_cache& cache;
+	const std::vector<std::string>& keys;
+	threading::mutex& m;
+	bool& done;
+
+	bool finished() const {
+		threading::lock lck(m);
+		return done;
+	}
+
+	void operator()() {
+		for(int n = 0; !finished(); ++n) {
+			for(int i = 0; i != 100; ++i) {
+				cache.get(keys[(n*100 + i)%keys.size()]);
+			}
+		}
+	}
+};
+}
+
+UNIT_TEST(concurrent_cache_threads)
+{
+	int_cache cache(int_cache::NumShards*2000, hundred_bytes);
+	const std::vector<std::string> keys = make_keys(500);
+	threading::mutex m;
+	bool done = false;
+	{
+		std::vector<boost::shared_ptr<threading::thread> > readers;
+		for(int n = 0; n != 4; ++n) {
+			readers.push_back(boost::shared_ptr<threading::thread>(new threading::thread(cache_reader(cache, keys, m, done))));
+		}
+
+		for(int n = 0; n != 20000; ++n) {
+			cache.put(keys[n%keys.size()], make_int(n));
+		}
+
+		threading::lock lck(m);
+		done = true;
+	}
+
+	CHECK_LE(cache.size_in_bytes(), cache.budget());
+	CHECK_EQ(cache.size_in_bytes(), cache.size()*100);
+}
+
+//looks up entries on the main thread while other threads look up entries
+//in the same cache, as loader threads do while the game runs.
+BENCHMARK_ARG(concurrent_cache_readers, int threads)
+{
+	int_cache cache;
+	const std::vector<std::string> keys = make_keys(1000);
+	for(int n = 0; n != keys.size(); ++n) {
+		cache.put(keys[n], make_int(n));
+	}
+
+	threading::mutex m;
+	bool done = false;
+	std::vector<boost::shared_ptr<threading::thread> > readers;
+	for(int n = 1; n < threads; ++n) {
+		readers.push_back(boost::shared_ptr<threading::thread>(new threading::thread(cache_reader(cache, keys, m, done))));
+	}
+
+	int n = 0;
+	BENCHMARK_LOOP {
+		cache.get(keys[n++%keys.size()]);
+	}
+
+	threading::lock lck(m);
+	done = true;
+}
+
+BENCHMARK_ARG_CALL(concurrent_cache_readers, single_reader, 1);
+BENCHMARK_ARG_CALL(concurrent_cache_readers, eight_readers, 8);
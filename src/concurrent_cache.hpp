@@ -1,54 +1,256 @@
 #ifndef CONCURRENT_CACHE_HPP_INCLUDED
 #define CONCURRENT_CACHE_HPP_INCLUDED
 
-#include <map>
+#include <list>
+
+#include <boost/function.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "thread.hpp"
 
-template<typename Key, typename Value>
+//counts of how well a concurrent_cache is doing.
+struct concurrent_cache_stats {
+	concurrent_cache_stats() : hits(0), misses(0), evictions(0)
+	{}
+
+	int hits, misses, evictions;
+};
+
+//a cache which is used by loader threads and the main thread at once.
+//Entries are spread over shards by the hash of their key, each with its
+//own lock, so threads looking up different keys seldom wait for each
+//other, and a lookup holds its lock only for a hash table probe.
+//
+//A cache may be given a budget, with a function which gives the size of
+//an entry. Each shard then keeps within its share of the budget by
+//discarding its least recently used entries. Values are expected to be
+//handles, such as smart pointers, so discarding an entry doesn't take
+//it from anyone still using it.
+template<typename Key, typename Value, typename Hash=boost::hash<Key> >
 class concurrent_cache
 {
 public:
-	typedef std::map<Key, Value> map_type;
-	size_t size() const { threading::lock l(mutex_); return map_.size(); }
+	typedef boost::function<size_t (const Key&, const Value&)> size_function;
+
+	enum { NumShards = 16 };
+
+	concurrent_cache() : budget_(0)
+	{}
+
+	concurrent_cache(size_t budget, size_function size_fn) : budget_(budget), size_fn_(size_fn)
+	{}
+
+	size_t size() const {
+		size_t result = 0;
+		for(int n = 0; n != NumShards; ++n) {
+			threading::lock l(shards_[n].mutex_);
+			result += shards_[n].map_.size();
+		}
+
+		return result;
+	}
+
+	//returns the value for key, or a default value if there isn't one.
 	Value get(const Key& key) {
-		threading::lock l(mutex_);
-		typename map_type::const_iterator itor = map_.find(key);
-		if(itor != map_.end()) {
-			return itor->second;
-		} else {
+		shard& s = get_shard(key);
+		threading::lock l(s.mutex_);
+		typename map_type::iterator itor = s.map_.find(key);
+		if(itor == s.map_.end()) {
+			++s.stats_.misses;
 			return Value();
 		}
+
+		++s.stats_.hits;
+		if(budget_) {
+			s.lru_.splice(s.lru_.begin(), s.lru_, itor->second.lru);
+		}
+
+		return itor->second.value;
 	}
 
 	void put(const Key& key, const Value& value) {
-		threading::lock l(mutex_);
-		map_[key] = value;
+		shard& s = get_shard(key);
+		const size_t size = budget_ ? size_fn_(key, value) : 0;
+		threading::lock l(s.mutex_);
+		typename map_type::iterator itor = s.map_.find(key);
+		if(itor == s.map_.end()) {
+			itor = s.map_.insert(std::make_pair(key, entry())).first;
+			if(budget_) {
+				s.lru_.push_front(key);
+				itor->second.lru = s.lru_.begin();
+			}
+		} else if(budget_) {
+			s.bytes_ -= itor->second.size;
+			s.lru_.splice(s.lru_.begin(), s.lru_, itor->second.lru);
+		}
+
+		itor->second.value = value;
+		itor->second.size = size;
+		s.bytes_ += size;
+
+		if(budget_) {
+			enforce_budget(s);
+		}
 	}
 
 	int count(const Key& key) const {
-		threading::lock l(mutex_);
-		return map_.count(key);
+		const shard& s = get_shard(key);
+		threading::lock l(s.mutex_);
+		return s.map_.count(key);
+	}
+
+	void erase(const Key& key) {
+		shard& s = get_shard(key);
+		threading::lock l(s.mutex_);
+		typename map_type::iterator itor = s.map_.find(key);
+		if(itor != s.map_.end()) {
+			erase_entry(s, itor);
+		}
+	}
+
+	//removes the entry for key and returns its value, or a default value
+	//if there isn't one.
+	Value take(const Key& key) {
+		shard& s = get_shard(key);
+		threading::lock l(s.mutex_);
+		typename map_type::iterator itor = s.map_.find(key);
+		if(itor == s.map_.end()) {
+			return Value();
+		}
+
+		const Value result = itor->second.value;
+		erase_entry(s, itor);
+		return result;
+	}
+
+	//removes every entry for which pred(key, value) is true. Each shard
+	//is locked while it's searched, so pred mustn't use the cache.
+	template<typename Pred>
+	void erase_if(Pred pred) {
+		for(int n = 0; n != NumShards; ++n) {
+			shard& s = shards_[n];
+			threading::lock l(s.mutex_);
+			typename map_type::iterator itor = s.map_.begin();
+			while(itor != s.map_.end()) {
+				if(pred(itor->first, itor->second.value)) {
+					erase_entry(s, itor++);
+				} else {
+					++itor;
+				}
+			}
+		}
+	}
+
+	//calls fn(key, value) for every entry, with the same restriction as
+	//erase_if().
+	template<typename Fn>
+	void for_each(Fn fn) const {
+		for(int n = 0; n != NumShards; ++n) {
+			const shard& s = shards_[n];
+			threading::lock l(s.mutex_);
+			for(typename map_type::const_iterator itor = s.map_.begin(); itor != s.map_.end(); ++itor) {
+				fn(itor->first, itor->second.value);
+			}
+		}
 	}
 
 	void clear() {
-		threading::lock l(mutex_);
-		map_.clear();
+		for(int n = 0; n != NumShards; ++n) {
+			threading::lock l(shards_[n].mutex_);
+			shards_[n].map_.clear();
+			shards_[n].lru_.clear();
+			shards_[n].bytes_ = 0;
+		}
 	}
 
-	struct lock : public threading::lock {
-		explicit lock(concurrent_cache& cache) : threading::lock(cache.mutex_), cache_(cache) {
+	size_t budget() const { return budget_; }
+
+	//the total size of the entries, if the cache has a budget.
+	size_t size_in_bytes() const {
+		size_t result = 0;
+		for(int n = 0; n != NumShards; ++n) {
+			threading::lock l(shards_[n].mutex_);
+			result += shards_[n].bytes_;
 		}
 
-		map_type& map() const { return cache_.map_; }
+		return result;
+	}
 
-	private:
-		concurrent_cache& cache_;
-	};
+	concurrent_cache_stats get_stats() const {
+		concurrent_cache_stats result;
+		for(int n = 0; n != NumShards; ++n) {
+			threading::lock l(shards_[n].mutex_);
+			result.hits += shards_[n].stats_.hits;
+			result.misses += shards_[n].stats_.misses;
+			result.evictions += shards_[n].stats_.evictions;
+		}
+
+		return result;
+	}
 
 private:
-	map_type map_;
-	mutable threading::mutex mutex_;
+	//keys, most recently used first. Only kept if the cache has a budget.
+	typedef std::list<Key> lru_list;
+
+	struct entry {
+		entry() : size(0)
+		{}
+
+		Value value;
+		size_t size;
+		typename lru_list::iterator lru;
+	};
+
+	typedef boost::unordered_map<Key, entry, Hash> map_type;
+
+	struct shard {
+		shard() : bytes_(0)
+		{}
+
+		map_type map_;
+		lru_list lru_;
+		size_t bytes_;
+		concurrent_cache_stats stats_;
+		mutable threading::mutex mutex_;
+	};
+
+	shard& get_shard(const Key& key) {
+		return shards_[shard_index(key)];
+	}
+
+	const shard& get_shard(const Key& key) const {
+		return shards_[shard_index(key)];
+	}
+
+	static size_t shard_index(const Key& key) {
+		//the low bits are what the shard's own table uses, so the shard is
+		//picked from higher ones.
+		const size_t h = Hash()(key);
+		return ((h >> 8) ^ (h >> 20))%NumShards;
+	}
+
+	void erase_entry(shard& s, typename map_type::iterator itor) {
+		if(budget_) {
+			s.lru_.erase(itor->second.lru);
+		}
+
+		s.bytes_ -= itor->second.size;
+		s.map_.erase(itor);
+	}
+
+	//discards least recently used entries, never the one just used, until
+	//the shard is within its share of the budget.
+	void enforce_budget(shard& s) {
+		while(s.bytes_ > budget_/NumShards && s.lru_.size() > 1) {
+			erase_entry(s, s.map_.find(s.lru_.back()));
+			++s.stats_.evictions;
+		}
+	}
+
+	shard shards_[NumShards];
+	size_t budget_;
+	size_function size_fn_;
 };
 
 #endif
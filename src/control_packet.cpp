@@ -0,0 +1,239 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#include <string.h>
+
+#include "control_packet.hpp"
+#include "unit_test.hpp"
+
+namespace controls {
+
+namespace {
+//the largest history we'll accept in a packet. At 50 cycles a second this
+//is several minutes, far more than any peer should ever fall behind by.
+const uint32_t MaxPacketCycles = 16384;
+
+void write_varint(std::vector<char>& v, uint32_t n)
+{
+	while(n >= 0x80) {
+		v.push_back(static_cast<char>((n&0x7F) | 0x80));
+		n >>= 7;
+	}
+
+	v.push_back(static_cast<char>(n));
+}
+
+bool read_varint(const char*& buf, const char* end, uint32_t* result)
+{
+	*result = 0;
+	for(int shift = 0; shift < 35; shift += 7) {
+		if(buf == end) {
+			return false;
+		}
+
+		const unsigned char c = static_cast<unsigned char>(*buf++);
+		*result |= static_cast<uint32_t>(c&0x7F) << shift;
+		if((c&0x80) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+}
+
+control_packet::control_packet()
+  : slot(0), to_slot(0), current_cycle(0), checksum(0), ack(0)
+{}
+
+void encode_control_packet(const control_packet& p, std::vector<char>& v)
+{
+	v.push_back(p.slot);
+	v.push_back(p.to_slot);
+
+	//cycles are sent offset by one so that -1 (nothing yet) is encodable.
+	write_varint(v, p.current_cycle + 1);
+
+	const int32_t checksum_net = htonl(p.checksum);
+	v.resize(v.size() + 4);
+	memcpy(&v[v.size()-4], &checksum_net, 4);
+
+	write_varint(v, p.ack + 1);
+	write_varint(v, p.controls.size());
+
+	//run-length encode the controls: pairs of run length and state.
+	std::vector<unsigned char>::const_iterator i = p.controls.begin();
+	while(i != p.controls.end()) {
+		std::vector<unsigned char>::const_iterator run_end = i + 1;
+		while(run_end != p.controls.end() && *run_end == *i) {
+			++run_end;
+		}
+
+		write_varint(v, run_end - i);
+		v.push_back(*i);
+		i = run_end;
+	}
+}
+
+bool decode_control_packet(const char* buf, size_t len, control_packet* p)
+{
+	const char* end = buf + len;
+	if(len < 2) {
+		return false;
+	}
+
+	p->slot = *buf++;
+	p->to_slot = *buf++;
+
+	uint32_t current_cycle = 0, ack = 0, ncycles = 0;
+	if(!read_varint(buf, end, &current_cycle) || end - buf < 4) {
+		return false;
+	}
+
+	p->current_cycle = static_cast<int32_t>(current_cycle) - 1;
+
+	int32_t checksum;
+	memcpy(&checksum, buf, 4);
+	p->checksum = ntohl(checksum);
+	buf += 4;
+
+	if(!read_varint(buf, end, &ack) || !read_varint(buf, end, &ncycles)) {
+		return false;
+	}
+
+	p->ack = static_cast<int32_t>(ack) - 1;
+
+	if(ncycles > MaxPacketCycles || ncycles > current_cycle) {
+		return false;
+	}
+
+	p->controls.clear();
+	while(p->controls.size() < ncycles) {
+		uint32_t run = 0;
+		if(!read_varint(buf, end, &run) || run == 0 || run > ncycles - p->controls.size() || buf == end) {
+			return false;
+		}
+
+		p->controls.insert(p->controls.end(), run, static_cast<unsigned char>(*buf++));
+	}
+
+	return buf == end;
+}
+
+int apply_control_packet(const control_packet& p, std::vector<unsigned char>& history, int32_t& highest_confirmed)
+{
+	if(p.current_cycle < highest_confirmed || p.controls.empty()) {
+		//an older packet than one we've already seen; everything in it
+		//has already been superseded.
+		return -1;
+	}
+
+	int first_changed = -1;
+
+	//cycles we already have confirmed data for don't need reprocessing.
+	int cycle = p.start_cycle();
+	std::vector<unsigned char>::const_iterator state = p.controls.begin();
+	if(cycle < highest_confirmed) {
+		state += highest_confirmed - cycle;
+		cycle = highest_confirmed;
+	}
+
+	for(; cycle <= p.current_cycle; ++cycle, ++state) {
+		if(cycle < static_cast<int>(history.size())) {
+			if(history[cycle] != *state) {
+				history[cycle] = *state;
+				if(first_changed == -1) {
+					first_changed = cycle;
+				}
+			}
+		} else {
+			history.resize(cycle + 1, *state);
+		}
+	}
+
+	//extend the current control out to the end, to keep the assumption that
+	//controls don't change unless we get an explicit signal
+	const unsigned char last_state = p.controls.back();
+	for(int n = p.current_cycle + 1; n < static_cast<int>(history.size()); ++n) {
+		if(history[n] != last_state) {
+			history[n] = last_state;
+			if(first_changed == -1) {
+				first_changed = n;
+			}
+		}
+	}
+
+	highest_confirmed = p.current_cycle;
+	return first_changed;
+}
+
+}
+
+UNIT_TEST(control_packet_round_trip)
+{
+	controls::control_packet p;
+	p.slot = 1;
+	p.to_slot = 0;
+	p.current_cycle = 1000;
+	p.checksum = -123456;
+	p.ack = 990;
+	for(int n = 0; n != 100; ++n) {
+		p.controls.push_back(n < 40 ? 0 : (n < 90 ? 5 : 1));
+	}
+
+	std::vector<char> v;
+	controls::encode_control_packet(p, v);
+
+	//three runs, so the packet should be far smaller than the raw history.
+	CHECK_LT(v.size(), 20);
+
+	controls::control_packet q;
+	CHECK_EQ(controls::decode_control_packet(&v[0], v.size(), &q), true);
+	CHECK_EQ(q.slot, p.slot);
+	CHECK_EQ(q.to_slot, p.to_slot);
+	CHECK_EQ(q.current_cycle, p.current_cycle);
+	CHECK_EQ(q.checksum, p.checksum);
+	CHECK_EQ(q.ack, p.ack);
+	CHECK(q.controls == p.controls, "controls differ after decoding");
+
+	//every truncation of the packet must be rejected.
+	for(int n = 0; n < v.size(); ++n) {
+		CHECK_EQ(controls::decode_control_packet(&v[0], n, &q), false);
+	}
+}
+
+UNIT_TEST(control_packet_apply_out_of_order)
+{
+	std::vector<unsigned char> history;
+	int32_t highest_confirmed = 0;
+
+	controls::control_packet first;
+	first.current_cycle = 4;
+	for(int n = 0; n != 5; ++n) {
+		first.controls.push_back(1);
+	}
+
+	controls::control_packet second = first;
+	second.current_cycle = 9;
+	for(int n = 0; n != 5; ++n) {
+		second.controls.push_back(2);
+	}
+
+	//the newer packet arrives first, then the older one is ignored.
+	CHECK_EQ(controls::apply_control_packet(second, history, highest_confirmed), -1);
+	CHECK_EQ(highest_confirmed, 9);
+	CHECK_EQ(history.size(), 10);
+	CHECK_EQ(controls::apply_control_packet(first, history, highest_confirmed), -1);
+	CHECK_EQ(highest_confirmed, 9);
+
+	//a predicted state beyond the confirmed cycles gets corrected.
+	history.push_back(7);
+	controls::control_packet third;
+	third.current_cycle = 10;
+	third.controls.push_back(3);
+	CHECK_EQ(controls::apply_control_packet(third, history, highest_confirmed), 10);
+	CHECK_EQ(history[10], 3);
+}
@@ -0,0 +1,56 @@
+#ifndef CONTROL_PACKET_HPP_INCLUDED
+#define CONTROL_PACKET_HPP_INCLUDED
+
+#include <cstddef>
+#include <vector>
+
+#include <cstdint>
+
+namespace controls {
+
+//the contents of a packet sent from one player to another giving the
+//sender's control history which the receiver hasn't yet confirmed.
+//
+//On the wire, cycle numbers are variable length integers and the control
+//history is run-length encoded, since controls usually stay the same for
+//many cycles. A packet is addressed to a single player, and carries the
+//highest of that player's cycles the sender has confirmed, so each player
+//only gets resent the cycles it is missing.
+struct control_packet {
+	control_packet();
+
+	//the slot of the player who sent the packet, and of the one it is for.
+	int slot;
+	int to_slot;
+
+	//the sender's latest cycle; the last entry in controls is for this cycle.
+	int32_t current_cycle;
+
+	//the sender's checksum of the game state at current_cycle-1, or 0.
+	int32_t checksum;
+
+	//the highest of the receiver's cycles the sender has confirmed.
+	int32_t ack;
+
+	std::vector<unsigned char> controls;
+
+	int32_t start_cycle() const { return current_cycle + 1 - controls.size(); }
+};
+
+//appends the encoded packet to v.
+void encode_control_packet(const control_packet& p, std::vector<char>& v);
+
+//decodes a packet, returning false if it's malformed.
+bool decode_control_packet(const char* buf, size_t len, control_packet* p);
+
+//merges the controls in a packet into the control history of the player
+//who sent it. highest_confirmed is the highest cycle in history that has
+//already been confirmed; it is updated to the packet's current cycle.
+//Cycles beyond the packet's current cycle are assumed to repeat its last
+//control state. Returns the first cycle whose controls changed as a result,
+//or -1 if none did.
+int apply_control_packet(const control_packet& p, std::vector<unsigned char>& history, int32_t& highest_confirmed);
+
+}
+
+#endif
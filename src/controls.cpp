@@ -9,12 +9,14 @@
 
 #include <stdio.h>
 
+#include <map>
 #include <stack>
 #include <vector>
 
 #include "SDL.h"
 
 #include "asserts.hpp"
+#include "control_packet.hpp"
 #include "controls.hpp"
 #include "foreach.hpp"
 #include "joystick.hpp"
@@ -28,6 +30,13 @@ namespace {
 int npackets_received;
 int ngood_packets;
 int last_packet_size_;
+int last_packet_bytes_;
+int nbytes_sent;
+
+//the total number of cycles our acknowledged cycles were behind our
+//current cycle, each time a player acknowledged more of our cycles.
+int total_confirm_lag;
+int nconfirms;
 
 const int MAX_PLAYERS = 8;
 
@@ -113,6 +122,9 @@ void new_level(int level_starting_cycles, int level_nplayers, int level_local_pl
 	foreach(int32_t& highest, remote_highest_confirmed) {
 		highest = 0;
 	}
+
+	our_checksums.clear();
+	total_confirm_lag = nconfirms = 0;
 }
 
 namespace {
@@ -241,17 +253,22 @@ void set_delay(int value)
 
 void read_control_packet(const char* buf, size_t len)
 {
-	++npackets_received;
-
-	if(len < 13) {
-		fprintf(stderr, "ERROR: CONTROL PACKET TOO SHORT: %d\n", (int)len);
+	static control_packet packet;
+	if(!decode_control_packet(buf, len, &packet)) {
+		++npackets_received;
+		fprintf(stderr, "ERROR: MALFORMED CONTROL PACKET: %d bytes\n", (int)len);
 		return;
 	}
 
-	const char* end_buf = buf + len;
+	//packets are addressed to one player, so one meant for someone else
+	//has been misrouted.
+	if(packet.to_slot != local_player) {
+		return;
+	}
 
-	int slot = *buf++;
+	++npackets_received;
 
+	const int slot = packet.slot;
 	if(slot < 0 || slot >= nplayers) {
 		fprintf(stderr, "ERROR: BAD SLOT NUMBER: %d/%d\n", slot, nplayers);
 		return;
@@ -262,135 +279,84 @@ void read_control_packet(const char* buf, size_t len)
 		return;
 	}
 
-	int32_t current_cycle;
-	memcpy(&current_cycle, buf, 4);
-	current_cycle = ntohl(current_cycle);
-	buf += 4;
-
-	if(current_cycle < highest_confirmed[slot]) {
-		fprintf(stderr, "DISCARDING PACKET -- OUT OF ORDER: %d < %d\n", current_cycle, highest_confirmed[slot]);
+	if(packet.current_cycle < highest_confirmed[slot]) {
+		fprintf(stderr, "DISCARDING PACKET -- OUT OF ORDER: %d < %d\n", packet.current_cycle, highest_confirmed[slot]);
 		return;
 	}
 
-	int32_t checksum;
-	memcpy(&checksum, buf, 4);
-	checksum = ntohl(checksum);
-	buf += 4;
-
-	if(checksum && our_checksums[current_cycle-1]) {
-		if(checksum == our_checksums[current_cycle-1]) {
-			std::cerr << "CHECKSUM MATCH FOR " << current_cycle << ": " << checksum << "\n";
-		} else {
-			std::cerr << "CHECKSUM DID NOT MATCH FOR " << current_cycle << ": " << checksum << " VS " << our_checksums[current_cycle-1] << "\n";
+	if(packet.checksum) {
+		std::map<int, int>::const_iterator i = our_checksums.find(packet.current_cycle-1);
+		if(i != our_checksums.end() && i->second && i->second != packet.checksum) {
+			std::cerr << "CHECKSUM DID NOT MATCH FOR " << packet.current_cycle << ": " << packet.checksum << " VS " << i->second << "\n";
 		}
-
 	}
 
-	int32_t highest_cycle;
-	memcpy(&highest_cycle, buf, 4);
-	highest_cycle = ntohl(highest_cycle);
-	buf += 4;
-
-	if(highest_cycle > remote_highest_confirmed[slot]) {
-		remote_highest_confirmed[slot] = highest_cycle;
-	}
-
-	int32_t ncycles;
-	memcpy(&ncycles, buf, 4);
-	ncycles = ntohl(ncycles);
-	buf += 4;
-
-	if(end_buf - buf != ncycles) {
-		fprintf(stderr, "ERROR: BAD NUMBER OF CYCLES: %d vs %d\n", ncycles, (end_buf - buf));
-		return;
+	if(packet.ack > remote_highest_confirmed[slot]) {
+		remote_highest_confirmed[slot] = packet.ack;
+		total_confirm_lag += static_cast<int>(controls[local_player].size()) - 1 - packet.ack;
+		++nconfirms;
 	}
 
-	int start_cycle = 1 + current_cycle - ncycles;
-
-	//if we already have data up to this point, don't reprocess it.
-	if(start_cycle < highest_confirmed[slot]) {
-		int diff = highest_confirmed[slot] - start_cycle;
-		ncycles -= diff;
-		buf += diff;
-		start_cycle = highest_confirmed[slot];
-	}
-
-	for(int cycle = start_cycle; cycle <= current_cycle; ++cycle) {
-		if(cycle < controls[slot].size()) {
-			if(controls[slot][cycle] != *buf) {
-				fprintf(stderr, "RECEIVED CORRECTION\n");
-				controls[slot][cycle] = *buf;
-				if(first_invalid_cycle_var == -1 || first_invalid_cycle_var > cycle) {
-					//mark us as invalid back to this point, so game logic
-					//will be recalculated from here.
-					first_invalid_cycle_var = cycle;
-				}
-			}
-		} else {
-			fprintf(stderr, "RECEIVED FUTURE PACKET!\n");
-			while(controls[slot].size() <= cycle) {
-				controls[slot].push_back(*buf);
-			}
-		}
-
-		++buf;
+	const int first_changed = apply_control_packet(packet, controls[slot], highest_confirmed[slot]);
+	if(first_changed != -1 && (first_invalid_cycle_var == -1 || first_invalid_cycle_var > first_changed)) {
+		//mark us as invalid back to this point, so game logic
+		//will be recalculated from here.
+		first_invalid_cycle_var = first_changed;
 	}
 
-	//extend the current control out to the end, to keep the assumption that
-	//controls don't change unless we get an explicit signal
-	if(current_cycle < static_cast<int>(controls[slot].size()) - 1) {
-		for(int n = current_cycle + 1; n < controls[slot].size(); ++n) {
-			controls[slot][n] = controls[slot][current_cycle];
+	//checksums for cycles every player has confirmed past will never be
+	//looked at again.
+	int oldest_needed = -1;
+	for(int n = 0; n != nplayers; ++n) {
+		if(n != local_player && (oldest_needed == -1 || highest_confirmed[n] < oldest_needed)) {
+			oldest_needed = highest_confirmed[n];
 		}
 	}
 
-	//mark our highest confirmed cycle for this player
-	highest_confirmed[slot] = current_cycle;
-
-	assert(buf == end_buf);
+	our_checksums.erase(our_checksums.begin(), our_checksums.lower_bound(oldest_needed - 1));
 
 	++ngood_packets;
 }
 
-void write_control_packet(std::vector<char>& v)
+void write_control_packet(std::vector<char>& v, int to_player)
 {
 	if(local_player < 0 || local_player >= nplayers) {
 		fprintf(stderr, "NO VALID LOCAL PLAYER\n");
 		return;
 	}
 
-	//write our slot to the packet
-	v.push_back(local_player);
+	static control_packet packet;
+	packet.slot = local_player;
+	packet.to_slot = to_player;
+	packet.current_cycle = controls[local_player].size()-1;
 
-	//write our current cycle
-	int32_t current_cycle = controls[local_player].size()-1;
-	int32_t current_cycle_net = htonl(current_cycle);
-	v.resize(v.size() + 4);
-	memcpy(&v[v.size()-4], &current_cycle_net, 4);
+	std::map<int, int>::const_iterator checksum = our_checksums.find(packet.current_cycle-1);
+	packet.checksum = checksum == our_checksums.end() ? 0 : checksum->second;
 
-	//write our checksum of game state
-	int32_t checksum = our_checksums[current_cycle-1];
-	int32_t checksum_net = htonl(checksum);
-	v.resize(v.size() + 4);
-	memcpy(&v[v.size()-4], &checksum_net, 4);
+	//tell them how much of their control history we have, so they only
+	//resend what we're missing.
+	packet.ack = highest_confirmed[to_player];
 
-	//write our highest confirmed cycle
-	int32_t highest_cycle = htonl(our_highest_confirmed());
-	v.resize(v.size() + 4);
-	memcpy(&v[v.size()-4], &highest_cycle, 4);
+	//only send the cycles this player hasn't confirmed yet.
+	int32_t ncycles_to_write = 1 + packet.current_cycle - remote_highest_confirmed[to_player];
 
-	int32_t ncycles_to_write = 1+current_cycle - their_highest_confirmed();
+	//always send at least the current cycle, even if they claim to have
+	//confirmed past it, so a packet never goes out with no controls.
+	if(ncycles_to_write < 1) {
+		ncycles_to_write = 1;
+	}
 
 	last_packet_size_ = ncycles_to_write;
 	if(ncycles_to_write > controls[local_player].size()) {
 		ncycles_to_write = controls[local_player].size();
 	}
 
-	int32_t ncycles_to_write_net = htonl(ncycles_to_write);
-	v.resize(v.size() + 4);
-	memcpy(&v[v.size()-4], &ncycles_to_write_net, 4);
+	packet.controls.assign(controls[local_player].end() - ncycles_to_write, controls[local_player].end());
 
-	v.insert(v.end(), controls[local_player].end() - ncycles_to_write, controls[local_player].end());
+	const size_t start_size = v.size();
+	encode_control_packet(packet, v);
+	last_packet_bytes_ = v.size() - start_size;
+	nbytes_sent += last_packet_bytes_;
 }
 
 int first_invalid_cycle()
@@ -432,11 +398,32 @@ int last_packet_size()
 	return last_packet_size_;
 }
 
+int last_packet_bytes()
+{
+	return last_packet_bytes_;
+}
+
+int bytes_sent()
+{
+	return nbytes_sent;
+}
+
+int average_confirm_lag()
+{
+	return nconfirms ? total_confirm_lag/nconfirms : 0;
+}
+
 void set_checksum(int cycle, int sum)
 {
 	our_checksums[cycle] = sum;
 }
 
+int get_checksum(int cycle)
+{
+	std::map<int, int>::const_iterator i = our_checksums.find(cycle);
+	return i == our_checksums.end() ? 0 : i->second;
+}
+
 void debug_dump_controls()
 {
 	fprintf(stderr, "CONTROLS:");
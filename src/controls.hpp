@@ -44,7 +44,10 @@ void get_control_status(int cycle, int player, bool* output);
 void set_delay(int delay);
 
 void read_control_packet(const char* buf, size_t len);
-void write_control_packet(std::vector<char>& v);
+
+//writes a packet for the given player, containing the controls they
+//haven't acknowledged yet.
+void write_control_packet(std::vector<char>& v, int to_player);
 
 int first_invalid_cycle();
 void mark_valid();
@@ -56,9 +59,18 @@ int cycles_behind();
 
 int their_highest_confirmed();
 int last_packet_size();
+int last_packet_bytes();
+int bytes_sent();
+
+//the average number of cycles between us running a cycle and a remote
+//player acknowledging it.
+int average_confirm_lag();
 
 void set_checksum(int cycle, int sum);
 
+//the checksum recorded for the given cycle, or 0 if there isn't one.
+int get_checksum(int cycle);
+
 void debug_dump_controls();
 
 }
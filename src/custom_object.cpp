@@ -17,6 +17,7 @@
 #include "custom_object_callable.hpp"
 #include "custom_object_functions.hpp"
 #include "draw_scene.hpp"
+#include "draw_stats.hpp"
 #include "font.hpp"
 #include "formatter.hpp"
 #include "formula_callable.hpp"
@@ -28,6 +29,7 @@
 #include "playable_custom_object.hpp"
 #include "preferences.hpp"
 #include "raster.hpp"
+#include "sprite_batch.hpp"
 #include "string_utils.hpp"
 #include "surface_formula.hpp"
 #include "wml_node.hpp"
@@ -598,16 +600,12 @@ wml::node_ptr custom_object::write() const
 		res->set_attr("on_" + get_object_event_str(n), event_handlers_[n]->str());
 	}
 
-	if(!vars_->equal_to(type_->variables())) {
-		wml::node_ptr vars(new wml::node("vars"));
-		vars_->write(vars);
-		res->add_child(vars);
-	}
-
-	if(tags_->values() != type_->tags()) {
-		wml::node_ptr tags(new wml::node("tags"));
-		tags_->write(tags);
-		res->add_child(tags);
+	if(written_variables_) {
+		for(wml::node::all_child_iterator i = written_variables_->begin_children(); i != written_variables_->end_children(); ++i) {
+			res->add_child(*i);
+		}
+	} else {
+		write_variables(res);
 	}
 
 	if(custom_type_) {
@@ -686,6 +684,21 @@ wml::node_ptr custom_object::write() const
 	return res;
 }
 
+void custom_object::write_variables(wml::node_ptr node) const
+{
+	if(!vars_->equal_to(type_->variables())) {
+		wml::node_ptr vars(new wml::node("vars"));
+		vars_->write(vars);
+		node->add_child(vars);
+	}
+
+	if(tags_->values() != type_->tags()) {
+		wml::node_ptr tags(new wml::node("tags"));
+		tags_->write(tags);
+		node->add_child(tags);
+	}
+}
+
 void custom_object::setup_drawing() const
 {
 	if(distortion_) {
@@ -750,6 +763,7 @@ void custom_object::draw() const
 	if(draw_color_) {
 		if(!draw_color_->fits_in_color()) {
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+			draw_stats::blend_change();
 			graphics::color_transform transform = *draw_color_;
 			while(!transform.fits_in_color()) {
 				transform = transform - transform.to_color();
@@ -758,6 +772,7 @@ void custom_object::draw() const
 			}
 
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			draw_stats::blend_change();
 		}
 
 		glColor4ub(255, 255, 255, 255);
@@ -769,8 +784,11 @@ void custom_object::draw() const
 
 	draw_debug_rects();
 
-	for(std::map<std::string, particle_system_ptr>::const_iterator i = particle_systems_.begin(); i != particle_systems_.end(); ++i) {
-		i->second->draw(rect(last_draw_position().x/100, last_draw_position().y/100, graphics::screen_width(), graphics::screen_height()), *this);
+	if(!particle_systems_.empty()) {
+		draw_stats::subsystem_scope stats_scope(draw_stats::SUBSYSTEM_PARTICLES);
+		for(std::map<std::string, particle_system_ptr>::const_iterator i = particle_systems_.begin(); i != particle_systems_.end(); ++i) {
+			i->second->draw(rect(last_draw_position().x/100, last_draw_position().y/100, graphics::screen_width(), graphics::screen_height()), *this);
+		}
 	}
 
 	if(text_ && text_->font && text_->alpha) {
@@ -793,6 +811,44 @@ void custom_object::draw() const
 #endif
 }
 
+bool custom_object::draw_into_sprite_batch(graphics::sprite_batch& batch) const
+{
+	if(frame_ == NULL) {
+		return true;
+	}
+
+	//anything which needs more than a single quad with the default GL
+	//state has to be drawn by draw().
+	if(shader_ || !fragment_shaders_.empty() || clip_area_ || driver_ ||
+	   !attached_objects().empty() || draw_scale_ || draw_area_ ||
+	   rotate_ != decimal() || blur_ || !particle_systems_.empty() || text_ ||
+	   preferences::show_debug_hitboxes()) {
+		return false;
+	}
+
+	unsigned char color[4] = { 255, 255, 255, 255 };
+	if(draw_color_) {
+		if(!draw_color_->fits_in_color()) {
+			return false;
+		}
+
+		const graphics::color c = draw_color_->to_color();
+		color[0] = c.r();
+		color[1] = c.g();
+		color[2] = c.b();
+		color[3] = c.a();
+	}
+
+	const int draw_x = x();
+	const int draw_y = y();
+
+	static graphics::blit_queue quad;
+	quad.clear();
+	frame_->draw_into_blit_queue(quad, draw_x-draw_x%2, draw_y-draw_y%2, face_right(), upside_down(), time_in_frame_);
+	batch.add(quad, color[0], color[1], color[2], color[3]);
+	return true;
+}
+
 void custom_object::draw_group() const
 {
 	if(label().empty() == false && label()[0] != '_') {
@@ -1925,6 +1981,8 @@ void custom_object::get_inputs(std::vector<game_logic::formula_input>* inputs) c
 
 void custom_object::set_value(const std::string& key, const variant& value)
 {
+	activation_changed();
+
 	const int slot = custom_object_callable::get_key_slot(key);
 	if(slot != -1) {
 		set_value_by_slot(slot, value);
@@ -2173,6 +2231,8 @@ void custom_object::set_value(const std::string& key, const variant& value)
 
 void custom_object::set_value_by_slot(int slot, const variant& value)
 {
+	activation_changed();
+
 	switch(slot) {
 	case CUSTOM_OBJECT_TYPE: {
 		const_custom_object_type_ptr p = custom_object_type::get(value.as_string());
@@ -2738,12 +2798,6 @@ void custom_object::die_with_no_event()
 
 bool custom_object::is_active(const rect& screen_area) const
 {
-	if(controls::num_players() > 1) {
-		//in multiplayer, make all objects always active
-		//TODO: review this behavior
-		return true;
-	}
-
 	if(always_active()) {
 		return true;
 	}
@@ -2792,6 +2846,42 @@ bool custom_object::is_active(const rect& screen_area) const
 	return false;
 }
 
+bool custom_object::activation_bounds(rect* bounds) const
+{
+	//this must give an area which contains every screen position where
+	//is_active() is true, or return false.
+	if(always_active() || is_human() || dies_on_inactive() || type_->goes_inactive_only_when_standing()) {
+		return false;
+	}
+
+	if(activation_area_) {
+		*bounds = *activation_area_;
+		return true;
+	}
+
+	const rect& area = frame_rect();
+	rect result;
+	if(draw_area_) {
+		result = rect(area.x(), area.y(), draw_area_->w()*2, draw_area_->h()*2);
+	} else if(parallax_scale_millis_.get() != NULL && (parallax_scale_millis_->first != 1000 || parallax_scale_millis_->second != 1000)) {
+		return false;
+	} else {
+		const int border = std::max(activation_border_, 0);
+		result = rect(area.x() - border, area.y() - border, area.w() + border*2, area.h() + border*2);
+	}
+
+	if(text_) {
+		const int x1 = std::min(result.x(), x());
+		const int y1 = std::min(result.y(), y());
+		const int x2 = std::max(result.x2(), x() + text_->dimensions.w());
+		const int y2 = std::max(result.y2(), y() + text_->dimensions.h());
+		result = rect(x1, y1, x2 - x1, y2 - y1);
+	}
+
+	*bounds = result;
+	return true;
+}
+
 void custom_object::move_to_standing(level& lvl)
 {
 	int start_y = y();
@@ -2872,6 +2962,33 @@ entity_ptr custom_object::backup() const
 	return res;
 }
 
+entity_ptr custom_object::save_copy() const
+{
+	entity_ptr res = backup();
+	custom_object& copy = static_cast<custom_object&>(*res);
+
+	//the copy constructor leaves out state which is set up afresh for a
+	//new object, but which has to be written.
+	copy.draw_scale_ = draw_scale_;
+	copy.draw_area_ = draw_area_;
+	copy.activation_area_ = activation_area_;
+	copy.clip_area_ = clip_area_;
+	copy.lights_ = lights_;
+	if(position_schedule_) {
+		copy.position_schedule_.reset(new position_schedule(*position_schedule_));
+	}
+
+	if(platform_area_) {
+		copy.platform_area_.reset(new rect(*platform_area_));
+	}
+
+	//variables are shared with other objects and may refer to them, so
+	//can only be written on this thread.
+	copy.written_variables_.reset(new wml::node("variables"));
+	write_variables(copy.written_variables_);
+	return res;
+}
+
 void custom_object::handle_event(const std::string& event, const formula_callable* context)
 {
 	handle_event(get_object_event_id(event), context);
@@ -3082,6 +3199,9 @@ void custom_object::set_text(const std::string& text, const std::string& font, i
 	text_->alpha = 255;
 	ASSERT_LOG(text_->font, "UNKNOWN FONT: " << font);
 	text_->dimensions = text_->font->dimensions(text_->text);
+
+	//the text counts towards where the object is active.
+	activation_changed();
 }
 
 bool custom_object::boardable_vehicle() const
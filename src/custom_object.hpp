@@ -38,6 +38,7 @@ public:
 	virtual void setup_drawing() const;
 	virtual void draw() const;
 	virtual void draw_group() const;
+	virtual bool draw_into_sprite_batch(graphics::sprite_batch& batch) const;
 	virtual void process(level& lvl);
 	void set_level(level& lvl) { }
 
@@ -90,6 +91,7 @@ public:
 	void die();
 	void die_with_no_event();
 	virtual bool is_active(const rect& screen_area) const;
+	virtual bool activation_bounds(rect* bounds) const;
 	bool dies_on_inactive() const;
 	bool always_active() const;
 	void move_to_standing(level& lvl);
@@ -115,6 +117,7 @@ public:
 
 	virtual entity_ptr clone() const;
 	virtual entity_ptr backup() const;
+	virtual entity_ptr save_copy() const;
 
 	game_logic::const_formula_ptr get_event_handler(int key) const;
 	void set_event_handler(int, game_logic::const_formula_ptr f);
@@ -211,6 +214,9 @@ private:
 
 	int slope_standing_on(int range) const;
 
+	//writes the object's variables and tags as children of node.
+	void write_variables(wml::node_ptr node) const;
+
 	int previous_y_;
 
 	wml::const_node_ptr custom_type_;
@@ -311,6 +317,10 @@ private:
 
 	std::vector<light_ptr> lights_;
 
+	//in copies made by save_copy(), the nodes write_variables() wrote when
+	//the copy was made.
+	wml::node_ptr written_variables_;
+
 	boost::scoped_ptr<rect> platform_area_;
 	const_solid_info_ptr platform_solid_info_;
 
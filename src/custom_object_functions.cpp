@@ -27,6 +27,7 @@
 #include "player_info.hpp"
 #include "powerup.hpp"
 #include "raster.hpp"
+#include "save_writer.hpp"
 #include "texture.hpp"
 #include "message_dialog.hpp"
 #include "options_dialog.hpp"
@@ -127,12 +128,7 @@ public:
 	virtual void execute(level& lvl, entity& ob) const {
 		lvl.player()->get_entity().save_game();
 		if(persistent_) {
-			wml::node_ptr node = lvl.write();
-			if(sound::current_music().empty() == false) {
-				node->set_attr("music", sound::current_music());
-			}
-
-			sys::write_file(preferences::save_file_path(), wml::output(node));
+			save_writer::save_async(lvl, preferences::save_file_path());
 		}
 	}
 };
@@ -1,8 +1,16 @@
+#include <stdio.h>
+
 #include <cassert>
 #include <iostream>
+#include <set>
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/regex.hpp>
 
 #include "asserts.hpp"
 #include "collision_utils.hpp"
+#include "concurrent_cache.hpp"
 #include "custom_object_callable.hpp"
 #include "custom_object_functions.hpp"
 #include "custom_object_type.hpp"
@@ -12,6 +20,7 @@
 #include "preferences.hpp"
 #include "solid_map.hpp"
 #include "string_utils.hpp"
+#include "thread.hpp"
 #include "wml_modify.hpp"
 #include "wml_node.hpp"
 #include "wml_parser.hpp"
@@ -48,10 +57,224 @@ object_map& cache() {
 	return instance;
 }
 
-namespace {
-const std::string BaseStr = "%PROTO%";
+//definitions of object types which have been parsed, merged with their
+//prototypes and validated by preload_types(), but not yet built.
+//definitions are prepared on the worker pool, so the map is made before
+//any workers are started.
+typedef concurrent_cache<std::string, wml::node_ptr> definition_map;
+definition_map prepared_definitions_instance;
+definition_map& prepared_definitions() {
+	return prepared_definitions_instance;
+}
+
+//bump this whenever merging or validating definitions changes, so
+//definitions cached by older versions are ignored.
+const char* ObjectCacheVersion = "1";
+
+std::string object_cache_path(const std::string& id)
+{
+	return std::string(preferences::user_data_path()) + "object_cache/" + id + ".cfg";
+}
+
+unsigned int hash_data(const std::string& data)
+{
+	unsigned int hash = 2166136261u;
+	foreach(char c, data) {
+		hash = (hash ^ static_cast<unsigned char>(c))*16777619u;
+	}
+
+	return hash;
+}
+
+//the key an object's cached definition is stored under: each file the
+//definition was made from, along with a hash of its contents. Returns an
+//empty string if the definition can't be cached, because the files
+//include other files we don't track.
+std::string make_cache_key(const std::vector<std::string>& paths)
+{
+	std::ostringstream key;
+	key << "#object_cache " << ObjectCacheVersion;
+	foreach(const std::string& path, paths) {
+		const std::string data = sys::read_file(path);
+		if(data.empty() || data.find("@include") != std::string::npos || data.find("@import") != std::string::npos) {
+			return "";
+		}
+
+		key << " " << path << "=" << std::hex << hash_data(data) << std::dec;
+	}
+
+	return key.str();
+}
+
+//the files listed in a cache key.
+std::vector<std::string> cache_key_paths(const std::string& key)
+{
+	std::vector<std::string> paths = util::split(key, ' ');
+	if(paths.size() < 2) {
+		return std::vector<std::string>();
+	}
+
+	paths.erase(paths.begin(), paths.begin() + 2);
+	foreach(std::string& path, paths) {
+		path.erase(std::find(path.begin(), path.end(), '='), path.end());
+	}
+
+	return paths;
+}
+
+wml::node_ptr read_cached_definition(const std::string& id)
+{
+	const std::string cache_path = object_cache_path(id);
+	if(!sys::file_exists(cache_path)) {
+		return wml::node_ptr();
+	}
+
+	const std::string data = sys::read_file(cache_path);
+	const std::string key(data.begin(), std::find(data.begin(), data.end(), '\n'));
+	const std::vector<std::string> paths = cache_key_paths(key);
+	if(paths.empty() || make_cache_key(paths) != key) {
+		return wml::node_ptr();
+	}
+
+	try {
+		return wml::parse_wml(data);
+	} catch(wml::parse_error& e) {
+		std::cerr << "IGNORING BAD OBJECT CACHE FILE " << cache_path << ": " << e.message << "\n";
+		return wml::node_ptr();
+	}
+}
+
+void write_cached_definition(const std::string& id, wml::const_node_ptr node, const std::vector<std::string>& paths)
+{
+	const std::string key = make_cache_key(paths);
+	if(key.empty()) {
+		return;
+	}
+
+	sys::get_dir(std::string(preferences::user_data_path()) + "object_cache");
+
+	//write to a temporary file and move it into place, so another thread
+	//or process never reads a partly written definition.
+	const std::string cache_path = object_cache_path(id);
+	const std::string tmp_path = cache_path + ".tmp";
+	sys::write_file(tmp_path, key + "\n" + wml::output(node));
+	if(!sys::replace_file(tmp_path, cache_path)) {
+		std::cerr << "COULD NOT WRITE OBJECT CACHE FILE " << cache_path << "\n";
+		remove(tmp_path.c_str());
+	}
+}
+
+//parses an object's file, merges it with its prototypes and validates it,
+//or reads the result of having done so from the object cache. Only reads
+//shared state, so once the object file paths are known this may be
+//called from any thread.
+wml::node_ptr load_definition(const std::string& id, const std::string& path)
+{
+	//compiled objects are already merged, so there is nothing to cache.
+	const bool use_cache = !preferences::load_compiled();
+	if(use_cache) {
+		wml::node_ptr node = read_cached_definition(id);
+		if(node) {
+			return node;
+		}
+	}
+
+	std::vector<std::string> sources(1, path);
+	wml::node_ptr node = wml::parse_wml_from_file(path);
+	node = custom_object_type::merge_prototype(node, &sources);
+
+	ASSERT_LOG(node->attr("id").str() == id, "IN " << path << " OBJECT ID DOES NOT MATCH FILENAME");
+
+	const wml::schema* schema = wml::schema::get("custom_object");
+	if(schema) {
+		schema->validate_node(node);
+	}
+
+	if(use_cache) {
+		write_cached_definition(id, node, sources);
+	}
+
+	return node;
+}
+
+//adds the ids of the object types of the characters in the node.
+void find_placed_types(wml::const_node_ptr node, std::set<std::string>& ids)
+{
+	if(node->name() == "character" && node->has_attr("type")) {
+		const std::string& type = node->attr("type");
+		ids.insert(std::string(type.begin(), std::find(type.begin(), type.end(), '.')));
+	}
+
+	for(wml::node::const_all_child_iterator i = node->begin_children(); i != node->end_children(); ++i) {
+		find_placed_types(*i, ids);
+	}
 }
 
+//adds the ids of any object types which look like they're spawned by
+//literal name in the node's formulas to ids. This also finds spawn()
+//calls in comments and formulas which are never run, so it's only good
+//for guessing which objects are worth preparing.
+void find_spawned_types(wml::const_node_ptr node, std::set<std::string>& ids)
+{
+	static const boost::regex spawn_pattern("spawn\\(\\s*['\"]([A-Za-z0-9_]+)");
+	for(wml::node::const_attr_iterator i = node->begin_attr(); i != node->end_attr(); ++i) {
+		const std::string& value = i->second.str();
+		boost::sregex_iterator m(value.begin(), value.end(), spawn_pattern), end;
+		for(; m != end; ++m) {
+			ids.insert((*m)[1]);
+		}
+	}
+
+	for(wml::node::const_all_child_iterator i = node->begin_children(); i != node->end_children(); ++i) {
+		find_spawned_types(*i, ids);
+	}
+}
+
+//finds the sound effects an object definition plays, either when its
+//animations are shown or from its formulas.
+void find_sounds(wml::const_node_ptr node, std::set<std::string>& sounds)
+{
+	static const boost::regex sound_pattern("\\bsound(?:_loop)?\\(\\s*['\"]([^'\"]+)");
+	for(wml::node::const_attr_iterator i = node->begin_attr(); i != node->end_attr(); ++i) {
+		const std::string& value = i->second.str();
+		if(i->first == "sound" && node->name() == "animation") {
+			foreach(const std::string& s, util::split(value)) {
+				sounds.insert(s);
+			}
+		}
+
+		boost::sregex_iterator m(value.begin(), value.end(), sound_pattern), end;
+		for(; m != end; ++m) {
+			foreach(const std::string& s, util::split((*m)[1])) {
+				sounds.insert(s);
+			}
+		}
+	}
+
+	for(wml::node::const_all_child_iterator i = node->begin_children(); i != node->end_children(); ++i) {
+		find_sounds(*i, sounds);
+	}
+}
+
+//prepares an object's definition ahead of it being built. If there is
+//an error in the definition it's logged and the definition is left
+//unprepared, so create() loads it again and reports the error properly
+//if the object is ever built.
+void prepare_definition(const std::string& id, const std::string& path)
+{
+	try {
+		prepared_definitions().put(id, load_definition(id, path));
+	} catch(wml::parse_error& e) {
+		std::cerr << "ERROR PREPARING OBJECT '" << id << "': " << e.message << "\n";
+	} catch(wml::schema_error& e) {
+		std::cerr << "ERROR PREPARING OBJECT '" << id << "': " << e.message << "\n";
+	} catch(...) {
+		std::cerr << "UNKNOWN ERROR PREPARING OBJECT '" << id << "'\n";
+	}
+}
+
+const std::string BaseStr = "%PROTO%";
+
 void merge_into_prototype(wml::node_ptr prototype_node, wml::node_ptr node)
 {
 	for(std::map<std::string, wml::const_node_ptr>::const_iterator i = node->base_elements().begin(); i != node->base_elements().end(); ++i) {
@@ -154,7 +377,7 @@ void merge_into_prototype(wml::node_ptr prototype_node, wml::node_ptr node)
 
 //function which finds if a node has a prototype, and if so, applies the
 //prototype to the node.
-wml::node_ptr custom_object_type::merge_prototype(wml::node_ptr node)
+wml::node_ptr custom_object_type::merge_prototype(wml::node_ptr node, std::vector<std::string>* proto_paths)
 {
 	if(!node->has_attr("prototype")) {
 		return node;
@@ -167,8 +390,12 @@ wml::node_ptr custom_object_type::merge_prototype(wml::node_ptr node)
 		std::map<std::string, std::string>::const_iterator path_itor = prototype_file_paths().find(proto + ".cfg");
 		ASSERT_LOG(path_itor != prototype_file_paths().end(), "Could not find file for prototype '" << node->attr("prototype") << "'");
 
+		if(proto_paths) {
+			proto_paths->push_back(path_itor->second);
+		}
+
 		wml::node_ptr prototype_node = wml::parse_wml_from_file(path_itor->second);
-		prototype_node = merge_prototype(prototype_node);
+		prototype_node = merge_prototype(prototype_node, proto_paths);
 		merge_into_prototype(prototype_node, node);
 		node = prototype_node;
 	}
@@ -237,15 +464,10 @@ custom_object_type_ptr custom_object_type::create(const std::string& id)
 	ASSERT_LOG(path_itor != object_file_paths().end(), "Could not find file for object '" << id << "'");
 
 	try {
-		wml::node_ptr node = wml::parse_wml_from_file(path_itor->second);
-
-		node = merge_prototype(node);
+		wml::node_ptr node = prepared_definitions().take(id);
 
-		ASSERT_LOG(node->attr("id").str() == id, "IN " << path_itor->second << " OBJECT ID DOES NOT MATCH FILENAME");
-
-		static const wml::schema* schema = wml::schema::get("custom_object");
-		if(schema) {
-			schema->validate_node(node);
+		if(!node) {
+			node = load_definition(id, path_itor->second);
 		}
 
 		//create the object and add it to our cache.
@@ -264,14 +486,81 @@ custom_object_type_ptr custom_object_type::create(const std::string& id)
 	}
 }
 
+void custom_object_type::preload_types(const std::vector<wml::const_node_ptr>& nodes)
+{
+	//only the types of characters in the level are built now. Types
+	//which look like they're spawned are only prepared, since they may
+	//never be used and mustn't stop the level loading if they're broken.
+	std::set<std::string> placed;
+	foreach(wml::const_node_ptr node, nodes) {
+		find_placed_types(node, placed);
+	}
+
+	std::set<std::string> ids = placed;
+	foreach(wml::const_node_ptr node, nodes) {
+		find_spawned_types(node, ids);
+	}
+
+	//every object we've looked at, so each is only loaded once even if
+	//many objects spawn it.
+	std::set<std::string> seen;
+
+	while(!ids.empty()) {
+		std::vector<std::string> round;
+		std::vector<threading::task_ptr> tasks;
+		foreach(const std::string& id, ids) {
+			if(!seen.insert(id).second || cache().count(id)) {
+				continue;
+			}
+
+			const std::string* path = get_object_path(id + ".cfg");
+			if(path) {
+				round.push_back(id);
+				tasks.push_back(threading::run_task(boost::bind(prepare_definition, id, *path)));
+			}
+		}
+
+		ids.clear();
+		if(round.empty()) {
+			break;
+		}
+
+		//any definitions no worker has got to yet are prepared on this
+		//thread while we wait.
+		foreach(const threading::task_ptr& t, tasks) {
+			t->wait();
+		}
+
+		//objects may spawn other objects, so look in each definition for
+		//more objects to prepare.
+		foreach(const std::string& id, round) {
+			wml::const_node_ptr node = prepared_definitions().get(id);
+			if(node) {
+				find_spawned_types(node, ids);
+			}
+		}
+	}
+
+	//building a type parses its formulas and loads its frames, which has
+	//to be done on this thread, but is still done now rather than when
+	//the object first appears.
+	foreach(const std::string& id, placed) {
+		if(get_object_path(id + ".cfg")) {
+			get(id);
+		}
+	}
+}
+
 void custom_object_type::invalidate_object(const std::string& id)
 {
 	cache().erase(id);
+	prepared_definitions().erase(id);
 }
 
 void custom_object_type::invalidate_all_objects()
 {
 	cache().clear();
+	prepared_definitions().clear();
 	object_file_paths().clear();
 	prototype_file_paths().clear();
 }
@@ -444,6 +733,10 @@ custom_object_type::custom_object_type(wml::const_node_ptr node, const custom_ob
 		}
 	}
 
+	std::set<std::string> sounds;
+	find_sounds(node, sounds);
+	sounds_.assign(sounds.begin(), sounds.end());
+
 	std::vector<variant> available_frames;
 	for(frame_map::const_iterator i = frames_.begin(); i != frames_.end(); ++i) {
 		available_frames.push_back(variant(i->first));
@@ -665,15 +958,28 @@ BENCHMARK(custom_object_type_load)
 }
 
 
-BENCHMARK(custom_object_type_frogatto_load)
+//loading frogatto with the object cache empty, as on first run or after
+//editing its files, and with its definition already in the cache.
+BENCHMARK_ARG(custom_object_type_frogatto_load, bool warm)
 {
+	if(warm) {
+		custom_object_type::create("frogatto_playable");
+	}
+
 	BENCHMARK_LOOP {
+		if(!warm) {
+			remove(object_cache_path("frogatto_playable").c_str());
+		}
+
 		custom_object_type::create("frogatto_playable");
 		graphics::texture::clear_textures();
 		graphics::surface_cache::clear();
 	}
 }
 
+BENCHMARK_ARG_CALL(custom_object_type_frogatto_load, cold, false);
+BENCHMARK_ARG_CALL(custom_object_type_frogatto_load, warm, true);
+
 UTILITY(object_definition)
 {
 	foreach(const std::string& arg, args) {
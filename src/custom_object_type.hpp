@@ -31,10 +31,20 @@ typedef boost::shared_ptr<const modifier> const_modifier_ptr;
 class custom_object_type
 {
 public:
-	static wml::node_ptr merge_prototype(wml::node_ptr node);
+	//merges the node's prototypes into it. If proto_paths is given, the
+	//path to each prototype file used is added to it.
+	static wml::node_ptr merge_prototype(wml::node_ptr node, std::vector<std::string>* proto_paths=NULL);
 	static const std::string* get_object_path(const std::string& id);
 	static const_custom_object_type_ptr get(const std::string& id);
 	static custom_object_type_ptr create(const std::string& id);
+
+	//loads the object types of the characters in the given level nodes
+	//now, so they don't have to be loaded during play. The definitions of
+	//types they appear to spawn are prepared too, but errors in those are
+	//only reported if they're used. Definitions are prepared on worker
+	//threads and cached on disk, keyed by the contents of the files
+	//they're made from.
+	static void preload_types(const std::vector<wml::const_node_ptr>& nodes);
 	static void invalidate_object(const std::string& id);
 	static void invalidate_all_objects();
 	static std::vector<const_custom_object_type_ptr> get_all();
@@ -164,6 +174,9 @@ public:
 	int activation_border() const { return activation_border_; }
 	const variant& available_frames() const { return available_frames_; }
 
+	//the sound effects the object may play.
+	const std::vector<std::string>& sounds() const { return sounds_; }
+
 private:
 	custom_object_callable callable_definition_;
 
@@ -176,6 +189,8 @@ private:
 	frame_map frames_;
 	variant available_frames_;
 
+	std::vector<std::string> sounds_;
+
 	boost::shared_ptr<frame> default_frame_;
 
 	game_logic::const_formula_ptr next_animation_formula_;
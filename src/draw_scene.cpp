@@ -18,6 +18,7 @@
 #include "debug_console.hpp"
 #include "draw_number.hpp"
 #include "draw_scene.hpp"
+#include "draw_stats.hpp"
 #include "font.hpp"
 #include "foreach.hpp"
 #include "globals.h"
@@ -421,8 +422,10 @@ void draw_scene(const level& lvl, screen_position& pos, const entity* focus, boo
 		//glViewport(0, 0, fb->w, fb->h);
 		glViewport(0, 0, preferences::actual_screen_width(), preferences::actual_screen_height());
 		glVertexPointer(2, GL_SHORT, 0, &varray1);
+		draw_stats::draw_call(4);
 		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
 		glVertexPointer(2, GL_SHORT, 0, &varray2);
+		draw_stats::draw_call(4);
 		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
 		glEnable(GL_TEXTURE_2D);
 		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
@@ -448,11 +451,15 @@ void draw_fps(const level& lvl, const performance_data& data)
 	if(controls::num_players() > 1) {
 		//draw networking stats
 		std::ostringstream s;
-		s << controls::packets_received() << " packets received; " << controls::num_errors() << " errors; " << controls::cycles_behind() << " behind; " << controls::their_highest_confirmed() << " remote cycles " << controls::last_packet_size() << " packet";
+		s << controls::packets_received() << " packets received; " << controls::num_errors() << " errors; " << controls::cycles_behind() << " behind; " << controls::their_highest_confirmed() << " remote cycles " << controls::last_packet_size() << " packet (" << controls::last_packet_bytes() << " bytes); " << controls::average_confirm_lag() << " cycles to confirm";
 
 		area = font->draw(10, area.y2() + 5, s.str());
 	}
 
+	if(!data.draw_stats_info.empty()) {
+		area = font->draw(10, area.y2() + 5, data.draw_stats_info);
+	}
+
 	if(!data.profiling_info.empty()) {
 		font->draw(10, area.y2() + 5, data.profiling_info);
 	}
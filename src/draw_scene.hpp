@@ -48,6 +48,9 @@ struct performance_data {
 	int nevents;
 
 	std::string profiling_info;
+
+	//summary of the draw calls made in the last frame.
+	std::string draw_stats_info;
 };
 
 void draw_fps(const level& lvl, const performance_data& data);
@@ -0,0 +1,199 @@
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include <boost/cstdint.hpp>
+
+#include "draw_stats.hpp"
+#include "unit_test.hpp"
+
+namespace draw_stats
+{
+
+frame_stats current_frame;
+SUBSYSTEM current_subsystem = SUBSYSTEM_OTHER;
+
+namespace {
+frame_stats previous_frame;
+
+//the time at which the current subsystem was last charged for its time.
+boost::int64_t mark_time = 0;
+
+boost::int64_t get_micros()
+{
+#ifdef WIN32
+	static LARGE_INTEGER frequency;
+	if(frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+
+	LARGE_INTEGER count;
+	QueryPerformanceCounter(&count);
+
+	//split into whole seconds and the rest, so the count is never
+	//multiplied into overflowing.
+	const boost::int64_t seconds = count.QuadPart/frequency.QuadPart;
+	const boost::int64_t rest = count.QuadPart%frequency.QuadPart;
+	return seconds*1000000 + (rest*1000000)/frequency.QuadPart;
+#else
+	timeval tv;
+	gettimeofday(&tv, 0);
+	return boost::int64_t(tv.tv_sec)*1000000 + tv.tv_usec;
+#endif
+}
+
+void charge_current_subsystem()
+{
+	const boost::int64_t t = get_micros();
+	if(t > mark_time) {
+		current_frame.subsystems[current_subsystem].micros += t - mark_time;
+	}
+	mark_time = t;
+}
+}
+
+const char* subsystem_name(SUBSYSTEM s)
+{
+	static const char* names[] = { "other", "tiles", "background", "objects", "particles", "water", "lighting" };
+	return names[s];
+}
+
+void counters::clear()
+{
+	draw_calls = texture_binds = blend_changes = vertices = sprite_batches = batched_quads = micros = 0;
+}
+
+counters& counters::operator+=(const counters& c)
+{
+	draw_calls += c.draw_calls;
+	texture_binds += c.texture_binds;
+	blend_changes += c.blend_changes;
+	vertices += c.vertices;
+	sprite_batches += c.sprite_batches;
+	batched_quads += c.batched_quads;
+	micros += c.micros;
+	return *this;
+}
+
+counters frame_stats::total() const
+{
+	counters result;
+	for(int n = 0; n != NUM_SUBSYSTEMS; ++n) {
+		result += subsystems[n];
+	}
+
+	return result;
+}
+
+void frame_stats::clear()
+{
+	for(int n = 0; n != NUM_SUBSYSTEMS; ++n) {
+		subsystems[n].clear();
+	}
+}
+
+frame_stats& frame_stats::operator+=(const frame_stats& f)
+{
+	for(int n = 0; n != NUM_SUBSYSTEMS; ++n) {
+		subsystems[n] += f.subsystems[n];
+	}
+
+	return *this;
+}
+
+subsystem_scope::subsystem_scope(SUBSYSTEM s) : prev_(current_subsystem)
+{
+	charge_current_subsystem();
+	current_subsystem = s;
+}
+
+subsystem_scope::~subsystem_scope()
+{
+	charge_current_subsystem();
+	current_subsystem = prev_;
+}
+
+void end_frame()
+{
+	previous_frame = current_frame;
+	current_frame.clear();
+	mark_time = get_micros();
+}
+
+const frame_stats& last_frame()
+{
+	return previous_frame;
+}
+
+std::string get_summary()
+{
+	const counters total = previous_frame.total();
+	std::ostringstream s;
+	s << total.draw_calls << " draws; " << total.texture_binds << " binds; " << total.blend_changes << " blends; " << total.vertices << " verts; " << total.sprite_batches << " batches (" << total.batched_quads << " merged)";
+
+	//break the draw calls down by the subsystems which issued them.
+	for(int n = 0; n != NUM_SUBSYSTEMS; ++n) {
+		const counters& c = previous_frame.subsystems[n];
+		if(c.draw_calls) {
+			s << "; " << subsystem_name(static_cast<SUBSYSTEM>(n)) << ": " << c.draw_calls << "/" << (c.micros/100)/10.0 << "ms";
+		}
+	}
+
+	return s.str();
+}
+
+void write_report(std::ostream& s, const frame_stats& stats, int nframes)
+{
+	if(nframes < 1) {
+		nframes = 1;
+	}
+
+	s << std::setw(12) << "subsystem" << std::setw(10) << "draws" << std::setw(10) << "binds" << std::setw(10) << "blends" << std::setw(10) << "verts" << std::setw(10) << "batches" << std::setw(10) << "merged" << std::setw(10) << "us" << "\n";
+
+	for(int n = 0; n <= NUM_SUBSYSTEMS; ++n) {
+		const counters& c = n == NUM_SUBSYSTEMS ? stats.total() : stats.subsystems[n];
+		s << std::setw(12) << (n == NUM_SUBSYSTEMS ? "TOTAL" : subsystem_name(static_cast<SUBSYSTEM>(n)))
+		  << std::setw(10) << c.draw_calls/nframes
+		  << std::setw(10) << c.texture_binds/nframes
+		  << std::setw(10) << c.blend_changes/nframes
+		  << std::setw(10) << c.vertices/nframes
+		  << std::setw(10) << c.sprite_batches/nframes
+		  << std::setw(10) << c.batched_quads/nframes
+		  << std::setw(10) << c.micros/nframes << "\n";
+	}
+}
+
+}
+
+UNIT_TEST(draw_stats_scopes)
+{
+	draw_stats::end_frame();
+	draw_stats::draw_call(4);
+	{
+		draw_stats::subsystem_scope scope(draw_stats::SUBSYSTEM_TILES);
+		draw_stats::draw_call(6);
+		draw_stats::texture_bind();
+		{
+			draw_stats::subsystem_scope scope(draw_stats::SUBSYSTEM_WATER);
+			draw_stats::blend_change();
+		}
+		draw_stats::draw_call(6);
+	}
+	draw_stats::end_frame();
+
+	const draw_stats::frame_stats& f = draw_stats::last_frame();
+	CHECK_EQ(f.subsystems[draw_stats::SUBSYSTEM_OTHER].draw_calls, 1);
+	CHECK_EQ(f.subsystems[draw_stats::SUBSYSTEM_TILES].draw_calls, 2);
+	CHECK_EQ(f.subsystems[draw_stats::SUBSYSTEM_TILES].vertices, 12);
+	CHECK_EQ(f.subsystems[draw_stats::SUBSYSTEM_TILES].texture_binds, 1);
+	CHECK_EQ(f.subsystems[draw_stats::SUBSYSTEM_WATER].blend_changes, 1);
+	CHECK_EQ(f.total().draw_calls, 3);
+	CHECK_EQ(draw_stats::current_subsystem, draw_stats::SUBSYSTEM_OTHER);
+	CHECK_EQ(draw_stats::current_frame.total().draw_calls, 0);
+}
@@ -0,0 +1,102 @@
+#ifndef DRAW_STATS_HPP_INCLUDED
+#define DRAW_STATS_HPP_INCLUDED
+
+#include <iosfwd>
+#include <string>
+
+//lightweight per-frame instrumentation of what the renderer submits to GL.
+//Drawing code reports draw calls, texture binds and blend state changes,
+//and wraps its work in a subsystem_scope so the counts (and the CPU time
+//spent submitting them) are broken down by the part of the engine that
+//issued them. The figures for the last complete frame are shown by
+//draw_fps() and can be dumped by the render_level utility.
+namespace draw_stats
+{
+
+enum SUBSYSTEM { SUBSYSTEM_OTHER, SUBSYSTEM_TILES, SUBSYSTEM_BACKGROUND,
+                 SUBSYSTEM_OBJECTS, SUBSYSTEM_PARTICLES, SUBSYSTEM_WATER,
+                 SUBSYSTEM_LIGHTING, NUM_SUBSYSTEMS };
+
+const char* subsystem_name(SUBSYSTEM s);
+
+struct counters {
+	counters() { clear(); }
+	void clear();
+	counters& operator+=(const counters& c);
+
+	int draw_calls;
+	int texture_binds;
+	int blend_changes;
+	int vertices;
+
+	//the number of sprite batches drawn, and the number of quads which
+	//were merged into an existing batch instead of needing their own.
+	int sprite_batches;
+	int batched_quads;
+
+	//time spent inside the subsystem's scopes, in microseconds.
+	int micros;
+};
+
+struct frame_stats {
+	counters subsystems[NUM_SUBSYSTEMS];
+	counters total() const;
+	void clear();
+	frame_stats& operator+=(const frame_stats& f);
+};
+
+//the counters for the frame currently being drawn. Access through the
+//functions below rather than directly.
+extern frame_stats current_frame;
+extern SUBSYSTEM current_subsystem;
+
+inline void draw_call(int nvertices) {
+	counters& c = current_frame.subsystems[current_subsystem];
+	++c.draw_calls;
+	c.vertices += nvertices;
+}
+
+inline void texture_bind() {
+	++current_frame.subsystems[current_subsystem].texture_binds;
+}
+
+inline void blend_change() {
+	++current_frame.subsystems[current_subsystem].blend_changes;
+}
+
+inline void sprite_batch_drawn() {
+	++current_frame.subsystems[current_subsystem].sprite_batches;
+}
+
+inline void batched_quad() {
+	++current_frame.subsystems[current_subsystem].batched_quads;
+}
+
+//attributes all stats recorded within its lifetime to the given subsystem.
+//Scopes may be nested; time is charged exclusively to the innermost scope.
+class subsystem_scope
+{
+public:
+	explicit subsystem_scope(SUBSYSTEM s);
+	~subsystem_scope();
+private:
+	subsystem_scope(const subsystem_scope&);
+	void operator=(const subsystem_scope&);
+
+	SUBSYSTEM prev_;
+};
+
+//marks the end of a frame: the current counters become the 'last frame'
+//and are reset ready for the next frame.
+void end_frame();
+const frame_stats& last_frame();
+
+//a one line summary of the last frame, suitable for display on screen.
+std::string get_summary();
+
+//writes a per-subsystem table of the given stats.
+void write_report(std::ostream& s, const frame_stats& stats, int nframes=1);
+
+}
+
+#endif
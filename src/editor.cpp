@@ -9,6 +9,8 @@
 #include <iostream>
 #include <cmath>
 #include <algorithm>
+#include <map>
+#include <set>
 
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
@@ -46,6 +48,7 @@
 #include "package.hpp"
 #include "player_info.hpp"
 #include "preferences.hpp"
+#include "preprocessor.hpp"
 #include "property_editor_dialog.hpp"
 #include "raster.hpp"
 #include "segment_editor_dialog.hpp"
@@ -55,6 +58,7 @@
 #include "tile_map.hpp"
 #include "tileset_editor_dialog.hpp"
 #include "tooltip.hpp"
+#include "unit_test.hpp"
 #include "wml_node.hpp"
 #include "wml_parser.hpp"
 #include "wml_utils.hpp"
@@ -411,6 +415,29 @@ void execute_functions(const std::vector<boost::function<void()> >& v) {
 
 bool g_started_dragging_object = false;
 
+//if we're in the middle of a stroke of the pencil, after the first tile
+//painted in it.
+bool g_painting_tiles = false;
+
+//the tiles of one layer, out of those level::get_all_tiles_rect() found.
+std::vector<std::string> tiles_in_layer(const std::map<int, std::vector<std::string> >& tiles, int layer)
+{
+	std::map<int, std::vector<std::string> >::const_iterator i = tiles.find(layer);
+	if(i == tiles.end()) {
+		return std::vector<std::string>(1, "");
+	}
+
+	return i->second;
+}
+
+//commands made of functions can't tell how much memory they use, so they
+//are assumed to use this much.
+const size_t DefaultCommandSize = 256;
+
+//the memory commands in the undo list may take before the oldest are
+//discarded.
+const size_t UndoMemoryBudget = 16*1024*1024;
+
 //the current state of the rectangle we're dragging
 rect g_rect_drawing;
 
@@ -1185,33 +1212,19 @@ void editor::handle_key_press(const SDL_KeyboardEvent& key)
 	}
 
 	if(!tile_selection_.empty() && (key.keysym.sym == SDLK_DELETE || key.keysym.sym == SDLK_BACKSPACE)) {
-		int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
-		std::vector<boost::function<void()> > redo, undo;
+		tile_edit_ptr edit(new tile_edit);
 		foreach(const point& p, tile_selection_.tiles) {
 			const int x = p.x*TileSize;
 			const int y = p.y*TileSize;
 
-			min_x = std::min(x, min_x);
-			max_x = std::max(x, max_x);
-			min_y = std::min(y, min_y);
-			max_y = std::max(y, max_y);
-
-			redo.push_back(boost::bind(&level::clear_tile_rect, lvl_.get(), x, y, x, y));
 			std::map<int, std::vector<std::string> > old_tiles;
 			lvl_->get_all_tiles_rect(x, y, x, y, old_tiles);
 			for(std::map<int, std::vector<std::string> >::const_iterator i = old_tiles.begin(); i != old_tiles.end(); ++i) {
-				undo.push_back(boost::bind(&level::add_tile_rect_vector, lvl_.get(), i->first, x, y, x, y, i->second));
+				edit->add(tile_rect_diff(i->first, x, y, x, y, i->second, std::vector<std::string>(1, "")));
 			}
 		}
 
-		if(!tile_selection_.tiles.empty()) {
-			undo.push_back(boost::bind(&level::start_rebuild_tiles_in_background, lvl_.get(), std::vector<int>()));
-			redo.push_back(boost::bind(&level::start_rebuild_tiles_in_background, lvl_.get(), std::vector<int>()));
-		}
-
-		execute_command(
-		  boost::bind(execute_functions, redo),
-		  boost::bind(execute_functions, undo));
+		execute_tile_edit(edit);
 	}
 
 	if(key.keysym.sym == SDLK_o) {
@@ -1359,7 +1372,7 @@ void editor::handle_drawing_rect(int mousex, int mousey)
 	if(tool() == TOOL_ADD_RECT) {
 		lvl_->freeze_rebuild_tiles_in_background();
 		if(tmp_undo_.get()) {
-			tmp_undo_->undo_command();
+			apply_command(*tmp_undo_, true);
 		}
 
 		if(buttons == SDL_BUTTON_LEFT) {
@@ -1489,11 +1502,13 @@ void editor::handle_mouse_button_down(const SDL_MouseButtonEvent& event)
 	} else if(tool() == TOOL_PENCIL) {
 		drawing_rect_ = false;
 		point p(anchorx_, anchory_);
+		g_painting_tiles = false;
 		if(buttons&SDL_BUTTON_LEFT) {
 			add_tile_rect(p.x, p.y, p.x, p.y);
 		} else {
 			remove_tile_rect(p.x, p.y, p.x, p.y);
 		}
+		g_painting_tiles = true;
 		g_current_draw_tiles.clear();
 		g_current_draw_tiles.push_back(p);
 	} else if(property_dialog_ && variable_info_selected(property_dialog_->get_entity(), anchorx_, anchory_, zoom_)) {
@@ -1589,8 +1604,30 @@ void editor::handle_mouse_button_down(const SDL_MouseButtonEvent& event)
 	}
 }
 
+struct editor::selection_move {
+	tile_edit_ptr tiles;
+	tile_selection old_selection, new_selection;
+
+	void apply(editor* ed, bool undo) const {
+		if(undo) {
+			tiles->undo(ed->lvl_.get());
+		} else {
+			tiles->redo(ed->lvl_.get());
+		}
+
+		ed->set_selection(undo ? old_selection : new_selection);
+	}
+
+	size_t size_in_bytes() const {
+		return sizeof(*this) + tiles->size_in_bytes() +
+		       (old_selection.tiles.capacity() + new_selection.tiles.capacity())*sizeof(point);
+	}
+};
+
 void editor::handle_mouse_button_up(const SDL_MouseButtonEvent& event)
 {
+	g_painting_tiles = false;
+
 	const bool ctrl_pressed = (SDL_GetModState()&(KMOD_LCTRL|KMOD_RCTRL)) != 0;
 	const bool shift_pressed = (SDL_GetModState()&(KMOD_LSHIFT|KMOD_RSHIFT)) != 0;
 	int mousex, mousey;
@@ -1636,85 +1673,64 @@ void editor::handle_mouse_button_up(const SDL_MouseButtonEvent& event)
 			int diffy = (selecty - anchory_)/TileSize;
 
 			std::cerr << "MAKE DIFF: " << diffx << "," << diffy << "\n";
-			std::vector<boost::function<void()> > redo, undo;
 
+			//the tiles of every layer in the selection and where it's moved
+			//to, before the move.
+			std::set<point> sources(tile_selection_.tiles.begin(), tile_selection_.tiles.end());
+			std::map<point, std::map<int, std::vector<std::string> > > old_tiles;
 			foreach(const point& p, tile_selection_.tiles) {
-				const int x = (p.x+diffx)*TileSize;
-				const int y = (p.y+diffy)*TileSize;
-				undo.push_back(boost::bind(&level::clear_tile_rect,lvl_.get(), x, y, x, y));
+				const point dest(p.x + diffx, p.y + diffy);
+				lvl_->get_all_tiles_rect(p.x*TileSize, p.y*TileSize, p.x*TileSize, p.y*TileSize, old_tiles[p]);
+				lvl_->get_all_tiles_rect(dest.x*TileSize, dest.y*TileSize, dest.x*TileSize, dest.y*TileSize, old_tiles[dest]);
 			}
 
-			int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
-
-			//backup both the contents of the old and new regions, so we can restore them both
-			foreach(const point& p, tile_selection_.tiles) {
-				int x = p.x*TileSize;
-				int y = p.y*TileSize;
-
-				min_x = std::min(x, min_x);
-				max_x = std::max(x, max_x);
-				min_y = std::min(y, min_y);
-				max_y = std::max(y, max_y);
-
-				std::map<int, std::vector<std::string> > old_tiles;
-				lvl_->get_all_tiles_rect(x, y, x, y, old_tiles);
-				for(std::map<int, std::vector<std::string> >::const_iterator i = old_tiles.begin(); i != old_tiles.end(); ++i) {
-					undo.push_back(boost::bind(&level::add_tile_rect_vector, lvl_.get(), i->first, x, y, x, y, i->second));
-					redo.push_back(boost::bind(&level::add_tile_rect_vector, lvl_.get(), i->first, x, y, x, y, std::vector<std::string>(1,"")));
+			//the tiles are moved to where they're dragged, in every layer,
+			//and the places they're moved from are left empty.
+			tile_edit_ptr edit(new tile_edit);
+			const std::map<int, std::vector<std::string> > no_tiles;
+			typedef std::pair<const point, std::map<int, std::vector<std::string> > > cell_tiles;
+			foreach(const cell_tiles& cell, old_tiles) {
+				const point src(cell.first.x - diffx, cell.first.y - diffy);
+				const std::map<int, std::vector<std::string> >& new_tiles = sources.count(src) ? old_tiles[src] : no_tiles;
+
+				std::set<int> layers;
+				for(std::map<int, std::vector<std::string> >::const_iterator i = cell.second.begin(); i != cell.second.end(); ++i) {
+					layers.insert(i->first);
 				}
 
-				old_tiles.clear();
-	
-				x += diffx*TileSize;
-				y += diffy*TileSize;
-
-				min_x = std::min(x, min_x);
-				max_x = std::max(x, max_x);
-				min_y = std::min(y, min_y);
-				max_y = std::max(y, max_y);
-
-				lvl_->get_all_tiles_rect(x, y, x, y, old_tiles);
-				for(std::map<int, std::vector<std::string> >::const_iterator i = old_tiles.begin(); i != old_tiles.end(); ++i) {
-					undo.push_back(boost::bind(&level::add_tile_rect_vector, lvl_.get(), i->first, x, y, x, y, i->second));
-					redo.push_back(boost::bind(&level::add_tile_rect_vector, lvl_.get(), i->first, x, y, x, y, std::vector<std::string>(1,"")));
+				for(std::map<int, std::vector<std::string> >::const_iterator i = new_tiles.begin(); i != new_tiles.end(); ++i) {
+					layers.insert(i->first);
 				}
-			}
 
-			
-			foreach(const point& p, tile_selection_.tiles) {
-				const int x = p.x*TileSize;
-				const int y = p.y*TileSize;
-
-				min_x = std::min(x + diffx*TileSize, min_x);
-				max_x = std::max(x + diffx*TileSize, max_x);
-				min_y = std::min(y + diffy*TileSize, min_y);
-				max_y = std::max(y + diffy*TileSize, max_y);
-
-				std::map<int, std::vector<std::string> > old_tiles;
-				lvl_->get_all_tiles_rect(x, y, x, y, old_tiles);
-				for(std::map<int, std::vector<std::string> >::const_iterator i = old_tiles.begin(); i != old_tiles.end(); ++i) {
-					redo.push_back(boost::bind(&level::add_tile_rect_vector, lvl_.get(), i->first, x + diffx*TileSize, y + diffy*TileSize, x + diffx*TileSize, y + diffy*TileSize, i->second));
+				const int x = cell.first.x*TileSize, y = cell.first.y*TileSize;
+				foreach(int layer, layers) {
+					edit->add(tile_rect_diff(layer, x, y, x, y, tiles_in_layer(cell.second, layer), tiles_in_layer(new_tiles, layer)));
 				}
 			}
 
-			if(!tile_selection_.tiles.empty()) {
-				undo.push_back(boost::bind(&level::start_rebuild_tiles_in_background, lvl_.get(), std::vector<int>()));
-				redo.push_back(boost::bind(&level::start_rebuild_tiles_in_background, lvl_.get(), std::vector<int>()));
-			}
-
-			tile_selection new_selection = tile_selection_;
-			foreach(point& p, new_selection.tiles) {
+			boost::shared_ptr<selection_move> move(new selection_move);
+			move->tiles = edit;
+			move->old_selection = tile_selection_;
+			move->new_selection = tile_selection_;
+			foreach(point& p, move->new_selection.tiles) {
 				p.x += diffx;
 				p.y += diffy;
 			}
-			
-			redo.push_back(boost::bind(&editor::set_selection, this, new_selection));
-			undo.push_back(boost::bind(&editor::set_selection, this, tile_selection_));
 
-			execute_command(
-			  boost::bind(execute_functions, redo),
-			  boost::bind(execute_functions, undo));
-			
+			executable_command cmd;
+			cmd.redo_command = boost::bind(&selection_move::apply, move, this, false);
+			cmd.undo_command = boost::bind(&selection_move::apply, move, this, true);
+			cmd.size = sizeof(executable_command) + move->size_in_bytes();
+			cmd.rebuild_tiles = !edit->layers().empty();
+			cmd.tile_layers = edit->layers();
+
+			level_changed_++;
+			apply_command(cmd, false);
+
+			undo_.push_back(cmd);
+			redo_.clear();
+
+			enforce_undo_budget();
 		} else if(!drawing_rect_) {
 			//wasn't drawing a rect.
 			if(event.button == SDL_BUTTON_LEFT && tool() == TOOL_MAGIC_WAND) {
@@ -1728,7 +1744,7 @@ void editor::handle_mouse_button_up(const SDL_MouseButtonEvent& event)
 				if(tmp_undo_.get()) {
 					//if we have a temporary change that was made while dragging
 					//to preview the change, undo that now.
-					tmp_undo_->undo_command();
+					apply_command(*tmp_undo_, true);
 					tmp_undo_.reset();
 				}
 
@@ -1743,7 +1759,7 @@ void editor::handle_mouse_button_up(const SDL_MouseButtonEvent& event)
 			if(tmp_undo_.get()) {
 				//if we have a temporary change that was made while dragging
 				//to preview the change, undo that now.
-				tmp_undo_->undo_command();
+				apply_command(*tmp_undo_, true);
 				tmp_undo_.reset();
 			}
 			remove_tile_rect(anchorx_, anchory_, xpos, ypos);
@@ -1861,19 +1877,9 @@ void editor::add_tile_rect(int zorder, const std::string& tile_id, int x1, int y
 	std::vector<std::string> old_rect;
 	lvl_->get_tile_rect(zorder, x1, y1, x2, y2, old_rect);
 
-	std::vector<boost::function<void()> > undo, redo;
-
-	redo.push_back(boost::bind(&level::add_tile_rect, lvl_.get(), zorder, x1, y1, x2, y2, tile_id));
-	undo.push_back(boost::bind(&level::add_tile_rect_vector, lvl_.get(), zorder, x1, y1, x2, y2, old_rect));
-
-	std::vector<int> layers;
-	layers.push_back(zorder);
-	undo.push_back(boost::bind(&level::start_rebuild_tiles_in_background, lvl_.get(), layers));
-	redo.push_back(boost::bind(&level::start_rebuild_tiles_in_background, lvl_.get(), layers));
-
-	execute_command(
-	  boost::bind(execute_functions, redo),
-	  boost::bind(execute_functions, undo));
+	tile_edit_ptr edit(new tile_edit);
+	edit->add(tile_rect_diff(zorder, x1, y1, x2, y2, old_rect, std::vector<std::string>(1, tile_id)));
+	execute_tile_edit(edit, COMMAND_TYPE_PAINT_TILES);
 
 	if(layers_dialog_) {
 		layers_dialog_->init();
@@ -1910,18 +1916,13 @@ void editor::remove_tile_rect(int x1, int y1, int x2, int y2)
 
 	std::map<int, std::vector<std::string> > old_tiles;
 	lvl_->get_all_tiles_rect(x1, y1, x2, y2, old_tiles);
-	std::vector<boost::function<void()> > redo, undo;
+
+	tile_edit_ptr edit(new tile_edit);
 	for(std::map<int, std::vector<std::string> >::const_iterator i = old_tiles.begin(); i != old_tiles.end(); ++i) {
-		undo.push_back(boost::bind(&level::add_tile_rect_vector, lvl_.get(), i->first, x1, y1, x2, y2, i->second));
+		edit->add(tile_rect_diff(i->first, x1, y1, x2, y2, i->second, std::vector<std::string>(1, "")));
 	}
 
-	redo.push_back(boost::bind(&level::clear_tile_rect, lvl_.get(), x1, y1, x2, y2));
-	undo.push_back(boost::bind(&level::start_rebuild_tiles_in_background, lvl_.get(), std::vector<int>()));
-	redo.push_back(boost::bind(&level::start_rebuild_tiles_in_background, lvl_.get(), std::vector<int>()));
-
-	execute_command(
-	  boost::bind(execute_functions, redo),
-	  boost::bind(execute_functions, undo));
+	execute_tile_edit(edit, COMMAND_TYPE_PAINT_TILES);
 }
 
 void editor::select_tile_rect(int x1, int y1, int x2, int y2)
@@ -2185,14 +2186,13 @@ void editor::save_level()
 	remove_ghost_objects();
 	ghost_objects_.clear();
 
-	std::string data;
 	wml::node_ptr lvl_node = lvl_->write();
 	lvl_node->erase_attr("cycle"); //levels saved in the editor should never
 	                               //have a cycle attached to them so that
 								   //all levels start at cycle 0.
-	wml::write(lvl_node, data);
 	std::cerr << "GET LEVEL FILENAME: " << filename_ << "\n";
-	sys::write_file(package::get_level_filename(filename_), data);
+	wml::write_file(package::get_level_filename(filename_), lvl_node);
+	invalidate_preprocessed_file(package::get_level_filename(filename_));
 
 	//see if we should write the next/previous levels also
 	//based on them having changed.
@@ -2202,9 +2202,7 @@ void editor::save_level()
 			prev.finish_loading();
 			if(prev.next_level() != lvl_->id()) {
 				prev.set_next_level(lvl_->id());
-				std::string data;
-				wml::write(prev.write(), data);
-				sys::write_file(package::get_level_filename(prev.id()), data);
+				wml::write_file(package::get_level_filename(prev.id()), prev.write());
 			}
 		} catch(...) {
 		}
@@ -2216,9 +2214,7 @@ void editor::save_level()
 			next.finish_loading();
 			if(next.previous_level() != lvl_->id()) {
 				next.set_previous_level(lvl_->id());
-				std::string data;
-				wml::write(next.write(), data);
-				sys::write_file(package::get_level_filename(next.id()), data);
+				wml::write_file(package::get_level_filename(next.id()), next.write());
 			}
 		} catch(...) {
 		}
@@ -2630,8 +2626,134 @@ void editor::execute_command(boost::function<void()> command, boost::function<vo
 	cmd.redo_command = command;
 	cmd.undo_command = undo;
 	cmd.type = type;
+	cmd.size = DefaultCommandSize;
+	undo_.push_back(cmd);
+	redo_.clear();
+
+	enforce_undo_budget();
+}
+
+void editor::execute_tile_edit(tile_edit_ptr edit, EXECUTABLE_COMMAND_TYPE type)
+{
+	if(type == COMMAND_TYPE_PAINT_TILES && g_painting_tiles && !undo_.empty() && undo_.back().type == COMMAND_TYPE_PAINT_TILES && undo_.back().tiles) {
+		//a stroke of the pencil is undone all at once, so the tiles it
+		//paints are rolled into the command which began it.
+		edit->redo(lvl_.get());
+		if(!edit->layers().empty() && undo_commands_groups_.empty()) {
+			lvl_->start_rebuild_tiles_in_background(edit->layers());
+		}
+
+		executable_command& cmd = undo_.back();
+		cmd.tiles->append(*edit);
+		cmd.size = cmd.tiles->size_in_bytes();
+		cmd.rebuild_tiles = !cmd.tiles->layers().empty();
+		cmd.tile_layers = cmd.tiles->layers();
+		redo_.clear();
+		return;
+	}
+
+	executable_command cmd;
+	cmd.redo_command = boost::bind(&tile_edit::redo, edit, lvl_.get());
+	cmd.undo_command = boost::bind(&tile_edit::undo, edit, lvl_.get());
+	cmd.type = type;
+	cmd.size = edit->size_in_bytes();
+	cmd.rebuild_tiles = !edit->layers().empty();
+	cmd.tile_layers = edit->layers();
+	cmd.tiles = edit;
+
+	level_changed_++;
+	apply_command(cmd, false);
+
+	undo_.push_back(cmd);
+	redo_.clear();
+
+	enforce_undo_budget();
+}
+
+struct editor::property_delta {
+	entity_ptr obj;
+	std::string id;
+	variant old_value, new_value;
+
+	void apply(editor* ed, bool undo) const {
+		ed->mutate_object_value(obj, id, undo ? old_value : new_value);
+	}
+};
+
+void editor::edit_object_value(entity_ptr e, const std::string& id, const variant& value)
+{
+	game_logic::formula_callable* vars = e->vars();
+	if(!vars) {
+		return;
+	}
+
+	if(!undo_.empty() && undo_.back().type == COMMAND_TYPE_OBJECT_PROPERTY &&
+	   undo_.back().property->obj == e && undo_.back().property->id == id) {
+		//changing the same variable again, such as by clicking on a
+		//button to increase it several times, is undone all at once.
+		undo_.back().property->new_value = value;
+		undo_.back().property->apply(this, false);
+		redo_.clear();
+		return;
+	}
+
+	boost::shared_ptr<property_delta> delta(new property_delta);
+	delta->obj = e;
+	delta->id = id;
+	delta->old_value = vars->query_value(id);
+	delta->new_value = value;
+
+	executable_command cmd;
+	cmd.redo_command = boost::bind(&property_delta::apply, delta, this, false);
+	cmd.undo_command = boost::bind(&property_delta::apply, delta, this, true);
+	cmd.type = COMMAND_TYPE_OBJECT_PROPERTY;
+	cmd.size = sizeof(executable_command) + sizeof(property_delta) + id.size();
+	cmd.property = delta;
+
+	level_changed_++;
+	apply_command(cmd, false);
+
 	undo_.push_back(cmd);
 	redo_.clear();
+
+	enforce_undo_budget();
+}
+
+void editor::apply_command(const executable_command& cmd, bool undo)
+{
+	if(undo) {
+		cmd.undo_command();
+	} else {
+		cmd.redo_command();
+	}
+
+	if(cmd.rebuild_tiles && undo_commands_groups_.empty()) {
+		lvl_->start_rebuild_tiles_in_background(cmd.tile_layers);
+	}
+}
+
+void editor::enforce_undo_budget()
+{
+	//while a group of commands is being made, it refers to the commands
+	//by their position in the undo list.
+	if(!undo_commands_groups_.empty()) {
+		return;
+	}
+
+	size_t size = 0;
+	foreach(const executable_command& cmd, redo_) {
+		size += cmd.size;
+	}
+
+	//keep the newest commands which fit in the budget, and always the
+	//newest one.
+	int first_kept = undo_.size();
+	while(first_kept > 0 && (first_kept == undo_.size() || size + undo_[first_kept - 1].size <= UndoMemoryBudget)) {
+		--first_kept;
+		size += undo_[first_kept].size;
+	}
+
+	undo_.erase(undo_.begin(), undo_.begin() + first_kept);
 }
 
 void editor::begin_command_group()
@@ -2654,13 +2776,30 @@ void editor::end_command_group()
 		return;
 	}
 
-	//group all of the commands since beginning into one command
+	//group all of the commands since beginning into one command. Tiles
+	//aren't rebuilt by the commands in a group, but once for the group.
+	executable_command cmd;
 	std::vector<boost::function<void()> > undo, redo;
 	for(int n = index; n != undo_.size(); ++n) {
 		undo.push_back(undo_[n].undo_command);
 		redo.push_back(undo_[n].redo_command);
+		cmd.size += undo_[n].size;
+
+		if(undo_[n].rebuild_tiles) {
+			if((cmd.rebuild_tiles && cmd.tile_layers.empty()) || undo_[n].tile_layers.empty()) {
+				//every layer is rebuilt.
+				cmd.tile_layers.clear();
+			} else {
+				cmd.tile_layers.insert(cmd.tile_layers.end(), undo_[n].tile_layers.begin(), undo_[n].tile_layers.end());
+			}
+
+			cmd.rebuild_tiles = true;
+		}
 	}
 
+	std::sort(cmd.tile_layers.begin(), cmd.tile_layers.end());
+	cmd.tile_layers.erase(std::unique(cmd.tile_layers.begin(), cmd.tile_layers.end()), cmd.tile_layers.end());
+
 	//reverse the undos, since we want them executed in reverse order.
 	std::reverse(undo.begin(), undo.end());
 
@@ -2671,13 +2810,20 @@ void editor::end_command_group()
 	redo.insert(redo.begin(), boost::bind(&level::editor_freeze_tile_updates, lvl_.get(), true));
 	redo.push_back(boost::bind(&level::editor_freeze_tile_updates, lvl_.get(), false));
 
-	executable_command cmd;
 	cmd.redo_command = boost::bind(execute_functions, redo);
 	cmd.undo_command = boost::bind(execute_functions, undo);
 
 	//replace all the individual commands with the one group command.
 	undo_.erase(undo_.begin() + index, undo_.end());
 	undo_.push_back(cmd);
+
+	if(undo_commands_groups_.empty()) {
+		if(cmd.rebuild_tiles) {
+			lvl_->start_rebuild_tiles_in_background(cmd.tile_layers);
+		}
+
+		enforce_undo_budget();
+	}
 }
 
 void editor::undo_command()
@@ -2688,7 +2834,7 @@ void editor::undo_command()
 
 	--level_changed_;
 
-	undo_.back().undo_command();
+	apply_command(undo_.back(), true);
 	redo_.push_back(undo_.back());
 	undo_.pop_back();
 
@@ -2705,7 +2851,7 @@ void editor::redo_command()
 
 	++level_changed_;
 
-	redo_.back().redo_command();
+	apply_command(redo_.back(), false);
 	undo_.push_back(redo_.back());
 	redo_.pop_back();
 
@@ -2762,3 +2908,75 @@ void editor::mutate_object_value(entity_ptr e, const std::string& value, variant
 	e->handle_event("editor_changed_variable");
 }
 
+
+//a long session of painting tiles one at a time, then undoing and redoing
+//all of it. The editor's loop is followed: after each command, tiles
+//which have been rebuilt in the background are taken, and rebuilds asked
+//for meanwhile are batched into the next one.
+BENCHMARK_ARG(editor_undo_session, int edits)
+{
+	const int Width = 50, Height = 20;
+	static editor* ed = NULL;
+	static int zorder = 0;
+	static std::string tile;
+	if(ed == NULL) {
+		ed = new editor("stairway-to-heaven.cfg");
+
+		//find a tile to paint with.
+		const rect& area = ed->get_level().boundaries();
+		std::map<int, std::vector<std::string> > tiles;
+		ed->get_level().get_all_tiles_rect(area.x(), area.y(), area.x2(), area.y2(), tiles);
+		for(std::map<int, std::vector<std::string> >::const_iterator i = tiles.begin(); i != tiles.end() && tile.empty(); ++i) {
+			foreach(const std::string& t, i->second) {
+				if(!t.empty()) {
+					zorder = i->first;
+					tile = t;
+					break;
+				}
+			}
+		}
+
+		ASSERT_LOG(!tile.empty(), "NO TILES FOUND TO PAINT WITH");
+	}
+
+	level& lvl = ed->get_level();
+	const int x1 = lvl.boundaries().x() - lvl.boundaries().x()%TileSize;
+	const int y1 = lvl.boundaries().y() - lvl.boundaries().y()%TileSize;
+	const int x2 = x1 + (Width - 1)*TileSize, y2 = y1 + (Height - 1)*TileSize;
+
+	BENCHMARK_LOOP {
+		std::vector<std::string> before, after;
+		lvl.get_tile_rect(zorder, x1, y1, x2, y2, before);
+
+		for(int n = 0; n != edits; ++n) {
+			const int x = x1 + ((n*7)%Width)*TileSize, y = y1 + ((n*3)%Height)*TileSize;
+			ed->add_tile_rect(zorder, n%2 ? tile : "", x, y, x, y);
+			lvl.complete_rebuild_tiles_in_background();
+		}
+
+		for(int n = 0; n != edits; ++n) {
+			ed->undo_command();
+			lvl.complete_rebuild_tiles_in_background();
+		}
+
+		for(int n = 0; n != edits; ++n) {
+			ed->redo_command();
+			lvl.complete_rebuild_tiles_in_background();
+		}
+
+		for(int n = 0; n != edits; ++n) {
+			ed->undo_command();
+			lvl.complete_rebuild_tiles_in_background();
+		}
+
+		while(lvl.rebuilding_tiles_in_background()) {
+			lvl.complete_rebuild_tiles_in_background();
+		}
+
+		lvl.get_tile_rect(zorder, x1, y1, x2, y2, after);
+		CHECK(before == after, "undoing every edit didn't restore the tiles");
+	}
+}
+
+BENCHMARK_ARG_CALL(editor_undo_session, hundred_edits, 100);
+BENCHMARK_ARG_CALL(editor_undo_session, thousand_edits, 1000);
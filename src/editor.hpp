@@ -6,6 +6,7 @@
 #include <stack>
 #include <vector>
 
+#include "editor_tile_edit.hpp"
 #include "geometry.hpp"
 #include "key.hpp"
 #include "level.hpp"
@@ -123,7 +124,7 @@ public:
 	int get_tile_zorder(const std::string& tile_id) const;
 	void add_tile_rect(int zorder, const std::string& tile_id, int x1, int y1, int x2, int y2);
 
-	enum EXECUTABLE_COMMAND_TYPE { COMMAND_TYPE_DEFAULT, COMMAND_TYPE_DRAG_OBJECT };
+	enum EXECUTABLE_COMMAND_TYPE { COMMAND_TYPE_DEFAULT, COMMAND_TYPE_DRAG_OBJECT, COMMAND_TYPE_PAINT_TILES, COMMAND_TYPE_OBJECT_PROPERTY };
 
 	//function to execute a command which will go into the undo/redo list.
 	//normally any time the editor mutates the level, it should be done
@@ -141,6 +142,10 @@ public:
 	void begin_command_group();
 	void end_command_group();
 
+	//sets one of an object's variables, as a command which can be undone.
+	//Changes to the same variable one after another are undone together.
+	void edit_object_value(entity_ptr e, const std::string& id, const variant& value);
+
 private:
 	void reset_dialog_positions();
 
@@ -213,12 +218,43 @@ private:
 	//if the mouse is currently down, drawing a rect.
 	bool drawing_rect_, dragging_;
 
+	struct property_delta;
+
+	//a dragged tile selection: the tiles it moves, and the selection
+	//before and after.
+	struct selection_move;
+
 	struct executable_command {
+		executable_command() : type(COMMAND_TYPE_DEFAULT), size(0), rebuild_tiles(false)
+		{}
+
 		boost::function<void()> redo_command;
 		boost::function<void()> undo_command;
 		EXECUTABLE_COMMAND_TYPE type;
+
+		//roughly how much memory the command takes.
+		size_t size;
+
+		//if set, the layers in tile_layers, or every layer if it's empty,
+		//have their tiles rebuilt once the command is executed or undone.
+		bool rebuild_tiles;
+		std::vector<int> tile_layers;
+
+		//what the command changes, kept so following changes can be
+		//rolled into the same command.
+		tile_edit_ptr tiles;
+		boost::shared_ptr<property_delta> property;
 	};
 
+	//executes or undoes a command, and starts rebuilding the tiles it
+	//changed, unless a group of commands is being made.
+	void apply_command(const executable_command& cmd, bool undo);
+
+	void execute_tile_edit(tile_edit_ptr edit, EXECUTABLE_COMMAND_TYPE type=COMMAND_TYPE_DEFAULT);
+
+	//discards the oldest commands once the undo list takes too much memory.
+	void enforce_undo_budget();
+
 	std::vector<executable_command> undo_, redo_;
 
 	//a temporary undo which is used for when we execute commands on
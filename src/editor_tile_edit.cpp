@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <map>
+
+#include "asserts.hpp"
+#include "editor_tile_edit.hpp"
+#include "foreach.hpp"
+#include "level.hpp"
+#include "unit_test.hpp"
+
+namespace {
+//every tile id used in an edit is kept here once, and edits refer to
+//tiles by their index. There are only as many tile ids as there are
+//types of tile, so this never grows large.
+std::vector<std::string>& tile_ids()
+{
+	static std::vector<std::string> ids(1, "");
+	return ids;
+}
+
+int intern_tile_id(const std::string& id)
+{
+	static std::map<std::string, int> indexes;
+	if(id.empty()) {
+		return 0;
+	}
+
+	std::map<std::string, int>::const_iterator i = indexes.find(id);
+	if(i != indexes.end()) {
+		return i->second;
+	}
+
+	const int index = tile_ids().size();
+	tile_ids().push_back(id);
+	indexes[id] = index;
+	return index;
+}
+}
+
+tile_rect_diff::tile_rect_diff(int zorder, int x1, int y1, int x2, int y2,
+                               const std::vector<std::string>& old_tiles,
+                               const std::vector<std::string>& new_tiles)
+  : zorder_(zorder), x1_(x1), y1_(y1), x2_(x2), y2_(y2)
+{
+	ASSERT_LOG(!old_tiles.empty() && !new_tiles.empty(), "NO TILES GIVEN FOR TILE DIFF");
+
+	const int ncells = std::max(old_tiles.size(), new_tiles.size());
+	for(int n = 0; n != ncells; ++n) {
+		const int old_id = intern_tile_id(old_tiles[std::min<int>(n, old_tiles.size() - 1)]);
+		const int new_id = intern_tile_id(new_tiles[std::min<int>(n, new_tiles.size() - 1)]);
+		if(!runs_.empty() && runs_.back().old_id == old_id && runs_.back().new_id == new_id) {
+			++runs_.back().count;
+		} else {
+			const run r = { 1, old_id, new_id };
+			runs_.push_back(r);
+		}
+	}
+
+	std::vector<run>(runs_).swap(runs_);
+}
+
+bool tile_rect_diff::changed() const
+{
+	foreach(const run& r, runs_) {
+		if(r.old_id != r.new_id) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void tile_rect_diff::get_old_tiles(std::vector<std::string>* tiles) const
+{
+	get_tiles(false, tiles);
+}
+
+void tile_rect_diff::get_new_tiles(std::vector<std::string>* tiles) const
+{
+	get_tiles(true, tiles);
+}
+
+void tile_rect_diff::get_tiles(bool new_tiles, std::vector<std::string>* tiles) const
+{
+	tiles->clear();
+	foreach(const run& r, runs_) {
+		tiles->insert(tiles->end(), r.count, tile_ids()[new_tiles ? r.new_id : r.old_id]);
+	}
+}
+
+void tile_rect_diff::undo(level* lvl) const
+{
+	std::vector<std::string> tiles;
+	get_old_tiles(&tiles);
+	lvl->add_tile_rect_vector(zorder_, x1_, y1_, x2_, y2_, tiles);
+}
+
+void tile_rect_diff::redo(level* lvl) const
+{
+	std::vector<std::string> tiles;
+	get_new_tiles(&tiles);
+	lvl->add_tile_rect_vector(zorder_, x1_, y1_, x2_, y2_, tiles);
+}
+
+size_t tile_rect_diff::size_in_bytes() const
+{
+	return sizeof(*this) + runs_.capacity()*sizeof(run);
+}
+
+void tile_edit::add(const tile_rect_diff& diff)
+{
+	if(!diff.changed()) {
+		return;
+	}
+
+	diffs_.push_back(diff);
+
+	std::vector<int>::iterator i = std::lower_bound(layers_.begin(), layers_.end(), diff.zorder());
+	if(i == layers_.end() || *i != diff.zorder()) {
+		layers_.insert(i, diff.zorder());
+	}
+}
+
+void tile_edit::append(const tile_edit& edit)
+{
+	foreach(const tile_rect_diff& diff, edit.diffs_) {
+		add(diff);
+	}
+}
+
+void tile_edit::undo(level* lvl) const
+{
+	for(std::vector<tile_rect_diff>::const_reverse_iterator i = diffs_.rbegin(); i != diffs_.rend(); ++i) {
+		i->undo(lvl);
+	}
+}
+
+void tile_edit::redo(level* lvl) const
+{
+	foreach(const tile_rect_diff& diff, diffs_) {
+		diff.redo(lvl);
+	}
+}
+
+size_t tile_edit::size_in_bytes() const
+{
+	size_t result = sizeof(*this) + layers_.capacity()*sizeof(int);
+	foreach(const tile_rect_diff& diff, diffs_) {
+		result += diff.size_in_bytes();
+	}
+
+	return result + (diffs_.capacity() - diffs_.size())*sizeof(tile_rect_diff);
+}
+
+UNIT_TEST(tile_rect_diff)
+{
+	std::vector<std::string> old_tiles;
+	for(int n = 0; n != 100; ++n) {
+		old_tiles.push_back(n < 30 ? "" : n < 60 ? "rock" : "grass");
+	}
+
+	const tile_rect_diff diff(0, 0, 0, 9*32, 9*32, old_tiles, std::vector<std::string>(1, "rock"));
+	CHECK_EQ(diff.changed(), true);
+
+	std::vector<std::string> tiles;
+	diff.get_old_tiles(&tiles);
+	CHECK(tiles == old_tiles, "old tiles differ after encoding");
+
+	diff.get_new_tiles(&tiles);
+	CHECK_EQ(tiles.size(), 100);
+	CHECK_EQ(std::count(tiles.begin(), tiles.end(), "rock"), 100);
+
+	//a rect of one tile, painted over with another, is a single run.
+	const tile_rect_diff uniform(0, 0, 0, 99*32, 99*32, std::vector<std::string>(10000, "grass"), std::vector<std::string>(1, "rock"));
+	CHECK_LE(uniform.size_in_bytes(), sizeof(tile_rect_diff) + 16);
+
+	const tile_rect_diff unchanged(0, 0, 0, 0, 0, std::vector<std::string>(1, "rock"), std::vector<std::string>(1, "rock"));
+	CHECK_EQ(unchanged.changed(), false);
+}
+
+UNIT_TEST(tile_edit_memory)
+{
+	//a long session of painting single tiles, as done with the pencil,
+	//each recorded as its own edit.
+	std::vector<tile_edit> edits(10000);
+	size_t bytes = 0;
+	for(int n = 0; n != edits.size(); ++n) {
+		const int x = (n%100)*32, y = (n/100)*32;
+		edits[n].add(tile_rect_diff(n%3, x, y, x, y, std::vector<std::string>(1, n%2 ? "rock" : ""), std::vector<std::string>(1, "grass")));
+		bytes += edits[n].size_in_bytes();
+	}
+
+	CHECK_LE(bytes/edits.size(), 160);
+	CHECK_EQ(edits[7].layers().size(), 1);
+	CHECK_EQ(edits[7].layers().front(), 1);
+
+	//a stroke of the pencil coalesced into one edit.
+	tile_edit stroke;
+	for(int n = 0; n != 1000; ++n) {
+		stroke.append(edits[n]);
+	}
+
+	CHECK_EQ(stroke.layers().size(), 3);
+	CHECK_LE(stroke.size_in_bytes(), 1000*96);
+
+	//edits which change nothing take no room.
+	tile_edit empty;
+	empty.add(tile_rect_diff(0, 0, 0, 0, 0, std::vector<std::string>(1, "rock"), std::vector<std::string>(1, "rock")));
+	CHECK_EQ(empty.layers().empty(), true);
+	CHECK_EQ(empty.size_in_bytes(), sizeof(tile_edit));
+}
+
+//records and replays the tiles of a long session of editing, painting
+//rects of various sizes over a varied level.
+BENCHMARK(tile_edit_session)
+{
+	const char* ids[] = { "", "rock", "grass", "dirt", "wood" };
+	std::vector<std::string> old_tiles;
+	std::vector<std::string> tiles;
+	int n = 0;
+	BENCHMARK_LOOP {
+		const int size = 1 + n%16;
+		old_tiles.clear();
+		for(int i = 0; i != size*size; ++i) {
+			old_tiles.push_back(ids[(i/7 + n)%5]);
+		}
+
+		tile_edit edit;
+		edit.add(tile_rect_diff(0, 0, 0, (size - 1)*32, (size - 1)*32, old_tiles, std::vector<std::string>(1, ids[n%5])));
+		edit.add(tile_rect_diff(1, 0, 0, (size - 1)*32, (size - 1)*32, std::vector<std::string>(1, ""), old_tiles));
+		++n;
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef EDITOR_TILE_EDIT_HPP_INCLUDED
+#define EDITOR_TILE_EDIT_HPP_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+class level;
+
+//the tiles of a rect in one layer of a level, from before and after an
+//edit, so the edit can be undone and redone. The tiles are kept as runs
+//of the same change, with tile ids interned, so painting a large rect
+//with one tile takes only a few bytes.
+class tile_rect_diff
+{
+public:
+	//the rect and tiles are as passed to level::add_tile_rect_vector().
+	//If a vector of tiles is shorter than the rect, its last tile fills
+	//in the rest of the rect.
+	tile_rect_diff(int zorder, int x1, int y1, int x2, int y2,
+	               const std::vector<std::string>& old_tiles,
+	               const std::vector<std::string>& new_tiles);
+
+	int zorder() const { return zorder_; }
+
+	//true if any tile is different after the edit.
+	bool changed() const;
+
+	void get_old_tiles(std::vector<std::string>* tiles) const;
+	void get_new_tiles(std::vector<std::string>* tiles) const;
+
+	void undo(level* lvl) const;
+	void redo(level* lvl) const;
+
+	size_t size_in_bytes() const;
+
+private:
+	struct run {
+		int count;
+		int old_id, new_id;
+	};
+
+	void get_tiles(bool new_tiles, std::vector<std::string>* tiles) const;
+
+	int zorder_;
+	int x1_, y1_, x2_, y2_;
+	std::vector<run> runs_;
+};
+
+//a set of changes to tiles which are undone and redone together, such as
+//those of one command, or of one stroke of the pencil.
+class tile_edit
+{
+public:
+	void add(const tile_rect_diff& diff);
+	void append(const tile_edit& edit);
+
+	//the layers the edit changes, in order.
+	const std::vector<int>& layers() const { return layers_; }
+
+	void undo(level* lvl) const;
+	void redo(level* lvl) const;
+
+	size_t size_in_bytes() const;
+
+private:
+	std::vector<tile_rect_diff> diffs_;
+	std::vector<int> layers_;
+};
+
+typedef boost::shared_ptr<tile_edit> tile_edit_ptr;
+
+#endif
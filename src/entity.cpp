@@ -159,6 +159,7 @@ void entity::calculate_solid_rect()
 	} else {
 		platform_rect_ = rect();
 	}
+	activation_changed();
 }
 
 rect entity::body_rect() const
@@ -5,6 +5,7 @@
 
 #include "boost/intrusive_ptr.hpp"
 
+#include "activation_index.hpp"
 #include "controls.hpp"
 #include "current_generator.hpp"
 #include "editor_variable_info.hpp"
@@ -19,6 +20,10 @@
 #include "wml_formula_callable.hpp"
 #include "wml_node_fwd.hpp"
 
+namespace graphics {
+class sprite_batch;
+}
+
 class character;
 class frame;
 class level;
@@ -38,6 +43,11 @@ public:
 	virtual void setup_drawing() const {}
 	virtual void draw() const = 0;
 	virtual void draw_group() const = 0;
+
+	//if the entity can be drawn as plain textured quads, queues it in the
+	//batch and returns true. Otherwise returns false, and draw() must be
+	//used instead.
+	virtual bool draw_into_sprite_batch(graphics::sprite_batch& batch) const { return false; }
 	player_info* get_player_info() { return is_human(); }
 	const player_info* get_player_info() const { return is_human(); }
 	virtual const player_info* is_human() const { return NULL; }
@@ -136,6 +146,21 @@ public:
 	virtual bool is_active(const rect& screen_area) const = 0;
 	virtual bool dies_on_inactive() const { return false; } 
 	virtual bool always_active() const { return false; } 
+
+	//if the entity can only be active when the screen intersects some
+	//area, sets bounds to contain that area and returns true. Returns false
+	//if the entity has to be checked for being active every cycle.
+	virtual bool activation_bounds(rect* bounds) const { return false; }
+
+	//must be called whenever the entity changes in a way which might change
+	//where it's active, to keep its level's activation index up to date.
+	void activation_changed() {
+		if(activation_.index) {
+			activation_.index->mark_dirty(*this);
+		}
+	}
+
+	activation_record& activation() { return activation_; }
 	
 	virtual formula_callable* vars() { return NULL; }
 	virtual const formula_callable* vars() const { return NULL; }
@@ -170,6 +195,12 @@ public:
 	virtual entity_ptr clone() const { return entity_ptr(); }
 	virtual entity_ptr backup() const = 0;
 
+	//copies the entity so the copy can be written with write() on another
+	//thread while this one carries on changing. Anything the copy would
+	//share with other entities, such as its variables, is written now.
+	//The copy must be destroyed on the thread which made it.
+	virtual entity_ptr save_copy() const = 0;
+
 	virtual void generate_current(const entity& target, int* velocity_x, int* velocity_y) const;
 
 	virtual game_logic::const_formula_ptr get_event_handler(int key) const { return game_logic::const_formula_ptr(); }
@@ -317,6 +348,8 @@ private:
 	const solid_info* platform_;
 
 	int platform_motion_x_;
+
+	activation_record activation_;
 };
 
 #endif
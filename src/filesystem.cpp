@@ -269,6 +269,7 @@ BPath be_path;
 
 // for getenv
 #include <cstdlib>
+#include <cstdio>
 #include <cerrno>
 #include <cstring>
 #include <algorithm>
@@ -528,6 +529,66 @@ bool file_exists(const std::string& name)
 	return do_file_exists(find_file(name));
 }
 
+bool replace_file(const std::string& from, const std::string& to)
+{
+#ifdef _WIN32
+	//rename() won't replace an existing file on Windows.
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+std::string make_temp_dir()
+{
+#ifdef _WIN32
+	char buf[MAX_PATH];
+	if(GetTempPathA(sizeof(buf), buf) == 0) {
+		return "";
+	}
+
+	std::string path = std::string(buf) + "frogattoXXXXXX";
+	if(_mktemp(&path[0]) == NULL || _mkdir(path.c_str()) != 0) {
+		return "";
+	}
+
+	std::replace(path.begin(), path.end(), '\\', '/');
+#else
+	const char* tmp = getenv("TMPDIR");
+	std::string path = std::string(tmp && *tmp ? tmp : "/tmp") + "/frogattoXXXXXX";
+	if(mkdtemp(&path[0]) == NULL) {
+		return "";
+	}
+#endif
+
+	return path + "/";
+}
+
+bool remove_dir(const std::string& dir)
+{
+#ifdef _WIN32
+	return _rmdir(dir.c_str()) == 0;
+#else
+	return rmdir(dir.c_str()) == 0;
+#endif
+}
+
+time_t file_mod_time(const std::string& name)
+{
+	//look for the file the same way find_file() does, but using stat()
+	//rather than opening it.
+	struct stat st;
+	if(::stat(name.c_str(), &st) == 0) {
+		return st.st_mtime;
+	}
+
+	if(have_datadir && ::stat((data_dir + "/" + name).c_str(), &st) == 0) {
+		return st.st_mtime;
+	}
+
+	return 0;
+}
+
 std::string read_file(const std::string& name)
 {
 	std::string fname = find_file(name);
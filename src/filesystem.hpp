@@ -13,6 +13,8 @@
 #ifndef FILESYSTEM_HPP_INCLUDED
 #define FILESYSTEM_HPP_INCLUDED
 
+#include <time.h>
+
 #include <map>
 #include <string>
 #include <vector>
@@ -47,6 +49,21 @@ std::string read_file(const std::string& fname);
 void write_file(const std::string& fname, const std::string& data);
 
 bool file_exists(const std::string& fname);
+
+//moves the file from to the path to, replacing any file already there,
+//in a single step where the platform allows it. Returns false on failure,
+//in which case the file at to is left alone.
+bool replace_file(const std::string& from, const std::string& to);
+
+//makes a new, empty directory for temporary files and returns its path,
+//ending in a '/', or an empty string if it couldn't be made.
+std::string make_temp_dir();
+
+//removes an empty directory. Returns false on failure.
+bool remove_dir(const std::string& dir);
+
+//the time the file was last modified, or 0 if it doesn't exist.
+time_t file_mod_time(const std::string& fname);
 std::string find_file(const std::string& name);
 
 }
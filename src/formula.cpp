@@ -11,7 +11,9 @@
  See the COPYING file for more details.
  */
 #include <algorithm>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/weak_ptr.hpp>
 #include <cmath>
 #include <stack>
 #include <stdio.h>
@@ -32,6 +34,7 @@
 #include "i18n.hpp"
 #include "map_utils.hpp"
 #include "random.hpp"
+#include "thread.hpp"
 #include "unit_test.hpp"
 #include "wml_node.hpp"
 
@@ -130,6 +133,13 @@ namespace game_logic
 			return itor->second;
 		}
 	}
+
+	variant map_formula_callable::get_value_by_slot(int slot) const
+	{
+		//only the fallback can have slots.
+		ASSERT_LOG(fallback_, "Could not get value by slot from map formula callable " << slot);
+		return fallback_->query_value_by_slot(slot);
+	}
 	
 	void map_formula_callable::get_inputs(std::vector<formula_input>* inputs) const
 	{
@@ -722,60 +732,152 @@ private:
 	expression_ptr left_, right_;
 };
 
-typedef std::map<std::string,expression_ptr> expr_table;
-typedef boost::shared_ptr<expr_table> expr_table_ptr;
+//the definition of the variables in scope in the body of a where
+//expression: those of the enclosing definition, with the variables the
+//where clauses define given the slots following them. Identifiers in the
+//body are resolved against it when parsed, so where variables are read
+//by slot rather than looked up by name.
+class where_variables_definition : public formula_callable_definition {
+public:
+	where_variables_definition(const formula_callable_definition* base, const std::vector<std::string>& names)
+	  : base_(base), first_slot_(base ? base->num_slots() : 0)
+	{
+		foreach(const std::string& name, names) {
+			entries_.push_back(entry(name));
+		}
+	}
+
+	int get_slot(const std::string& key) const {
+		for(int n = 0; n != entries_.size(); ++n) {
+			if(entries_[n].id == key) {
+				return first_slot_ + n;
+			}
+		}
+
+		return base_ ? base_->get_slot(key) : -1;
+	}
+
+	const entry* get_entry(int slot) const {
+		if(slot >= first_slot_ && slot < first_slot_ + entries_.size()) {
+			return &entries_[slot - first_slot_];
+		}
+
+		return base_ && slot >= 0 ? base_->get_entry(slot) : NULL;
+	}
+
+	int num_slots() const { return first_slot_ + entries_.size(); }
 
+	int first_slot() const { return first_slot_; }
+
+private:
+	const formula_callable_definition* base_;
+	int first_slot_;
+	std::vector<entry> entries_;
+};
+
+//the frame a where expression's body is evaluated in. It normally lives
+//on the stack, and each where variable is only evaluated when it's first
+//read. Anything else is passed on to the callable the where expression
+//was evaluated with.
 class where_variables: public formula_callable {
 public:
+	enum { InlineSlots = 8 };
+
 	where_variables(const formula_callable &base,
-					expr_table_ptr table )
-	: formula_callable(false), base_(base), table_(table) { }
+	                const where_variables_definition& def,
+	                const std::vector<expression_ptr>& clauses,
+	                bool on_stack)
+	: formula_callable(false), base_(base), def_(def), clauses_(clauses),
+	  values_(inline_values_), evaluated_(inline_evaluated_)
+	{
+		if(on_stack) {
+			turn_reference_counting_off();
+		}
+
+		if(clauses_.size() > InlineSlots) {
+			extra_values_.resize(clauses_.size());
+			extra_evaluated_.resize(clauses_.size());
+			values_ = &extra_values_[0];
+			evaluated_ = &extra_evaluated_[0];
+		}
+
+		std::fill(evaluated_, evaluated_ + clauses_.size(), false);
+	}
 private:
 	const formula_callable& base_;
-	expr_table_ptr table_;
-	
-	mutable std::map<std::string, variant> results_cache_;
+	const where_variables_definition& def_;
+	const std::vector<expression_ptr>& clauses_;
+
+	variant inline_values_[InlineSlots];
+	char inline_evaluated_[InlineSlots];
+	std::vector<variant> extra_values_;
+	std::vector<char> extra_evaluated_;
+	variant* values_;
+	char* evaluated_;
+
+	variant get_variable(int index) const {
+		if(!evaluated_[index]) {
+			values_[index] = clauses_[index]->evaluate(base_);
+			evaluated_[index] = true;
+		}
+
+		return values_[index];
+	}
 	
 	void get_inputs(std::vector<formula_input>* inputs) const {
-		for(expr_table::const_iterator i = table_->begin(); i != table_->end(); ++i) {
-			inputs->push_back(formula_input(i->first, FORMULA_READ_ONLY));
+		for(int n = 0; n != clauses_.size(); ++n) {
+			inputs->push_back(formula_input(def_.get_entry(def_.first_slot() + n)->id, FORMULA_READ_ONLY));
 		}
 	}
 
 	variant get_value_by_slot(int slot) const {
+		const int index = slot - def_.first_slot();
+		if(index >= 0 && index < clauses_.size()) {
+			return get_variable(index);
+		}
+
 		return base_.query_value_by_slot(slot);
 	}
 	
 	variant get_value(const std::string& key) const {
-		expr_table::iterator i = table_->find(key);
-		if(i != table_->end()) {
-			std::map<std::string, variant>::const_iterator itor = results_cache_.find(key);
-			if(itor != results_cache_.end()) {
-				return itor->second;
+		for(int n = 0; n != clauses_.size(); ++n) {
+			if(def_.get_entry(def_.first_slot() + n)->id == key) {
+				return get_variable(n);
 			}
-			
-			variant result = i->second->evaluate(base_);
-			results_cache_[key] = result;
-			return result;
 		}
+
 		return base_.query_value(key);
 	}
 };
 
 class where_expression: public formula_expression {
 public:
-	explicit where_expression(expression_ptr body,
-							  expr_table_ptr clauses)
-	: formula_expression("_where"), body_(body), clauses_(clauses)
+	where_expression(expression_ptr body,
+	                 boost::shared_ptr<where_variables_definition> def,
+	                 const std::vector<expression_ptr>& clauses,
+	                 bool body_uses_context)
+	: formula_expression("_where"), body_(body), def_(def), clauses_(clauses),
+	  body_uses_context_(body_uses_context)
 	{}
 	
 private:
 	expression_ptr body_;
-	expr_table_ptr clauses_;
+	boost::shared_ptr<where_variables_definition> def_;
+	std::vector<expression_ptr> clauses_;
+
+	//functions such as map() can hand the callable they're evaluated with
+	//to formulas as 'context', which may keep a reference to it, so in
+	//that case the frame is reference counted and allocated on the heap.
+	bool body_uses_context_;
 	
 	variant execute(const formula_callable& variables) const {
-		formula_callable_ptr wrapped_variables(new where_variables(variables, clauses_));
-		return body_->evaluate(*wrapped_variables);
+		if(body_uses_context_) {
+			formula_callable_ptr wrapped_variables(new where_variables(variables, *def_, clauses_, false));
+			return body_->evaluate(*wrapped_variables);
+		}
+
+		const where_variables frame(variables, *def_, clauses_, true);
+		return body_->evaluate(frame);
 	}
 };
 
@@ -1031,8 +1133,25 @@ void parse_set_args(const token* i1, const token* i2,
 	}
 }
 
+void add_where_clause(const std::string& name, expression_ptr expr,
+                      std::vector<std::string>* names, std::vector<expression_ptr>* res)
+{
+	std::vector<std::string>::iterator i = std::find(names->begin(), names->end(), name);
+	if(i != names->end()) {
+		(*res)[i - names->begin()] = expr;
+		return;
+	}
+
+	names->push_back(name);
+	res->push_back(expr);
+}
+
+//parses the clauses of a where expression into the names of the variables
+//they define, and the expressions giving their values. If a name is
+//given more than once, the last definition is used.
 void parse_where_clauses(const token* i1, const token * i2,
-						 expr_table_ptr res, function_symbol_table* symbols,
+						 std::vector<std::string>* names,
+						 std::vector<expression_ptr>* res, function_symbol_table* symbols,
 						 const formula_callable_definition* callable_def) {
 	int parens = 0;
 	const token *original_i1_cached = i1;
@@ -1050,7 +1169,7 @@ void parse_where_clauses(const token* i1, const token * i2,
 					<< "'where name=<expression>,' was needed.\n";
 					throw formula_error();
 				}
-				(*res)[var_name] = parse_expression(beg,i1, symbols, callable_def);
+				add_where_clause(var_name, parse_expression(beg,i1, symbols, callable_def), names, res);
 				beg = i1+1;
 				var_name = "";
 			} else if(i1->type == TOKEN_OPERATOR) {
@@ -1087,7 +1206,7 @@ void parse_where_clauses(const token* i1, const token * i2,
 			<< "'where name=<expression> was needed.\n";
 			throw formula_error();
 		}
-		(*res)[var_name] = parse_expression(beg,i1, symbols, callable_def);
+		add_where_clause(var_name, parse_expression(beg,i1, symbols, callable_def), names, res);
 	}
 }
 
@@ -1497,10 +1616,20 @@ expression_ptr parse_expression_internal(const token* i1, const token* i2, funct
 	}
 	
 	if(op_name == "where") {
-		expr_table_ptr table(new expr_table());
-		parse_where_clauses(op+1, i2, table, symbols, callable_def);
-		return expression_ptr(new where_expression(parse_expression(i1, op, symbols, callable_def, can_optimize),
-												   table));
+		std::vector<std::string> names;
+		std::vector<expression_ptr> clauses;
+		parse_where_clauses(op+1, i2, &names, &clauses, symbols, callable_def);
+
+		bool body_uses_context = false;
+		for(const token* t = i1; t != op; ++t) {
+			if(t->type == TOKEN_IDENTIFIER && std::string(t->begin, t->end) == "context") {
+				body_uses_context = true;
+			}
+		}
+
+		boost::shared_ptr<where_variables_definition> def(new where_variables_definition(callable_def, names));
+		return expression_ptr(new where_expression(parse_expression(i1, op, symbols, def.get(), can_optimize),
+		                                           def, clauses, body_uses_context));
 	}
 
 	const bool is_dot = op_name == ".";
@@ -1517,6 +1646,200 @@ void formula::fail_if_static_context()
 	}
 }
 	
+namespace {
+//the key formulas are cached under. Formulas are the same if they have the
+//same tokens, so they may differ in whitespace and comments, and are
+//parsed with the same symbols, with definitions which have the same
+//slots, in the same locale.
+struct formula_cache_key {
+	formula_cache_key() : symbols(NULL), verbatim(false) {}
+	std::string tokens;
+	const function_symbol_table* symbols;
+	std::string def;
+	bool verbatim;
+	std::string locale;
+
+	bool operator<(const formula_cache_key& k) const {
+		if(symbols != k.symbols) {
+			return symbols < k.symbols;
+		} else if(def != k.def) {
+			return def < k.def;
+		} else if(verbatim != k.verbatim) {
+			return verbatim < k.verbatim;
+		} else if(locale != k.locale) {
+			return locale < k.locale;
+		}
+
+		return tokens < k.tokens;
+	}
+};
+
+//constants are replaced by their values when a formula is parsed, so a
+//cached expression can only be shared by a formula parsed with the same
+//values for the constants it uses. Expressions are held weakly, and go
+//away with the last formula using them.
+struct formula_cache_entry {
+	std::vector<std::pair<std::string, variant> > constants;
+	boost::weak_ptr<formula_expression> expr;
+};
+
+typedef std::map<formula_cache_key, std::vector<formula_cache_entry> > formula_cache_map;
+formula_cache_map formula_cache;
+size_t formula_cache_sweep_size = 1024;
+formula::cache_stats formula_cache_stats;
+threading::mutex formula_cache_mutex;
+
+//writes out the names of a definition's slots, and those of the
+//definitions of their types, so definitions which are built separately,
+//such as those of an object and its variations, give the same result if
+//formulas would be parsed the same way with either of them.
+void write_definition_signature(const formula_callable_definition* def, std::vector<const formula_callable_definition*>* path, std::string* out)
+{
+	if(def == NULL) {
+		out->push_back('-');
+		return;
+	}
+
+	//a definition can contain itself, in which case it refers back to
+	//where it was first written.
+	const std::vector<const formula_callable_definition*>::const_iterator seen = std::find(path->begin(), path->end(), def);
+	if(seen != path->end()) {
+		*out += "^" + boost::lexical_cast<std::string>(seen - path->begin());
+		return;
+	}
+
+	path->push_back(def);
+	out->push_back('{');
+	for(int n = 0; n != def->num_slots(); ++n) {
+		const formula_callable_definition::entry* e = def->get_entry(n);
+		if(e) {
+			*out += e->id;
+			if(e->type_definition) {
+				write_definition_signature(e->type_definition, path, out);
+			}
+		}
+
+		out->push_back(',');
+	}
+
+	out->push_back('}');
+	path->pop_back();
+}
+
+//formulas which define functions add them to their symbols as they're
+//parsed, so have to be parsed every time.
+bool formula_cacheable(const std::vector<formula_tokenizer::token>& tokens)
+{
+	if(tokens.empty()) {
+		return false;
+	}
+
+	foreach(const formula_tokenizer::token& tok, tokens) {
+		if(tok.type == formula_tokenizer::TOKEN_KEYWORD && std::string(tok.begin, tok.end) == "def") {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void make_formula_cache_key(const std::vector<formula_tokenizer::token>& tokens,
+                            const function_symbol_table* symbols,
+                            const formula_callable_definition* def,
+                            formula_cache_key* key,
+                            std::vector<std::pair<std::string, variant> >* constants)
+{
+	key->symbols = symbols;
+
+	std::vector<const formula_callable_definition*> path;
+	write_definition_signature(def, &path, &key->def);
+
+	key->verbatim = _verbatim_string_expressions;
+	key->locale = i18n::get_locale();
+
+	//tokens are separated by a character which can only appear inside
+	//string literals, so different tokens can't give the same key.
+	foreach(const formula_tokenizer::token& tok, tokens) {
+		key->tokens.append(tok.begin, tok.end);
+		key->tokens.push_back('\n');
+
+		if(tok.type == formula_tokenizer::TOKEN_CONST_IDENTIFIER) {
+			const std::string id(tok.begin, tok.end);
+			constants->push_back(std::pair<std::string, variant>(id, get_constant(id)));
+		}
+	}
+}
+
+bool same_constants(const std::vector<std::pair<std::string, variant> >& a,
+                    const std::vector<std::pair<std::string, variant> >& b)
+{
+	for(int n = 0; n != a.size(); ++n) {
+		if(a[n].second.is_decimal() != b[n].second.is_decimal() || a[n].second != b[n].second) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+expression_ptr find_cached_formula(const formula_cache_key& key, const std::vector<std::pair<std::string, variant> >& constants)
+{
+	threading::lock lck(formula_cache_mutex);
+	formula_cache_map::const_iterator i = formula_cache.find(key);
+	if(i != formula_cache.end()) {
+		foreach(const formula_cache_entry& entry, i->second) {
+			if(same_constants(entry.constants, constants)) {
+				expression_ptr expr = entry.expr.lock();
+				if(expr) {
+					++formula_cache_stats.hits;
+					return expr;
+				}
+			}
+		}
+	}
+
+	return expression_ptr();
+}
+
+void add_cached_formula(const formula_cache_key& key, const std::vector<std::pair<std::string, variant> >& constants, expression_ptr expr, int parse_us)
+{
+	threading::lock lck(formula_cache_mutex);
+	++formula_cache_stats.misses;
+	formula_cache_stats.parse_us += parse_us;
+
+	std::vector<formula_cache_entry>& entries = formula_cache[key];
+	for(int n = 0; n != entries.size(); ++n) {
+		if(entries[n].expr.expired() || same_constants(entries[n].constants, constants)) {
+			entries.erase(entries.begin() + n--);
+		}
+	}
+
+	entries.push_back(formula_cache_entry());
+	entries.back().constants = constants;
+	entries.back().expr = expr;
+
+	//every so often, forget formulas which are no longer used.
+	if(formula_cache.size() >= formula_cache_sweep_size) {
+		for(formula_cache_map::iterator i = formula_cache.begin(); i != formula_cache.end(); ) {
+			std::vector<formula_cache_entry>& v = i->second;
+			for(int n = 0; n != v.size(); ++n) {
+				if(v[n].expr.expired()) {
+					v.erase(v.begin() + n--);
+				}
+			}
+
+			if(v.empty()) {
+				formula_cache.erase(i++);
+			} else {
+				++i;
+			}
+		}
+
+		formula_cache_sweep_size = std::max<size_t>(1024, formula_cache.size()*2);
+	}
+}
+}
+
 formula_ptr formula::create_string_formula(const std::string& str)
 {
 	formula_ptr res(new formula());
@@ -1531,7 +1854,7 @@ formula_ptr formula::create_optional_formula(const wml::value& val, function_sym
 	}
 	
 	try {
-		return formula_ptr(new formula(val, symbols, callable_definition));
+		return formula_ptr(new formula(val, symbols, callable_definition, true));
 	} catch(...) {
 		if(val.filename()) {
 			std::cerr << *val.filename() << " " << val.line() << ": ";
@@ -1546,6 +1869,22 @@ formula_ptr formula::create_optional_formula(const wml::value& val, function_sym
 }
 
 formula::formula(const wml::value& val, function_symbol_table* symbols, const formula_callable_definition* callable_definition) : str_(val.str()), filename_(val.filename()), line_(val.line())
+{
+	parse(symbols, callable_definition, false);
+}
+
+formula::formula(const wml::value& val, function_symbol_table* symbols, const formula_callable_definition* callable_definition, bool use_cache) : str_(val.str()), filename_(val.filename()), line_(val.line())
+{
+	parse(symbols, callable_definition, use_cache);
+}
+
+formula::cache_stats formula::get_cache_stats()
+{
+	threading::lock lck(formula_cache_mutex);
+	return formula_cache_stats;
+}
+
+void formula::parse(function_symbol_table* symbols, const formula_callable_definition* callable_definition, bool use_cache)
 {
 	using namespace formula_tokenizer;
 	
@@ -1638,6 +1977,21 @@ formula::formula(const wml::value& val, function_symbol_table* symbols, const fo
 		}
 	}
 	
+	const bool cached = use_cache && formula_cacheable(tokens);
+	formula_cache_key key;
+	std::vector<std::pair<std::string, variant> > constants;
+	if(cached) {
+		make_formula_cache_key(tokens, symbols, callable_definition, &key, &constants);
+		expr_ = find_cached_formula(key, constants);
+		if(expr_) {
+			return;
+		}
+	}
+
+	//most formulas parse in well under a millisecond, so they're timed in
+	//microseconds.
+	const boost::posix_time::ptime begin_parse = boost::posix_time::microsec_clock::universal_time();
+
 	try {
 		if(tokens.size() != 0) {
 			expr_ = parse_expression(&tokens[0],&tokens[0] + tokens.size(), symbols, callable_definition);
@@ -1648,6 +2002,10 @@ formula::formula(const wml::value& val, function_symbol_table* symbols, const fo
 		std::cerr << "ERROR WHILE PARSING AT " << (filename_ ? *filename_ : "UNKNOWN") << ":" << line_ << "::\n" << str_ << "\n";
 		throw;
 	}
+
+	if(cached) {
+		add_cached_formula(key, constants, expr_, (boost::posix_time::microsec_clock::universal_time() - begin_parse).total_microseconds());
+	}
 }
 
 formula::~formula() {
@@ -1732,6 +2090,115 @@ UNIT_TEST(dot_precedence) {
 	CHECK(result == variant(2), "test failed: " << result.to_debug_string());
 }
 
+namespace {
+//a callable with the slots 'x' and 'y', which counts how often it's read.
+class where_test_callable : public formula_callable {
+public:
+	where_test_callable() : reads(0) {}
+	mutable int reads;
+private:
+	variant get_value(const std::string& key) const {
+		++reads;
+		return variant(key == "x" ? 2 : 3);
+	}
+
+	variant get_value_by_slot(int slot) const {
+		++reads;
+		return variant(slot == 0 ? 2 : 3);
+	}
+};
+}
+
+UNIT_TEST(formula_where_slots) {
+	const std::string names[] = { "x", "y" };
+	const formula_callable_definition_ptr def = create_formula_callable_definition(names, names + 2);
+	where_test_callable* callable = new where_test_callable;
+	variant ref(callable);
+
+	//each where variable is only evaluated the first time it's read.
+	variant result = formula("a*a + a where a = x + y", NULL, def.get()).execute(*callable);
+	CHECK(result == variant(30), "test failed: " << result.to_debug_string());
+	CHECK_EQ(callable->reads, 2);
+
+	callable->reads = 0;
+	result = formula("if(x = 2, a, b) where a = y, b = x*100", NULL, def.get()).execute(*callable);
+	CHECK(result == variant(3), "test failed: " << result.to_debug_string());
+	CHECK_EQ(callable->reads, 2);
+
+	result = formula("(a + b where b = a*y) where a = x", NULL, def.get()).execute(*callable);
+	CHECK(result == variant(8), "test failed: " << result.to_debug_string());
+
+	result = formula("x + y where x = 10", NULL, def.get()).execute(*callable);
+	CHECK(result == variant(13), "test failed: " << result.to_debug_string());
+
+	result = formula("a where a = 1, a = x").execute(*callable);
+	CHECK(result == variant(2), "test failed: " << result.to_debug_string());
+
+	result = formula("map([1, 2], 'n', n + context.a) where a = y", NULL, def.get()).execute(*callable);
+	CHECK(result == formula("[4, 5]").execute(), "test failed: " << result.to_debug_string());
+}
+
+UNIT_TEST(formula_where_in_function_arguments) {
+	//functions evaluate their arguments with callables of their own, which
+	//must pass reads of where variables on to the frame.
+	variant result = formula("sort([3, 1, 2], a + k < b) where k = 0").execute();
+	CHECK(result == formula("[1, 2, 3]").execute(), "test failed: " << result.to_debug_string());
+
+	result = formula("map(filter([1, 2, 3], 'n', n >= k), 'n', n*k) where k = 2").execute();
+	CHECK(result == formula("[4, 6]").execute(), "test failed: " << result.to_debug_string());
+
+	result = formula("transform([1, 2], v + i + k) where k = 10").execute();
+	CHECK(result == formula("[11, 13]").execute(), "test failed: " << result.to_debug_string());
+
+	const std::string names[] = { "x", "y" };
+	const formula_callable_definition_ptr def = create_formula_callable_definition(names, names + 2);
+	where_test_callable* callable = new where_test_callable;
+	variant ref(callable);
+	result = formula("sort(map([y, x, 1], 'n', n*k), a > b) where k = x", NULL, def.get()).execute(*callable);
+	CHECK(result == formula("[6, 4, 2]").execute(), "test failed: " << result.to_debug_string());
+}
+
+UNIT_TEST(formula_cache) {
+	const std::string names[] = { "x", "y" };
+	const formula_callable_definition_ptr def = create_formula_callable_definition(names, names + 2);
+	const formula_callable_definition_ptr same_def = create_formula_callable_definition(names, names + 2);
+	const std::string other_names[] = { "y", "x" };
+	const formula_callable_definition_ptr other_def = create_formula_callable_definition(other_names, other_names + 2);
+
+	//formulas which differ only in whitespace share an expression.
+	const formula::cache_stats before = formula::get_cache_stats();
+	const_formula_ptr a = formula::create_optional_formula("x*2 + y where y = 7", NULL, def.get());
+	const_formula_ptr b = formula::create_optional_formula("x * 2+y\nwhere y=7", NULL, def.get());
+	formula::cache_stats after = formula::get_cache_stats();
+	CHECK_EQ(after.misses, before.misses + 1);
+	CHECK_EQ(after.hits, before.hits + 1);
+
+	where_test_callable* callable = new where_test_callable;
+	variant ref(callable);
+	CHECK(a->execute(*callable) == variant(11), "test failed");
+	CHECK(b->execute(*callable) == variant(11), "test failed");
+
+	//a definition with the same slots shares it too, but one with
+	//different slots doesn't.
+	const_formula_ptr c = formula::create_optional_formula("x*2 + y where y = 7", NULL, same_def.get());
+	CHECK_EQ(formula::get_cache_stats().hits, after.hits + 1);
+	const_formula_ptr d = formula::create_optional_formula("x*2 + y where y = 7", NULL, other_def.get());
+	CHECK_EQ(formula::get_cache_stats().misses, after.misses + 1);
+	CHECK(d->execute(*callable) == variant(13), "test failed");
+
+	//and formulas made directly aren't cached.
+	formula("x*2 + y where y = 7", NULL, def.get());
+	CHECK_EQ(formula::get_cache_stats().misses, after.misses + 1);
+
+	//once every formula sharing an expression is gone, it's parsed again.
+	a.reset();
+	b.reset();
+	c.reset();
+	after = formula::get_cache_stats();
+	a = formula::create_optional_formula("x*2 + y where y = 7", NULL, def.get());
+	CHECK_EQ(formula::get_cache_stats().misses, after.misses + 1);
+}
+
 UNIT_TEST(short_circuit) {
 	map_formula_callable* callable = new map_formula_callable;
 	variant ref(callable);
@@ -1771,4 +2238,30 @@ BENCHMARK(formula_add) {
 	}
 }
 
+BENCHMARK(formula_where) {
+	static map_formula_callable* callable = new map_formula_callable;
+	callable->add("x", variant(1));
+	static formula f("a + b*a where a = x + 1, b = x*2");
+	BENCHMARK_LOOP {
+		f.execute(*callable);
+	}
+}
+
+//parses a formula like an object's event handler, as each object type
+//with the handler would.
+BENCHMARK_ARG(formula_parse, bool cached) {
+	const std::string text = "if(x > 10 and y < 5, [set(x, x - 1), fire_event('landed')], map(filter(items, 'i', i.alive), 'i', i.x + y)) where a = x*2";
+	const_formula_ptr keep = formula::create_optional_formula(text);
+	BENCHMARK_LOOP {
+		if(cached) {
+			formula::create_optional_formula(text);
+		} else {
+			formula f(text);
+		}
+	}
+}
+
+BENCHMARK_ARG_CALL(formula_parse, parse_every_time, false);
+BENCHMARK_ARG_CALL(formula_parse, parse_once, true);
+
 }
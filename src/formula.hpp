@@ -17,6 +17,8 @@
 #include <map>
 #include <string>
 
+#include <boost/cstdint.hpp>
+
 #include "formula_callable_definition_fwd.hpp"
 #include "formula_fwd.hpp"
 #include "formula_function.hpp"
@@ -54,6 +56,18 @@ public:
 	static formula_ptr create_string_formula(const std::string& str);
 	static formula_ptr create_optional_formula(const wml::value& str, function_symbol_table* symbols=NULL, const formula_callable_definition* def=NULL);
 	explicit formula(const wml::value& val, function_symbol_table* symbols=NULL, const formula_callable_definition* def=NULL);
+
+	//formulas made with create_optional_formula() share their parsed
+	//expression with any other formula which is the same. These are the
+	//number of formulas which found one to share and which were parsed,
+	//and the time spent parsing them, in microseconds.
+	struct cache_stats {
+		cache_stats() : hits(0), misses(0), parse_us(0) {}
+		int hits, misses;
+		boost::int64_t parse_us;
+	};
+
+	static cache_stats get_cache_stats();
 	~formula();
 	variant execute(const formula_callable& variables) const;
 	variant execute() const;
@@ -63,6 +77,9 @@ public:
 
 private:
 	formula() {}
+	formula(const wml::value& val, function_symbol_table* symbols, const formula_callable_definition* def, bool use_cache);
+	void parse(function_symbol_table* symbols, const formula_callable_definition* def, bool use_cache);
+
 	expression_ptr expr_;
 	std::string str_;
 	const std::string* filename_;
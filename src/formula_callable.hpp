@@ -122,6 +122,12 @@ class formula_callable_with_backup : public formula_callable {
 		return var;
 	}
 
+	//formulas evaluated with this are parsed with the backup's definition,
+	//so anything read by slot is the backup's.
+	variant get_value_by_slot(int slot) const {
+		return backup_.query_value_by_slot(slot);
+	}
+
 	void get_inputs(std::vector<formula_input>* inputs) const {
 		main_.get_inputs(inputs);
 		backup_.get_inputs(inputs);
@@ -143,6 +149,10 @@ class formula_variant_callable_with_backup : public formula_callable {
 		return var;
 	}
 
+	variant get_value_by_slot(int slot) const {
+		return backup_.query_value_by_slot(slot);
+	}
+
 	void get_inputs(std::vector<formula_input>* inputs) const {
 		backup_.get_inputs(inputs);
 	}
@@ -182,6 +192,7 @@ private:
 	//map_formula_callable(const map_formula_callable&);
 
 	variant get_value(const std::string& key) const;
+	variant get_value_by_slot(int slot) const;
 	void get_inputs(std::vector<formula_input>* inputs) const;
 	void set_value(const std::string& key, const variant& value);
 	std::map<std::string,variant> values_;
@@ -349,6 +349,241 @@ namespace {
 		}
 	};
 
+	//the callable the formula given to a list function is evaluated with
+	//for each element of the list. Given just a formula, the formula can
+	//use the members of the element directly. Given the name of the
+	//element as well, it can use that name, and 'context' for the callable
+	//the function was called with.
+	//
+	//A frame is bound to one element after another instead of allocating a
+	//callable for each element. If a formula keeps a reference to the frame,
+	//the element it's bound to mustn't change, so bind_element() gives the
+	//next element a new frame.
+	class element_callable : public formula_callable {
+	public:
+		element_callable(bool named, bool has_index, bool lookup_members)
+		  : formula_callable(named), backup_(NULL), index_(0), named_(named),
+		    has_index_(has_index), lookup_members_(lookup_members)
+		{}
+
+		void begin(const formula_callable& backup, const std::string& name) {
+			backup_ = &backup;
+			name_ = name;
+			index_ = 0;
+		}
+
+		//drops the element, so the frame doesn't keep it alive while it's
+		//waiting to be used again.
+		void end() {
+			element_ = variant();
+		}
+
+		void set(const variant& element) {
+			element_ = element;
+			++index_;
+		}
+
+	private:
+		variant get_value(const std::string& key) const {
+			if(named_) {
+				if(key == name_) {
+					return element_;
+				} else if(key == "context") {
+					return variant(backup_);
+				} else if(has_index_ && key == "index") {
+					return variant(index_ - 1);
+				}
+			}
+
+			if(lookup_members_) {
+				const variant var = element_.get_member(key);
+				if(!var.is_null()) {
+					return var;
+				}
+			}
+
+			return backup_->query_value(key);
+		}
+
+		//the function's arguments are parsed with the definition of the
+		//callable it's called with, so slots are that callable's.
+		variant get_value_by_slot(int slot) const {
+			return backup_->query_value_by_slot(slot);
+		}
+
+		void get_inputs(std::vector<formula_input>* inputs) const {
+			backup_->get_inputs(inputs);
+		}
+
+		const formula_callable* backup_;
+		std::string name_;
+		variant element_;
+		int index_;
+		bool named_, has_index_, lookup_members_;
+	};
+
+	typedef boost::intrusive_ptr<element_callable> element_callable_ptr;
+
+	element_callable& bind_element(element_callable_ptr& frame, const variant& element)
+	{
+		if(frame->refcount() != 1) {
+			frame.reset(new element_callable(*frame));
+		}
+
+		frame->set(element);
+		return *frame;
+	}
+
+	//one map() or filter() in a pipeline.
+	struct list_stage {
+		list_stage() : is_map(false) {}
+		bool is_map;
+
+		//the expression giving the element's name, or NULL if the formula
+		//uses the element's members directly.
+		expression_ptr name;
+		expression_ptr formula;
+	};
+
+	//a list function which can be fused with the map() and filter() calls
+	//giving it its list. map(filter(items, x > 0), x*2) is parsed into a
+	//pipeline with a filter and a map stage, which runs each element
+	//through both stages before moving on to the next, without making the
+	//filtered list in between.
+	class list_pipeline_function : public function_expression {
+	public:
+		//true for map() and filter(), whose result is another list to fuse.
+		bool produces_list() const { return produces_list_; }
+
+		//runs every element of the list through the pipeline, and gives
+		//each which comes out of the end to the sink, until it returns
+		//false. The sink is also told how many elements to expect, when
+		//every stage is a map().
+		template<typename Sink>
+		void run(const formula_callable& variables, Sink& sink) const;
+
+	protected:
+		list_pipeline_function(const std::string& name, const args_list& args,
+		                       int min_args, int max_args,
+		                       bool is_map, bool produces_list)
+		  : function_expression(name, args, min_args, max_args),
+		    produces_list_(produces_list), all_maps_(true)
+		{
+			const list_pipeline_function* input = dynamic_cast<const list_pipeline_function*>(args.front().get());
+			if(input && input->produces_list()) {
+				source_ = input->source_;
+				stages_ = input->stages_;
+				all_maps_ = input->all_maps_;
+			} else {
+				source_ = args.front();
+			}
+
+			list_stage stage;
+			stage.is_map = is_map;
+			if(args.size() == 3) {
+				stage.name = args[1];
+			}
+
+			stage.formula = args.back();
+			stages_.push_back(stage);
+			all_maps_ = all_maps_ && is_map;
+		}
+
+	private:
+		expression_ptr source_;
+		std::vector<list_stage> stages_;
+		bool produces_list_, all_maps_;
+
+		//frames kept between calls. They're taken out while the pipeline
+		//runs, so a recursive call makes its own.
+		mutable std::vector<element_callable_ptr> frames_;
+	};
+
+	template<typename Sink>
+	void list_pipeline_function::run(const formula_callable& variables, Sink& sink) const
+	{
+		const variant items = source_->evaluate(variables);
+
+		std::vector<element_callable_ptr> frames;
+		frames.swap(frames_);
+		frames.resize(stages_.size());
+		for(int n = 0; n != stages_.size(); ++n) {
+			const list_stage& stage = stages_[n];
+			if(!frames[n] || frames[n]->refcount() != 1) {
+				const bool named = stage.name.get() != NULL;
+				frames[n].reset(new element_callable(named, named && stage.is_map, !named || !stage.is_map));
+			}
+
+			frames[n]->begin(variables, stage.name ? stage.name->evaluate(variables).as_string() : "");
+		}
+
+		const int nitems = items.num_elements();
+		if(all_maps_) {
+			sink.reserve(nitems);
+		}
+
+		const int last = stages_.size() - 1;
+		const list_stage& final_stage = stages_.back();
+		variant mapped;
+		for(int n = 0; n != nitems; ++n) {
+			//every stage but the last passes its result on to the next, and
+			//the last passes it on to the sink.
+			const variant* value = &items[n];
+			int s = 0;
+			for(; s != last; ++s) {
+				const list_stage& stage = stages_[s];
+				element_callable& frame = bind_element(frames[s], *value);
+				if(stage.is_map) {
+					mapped = stage.formula->evaluate(frame);
+					value = &mapped;
+				} else if(!stage.formula->evaluate(frame).as_bool()) {
+					break;
+				}
+			}
+
+			if(s != last) {
+				continue;
+			}
+
+			element_callable& frame = bind_element(frames[last], *value);
+			if(final_stage.is_map) {
+				if(!sink(final_stage.formula->evaluate(frame))) {
+					break;
+				}
+			} else if(final_stage.formula->evaluate(frame).as_bool() && !sink(*value)) {
+				break;
+			}
+		}
+
+		foreach(const element_callable_ptr& frame, frames) {
+			if(frame->refcount() == 1) {
+				frame->end();
+			}
+		}
+
+		frames_.swap(frames);
+	}
+
+	struct list_sink {
+		explicit list_sink(std::vector<variant>* items) : items(items) {}
+		void reserve(int n) { items->reserve(n); }
+		bool operator()(const variant& v) { items->push_back(v); return true; }
+		std::vector<variant>* items;
+	};
+
+	struct find_sink {
+		void reserve(int n) {}
+		bool operator()(const variant& v) { result = v; return false; }
+		variant result;
+	};
+
+	struct sum_sink {
+		explicit sum_sink(const variant& start) : result(start) {}
+		void reserve(int n) {}
+		bool operator()(const variant& v) { result = result + v; return true; }
+		variant result;
+	};
+
 	class choose_function : public function_expression {
 	public:
 		explicit choose_function(const args_list& args)
@@ -360,12 +595,13 @@ namespace {
 			const variant items = args()[0]->evaluate(variables);
 			int max_index = -1;
 			variant max_value;
+			element_callable_ptr frame(new element_callable(false, false, true));
+			frame->begin(variables, "");
 			for(size_t n = 0; n != items.num_elements(); ++n) {
 				variant val;
 				
 				if(args().size() >= 2) {
-					formula_callable_ptr callable(new formula_variant_callable_with_backup(items[n], variables));
-					val = args()[1]->evaluate(*callable);
+					val = args()[1]->evaluate(bind_element(frame, items[n]));
 				} else {
 					val = variant(rand());
 				}
@@ -600,6 +836,10 @@ namespace {
 			}
 		}
 
+		variant get_value_by_slot(int slot) const {
+			return fallback_->query_value_by_slot(slot);
+		}
+
 		void get_inputs(std::vector<formula_input>* inputs) const {
 			fallback_->get_inputs(inputs);
 		}
@@ -694,39 +934,16 @@ namespace {
 	};
 		
 		
-	class filter_function : public function_expression {
+	class filter_function : public list_pipeline_function {
 	public:
 		explicit filter_function(const args_list& args)
-			: function_expression("filter", args, 2, 3)
+			: list_pipeline_function("filter", args, 2, 3, false, true)
 		{}
 	private:
 		variant execute(const formula_callable& variables) const {
 			std::vector<variant> vars;
-			const variant items = args()[0]->evaluate(variables);
-			if(args().size() == 2) {
-				for(size_t n = 0; n != items.num_elements(); ++n) {
-					formula_callable_ptr callable(new formula_variant_callable_with_backup(items[n], variables));
-					const variant val = args()[1]->evaluate(*callable);
-					if(val.as_bool()) {
-						vars.push_back(items[n]);
-					}
-				}
-			} else {
-				map_formula_callable* self_callable = new map_formula_callable;
-				formula_callable_ptr callable(self_callable);
-				self_callable->add("context", variant(&variables));
-				const std::string self = args()[1]->evaluate(variables).as_string();
-				for(size_t n = 0; n != items.num_elements(); ++n) {
-					self_callable->add(self, items[n]);
-					formula_callable_ptr callable_with_backup(new formula_variant_callable_with_backup(items[n], variables));
-					formula_callable_ptr callable_ptr(new formula_callable_with_backup(*self_callable, *callable_with_backup));
-					const variant val = args()[2]->evaluate(*callable_ptr);
-					if(val.as_bool()) {
-						vars.push_back(items[n]);
-					}
-				}
-			}
-
+			list_sink sink(&vars);
+			run(variables, sink);
 			return variant(&vars);
 		}
 	};
@@ -749,44 +966,17 @@ namespace {
 		}
 	};
 
-	class find_function : public function_expression {
+	class find_function : public list_pipeline_function {
 	public:
 		explicit find_function(const args_list& args)
-			: function_expression("find", args, 2, 3)
+			: list_pipeline_function("find", args, 2, 3, false, false)
 		{}
 
 	private:
 		variant execute(const formula_callable& variables) const {
-			const variant items = args()[0]->evaluate(variables);
-
-			if(args().size() == 2) {
-				for(size_t n = 0; n != items.num_elements(); ++n) {
-					formula_callable_ptr callable(new formula_variant_callable_with_backup(items[n], variables));
-					const variant val = args()[1]->evaluate(*callable);
-					if(val.as_bool()) {
-						return items[n];
-					}
-				}
-			} else {
-				map_formula_callable* self_callable = new map_formula_callable;
-				formula_callable_ptr callable(self_callable);
-				self_callable->add("context", variant(&variables));
-
-				const std::string self = args()[1]->evaluate(variables).as_string();
-				for(size_t n = 0; n != items.num_elements(); ++n) {
-					self_callable->add(self, items[n]);
-
-					boost::intrusive_ptr<formula_variant_callable_with_backup> callable_backup(new formula_variant_callable_with_backup(items[n], variables));
-
-					formula_callable_ptr callable(new formula_callable_with_backup(*self_callable, *callable_backup));
-					const variant val = args().back()->evaluate(*callable);
-					if(val.as_bool()) {
-						return items[n];
-					}
-				}
-			}
-
-			return variant();
+			find_sink sink;
+			run(variables, sink);
+			return sink.result;
 		}
 	};
 
@@ -846,47 +1036,16 @@ namespace {
 		}
 	};
 
-	class map_function : public function_expression {
+	class map_function : public list_pipeline_function {
 	public:
 		explicit map_function(const args_list& args)
-			: function_expression("map", args, 2, 3)
+			: list_pipeline_function("map", args, 2, 3, true, true)
 		{}
 	private:
 		variant execute(const formula_callable& variables) const {
 			std::vector<variant> vars;
-			const variant items = args()[0]->evaluate(variables);
-
-			vars.reserve(items.num_elements());
-
-			if(args().size() == 2) {
-				for(size_t n = 0; n != items.num_elements(); ++n) {
-					formula_callable_ptr callable(new formula_variant_callable_with_backup(items[n], variables));
-					const variant val = args().back()->evaluate(*callable);
-					vars.push_back(val);
-				}
-			} else {
-				static const std::string index_str = "index";
-				static const std::string context_str = "context";
-				map_formula_callable* self_callable = new map_formula_callable;
-				formula_callable_ptr callable_ref(self_callable);
-				self_callable->add(context_str, variant(&variables));
-				const std::string self = args()[1]->evaluate(variables).as_string();
-
-				variant& self_variant = self_callable->add_direct_access(self);
-
-				//the variant representing the index we are currently at.
-				variant& index_variant = self_callable->add_direct_access(index_str);
-				index_variant = variant(0);
-
-				formula_callable_ptr callable_backup(new formula_callable_with_backup(*self_callable, variables));
-
-				const int nelements = items.num_elements();
-				for(int& n = index_variant.int_addr(); n != nelements; ++n) {
-					self_variant = items[n];
-					vars.push_back(args().back()->evaluate(*callable_backup));
-				}
-			}
-
+			list_sink sink(&vars);
+			run(variables, sink);
 			return variant(&vars);
 		}
 	};
@@ -899,10 +1058,20 @@ namespace {
 	private:
 		variant execute(const formula_callable& variables) const {
 			variant res(0);
-			const variant items = args()[0]->evaluate(variables);
 			if(args().size() >= 2) {
 				res = args()[1]->evaluate(variables);
 			}
+
+			//the sum of a map() or filter() is added up as the elements
+			//come out of it, without making the list.
+			const list_pipeline_function* pipeline = dynamic_cast<const list_pipeline_function*>(args()[0].get());
+			if(pipeline && pipeline->produces_list()) {
+				sum_sink sink(res);
+				pipeline->run(variables, sink);
+				return sink.result;
+			}
+
+			const variant items = args()[0]->evaluate(variables);
 			for(size_t n = 0; n != items.num_elements(); ++n) {
 				res = res + items[n];
 			}
@@ -1517,6 +1686,69 @@ UNIT_TEST(flatten_function) {
 // 	CHECK(game_logic::formula("regex('a(bc.)', 'abcd abce bbcf bacg')").execute() == game_logic::formula("['bcd', 'bce']").execute(), "regex failed")
 //}
 
+UNIT_TEST(list_function_pipelines) {
+	using namespace game_logic;
+
+	//each stage sees the elements which come out of the one before it, in
+	//order, with its own index.
+	CHECK(formula("map(filter(range(10), 'n', n%3 = 0), 'n', n*2)").execute() == formula("[0,6,12,18]").execute(), "test failed");
+	CHECK(formula("map(filter(range(10), 'n', n%3 = 0), 'n', index)").execute() == formula("[0,1,2,3]").execute(), "test failed");
+	CHECK(formula("map(filter(map(range(5), 'n', n*n), 'sq', sq > 3), 'sq', sq + index)").execute() == formula("[4,10,18]").execute(), "test failed");
+	CHECK(formula("find(map(range(5), 'n', n*3), 'n', n > 4)").execute() == formula("6").execute(), "test failed");
+	CHECK(formula("find(filter(range(5), 'n', n > 10), 1)").execute() == variant(), "test failed");
+	CHECK(formula("sum(map(filter(range(5), 'n', n > 1), 'n', n*10), 1)").execute() == formula("91").execute(), "test failed");
+	CHECK(formula("sum(filter(range(5), 'n', n > 10))").execute() == formula("0").execute(), "test failed");
+
+	//a formula can keep a reference to the frame an element is bound to,
+	//and the element it's bound to doesn't change.
+	CHECK(formula("map(map([1,2,3], 'n', self), n)").execute() == formula("[1,2,3]").execute(), "test failed");
+
+	//context is the callable the function was called with, and elements
+	//which are callables can have their members used directly.
+	map_formula_callable* callable = new map_formula_callable;
+	variant callable_var(callable);
+	callable->add("k", variant(5));
+	std::vector<variant> items;
+	for(int n = 0; n != 2; ++n) {
+		map_formula_callable* item = new map_formula_callable;
+		items.push_back(variant(item));
+		item->add("a", variant(n));
+	}
+	callable->add("items", variant(&items));
+
+	CHECK(formula("map(filter(range(3), 'n', n < context.k), 'n', n + context.k)").execute(*callable) == formula("[5,6,7]").execute(), "test failed");
+	CHECK(formula("map(filter(items, a > 0), a + k)").execute(*callable) == formula("[6]").execute(), "test failed");
+	CHECK(formula("choose(items, -a)").execute(*callable) == callable->query_value("items")[0], "test failed");
+
+	//a function called from inside its own formula gets its own frames.
+	CHECK(formula("map(range(2), 'a', map(range(2), 'b', a*10 + b))").execute() == formula("[[0,1],[10,11]]").execute(), "test failed");
+}
+
+namespace {
+//a list of callables which each have an x, like a list of level objects.
+game_logic::map_formula_callable& list_function_callable() {
+	using namespace game_logic;
+
+	static map_formula_callable* callable = NULL;
+	static variant callable_var;
+	
+	if(callable == NULL) {
+		std::vector<variant> v;
+		for(int n = 0; n != 1000; ++n) {
+			map_formula_callable* item = new map_formula_callable;
+			v.push_back(variant(item));
+			item->add("x", variant(n));
+		}
+
+		callable = new map_formula_callable;
+		callable_var = variant(callable);
+		callable->add("items", variant(&v));
+	}
+
+	return *callable;
+}
+}
+
 BENCHMARK(map_function) {
 	using namespace game_logic;
 
@@ -1543,3 +1775,30 @@ BENCHMARK(map_function) {
 		f.execute(*callable);
 	}
 }
+
+BENCHMARK(map_function_members) {
+	using namespace game_logic;
+	map_formula_callable& callable = list_function_callable();
+	static formula f("map(items, x)");
+	BENCHMARK_LOOP {
+		f.execute(callable);
+	}
+}
+
+BENCHMARK(map_filter_function) {
+	using namespace game_logic;
+	map_formula_callable& callable = list_function_callable();
+	static formula f("map(filter(items, 'obj', obj.x%2 = 0), 'obj', obj.x*2)");
+	BENCHMARK_LOOP {
+		f.execute(callable);
+	}
+}
+
+BENCHMARK(sum_map_function) {
+	using namespace game_logic;
+	map_formula_callable& callable = list_function_callable();
+	static formula f("sum(map(items, x))");
+	BENCHMARK_LOOP {
+		f.execute(callable);
+	}
+}
@@ -14,6 +14,7 @@
 #include "surface_formula.hpp"
 #include "surface_palette.hpp"
 #include "texture.hpp"
+#include "unit_test.hpp"
 #include "wml_node.hpp"
 #include "wml_utils.hpp"
 
@@ -24,6 +25,33 @@ std::set<frame*>& palette_frames() {
 }
 
 unsigned int current_palette_mask = 0;
+
+//gets the 64 bits of a row of bits starting at bit 'start', which may be
+//outside the row, in which case the bits outside it are 0.
+uint64_t get_mask_bits(const uint64_t* row, int nwords, int start)
+{
+	const int word = start >= 0 ? start/64 : -((-start + 63)/64);
+	const int shift = start - word*64;
+	const uint64_t lo = word >= 0 && word < nwords ? row[word] : 0;
+	if(shift == 0) {
+		return lo;
+	}
+
+	const uint64_t hi = word + 1 >= 0 && word + 1 < nwords ? row[word + 1] : 0;
+	return (lo >> shift) | (hi << (64 - shift));
+}
+
+//repeats each of the low 32 bits of v twice, to scale a row of pixels up.
+uint64_t double_bits(uint64_t v)
+{
+	v &= 0xFFFFFFFFULL;
+	v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+	v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+	v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	v = (v | (v << 2)) & 0x3333333333333333ULL;
+	v = (v | (v << 1)) & 0x5555555555555555ULL;
+	return v | (v << 1);
+}
 }
 
 frame::frame(wml::const_node_ptr node)
@@ -73,6 +101,7 @@ frame::frame(wml::const_node_ptr node)
 	 rotate_on_slope_(wml::get_bool(node, "rotate_on_slope")),
 	 damage_(wml::get_int(node, "damage")),
 	 sounds_(util::split(node->attr("sound"))),
+	 alpha_mask_words_(0),
 	 no_remove_alpha_borders_(wml::get_bool(node, "no_remove_alpha_borders", false)),
 	 current_palette_(-1)
 {
@@ -283,22 +312,33 @@ void frame::build_alpha_from_frame_info()
 		return;
 	}
 
-	alpha_.resize(nframes_*img_rect_.w()*img_rect_.h(), true);
+	alpha_mask_words_ = (img_rect_.w() + 63)/64;
+	alpha_mask_.assign(nframes_*img_rect_.h()*2*alpha_mask_words_, 0);
 	for(int n = 0; n < nframes_; ++n) {
 		const rect& area = frames_[n].area;
-		int dst_index = frames_[n].y_adjust*img_rect_.w()*nframes_ + n*img_rect_.w() + frames_[n].x_adjust;
 		for(int y = 0; y != area.h(); ++y) {
-			ASSERT_INDEX_INTO_VECTOR(dst_index, alpha_);
-			std::vector<bool>::iterator dst = alpha_.begin() + dst_index;
-
 			ASSERT_LT(area.x(), texture_.width());
 			ASSERT_LE(area.x() + area.w(), texture_.width());
 			ASSERT_LT(area.y() + y, texture_.height());
 			std::vector<bool>::const_iterator src = texture_.get_alpha_row(area.x(), area.y() + y);
 
-			std::copy(src, src + area.w(), dst);
-			
-			dst_index += img_rect_.w()*nframes_;
+			set_alpha_row(n, frames_[n].x_adjust, frames_[n].y_adjust + y, src, area.w());
+		}
+	}
+}
+
+void frame::set_alpha_row(int nframe, int x, int y, std::vector<bool>::const_iterator src, int len)
+{
+	ASSERT_LE(x + len, img_rect_.w());
+	ASSERT_LT(y, img_rect_.h());
+	uint64_t* right = &alpha_mask_[((nframe*img_rect_.h() + y)*2)*alpha_mask_words_];
+	uint64_t* left = right + alpha_mask_words_;
+	for(int n = 0; n != len; ++n, ++src) {
+		if(!*src) {
+			const int pos = x + n;
+			const int mirrored = img_rect_.w() - pos - 1;
+			right[pos/64] |= uint64_t(1) << (pos%64);
+			left[mirrored/64] |= uint64_t(1) << (mirrored%64);
 		}
 	}
 }
@@ -310,7 +350,8 @@ void frame::build_alpha()
 		return;
 	}
 
-	alpha_.resize(nframes_*img_rect_.w()*img_rect_.h(), true);
+	alpha_mask_words_ = (img_rect_.w() + 63)/64;
+	alpha_mask_.assign(nframes_*img_rect_.h()*2*alpha_mask_words_, 0);
 
 	for(int n = 0; n < nframes_; ++n) {
 		const int current_col = (nframes_per_row_ > 0) ? (n% nframes_per_row_) : n;
@@ -325,13 +366,8 @@ void frame::build_alpha()
 		}
 
 		for(int y = 0; y != img_rect_.h(); ++y) {
-			const int dst_index = y*img_rect_.w()*nframes_ + n*img_rect_.w();
-			ASSERT_INDEX_INTO_VECTOR(dst_index, alpha_);
-
-			std::vector<bool>::iterator dst = alpha_.begin() + dst_index;
-
 			std::vector<bool>::const_iterator src = texture_.get_alpha_row(xbase, ybase + y);
-			std::copy(src, src + img_rect_.w(), dst);
+			set_alpha_row(n, 0, y, src, img_rect_.w());
 		}
 
 		//now calculate if the actual frame we should be using for drawing
@@ -418,27 +454,52 @@ void frame::build_alpha()
 
 bool frame::is_alpha(int x, int y, int time, bool face_right) const
 {
-	if(alpha_.empty()) {
+	if(alpha_mask_.empty()) {
 		return true;
 	}
 
-	if(face_right == false) {
-		x = width() - x - 1;
-	}
-
 	if(x < 0 || y < 0 || x >= width() || y >= height()) {
 		return true;
 	}
 
+	//rows facing left are stored mirrored, so x is used as it is.
 	x /= scale_;
 	y /= scale_;
 
-	const int nframe = frame_number(time);
-	x += nframe*img_rect_.w();
-	
-	const int index = y*img_rect_.w()*nframes_ + x;
-	ASSERT_INDEX_INTO_VECTOR(index, alpha_);
-	return alpha_[index];
+	const uint64_t* row = alpha_mask_row(frame_number(time), y, face_right);
+	return (row[x/64] & (uint64_t(1) << (x%64))) == 0;
+}
+
+uint64_t frame::opaque_bits(int x, int y, int time, bool face_right) const
+{
+	if(alpha_mask_.empty() || y < 0 || y >= height() || x >= width() || x + 64 <= 0) {
+		return 0;
+	}
+
+	const uint64_t* row = alpha_mask_row(frame_number(time), y/scale_, face_right);
+	if(scale_ == 1) {
+		return get_mask_bits(row, alpha_mask_words_, x);
+	}
+
+	//find the unscaled pixel x is in, and how far into it x is.
+	const int start = x >= 0 ? x/scale_ : -((-x + scale_ - 1)/scale_);
+	const int offset = x - start*scale_;
+
+	if(scale_ == 2) {
+		const uint64_t bits = get_mask_bits(row, alpha_mask_words_, start);
+		const uint64_t result = double_bits(bits);
+		return offset ? (result >> 1) | ((bits >> 32) << 63) : result;
+	}
+
+	uint64_t result = 0;
+	for(int n = 0; n != 64; ++n) {
+		const int pos = start + (offset + n)/scale_;
+		if(pos >= 0 && pos < img_rect_.w() && (row[pos/64] & (uint64_t(1) << (pos%64)))) {
+			result |= uint64_t(1) << n;
+		}
+	}
+
+	return result;
 }
 
 void frame::draw_into_blit_queue(graphics::blit_queue& blit, int x, int y, bool face_right, bool upside_down, int time) const
@@ -452,6 +513,11 @@ void frame::draw_into_blit_queue(graphics::blit_queue& blit, int x, int y, bool
 	const int w = info->area.w()*scale_*(face_right ? 1 : -1);
 	const int h = info->area.h()*scale_*(upside_down ? -1 : 1);
 
+	rect[0] = texture_.translate_coord_x(rect[0]);
+	rect[1] = texture_.translate_coord_y(rect[1]);
+	rect[2] = texture_.translate_coord_x(rect[2]);
+	rect[3] = texture_.translate_coord_y(rect[3]);
+
 	blit.set_texture(texture_.get_id());
 
 	blit.add(x, y, rect[0], rect[1]);
@@ -648,3 +714,20 @@ point frame::pivot(const std::string& name, int time_in_frame) const
 
 	return point(feet_x(),feet_y()); //default is to pivot around feet.
 }
+
+UNIT_TEST(frame_alpha_mask_bits)
+{
+	const uint64_t row[2] = { 0x8000000000000001ULL, 0x5ULL };
+
+	CHECK_EQ(get_mask_bits(row, 2, 0), row[0]);
+	CHECK_EQ(get_mask_bits(row, 2, 63), 0xBULL);
+	CHECK_EQ(get_mask_bits(row, 2, 64), 0x5ULL);
+	CHECK_EQ(get_mask_bits(row, 2, 128), 0);
+	CHECK_EQ(get_mask_bits(row, 2, -1), 0x2ULL);
+	CHECK_EQ(get_mask_bits(row, 2, -64), 0);
+	CHECK_EQ(get_mask_bits(row, 2, -63), 0x1ULL << 63);
+
+	CHECK_EQ(double_bits(0x5ULL), 0x33ULL);
+	CHECK_EQ(double_bits(0x80000001ULL), 0xC000000000000003ULL);
+	CHECK_EQ(double_bits(0x100000000ULL), 0);
+}
@@ -3,6 +3,7 @@
 
 #include <boost/array.hpp>
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -44,8 +45,11 @@ public:
 	//play a sound. 'object' is just the address of the object playing the
 	//sound, useful if the sound is later cancelled.
 	void play_sound(const void* object=NULL) const;
-	std::vector<bool>::const_iterator alpha_row(int x, int y, int time, bool face_right) const;
 	bool is_alpha(int x, int y, int time, bool face_right) const;
+
+	//gets whether the 64 pixels starting at x, y are opaque, with bit n
+	//set if the pixel at x+n is. Pixels outside the frame aren't opaque.
+	uint64_t opaque_bits(int x, int y, int time, bool face_right) const;
 	void draw_into_blit_queue(graphics::blit_queue& blit, int x, int y, bool face_right=true, bool upside_down=false, int time=0) const;
 	void draw(int x, int y, bool face_right=true, bool upside_down=false, int time=0, GLfloat rotate=0) const;
 	void draw(int x, int y, bool face_right, bool upside_down, int time, GLfloat rotate, GLfloat scale) const;
@@ -149,7 +153,20 @@ private:
 
 	void build_alpha_from_frame_info();
 	void build_alpha();
-	std::vector<bool> alpha_;
+
+	//marks the pixels in a row of one of the frames which are opaque,
+	//taking them from a row of the texture's alpha map.
+	void set_alpha_row(int nframe, int x, int y, std::vector<bool>::const_iterator src, int len);
+	const uint64_t* alpha_mask_row(int nframe, int y, bool face_right) const {
+		return &alpha_mask_[((nframe*img_rect_.h() + y)*2 + (face_right ? 0 : 1))*alpha_mask_words_];
+	}
+
+	//a bit mask of the opaque pixels in each row of each frame, with one
+	//row facing right and then a mirrored row facing left. Each row is
+	//alpha_mask_words_ words long. It's unscaled, and empty if there's no
+	//texture, in which case nothing is opaque.
+	std::vector<uint64_t> alpha_mask_;
+	int alpha_mask_words_;
 
 	bool no_remove_alpha_borders_;
 
@@ -1,5 +1,6 @@
 #include <map>
 
+#include "draw_stats.hpp"
 #include "graphical_font.hpp"
 #include "raster.hpp"
 #include "wml_node.hpp"
@@ -241,6 +242,7 @@ rect graphical_font::do_draw(int x, int y, const std::string& text, bool draw_te
 		texture_.set_as_current_texture();
 		glVertexPointer(2, GL_FLOAT, 0, &font_varray.front());
 		glTexCoordPointer(2, GL_FLOAT, 0, &font_tcarray.front());
+		draw_stats::draw_call(font_varray.size()/2);
 		glDrawArrays(GL_TRIANGLE_STRIP, 0, font_varray.size()/2);
 	}
 
@@ -2,13 +2,18 @@
 
 #include <algorithm>
 #include <iostream>
+#include <iterator>
+#include <set>
 #include <math.h>
 
 #include "IMG_savepng.h"
 #include "asserts.hpp"
 #include "collision_utils.hpp"
+#include "control_packet.hpp"
 #include "controls.hpp"
+#include "custom_object_type.hpp"
 #include "draw_scene.hpp"
+#include "draw_stats.hpp"
 #include "draw_tile.hpp"
 #include "entity.hpp"
 #include "filesystem.hpp"
@@ -19,6 +24,7 @@
 #include "level.hpp"
 #include "level_object.hpp"
 #include "light.hpp"
+#include "light_map.hpp"
 #include "load_level.hpp"
 #include "multiplayer.hpp"
 #include "object_events.hpp"
@@ -28,10 +34,11 @@
 #include "preprocessor.hpp"
 #include "random.hpp"
 #include "raster.hpp"
+#include "sound.hpp"
+#include "sprite_batch.hpp"
 #include "stats.hpp"
 #include "string_utils.hpp"
 #include "surface_palette.hpp"
-#include "texture_frame_buffer.hpp"
 #include "thread.hpp"
 #include "tile_map.hpp"
 #include "unit_test.hpp"
@@ -133,7 +140,7 @@ level::level(const std::string& level_cfg)
       editor_tile_updates_frozen_(0), zoom_level_(1),
 	  palettes_used_(0),
 	  background_palette_(-1),
-	  segment_width_(0), segment_height_(0)
+	  segment_width_(0), segment_height_(0), stream_sub_levels_(false)
 {
 	std::cerr << "in level constructor...\n";
 	const int start_time = SDL_GetTicks();
@@ -410,16 +417,22 @@ level::level(const std::string& level_cfg)
 	gui_algorithm_->new_level();
 
 	sub_level_str_ = node->attr("sub_levels");
+	stream_sub_levels_ = wml::get_bool(node, "stream_sub_levels", false);
 	foreach(const std::string& sub_lvl, util::split(node->attr("sub_levels"))) {
 		sub_level_data& data = sub_levels_[sub_lvl];
+		if(stream_sub_levels_) {
+			//the sub-level is loaded once it's placed near the screen, but
+			//its WML is read now, to find out how big it is.
+			data.streamed = true;
+			preload_level_wml(sub_lvl + ".cfg");
+			continue;
+		}
+
 		data.lvl = boost::intrusive_ptr<level>(new level(sub_lvl + ".cfg"));
+		data.bounds = data.lvl->boundaries();
 		foreach(int layer, data.lvl->layers_) {
 			layers_.insert(layer);
 		}
-
-		data.active = false;
-		data.xoffset = data.yoffset = 0;
-		data.xbase = data.ybase = 0;
 	}
 
 }
@@ -473,7 +486,7 @@ void level::read_compiled_tiles(wml::const_node_ptr node, std::vector<level_tile
 
 void level::load_character(wml::const_node_ptr c)
 {
-	chars_.push_back(entity::build(c));
+	add_char_to_list(entity::build(c));
 	layers_.insert(chars_.back()->zorder());
 	if(!chars_.back()->is_human()) {
 		chars_.back()->set_id(chars_.size());
@@ -529,8 +542,7 @@ void level::finish_loading()
 				data.lvl.reset(sub_level);
 				data.xbase = x;
 				data.ybase = y;
-				data.xoffset = data.yoffset = 0;
-				data.active = false;
+				data.bounds = bounds;
 				sub_levels.push_back(data);
 			}
 		}
@@ -554,16 +566,13 @@ void level::finish_loading()
 		}
 	}
 
-	if(sub_levels_.empty() == false) {
-		solid_base_ = solid_;
-		standable_base_ = standable_;
-	}
-
 	graphics::texture::build_textures_from_worker_threads();
 
 	if (editor_ || preferences::compiling_tiles)
 		game_logic::set_verbatim_string_expressions (true);
 
+	custom_object_type::preload_types(wml_chars_);
+
 	game_logic::wml_formula_callable_read_scope read_scope;
 	foreach(wml::const_node_ptr node, wml_chars_) {
 		if(node->name() != "serialized_objects") {
@@ -608,6 +617,23 @@ void level::finish_loading()
 
 	game_logic::set_verbatim_string_expressions (false);
 
+	//start decoding the sounds the objects in the level make, so they
+	//don't have to be loaded the first time they're played.
+	if(!editor_) {
+		std::set<std::string> sounds;
+		foreach(wml::const_node_ptr node, wml_chars_) {
+			if(node->name() == "character" && node->has_attr("type")) {
+				const std::string& type = node->attr("type");
+				const_custom_object_type_ptr t = custom_object_type::get(std::string(type.begin(), std::find(type.begin(), type.end(), '.')));
+				if(t) {
+					sounds.insert(t->sounds().begin(), t->sounds().end());
+				}
+			}
+		}
+
+		sound::preload(std::vector<std::string>(sounds.begin(), sounds.end()));
+	}
+
 	wml_chars_.clear();
 
 	controls::new_level(cycle_, players_.empty() ? 1 : players_.size(), multiplayer::slot());
@@ -675,7 +701,8 @@ const level* level_building = NULL;
 bool tile_rebuild_in_progress = false;
 bool tile_rebuild_queued = false;
 
-threading::thread* rebuild_tile_thread = NULL;
+//the task building tiles on the worker pool.
+threading::task_ptr rebuild_tile_task;
 
 //an unsynchronized buffer only accessed by the main thread with layers
 //that will be rebuilt.
@@ -685,17 +712,10 @@ std::vector<int> rebuild_tile_layers_buffer;
 //be rebuilt.
 std::vector<int> rebuild_tile_layers_worker_buffer;
 
-//a locked flag which is polled to see if tile rebuilding has been completed.
-bool tile_rebuild_complete = false;
-threading::mutex& tile_rebuild_complete_mutex() {
-	static threading::mutex m;
-	return m;
-}
-
-//the tiles where the thread will store the new tiles.
+//the tiles where the task will store the new tiles.
 std::vector<level_tile> task_tiles;
 
-void build_tiles_thread_function(std::map<int, tile_map> tile_maps) {
+void build_tiles_task_function(std::map<int, tile_map> tile_maps) {
 	task_tiles.clear();
 
 	if(rebuild_tile_layers_worker_buffer.empty()) {
@@ -711,9 +731,6 @@ void build_tiles_thread_function(std::map<int, tile_map> tile_maps) {
 			}
 		}
 	}
-
-	threading::lock l(tile_rebuild_complete_mutex());
-	tile_rebuild_complete = true;
 }
 
 }
@@ -738,12 +755,13 @@ void level::start_rebuild_tiles_in_background(const std::vector<int>& layers)
 	level_building = this;
 
 	tile_rebuild_in_progress = true;
-	tile_rebuild_complete = false;
 
 	rebuild_tile_layers_worker_buffer = rebuild_tile_layers_buffer;
 	rebuild_tile_layers_buffer.clear();
 
-	rebuild_tile_thread = new threading::thread(boost::bind(build_tiles_thread_function, tile_maps_));
+	//the new tiles are shown as soon as they're built, so they go ahead
+	//of levels being loaded in the background.
+	rebuild_tile_task = threading::run_task(boost::bind(build_tiles_task_function, tile_maps_), threading::PRIORITY_HIGH);
 }
 
 void level::freeze_rebuild_tiles_in_background()
@@ -753,8 +771,8 @@ void level::freeze_rebuild_tiles_in_background()
 
 void level::unfreeze_rebuild_tiles_in_background()
 {
-	if(rebuild_tile_thread != NULL) {
-		//a thread is actually in flight calculating tiles, so any requests
+	if(rebuild_tile_task) {
+		//a task is actually in flight calculating tiles, so any requests
 		//would have been queued up anyway.
 		return;
 	}
@@ -764,43 +782,39 @@ void level::unfreeze_rebuild_tiles_in_background()
 }
 
 namespace {
-bool level_tile_from_layer(const level_tile& t, int zorder) {
-	return t.layer_from == zorder;
+struct TileFromLayers {
+	//layers must be sorted. If it's empty, tiles from every layer match.
+	explicit TileFromLayers(const std::vector<int>& layers) : layers_(layers)
+	{}
+
+	bool operator()(const level_tile& t) const {
+		return layers_.empty() || std::binary_search(layers_.begin(), layers_.end(), t.layer_from);
+	}
+
+	std::vector<int> layers_;
+};
 }
+
+bool level::rebuilding_tiles_in_background() const
+{
+	return rebuild_tile_task.get() != NULL;
 }
 
 void level::complete_rebuild_tiles_in_background()
 {
-	if(!tile_rebuild_in_progress) {
+	if(!tile_rebuild_in_progress || !rebuild_tile_task || !rebuild_tile_task->done()) {
 		return;
 	}
 
-	{
-		threading::lock l(tile_rebuild_complete_mutex());
-		if(!tile_rebuild_complete) {
-			return;
-		}
-	}
-
 	const int begin_time = SDL_GetTicks();
 
-//	ASSERT_LOG(rebuild_tile_thread, "REBUILD TILE THREAD IS NULL");
-	delete rebuild_tile_thread;
-	rebuild_tile_thread = NULL;
+	rebuild_tile_task.reset();
 
 	if(level_building == this) {
-		if(rebuild_tile_layers_worker_buffer.empty()) {
-			tiles_.clear();
-		} else {
-			foreach(int layer, rebuild_tile_layers_worker_buffer) {
-				tiles_.erase(std::remove_if(tiles_.begin(), tiles_.end(), boost::bind(level_tile_from_layer, _1, layer)), tiles_.end());
-			}
-		}
-
-		tiles_.insert(tiles_.end(), task_tiles.begin(), task_tiles.end());
+		//only the parts of the level where the tiles have changed are
+		//prepared again, so editing tiles in a big level stays smooth.
+		replace_tiles(task_tiles, TileFromLayers(rebuild_tile_layers_worker_buffer));
 		task_tiles.clear();
-
-		complete_tiles_refresh();
 	}
 
 	std::cerr << "COMPLETE TILE REBUILD: " << (SDL_GetTicks() - begin_time) << "\n";
@@ -886,39 +900,168 @@ struct TileInRect {
 
 	rect rect_;
 };
+
+//tiles are prepared for drawing, and have their solid cells built, in
+//square chunks of the level this many pixels across.
+const int TileChunkSize = TileSize*32;
+
+//the chunk containing the given level coordinate, rounding down.
+int tile_chunk_coord(int n)
+{
+	return n >= 0 ? n/TileChunkSize : -((-n - 1)/TileChunkSize) - 1;
 }
 
-void level::rebuild_tiles_rect(const rect& r)
+rect tile_chunk_area(const std::pair<int, int>& chunk)
 {
-	if(editor_tile_updates_frozen_) {
-		return;
+	return rect(chunk.first*TileChunkSize, chunk.second*TileChunkSize, TileChunkSize, TileChunkSize);
+}
+
+//adds the chunks covered by a tile's object.
+void add_tile_chunks(const level_tile& t, std::set<std::pair<int, int> >& chunks)
+{
+	const int x2 = tile_chunk_coord(t.x + std::max(t.object->width(), 1) - 1);
+	const int y2 = tile_chunk_coord(t.y + std::max(t.object->height(), 1) - 1);
+	for(int y = tile_chunk_coord(t.y); y <= y2; ++y) {
+		for(int x = tile_chunk_coord(t.x); x <= x2; ++x) {
+			chunks.insert(std::pair<int, int>(x, y));
+		}
 	}
+}
 
-	for(int x = r.x(); x < r.x2(); x += TileSize) {
-		for(int y = r.y(); y < r.y2(); y += TileSize) {
-			tile_pos pos(x/TileSize, y/TileSize);
-			solid_.erase(pos);
-			standable_.erase(pos);
+bool same_tile(const level_tile& a, const level_tile& b)
+{
+	return a.x == b.x && a.y == b.y && a.zorder == b.zorder &&
+	       a.layer_from == b.layer_from && a.object == b.object &&
+	       a.face_right == b.face_right;
+}
+
+level_tile tile_search_key(int zorder, int x, int y)
+{
+	level_tile t;
+	t.x = x;
+	t.y = y;
+	t.layer_from = t.zorder = zorder;
+	t.face_right = t.draw_disabled = false;
+	return t;
+}
+
+//finds the tiles in a layer with their top left corner in the given area,
+//in tiles sorted by level_tile_zorder_pos_comparer. Each row of the area
+//is found with a binary search, so this takes time in proportion to the
+//size of the area, not of the level.
+void find_tiles_in_rect(std::vector<level_tile>& tiles, int zorder, const rect& area, std::vector<level_tile*>& result)
+{
+	level_tile_zorder_pos_comparer cmp;
+	std::vector<level_tile>::iterator i = std::lower_bound(tiles.begin(), tiles.end(), tile_search_key(zorder, area.x(), area.y()), cmp);
+	while(i != tiles.end() && i->zorder == zorder && i->y < area.y2()) {
+		if(i->x < area.x()) {
+			i = std::lower_bound(i, tiles.end(), tile_search_key(zorder, area.x(), i->y), cmp);
+		} else if(i->x >= area.x2()) {
+			i = std::lower_bound(i, tiles.end(), tile_search_key(zorder, area.x(), i->y + 1), cmp);
+		} else {
+			result.push_back(&*i);
+			++i;
 		}
 	}
+}
+}
 
-	tiles_.erase(std::remove_if(tiles_.begin(), tiles_.end(), TileInRect(r)), tiles_.end());
+void level::rebuild_tiles_rect(const rect& r)
+{
+	if(editor_tile_updates_frozen_) {
+		return;
+	}
 
 	std::vector<level_tile> tiles;
 	for(std::map<int, tile_map>::const_iterator i = tile_maps_.begin(); i != tile_maps_.end(); ++i) {
 		i->second.build_tiles(&tiles, &r);
 	}
 
-	foreach(level_tile& t, tiles) {
-		add_tile_solid(t);
-		tiles_.push_back(t);
+	replace_tiles(tiles, TileInRect(r));
+}
+
+void level::replace_tiles(std::vector<level_tile>& tiles, const boost::function<bool(const level_tile&)>& replaced)
+{
+	level_tile_zorder_pos_comparer cmp;
+	std::sort(tiles.begin(), tiles.end(), cmp);
+
+	std::vector<level_tile> kept, old_tiles;
+	kept.reserve(tiles_.size());
+	foreach(const level_tile& t, tiles_) {
+		if(replaced(t)) {
+			old_tiles.push_back(t);
+		} else {
+			kept.push_back(t);
+		}
+	}
+
+	//walk through the old and new tiles together, to find the chunks in
+	//which they differ. Usually an edit only changes a few tiles.
+	std::set<tile_pos> chunks;
+	std::vector<level_tile>::const_iterator i = old_tiles.begin();
+	std::vector<level_tile>::const_iterator j = tiles.begin();
+	while(i != old_tiles.end() || j != tiles.end()) {
+		if(j == tiles.end() || i != old_tiles.end() && cmp(*i, *j)) {
+			add_tile_chunks(*i++, chunks);
+		} else if(i == old_tiles.end() || cmp(*j, *i)) {
+			add_tile_chunks(*j++, chunks);
+		} else {
+			if(!same_tile(*i, *j)) {
+				add_tile_chunks(*i, chunks);
+				add_tile_chunks(*j, chunks);
+			}
+
+			++i;
+			++j;
+		}
+	}
+
+	tiles_.clear();
+	std::merge(kept.begin(), kept.end(), tiles.begin(), tiles.end(), std::back_inserter(tiles_), cmp);
+
+	foreach(const level_tile& t, tiles) {
 		layers_.insert(t.zorder);
 	}
 
-	if(std::adjacent_find(tiles_.rbegin(), tiles_.rend(), level_tile_zorder_pos_comparer()) != tiles_.rend()) {
-		std::sort(tiles_.begin(), tiles_.end(), level_tile_zorder_pos_comparer());
+	level_object::set_current_palette(palettes_used_);
+	foreach(const tile_pos& chunk, chunks) {
+		rebuild_tile_chunk_solid(chunk);
+		prepare_tile_chunk(chunk);
+	}
+}
+
+void level::rebuild_tile_chunk_solid(const tile_pos& chunk)
+{
+	const rect area = tile_chunk_area(chunk);
+	for(int y = area.y(); y < area.y2(); y += TileSize) {
+		for(int x = area.x(); x < area.x2(); x += TileSize) {
+			const tile_pos pos(x/TileSize, y/TileSize);
+			solid_.erase(pos);
+			standable_.erase(pos);
+		}
+	}
+
+	foreach(const solid_rect& r, solid_rects_) {
+		if(rects_intersect(r.r, area)) {
+			const rect solid_area = intersection_rect(r.r, area);
+			add_solid_rect(solid_area.x(), solid_area.y(), solid_area.x2(), solid_area.y2(), r.friction, r.traction, r.damage);
+		}
+	}
+
+	//tiles above and to the left of the chunk may be big enough to reach
+	//into it.
+	const int xreach = std::max(0, widest_tile_ - 1);
+	const int yreach = std::max(0, highest_tile_ - 1);
+	const rect search_area(area.x() - xreach, area.y() - yreach, area.w() + xreach, area.h() + yreach);
+
+	std::vector<level_tile*> tiles;
+	foreach(int layer, layers_) {
+		find_tiles_in_rect(tiles_, layer, search_area, tiles);
+	}
+
+	foreach(const level_tile* t, tiles) {
+		add_tile_solid(*t);
 	}
-	prepare_tiles_for_drawing();
 }
 
 std::string level::package() const
@@ -932,6 +1075,30 @@ std::string level::package() const
 }
 
 wml::node_ptr level::write() const
+{
+	return write_level(NULL);
+}
+
+level_snapshot_ptr level::snapshot() const
+{
+	level_snapshot_ptr res(new level_snapshot);
+	res->node = write_level(res.get());
+	return res;
+}
+
+wml::node_ptr level_snapshot::write()
+{
+	typedef std::pair<entity_ptr, std::string> char_copy;
+	foreach(const char_copy& ch, chars) {
+		wml::node_ptr char_node(ch.first->write());
+		char_node->set_attr("_addr", ch.second);
+		node->add_child(char_node);
+	}
+
+	return node;
+}
+
+wml::node_ptr level::write_level(level_snapshot* snapshot) const
 {
 	std::sort(tiles_.begin(), tiles_.end(), level_tile_zorder_pos_comparer());
 	game_logic::wml_formula_callable_serialization_scope serialization_scope;
@@ -969,6 +1136,10 @@ wml::node_ptr level::write() const
 		res->set_attr("sub_levels", sub_level_str_);
 	}
 
+	if(stream_sub_levels_) {
+		res->set_attr("stream_sub_levels", "yes");
+	}
+
 	res->set_attr("dimensions", boundaries().to_string());
 
 	res->set_attr("xscale", formatter() << xscale_);
@@ -1003,6 +1174,8 @@ wml::node_ptr level::write() const
 	for(std::map<int, tile_map>::const_iterator i = tile_maps_.begin(); i != tile_maps_.end(); ++i) {
 		wml::node_ptr node(i->second.write());
 		if(preferences::compiling_tiles) {
+			//the tile map's node is cached, so copy it before changing it.
+			node = wml::deep_copy(node);
 			node->set_attr("tiles", "");
 			node->set_attr("unique_tiles", "");
 		}
@@ -1214,6 +1387,13 @@ wml::node_ptr level::write() const
 			continue;
 		}
 
+		if(snapshot) {
+			//the copy's variables are written now, within this scope.
+			entity_ptr copy = ch->save_copy();
+			snapshot->chars.push_back(std::make_pair(copy, game_logic::wml_formula_callable_serialization_scope::register_serialized_object(ch)));
+			continue;
+		}
+
 		wml::node_ptr node(ch->write());
 		res->add_child(node);
 		game_logic::wml_formula_callable_serialization_scope::register_serialized_object(ch, node);
@@ -1397,17 +1577,44 @@ void level::draw_layer(int layer, int x, int y, int w, int h) const
 		return;
 	}
 
-	std::map<int, layer_blit_info>::iterator layer_itor = blit_cache_.find(layer);
+	std::map<int, layer_chunk_map>::iterator layer_itor = blit_cache_.find(layer);
 	if(layer_itor == blit_cache_.end()) {
 		glPopMatrix();
 		return;
 	}
 
-	const level_tile* t = &*tile_itor;
-	const level_tile* end_tiles = &*tiles_.begin() + tiles_.size();
+	//tiles in one chunk never overlap those in another chunk of the same
+	//layer, so the opaque tiles of every chunk in view are drawn first,
+	//and then the translucent ones.
+	layer_chunk_map& chunks = layer_itor->second;
+	const int chunk_x1 = tile_chunk_coord(x), chunk_x2 = tile_chunk_coord(x + w);
+	const int chunk_y1 = tile_chunk_coord(y), chunk_y2 = tile_chunk_coord(y + h);
 
-	layer_blit_info& blit_info = layer_itor->second;
+	glDisable(GL_BLEND);
+	draw_stats::blend_change();
+	for(int chunk_x = chunk_x1; chunk_x <= chunk_x2; ++chunk_x) {
+		layer_chunk_map::iterator i = chunks.lower_bound(tile_pos(chunk_x, chunk_y1));
+		for(; i != chunks.end() && i->first.first == chunk_x && i->first.second <= chunk_y2; ++i) {
+			draw_layer_chunk(i->second, x, y, w, h);
+		}
+	}
 
+	glEnable(GL_BLEND);
+	draw_stats::blend_change();
+	for(int chunk_x = chunk_x1; chunk_x <= chunk_x2; ++chunk_x) {
+		layer_chunk_map::iterator i = chunks.lower_bound(tile_pos(chunk_x, chunk_y1));
+		for(; i != chunks.end() && i->first.first == chunk_x && i->first.second <= chunk_y2; ++i) {
+			draw_layer_chunk_translucent(i->second);
+		}
+	}
+
+	glPopMatrix();
+
+	glColor4f(1.0, 1.0, 1.0, 1.0);
+}
+
+void level::draw_layer_chunk(layer_blit_info& blit_info, int x, int y, int w, int h) const
+{
 	const rect tile_positions(x/32 - (x < 0 ? 1 : 0), y/32 - (y < 0 ? 1 : 0),
 	                          (x + w)/32 - (x + w < 0 ? 1 : 0),
 							  (y + h)/32 - (y + h < 0 ? 1 : 0));
@@ -1456,62 +1663,62 @@ void level::draw_layer(int layer, int x, int y, int w, int h) const
 		}
 	}
 
-	glDisable(GL_BLEND);
-	draw_layer_solid(layer, x, y, w, h);
-	if(blit_info.texture_id != GLuint(-1)) {
-		graphics::texture::set_current_texture(blit_info.texture_id);
-	}
+	draw_layer_solid(blit_info, x, y, w, h);
 
 	if(!opaque_indexes.empty()) {
+		if(blit_info.texture_id != GLuint(-1)) {
+			graphics::texture::set_current_texture(blit_info.texture_id);
+		}
+
 		glVertexPointer(2, GL_SHORT, sizeof(tile_corner), &blit_info.blit_vertexes[0].vertex[0]);
 		glTexCoordPointer(2, GL_FLOAT, sizeof(tile_corner), &blit_info.blit_vertexes[0].uv[0]);
+		//each tile is six indexes into its four vertices.
+		draw_stats::draw_call(opaque_indexes.size()/6*4);
 		glDrawElements(GL_TRIANGLES, opaque_indexes.size(), TILE_INDEX_TYPE, &opaque_indexes[0]);
 	}
-	glEnable(GL_BLEND);
-
-	if(!translucent_indexes.empty()) {
-		glVertexPointer(2, GL_SHORT, sizeof(tile_corner), &blit_info.blit_vertexes[0].vertex[0]);
-		glTexCoordPointer(2, GL_FLOAT, sizeof(tile_corner), &blit_info.blit_vertexes[0].uv[0]);
+}
 
-		if(blit_info.texture_id == GLuint(-1)) {
-			//we have multiple different texture ID's in this layer. This means
-			//we will draw each tile seperately.
-			for(int n = 0; n < translucent_indexes.size(); n += 6) {
-				graphics::texture::set_current_texture(blit_info.vertex_texture_ids[translucent_indexes[n]/4]);
-				glDrawElements(GL_TRIANGLES, 6, TILE_INDEX_TYPE, &translucent_indexes[n]);
-			}
-		} else {
-			//we have just one texture ID and so can draw all tiles in one call.
-			glDrawElements(GL_TRIANGLES, translucent_indexes.size(), TILE_INDEX_TYPE, &translucent_indexes[0]);
-		}
+void level::draw_layer_chunk_translucent(const layer_blit_info& blit_info) const
+{
+	const std::vector<layer_blit_info::IndexType>& translucent_indexes = blit_info.translucent_indexes;
+	if(translucent_indexes.empty()) {
+		return;
 	}
 
-	glPopMatrix();
+	glVertexPointer(2, GL_SHORT, sizeof(tile_corner), &blit_info.blit_vertexes[0].vertex[0]);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(tile_corner), &blit_info.blit_vertexes[0].uv[0]);
 
-	glColor4f(1.0, 1.0, 1.0, 1.0);
+	if(blit_info.texture_id == GLuint(-1)) {
+		//we have multiple different texture ID's in this chunk. This means
+		//we will draw each tile seperately.
+		for(int n = 0; n < translucent_indexes.size(); n += 6) {
+			graphics::texture::set_current_texture(blit_info.vertex_texture_ids[translucent_indexes[n]/4]);
+			draw_stats::draw_call(4);
+			glDrawElements(GL_TRIANGLES, 6, TILE_INDEX_TYPE, &translucent_indexes[n]);
+		}
+	} else {
+		//we have just one texture ID and so can draw all tiles in one call.
+		graphics::texture::set_current_texture(blit_info.texture_id);
+		draw_stats::draw_call(translucent_indexes.size()/6*4);
+		glDrawElements(GL_TRIANGLES, translucent_indexes.size(), TILE_INDEX_TYPE, &translucent_indexes[0]);
+	}
 }
 
-void level::draw_layer_solid(int layer, int x, int y, int w, int h) const
+void level::draw_layer_solid(const layer_blit_info& blit_info, int x, int y, int w, int h) const
 {
-	solid_color_rect arg;
-	arg.layer = layer;
-	typedef std::vector<solid_color_rect>::const_iterator SolidItor;
-	std::pair<SolidItor, SolidItor> solid = std::equal_range(solid_color_rects_.begin(), solid_color_rects_.end(), arg, solid_color_rect_cmp());
-	if(solid.first != solid.second) {
+	if(!blit_info.solid_rects.empty()) {
 		const rect viewport(x, y, w, h);
 
 		glDisable(GL_TEXTURE_2D);
 		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-		while(solid.first != solid.second) {
-			rect area = solid.first->area;
-			if(!rects_intersect(area, viewport)) {
-				++solid.first;
+		foreach(const solid_color_rect& r, blit_info.solid_rects) {
+			if(!rects_intersect(r.area, viewport)) {
 				continue;
 			}
 
-			area = intersection_rect(area, viewport);
+			const rect area = intersection_rect(r.area, viewport);
 
-			solid.first->color.set_as_current_color();
+			r.color.set_as_current_color();
 			GLshort varray[] = {
 			  area.x(), area.y(),
 			  area.x() + area.w(), area.y(),
@@ -1520,9 +1727,8 @@ void level::draw_layer_solid(int layer, int x, int y, int w, int h) const
 			};
 
 			glVertexPointer(2, GL_SHORT, 0, varray);
+			draw_stats::draw_call(4);
 			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-
-			++solid.first;
 		}
 		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 		glEnable(GL_TEXTURE_2D);
@@ -1534,121 +1740,148 @@ void level::prepare_tiles_for_drawing()
 {
 	level_object::set_current_palette(palettes_used_);
 
-	solid_color_rects_.clear();
 	blit_cache_.clear();
 
-	for(int n = 0; n != tiles_.size(); ++n) {
-		if(!is_arcade_level() && tiles_[n].object->solid_color()) {
-			continue;
-		}
+	std::set<tile_pos> chunks;
+	foreach(const level_tile& t, tiles_) {
+		chunks.insert(tile_pos(tile_chunk_coord(t.x), tile_chunk_coord(t.y)));
+	}
 
-		if(!editor_ && (tiles_[n].x <= boundaries().x() - TileSize || tiles_[n].y <= boundaries().y() - TileSize || tiles_[n].x >= boundaries().x2() || tiles_[n].y >= boundaries().y2())) {
-			continue;
-		}
+	foreach(const tile_pos& chunk, chunks) {
+		prepare_tile_chunk(chunk);
+	}
+}
 
-		layer_blit_info& blit_info = blit_cache_[tiles_[n].zorder];
-		if(blit_info.xbase == -1) {
-			blit_info.texture_id = tiles_[n].object->texture().get_id();
-			blit_info.xbase = tiles_[n].x;
-			blit_info.ybase = tiles_[n].y;
-		}
+void level::prepare_tiles_for_drawing(const rect& area)
+{
+	level_object::set_current_palette(palettes_used_);
 
-		if(tiles_[n].x < blit_info.xbase) {
-			blit_info.xbase = tiles_[n].x;
+	for(int y = tile_chunk_coord(area.y()); y <= tile_chunk_coord(area.y2() - 1); ++y) {
+		for(int x = tile_chunk_coord(area.x()); x <= tile_chunk_coord(area.x2() - 1); ++x) {
+			prepare_tile_chunk(tile_pos(x, y));
 		}
+	}
+}
 
-		if(tiles_[n].y < blit_info.ybase) {
-			blit_info.ybase = tiles_[n].y;
+void level::prepare_tile_chunk(const tile_pos& chunk)
+{
+	const rect area = tile_chunk_area(chunk);
+
+	std::vector<level_tile*> tiles;
+	foreach(int layer, layers_) {
+		std::map<int, layer_chunk_map>::iterator layer_itor = blit_cache_.find(layer);
+		if(layer_itor != blit_cache_.end()) {
+			layer_itor->second.erase(chunk);
 		}
-	}
 
-	for(int n = 0; n != tiles_.size(); ++n) {
-		if(!editor_ && (tiles_[n].x <= boundaries().x() - TileSize || tiles_[n].y <= boundaries().y() - TileSize || tiles_[n].x >= boundaries().x2() || tiles_[n].y >= boundaries().y2())) {
+		tiles.clear();
+		find_tiles_in_rect(tiles_, layer, area, tiles);
+		if(tiles.empty()) {
 			continue;
 		}
 
-		if(!is_arcade_level() && tiles_[n].object->solid_color()) {
-			tiles_[n].draw_disabled = true;
-			if(!solid_color_rects_.empty()) {
-				solid_color_rect& r = solid_color_rects_.back();
-				if(r.layer == tiles_[n].zorder && r.color.rgba() == tiles_[n].object->solid_color()->rgba() && r.area.y() == tiles_[n].y && r.area.x() + r.area.w() == tiles_[n].x) {
-					r.area = rect(r.area.x(), r.area.y(), r.area.w() + TileSize, r.area.h());
-					continue;
+		layer_chunk_map& chunks = blit_cache_[layer];
+		layer_blit_info& blit_info = chunks[chunk];
+		blit_info.xbase = area.x();
+		blit_info.ybase = area.y();
+
+		foreach(level_tile* t, tiles) {
+			if(!editor_ && (t->x <= boundaries().x() - TileSize || t->y <= boundaries().y() - TileSize || t->x >= boundaries().x2() || t->y >= boundaries().y2())) {
+				continue;
+			}
+
+			if(!is_arcade_level() && t->object->solid_color()) {
+				t->draw_disabled = true;
+				if(!blit_info.solid_rects.empty()) {
+					solid_color_rect& r = blit_info.solid_rects.back();
+					if(r.color.rgba() == t->object->solid_color()->rgba() && r.area.y() == t->y && r.area.x() + r.area.w() == t->x) {
+						r.area = rect(r.area.x(), r.area.y(), r.area.w() + TileSize, r.area.h());
+						continue;
+					}
 				}
+
+				solid_color_rect r;
+				r.color = *t->object->solid_color();
+				r.area = rect(t->x, t->y, TileSize, TileSize);
+				r.layer = t->zorder;
+				blit_info.solid_rects.push_back(r);
+				continue;
 			}
-				
-			solid_color_rect r;
-			r.color = *tiles_[n].object->solid_color();
-			r.area = rect(tiles_[n].x, tiles_[n].y, TileSize, TileSize);
-			r.layer = tiles_[n].zorder;
-			solid_color_rects_.push_back(r);
-			continue;
-		}
 
-		layer_blit_info& blit_info = blit_cache_[tiles_[n].zorder];
+			t->draw_disabled = false;
 
-		tiles_[n].draw_disabled = false;
+			blit_info.blit_vertexes.resize(blit_info.blit_vertexes.size() + 4);
+			const int npoints = level_object::calculate_tile_corners(&blit_info.blit_vertexes[blit_info.blit_vertexes.size() - 4], *t);
+			if(npoints == 0) {
+				blit_info.blit_vertexes.resize(blit_info.blit_vertexes.size() - 4);
+			} else {
+				//the chunk binds the id itself, so the texture mustn't
+				//be unloaded from under it.
+				const GLuint texture_id = t->object->texture().get_id();
+				t->object->texture().keep_resident();
+				if(blit_info.vertex_texture_ids.empty()) {
+					blit_info.texture_id = texture_id;
+				} else if(texture_id != blit_info.texture_id) {
+					blit_info.texture_id = GLuint(-1);
+				}
 
-		blit_info.blit_vertexes.resize(blit_info.blit_vertexes.size() + 4);
-		const int npoints = level_object::calculate_tile_corners(&blit_info.blit_vertexes[blit_info.blit_vertexes.size() - 4], tiles_[n]);
-		if(npoints == 0) {
-			blit_info.blit_vertexes.resize(blit_info.blit_vertexes.size() - 4);
-		} else {
-			blit_info.vertex_texture_ids.push_back(tiles_[n].object->texture().get_id());
-			if(blit_info.vertex_texture_ids.back() != blit_info.texture_id) {
-				blit_info.texture_id = GLuint(-1);
-			}
+				blit_info.vertex_texture_ids.push_back(texture_id);
 
-			const int xtile = (tiles_[n].x - blit_info.xbase)/TileSize;
-			const int ytile = (tiles_[n].y - blit_info.ybase)/TileSize;
-			ASSERT_GE(xtile, 0);
-			ASSERT_GE(ytile, 0);
-			if(blit_info.indexes.size() <= ytile) {
-				blit_info.indexes.resize(ytile+1);
-			}
+				const int xtile = (t->x - blit_info.xbase)/TileSize;
+				const int ytile = (t->y - blit_info.ybase)/TileSize;
+				ASSERT_GE(xtile, 0);
+				ASSERT_GE(ytile, 0);
+				if(blit_info.indexes.size() <= ytile) {
+					blit_info.indexes.resize(ytile+1);
+				}
 
-			if(blit_info.indexes[ytile].size() <= xtile) {
-				blit_info.indexes[ytile].resize(xtile+1, TILE_INDEX_TYPE_MAX);
+				if(blit_info.indexes[ytile].size() <= xtile) {
+					blit_info.indexes[ytile].resize(xtile+1, TILE_INDEX_TYPE_MAX);
+				}
+
+				blit_info.indexes[ytile][xtile] = (blit_info.blit_vertexes.size() - 4) * (t->object->is_opaque() ? 1 : -1);
 			}
+		}
 
-			blit_info.indexes[ytile][xtile] = (blit_info.blit_vertexes.size() - 4) * (tiles_[n].object->is_opaque() ? 1 : -1);
+		std::vector<solid_color_rect>& solid_rects = blit_info.solid_rects;
+		for(int n = 1; n < solid_rects.size(); ++n) {
+			solid_color_rect& a = solid_rects[n-1];
+			solid_color_rect& b = solid_rects[n];
+			if(a.area.x() == b.area.x() && a.area.x2() == b.area.x2() && a.area.y() + a.area.h() == b.area.y()) {
+				a.area = rect(a.area.x(), a.area.y(), a.area.w(), a.area.h() + b.area.h());
+				b.area = rect(0,0,0,0);
+			}
 		}
-	}
 
-	for(int n = 1; n < solid_color_rects_.size(); ++n) {
-		solid_color_rect& a = solid_color_rects_[n-1];
-		solid_color_rect& b = solid_color_rects_[n];
-		if(a.area.x() == b.area.x() && a.area.x2() == b.area.x2() && a.area.y() + a.area.h() == b.area.y() && a.layer == b.layer) {
-			a.area = rect(a.area.x(), a.area.y(), a.area.w(), a.area.h() + b.area.h());
-			b.area = rect(0,0,0,0);
+		solid_rects.erase(std::remove_if(solid_rects.begin(), solid_rects.end(), solid_color_rect_empty()), solid_rects.end());
+
+		if(blit_info.blit_vertexes.empty() && solid_rects.empty()) {
+			chunks.erase(chunk);
 		}
 	}
 
-	solid_color_rects_.erase(std::remove_if(solid_color_rects_.begin(), solid_color_rects_.end(), solid_color_rect_empty()), solid_color_rects_.end());
-
 	//remove tiles that are obscured by other tiles.
 	std::set<std::pair<int, int> > opaque;
-	for(int n = tiles_.size(); n > 0; --n) {
-		level_tile& t = tiles_[n-1];
-		const tile_map& map = tile_maps_[t.zorder];
-		if(map.x_speed() != 100 || map.y_speed() != 100) {
-			while(n != 0 && tiles_[n-1].zorder == t.zorder) {
-				--n;
-			}
-
+	for(std::set<int>::const_reverse_iterator layer = layers_.rbegin(); layer != layers_.rend(); ++layer) {
+		std::map<int, tile_map>::const_iterator map = tile_maps_.find(*layer);
+		if(map != tile_maps_.end() && (map->second.x_speed() != 100 || map->second.y_speed() != 100)) {
 			continue;
 		}
 
-		if(!t.draw_disabled && opaque.count(std::pair<int,int>(t.x, t.y))) {
-			t.draw_disabled = true;
-			continue;
-		}
+		tiles.clear();
+		find_tiles_in_rect(tiles_, *layer, area, tiles);
+		for(std::vector<level_tile*>::reverse_iterator i = tiles.rbegin(); i != tiles.rend(); ++i) {
+			level_tile& t = **i;
+			if(!t.draw_disabled && opaque.count(std::pair<int,int>(t.x, t.y))) {
+				t.draw_disabled = true;
+				continue;
+			}
 
-		if(t.object->is_opaque()) {
-			opaque.insert(std::pair<int,int>(t.x, t.y));
+			if(t.object->is_opaque()) {
+				opaque.insert(std::pair<int,int>(t.x, t.y));
+			}
 		}
 	}
-
 }
 
 namespace {
@@ -1682,9 +1915,17 @@ void level::draw_status() const
 }
 
 namespace {
-void draw_entity(const entity& obj, int x, int y, bool editor) {
+void draw_entity(const entity& obj, int x, int y, bool editor, graphics::sprite_batch& batch) {
 	const std::pair<int,int>* scroll_speed = obj.parallax_scale_millis();
 
+	if(!editor && !scroll_speed && obj.draw_into_sprite_batch(batch)) {
+		return;
+	}
+
+	//this entity is drawn directly, so anything batched before it must
+	//be drawn first.
+	batch.flush();
+
 	if(scroll_speed) {
 		glPushMatrix();
 		const int scrollx = scroll_speed->first;
@@ -1724,7 +1965,7 @@ void level::draw(int x, int y, int w, int h) const
 	w += widest_tile_;
 	h += highest_tile_;
 
-	const std::vector<entity_ptr>* chars_ptr = &active_chars_;
+	const std::vector<entity_ptr>* chars_ptr = controls::num_players() > 1 ? &visible_chars_ : &active_chars_;
 	std::vector<entity_ptr> editor_chars_buf;
 	if(editor_) {
 		//in the editor we draw all chars, not just active chars. We also
@@ -1739,6 +1980,10 @@ void level::draw(int x, int y, int w, int h) const
 
 	std::vector<entity_ptr>::const_iterator entity_itor = chars.begin();
 
+	//entities which are simple sprites are collected into batches, which
+	//are drawn whenever something else needs to be drawn over them.
+	static graphics::sprite_batch entity_batch;
+
 	
 	/*std::cerr << "SUMMARY " << cycle_ << ": ";
 	foreach(const entity_ptr& e, chars_) {
@@ -1758,26 +2003,39 @@ void level::draw(int x, int y, int w, int h) const
 
 	for(; layer != layers_.end(); ++layer) {
 		if(!water_drawn && *layer > water_zorder) {
+			draw_stats::subsystem_scope stats_scope(draw_stats::SUBSYSTEM_WATER);
 			water_->draw(x, y, w, h);
 			water_drawn = true;
 		}
 
-		while(entity_itor != chars.end() && (*entity_itor)->zorder() <= *layer) {
-			draw_entity(**entity_itor, x, y, editor_);
-			++entity_itor;
+		if(entity_itor != chars.end() && (*entity_itor)->zorder() <= *layer) {
+			draw_stats::subsystem_scope stats_scope(draw_stats::SUBSYSTEM_OBJECTS);
+			while(entity_itor != chars.end() && (*entity_itor)->zorder() <= *layer) {
+				draw_entity(**entity_itor, x, y, editor_, entity_batch);
+				++entity_itor;
+			}
+
+			entity_batch.flush();
 		}
 
+		draw_stats::subsystem_scope stats_scope(draw_stats::SUBSYSTEM_TILES);
 		draw_layer(*layer, x, y, w, h);
 	}
 
 	if(!water_drawn) {
+		draw_stats::subsystem_scope stats_scope(draw_stats::SUBSYSTEM_WATER);
 		water_->draw(x, y, w, h);
 			water_drawn = true;
 	}
 
-	while(entity_itor != chars.end()) {
-		draw_entity(**entity_itor, x, y, editor_);
-		++entity_itor;
+	{
+		draw_stats::subsystem_scope stats_scope(draw_stats::SUBSYSTEM_OBJECTS);
+		while(entity_itor != chars.end()) {
+			draw_entity(**entity_itor, x, y, editor_, entity_batch);
+			++entity_itor;
+		}
+
+		entity_batch.flush();
 	}
 
 	if(editor_) {
@@ -1786,17 +2044,20 @@ void level::draw(int x, int y, int w, int h) const
 				//if the entity is colliding with the level, then draw
 				//it in red to mark as 'bad'.
 				glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+				draw_stats::blend_change();
 				const GLfloat alpha = 0.5 + sin(draw_count/5.0)*0.5;
 				glColor4f(1.0, 0.0, 0.0, alpha);
 				obj->draw();
 				glColor4f(1.0, 1.0, 1.0, 1.0);
 				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+				draw_stats::blend_change();
 			}
 		}
 	}
 
 	if(editor_highlight_ || !editor_selection_.empty()) {
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+		draw_stats::blend_change();
 		const GLfloat alpha = 0.5 + sin(draw_count/5.0)*0.5;
 		glColor4f(1.0, 1.0, 1.0, alpha);
 
@@ -1819,57 +2080,129 @@ void level::draw(int x, int y, int w, int h) const
 
 		glColor4f(1.0, 1.0, 1.0, 1.0);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		draw_stats::blend_change();
 	}
 
 	draw_debug_solid(x, y, w, h);
 
 	if(background_) {
+		draw_stats::subsystem_scope stats_scope(draw_stats::SUBSYSTEM_BACKGROUND);
 		background_->draw_foreground(start_x, start_y, 0.0, cycle());
 	}
 
+	draw_stats::subsystem_scope stats_scope(draw_stats::SUBSYSTEM_LIGHTING);
 	calculate_lighting(start_x, start_y, start_w, start_h);
 }
 
+namespace {
+//the texture the map of the light in dark levels is uploaded to. It only
+//grows, to the next power of two large enough for the map.
+GLuint light_map_texture = 0;
+int light_map_texture_width = 0, light_map_texture_height = 0;
+
+int next_power_of_two(int n)
+{
+	int res = 1;
+	while(res < n) {
+		res *= 2;
+	}
+
+	return res;
+}
+
+void upload_light_map(const light_map& m)
+{
+	if(light_map_texture == 0) {
+		glGenTextures(1, &light_map_texture);
+		graphics::texture::set_current_texture(light_map_texture);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	graphics::texture::set_current_texture(light_map_texture);
+
+	if(m.width() > light_map_texture_width || m.height() > light_map_texture_height) {
+		light_map_texture_width = std::max(light_map_texture_width, next_power_of_two(m.width()));
+		light_map_texture_height = std::max(light_map_texture_height, next_power_of_two(m.height()));
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, light_map_texture_width, light_map_texture_height, 0,
+		             GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	}
+
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m.width(), m.height(),
+	                GL_RGBA, GL_UNSIGNED_BYTE, &m.pixels()[0]);
+
+	//the map rarely fills the texture, and filtering its last row and
+	//column blends them with the texels beyond, which hold nothing or an
+	//old map. Those texels are given the map's edge, so it's as if the
+	//texture was clamped at the map's edge.
+	const std::vector<unsigned char>& pixels = m.pixels();
+	const int edge_width = std::min(m.width() + 1, light_map_texture_width);
+	static std::vector<unsigned char> edge;
+	if(m.width() < light_map_texture_width) {
+		edge.resize(m.height()*4);
+		for(int y = 0; y != m.height(); ++y) {
+			std::copy(&pixels[((y+1)*m.width() - 1)*4], &pixels[(y+1)*m.width()*4], &edge[y*4]);
+		}
+
+		glTexSubImage2D(GL_TEXTURE_2D, 0, m.width(), 0, 1, m.height(),
+		                GL_RGBA, GL_UNSIGNED_BYTE, &edge[0]);
+	}
+
+	if(m.height() < light_map_texture_height) {
+		const unsigned char* last_row = &pixels[(m.height() - 1)*m.width()*4];
+		edge.assign(last_row, last_row + m.width()*4);
+		if(edge_width > m.width()) {
+			edge.insert(edge.end(), last_row + (m.width() - 1)*4, last_row + m.width()*4);
+		}
+
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, m.height(), edge_width, 1,
+		                GL_RGBA, GL_UNSIGNED_BYTE, &edge[0]);
+	}
+}
+}
+
 void level::calculate_lighting(int x, int y, int w, int h) const
 {
-	if(!dark_ || editor_ || texture_frame_buffer::unsupported()) {
+	if(!dark_ || editor_) {
 		return;
 	}
 
-	//find all the lights in the level
-	static std::vector<const light*> lights;
-	lights.clear();
+	//the map is built on the CPU, and only the parts of it near lights
+	//which have moved are built again each frame.
+	static light_map lighting;
+
+	const unsigned char color[] = { dark_color_.r(), dark_color_.g(), dark_color_.b(), dark_color_.a() };
+	lighting.begin(rect(x, y, w, h), color);
 	foreach(const entity_ptr& c, active_chars_) {
 		foreach(const light_ptr& lt, c->lights()) {
-			lights.push_back(lt.get());
+			lt->add_to_map(lighting);
 		}
 	}
 
-	{
-		glBlendFunc(GL_ONE, GL_ONE);
-		rect screen_area(x, y, w, h);
-		const texture_frame_buffer::render_scope scope;
+	lighting.end();
 
-		glClearColor(dark_color_.r()/255.0, dark_color_.g()/255.0, dark_color_.b()/255.0, dark_color_.a()/255.0);
-		glClear(GL_COLOR_BUFFER_BIT);
-		const unsigned char color[] = { dark_color_.r(), dark_color_.g(), dark_color_.b(), dark_color_.a() };
-		foreach(const light* lt, lights) {
-			lt->draw(screen_area, color);
-		}
-	}
+	upload_light_map(lighting);
 
-	//now blit the light buffer onto the screen
-	texture_frame_buffer::set_as_current_texture();
+	//now blit the light map onto the screen, scaled up and smoothed.
+	const int x1 = lighting.origin().x;
+	const int y1 = lighting.origin().y;
+	const int x2 = x1 + lighting.width()*light_map::CellSize;
+	const int y2 = y1 + lighting.height()*light_map::CellSize;
+	const GLfloat tx = GLfloat(lighting.width())/light_map_texture_width;
+	const GLfloat ty = GLfloat(lighting.height())/light_map_texture_height;
 
-	const GLfloat tcarray[] = { 0, 0, 0, 1, 1, 0, 1, 1 };
-	const GLfloat tcarray_rotated[] = { 0, 1, 1, 1, 0, 0, 1, 0 };
-	GLfloat varray[] = { x, y + h, x, y, x + w, y + h, x + w, y };
+	const GLfloat tcarray[] = { 0, ty, 0, 0, tx, ty, tx, 0 };
+	GLfloat varray[] = { x1, y2, x1, y1, x2, y2, x2, y1 };
 	glVertexPointer(2, GL_FLOAT, 0, varray);
-	glTexCoordPointer(2, GL_FLOAT, 0,
-	               preferences::screen_rotated() ? tcarray_rotated : tcarray);
+	glTexCoordPointer(2, GL_FLOAT, 0, tcarray);
 	glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+	draw_stats::blend_change();
+	draw_stats::draw_call(4);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	draw_stats::blend_change();
 }
 
 void level::draw_debug_solid(int x, int y, int w, int h) const
@@ -1916,6 +2249,7 @@ void level::draw_debug_solid(int x, int y, int w, int h) const
 
 					glPointSize(1);
 					glVertexPointer(2, GL_SHORT, 0, &v[0]);
+					draw_stats::draw_call(v.size()/2);
 					glDrawArrays(GL_POINTS, 0, v.size()/2);
 				}
 				glEnableClientState(GL_TEXTURE_COORD_ARRAY);
@@ -1968,6 +2302,7 @@ void level::draw_background(int x, int y, int rotation) const
 			}
 		}
 
+		draw_stats::subsystem_scope stats_scope(draw_stats::SUBSYSTEM_BACKGROUND);
 		background_->draw(x, y, screen_area, opaque_areas, rotation, cycle());
 	} else {
 		glClearColor(0.0, 0.0, 0.0, 0.0);
@@ -1981,13 +2316,10 @@ void level::process()
 		gui_algorithm_->process(*this);
 	}
 
-	const int LevelPreloadFrequency = 500; //10 seconds
-	//see if we have levels to pre-load. Load one periodically.
-	if((cycle_%LevelPreloadFrequency) == 0) {
-		const int index = cycle_/LevelPreloadFrequency;
-		if(index < preloads_.size()) {
-			preload_level(preloads_[index]);
-		}
+	const int LevelPredictFrequency = 25; //half a second
+	//see which levels the player may go to next, and preload them.
+	if((cycle_%LevelPredictFrequency) == 0 && !editor_) {
+		predict_levels(predicted_levels());
 	}
 
 	controls::read_local_controls();
@@ -2003,6 +2335,52 @@ void level::process()
 	}
 }
 
+namespace {
+//levels which the player is further than this from a way into aren't
+//predicted to be needed.
+const int MaxPredictedLevelDistance = 2048;
+
+int distance_to_rect(const point& p, const rect& r)
+{
+	const int xdist = std::max(0, std::max(r.x() - p.x, p.x - r.x2()));
+	const int ydist = std::max(0, std::max(r.y() - p.y, p.y - r.y2()));
+	return std::max(xdist, ydist);
+}
+}
+
+std::vector<std::string> level::predicted_levels() const
+{
+	std::vector<std::pair<int, std::string> > candidates;
+	if(player_) {
+		const point pos = player_->midpoint();
+		foreach(const portal& p, portals_) {
+			if(!p.level_dest.empty() && p.level_dest != id()) {
+				candidates.push_back(std::pair<int, std::string>(distance_to_rect(pos, p.area), p.level_dest));
+			}
+		}
+
+		if(!previous_level().empty()) {
+			candidates.push_back(std::pair<int, std::string>(std::max(0, pos.x - boundaries().x()), previous_level()));
+		}
+
+		if(!next_level().empty()) {
+			candidates.push_back(std::pair<int, std::string>(std::max(0, boundaries().x2() - pos.x), next_level()));
+		}
+	}
+
+	//the nearest ways out of the level are the most likely to be taken.
+	std::sort(candidates.begin(), candidates.end());
+
+	std::vector<std::string> result;
+	for(int n = 0; n != candidates.size() && candidates[n].first <= MaxPredictedLevelDistance; ++n) {
+		result.push_back(candidates[n].second);
+	}
+
+	//levels the level asks to preload are the least likely.
+	result.insert(result.end(), preloads_.begin(), preloads_.end());
+	return result;
+}
+
 void level::process_draw()
 {
 	foreach(const entity_ptr& e, active_chars_) {
@@ -2014,6 +2392,22 @@ namespace {
 bool compare_entity_num_parents(const entity_ptr& a, const entity_ptr& b) {
 	return a->parent_depth() < b->parent_depth();
 }
+
+//the size of the view around each player used to decide which characters
+//are active in multiplayer games; the size of the default screen.
+const int MultiplayerViewWidth = 800;
+const int MultiplayerViewHeight = 600;
+
+template<typename Cmp>
+bool is_sorted_by(const std::vector<entity_ptr>& v, Cmp cmp) {
+	for(int n = 1; n < v.size(); ++n) {
+		if(cmp(v[n], v[n-1])) {
+			return false;
+		}
+	}
+
+	return true;
+}
 }
 
 void level::do_processing()
@@ -2029,9 +2423,10 @@ void level::do_processing()
 
 	const int ticks = SDL_GetTicks();
 	detect_user_collisions(*this);
-	active_chars_.clear();
 
 	if(!player_) {
+		active_chars_.clear();
+		visible_chars_.clear();
 		return;
 	}
 
@@ -2040,36 +2435,98 @@ void level::do_processing()
 	const int screen_top = last_draw_position().y/100;
 	const int screen_bottom = last_draw_position().y/100 + graphics::screen_height();
 
-	const rect screen_area(screen_left, screen_top, screen_right - screen_left, screen_bottom - screen_top);
+	const rect screen_area(screen_left, screen_top, screen_right - screen_left, screen_bottom - screen_top);
+
+	if(stream_sub_levels_) {
+		stream_sub_levels(screen_area);
+	}
+
+	//in multiplayer every player's game has to agree on which characters
+	//are active, so rather than the local screen, a view around each
+	//player is used. The views depend only on the players' positions,
+	//which are the same in every game.
+	std::vector<rect>& activation_areas = activation_areas_;
+	activation_areas.clear();
+	if(controls::num_players() > 1) {
+		foreach(const entity_ptr& p, players_) {
+			const point mid = p->midpoint();
+			activation_areas.push_back(rect(mid.x - MultiplayerViewWidth/2, mid.y - MultiplayerViewHeight/2, MultiplayerViewWidth, MultiplayerViewHeight));
+		}
+	} else {
+		activation_areas.push_back(screen_area);
+	}
+
+	if(activation_index_.size() != chars_.size()) {
+		//characters have been put in the level without going through the
+		//index, such as when it was copied.
+		activation_index_.rebuild(chars_);
+	}
 
-	foreach(entity_ptr& c, chars_) {
-		const bool is_active = c->is_active(screen_area);
+	//only characters near the screen, or which have to be checked every
+	//cycle, can be active.
+	std::vector<entity_ptr>& candidates = activation_buf_;
+	candidates.clear();
+	const int query = activation_index_.find_candidates(activation_areas, &candidates);
+
+	std::vector<entity_ptr> activated;
+	foreach(const entity_ptr& c, candidates) {
+		bool is_active = false;
+		foreach(const rect& area, activation_areas) {
+			if(c->is_active(area)) {
+				is_active = true;
+				break;
+			}
+		}
 
 		if(is_active) {
 			if(c->group() >= 0) {
 				assert(c->group() < groups_.size());
 				const entity_group& group = groups_[c->group()];
-				active_chars_.insert(active_chars_.end(), group.begin(), group.end());
-			} else {
-				active_chars_.push_back(c);
+				foreach(const entity_ptr& e, group) {
+					if(e->activation().selected != query) {
+						e->activation().selected = query;
+						activated.push_back(e);
+					}
+				}
+			} else if(c->activation().selected != query) {
+				c->activation().selected = query;
+				activated.push_back(c);
 			}
 		} else { //char is inactive
 			if( c->dies_on_inactive() ){
 				if(c->label().empty() == false) {
 					c->die_with_no_event();
-					chars_by_label_.erase(c->label());
 				}
-				
-				c = entity_ptr(); //can't delete it while iterating over the container, so we null it for later removal
+
+				erase_char(c);
 			}
 		}
 	}
-	
-	chars_.erase(std::remove(chars_.begin(), chars_.end(), entity_ptr()), chars_.end());
 
-	std::sort(active_chars_.begin(), active_chars_.end());
-	active_chars_.erase(std::unique(active_chars_.begin(), active_chars_.end()), active_chars_.end());
-	std::sort(active_chars_.begin(), active_chars_.end(), sort_entity_drawing_pos);
+	//characters which stay active keep their place, and newly active
+	//characters are merged in, so the drawing order only has to be fully
+	//sorted again when characters move relative to each other.
+	std::vector<entity_ptr> retained, added;
+	foreach(const entity_ptr& e, active_chars_) {
+		if(e->activation().selected == query && e->activation().active != query) {
+			e->activation().active = query;
+			retained.push_back(e);
+		}
+	}
+
+	foreach(const entity_ptr& e, activated) {
+		if(e->activation().active != query) {
+			e->activation().active = query;
+			added.push_back(e);
+		}
+	}
+
+	std::sort(added.begin(), added.end(), sort_entity_drawing_pos);
+	active_chars_.resize(retained.size() + added.size());
+	std::merge(retained.begin(), retained.end(), added.begin(), added.end(), active_chars_.begin(), sort_entity_drawing_pos);
+	if(!is_sorted_by(active_chars_, sort_entity_drawing_pos)) {
+		std::sort(active_chars_.begin(), active_chars_.end(), sort_entity_drawing_pos);
+	}
 	
 /*
 	std::cerr << "SUMMARY " << cycle_ << ": ";
@@ -2090,7 +2547,10 @@ void level::do_processing()
 	const int ActivationDistance = 700;
 
 	std::vector<entity_ptr> active_chars = active_chars_;
-	std::sort(active_chars.begin(), active_chars.end(), compare_entity_num_parents);
+	if(!is_sorted_by(active_chars, compare_entity_num_parents)) {
+		std::stable_sort(active_chars.begin(), active_chars.end(), compare_entity_num_parents);
+	}
+
 	if(time_freeze_ >= 1000) {
 		time_freeze_ -= 1000;
 		active_chars = chars_immune_from_time_freeze_;
@@ -2098,6 +2558,7 @@ void level::do_processing()
 	foreach(const entity_ptr& c, active_chars) {
 		if(!c->destroyed() || c->is_human()) {
 			c->process(*this);
+			c->activation_changed();
 		}
 
 		if(c->destroyed() && !c->is_human()) {
@@ -2109,6 +2570,12 @@ void level::do_processing()
 		}
 	}
 
+	erase_dead_chars();
+
+	if(controls::num_players() > 1) {
+		find_visible_chars(screen_area, query);
+	}
+
 	if(water_) {
 		water_->process(*this);
 	}
@@ -2116,22 +2583,94 @@ void level::do_processing()
 	solid_chars_.clear();
 }
 
+void level::find_visible_chars(const rect& screen_area, int active_query)
+{
+	std::vector<entity_ptr>& candidates = activation_buf_;
+	candidates.clear();
+	activation_index_.find_candidates(std::vector<rect>(1, screen_area), &candidates);
+
+	//characters on the screen which aren't active aren't processed, so
+	//they're drawn as they are in every player's game.
+	std::vector<entity_ptr> added;
+	foreach(const entity_ptr& c, candidates) {
+		if(c->activation().active != active_query && c->is_active(screen_area)) {
+			added.push_back(c);
+		}
+	}
+
+	std::sort(added.begin(), added.end(), sort_entity_drawing_pos);
+	visible_chars_.resize(active_chars_.size() + added.size());
+	std::merge(active_chars_.begin(), active_chars_.end(), added.begin(), added.end(), visible_chars_.begin(), sort_entity_drawing_pos);
+}
+
 void level::erase_char(entity_ptr c)
 {
+	if(chars_to_erase_.insert(c).second == false) {
+		return;
+	}
 
 	if(c->label().empty() == false) {
-		chars_by_label_.erase(c->label());
+		//the label may have been given to a new character since.
+		label_map::iterator i = chars_by_label_.find(c->label());
+		if(i != chars_by_label_.end() && i->second == c) {
+			chars_by_label_.erase(i);
+		}
 	}
-	chars_.erase(std::remove(chars_.begin(), chars_.end(), c), chars_.end());
-	if(c->group() >= 0) {
-		assert(c->group() < groups_.size());
-		entity_group& group = groups_[c->group()];
-		group.erase(std::remove(group.begin(), group.end(), c), group.end());
+
+	solid_chars_.clear();
+}
+
+bool level::is_char_erased(const entity_ptr& c) const
+{
+	return chars_to_erase_.empty() == false && chars_to_erase_.count(c);
+}
+
+void level::erase_dead_chars()
+{
+	if(chars_to_erase_.empty()) {
+		return;
+	}
+
+	foreach(const entity_ptr& c, chars_to_erase_) {
+		activation_index_.remove(c);
+		if(c->group() >= 0) {
+			assert(c->group() < groups_.size());
+			entity_group& group = groups_[c->group()];
+			entity_group::iterator i = std::find(group.begin(), group.end(), c);
+			if(i != group.end()) {
+				*i = group.back();
+				group.pop_back();
+			}
+		}
+	}
+
+	//all the dead characters are taken out in one pass, which keeps the
+	//others in order.
+	std::vector<entity_ptr>::iterator out = chars_.begin();
+	foreach(const entity_ptr& c, chars_) {
+		if(!chars_to_erase_.count(c)) {
+			*out++ = c;
+		}
 	}
 
+	chars_.erase(out, chars_.end());
+
+	chars_to_erase_.clear();
 	solid_chars_.clear();
 }
 
+void level::add_char_to_list(const entity_ptr& e)
+{
+	chars_.push_back(e);
+	activation_index_.add(e);
+}
+
+void level::remove_char_from_list(const entity_ptr& e)
+{
+	activation_index_.remove(e);
+	chars_.erase(std::remove(chars_.begin(), chars_.end(), e), chars_.end());
+}
+
 bool level::is_solid(const level_solid_map& map, const entity& e, const std::vector<point>& points, int* friction, int* traction, int* damage) const
 {
 	const tile_solid_info* info = NULL;
@@ -2392,11 +2931,11 @@ entity_ptr level::board(int x, int y) const
 
 void level::add_tile(const level_tile& t)
 {
-	std::vector<level_tile>::iterator itor = std::lower_bound(tiles_.begin(), tiles_.end(), t, level_tile_zorder_comparer());
+	std::vector<level_tile>::iterator itor = std::upper_bound(tiles_.begin(), tiles_.end(), t, level_tile_zorder_pos_comparer());
 	tiles_.insert(itor, t);
 	add_tile_solid(t);
 	layers_.insert(t.zorder);
-	prepare_tiles_for_drawing();
+	prepare_tiles_for_drawing(rect(t.x, t.y, 1, 1));
 }
 
 void level::add_tile_rect(int zorder, int x1, int y1, int x2, int y2, const std::string& str)
@@ -2667,7 +3206,7 @@ void level::remove_character(entity_ptr e)
 	if(e->label().empty() == false) {
 		chars_by_label_.erase(e->label());
 	}
-	chars_.erase(std::remove(chars_.begin(), chars_.end(), e), chars_.end());
+	remove_char_from_list(e);
 	//std::cerr << "removed char: '" << e->label() << "'\n";
 }
 
@@ -2804,7 +3343,7 @@ void level::add_multi_player(entity_ptr p)
 	last_touched_player_ = p;
 	p->get_player_info()->set_player_slot(players_.size());
 	players_.push_back(p);
-	chars_.push_back(p);
+	add_char_to_list(p);
 	if(p->label().empty() == false) {
 		chars_by_label_[p->label()] = p;
 	}
@@ -2813,7 +3352,10 @@ void level::add_multi_player(entity_ptr p)
 
 void level::add_player(entity_ptr p)
 {
-	chars_.erase(std::remove(chars_.begin(), chars_.end(), player_), chars_.end());
+	if(player_) {
+		remove_char_from_list(player_);
+	}
+
 	last_touched_player_ = player_ = p;
 	if(players_.empty()) {
 		player_->get_player_info()->set_player_slot(players_.size());
@@ -2824,7 +3366,7 @@ void level::add_player(entity_ptr p)
 	}
 
 	assert(player_);
-	chars_.push_back(p);
+	add_char_to_list(p);
 
 	//remove objects that have already been destroyed
 	const std::vector<int>& destroyed_objects = player_->get_player_info()->get_objects_destroyed(id());
@@ -2834,6 +3376,7 @@ void level::add_player(entity_ptr p)
 			if(chars_[n]->label().empty() == false) {
 				chars_by_label_.erase(chars_[n]->label());
 			}
+			activation_index_.remove(chars_[n]);
 			chars_[n] = entity_ptr();
 		}
 	}
@@ -2841,6 +3384,7 @@ void level::add_player(entity_ptr p)
 	const int difficulty = current_difficulty();
 	for(int n = 0; n != chars_.size(); ++n) {
 		if(chars_[n].get() != NULL && !chars_[n]->appears_at_difficulty(difficulty)) {
+			activation_index_.remove(chars_[n]);
 			chars_[n] = entity_ptr();
 		}
 	}
@@ -2861,7 +3405,7 @@ void level::add_character(entity_ptr p)
 	if(p->is_human()) {
 		add_player(p);
 	} else {
-		chars_.push_back(p);
+		add_char_to_list(p);
 	}
 
 	layers_.insert(p->zorder());
@@ -3083,7 +3627,9 @@ variant level::get_value(const std::string& key) const
 	} else if(key == "chars") {
 		std::vector<variant> v;
 		foreach(const entity_ptr& e, chars_) {
-			v.push_back(variant(e.get()));
+			if(!is_char_erased(e)) {
+				v.push_back(variant(e.get()));
+			}
 		}
 
 		return variant(&v);
@@ -3252,7 +3798,7 @@ water& level::get_or_create_water()
 
 entity_ptr level::get_entity_by_label(const std::string& label)
 {
-	std::map<std::string, entity_ptr>::iterator itor = chars_by_label_.find(label);
+	label_map::iterator itor = chars_by_label_.find(label);
 	if(itor != chars_by_label_.end()) {
 		return itor->second;
 	}
@@ -3262,7 +3808,7 @@ entity_ptr level::get_entity_by_label(const std::string& label)
 
 const_entity_ptr level::get_entity_by_label(const std::string& label) const
 {
-	std::map<std::string, entity_ptr>::const_iterator itor = chars_by_label_.find(label);
+	label_map::const_iterator itor = chars_by_label_.find(label);
 	if(itor != chars_by_label_.end()) {
 		return itor->second;
 	}
@@ -3272,16 +3818,19 @@ const_entity_ptr level::get_entity_by_label(const std::string& label) const
 
 void level::get_all_labels(std::vector<std::string>& labels) const
 {
-	for(std::map<std::string, entity_ptr>::const_iterator i = chars_by_label_.begin(); i != chars_by_label_.end(); ++i) {
+	const int start = labels.size();
+	for(label_map::const_iterator i = chars_by_label_.begin(); i != chars_by_label_.end(); ++i) {
 		labels.push_back(i->first);
 	}
+
+	std::sort(labels.begin() + start, labels.end());
 }
 
 const std::vector<entity_ptr>& level::get_solid_chars() const
 {
 	if(solid_chars_.empty()) {
 		foreach(const entity_ptr& e, chars_) {
-			if(e->solid() || e->platform()) {
+			if((e->solid() || e->platform()) && !is_char_erased(e)) {
 				solid_chars_.push_back(e);
 			}
 		}
@@ -3390,6 +3939,8 @@ void level::restore_from_backup(backup_snapshot& snapshot)
 	rng::set_seed(snapshot.rng_seed);
 	cycle_ = snapshot.cycle;
 	chars_ = snapshot.chars;
+	activation_index_.rebuild(chars_);
+	chars_to_erase_.clear();
 	players_ = snapshot.players;
 	player_ = snapshot.player;
 	last_touched_player_ = snapshot.last_touched_player;
@@ -3465,6 +4016,29 @@ bool entity_in_current_level(const entity* e)
 	return std::find(lvl.get_chars().begin(), lvl.get_chars().end(), e) != lvl.get_chars().end();
 }
 
+namespace {
+//how near to the screen, in pixels, a streamed sub-level has to be to be
+//loaded in the background, and to be made active. Sub-levels are made
+//inactive, and unloaded, only when they're further away than they were
+//when they came in, so one near the edge isn't loaded over and over.
+const int SubLevelActivateDistance = 512;
+const int SubLevelDeactivateDistance = 1024;
+const int SubLevelPreloadDistance = 1536;
+const int SubLevelUnloadDistance = 2048;
+
+int distance_between_rects(const rect& a, const rect& b)
+{
+	const int xdist = std::max(0, std::max(a.x() - b.x2(), b.x() - a.x2()));
+	const int ydist = std::max(0, std::max(a.y() - b.y2(), b.y() - a.y2()));
+	return std::max(xdist, ydist);
+}
+
+rect offset_rect(const rect& r, int xoffset, int yoffset)
+{
+	return rect(r.x() + xoffset, r.y() + yoffset, r.w(), r.h());
+}
+}
+
 void level::add_sub_level(const std::string& lvl, int xoffset, int yoffset, bool add_objects)
 {
 
@@ -3475,16 +4049,144 @@ void level::add_sub_level(const std::string& lvl, int xoffset, int yoffset, bool
 		remove_sub_level(lvl);
 	}
 
+	if(itor->second.active) {
+		//the sub-level is being moved, so it's taken out of the solid map
+		//where it was, and merged back in where it's moved to.
+		remove_sub_level_solid(itor->second);
+	}
+
 	const int xdiff = xoffset - itor->second.xoffset;
 	const int ydiff = yoffset - itor->second.yoffset;
 
 	itor->second.xoffset = xoffset - itor->second.xbase;
 	itor->second.yoffset = yoffset - itor->second.ybase;
+	itor->second.placed = true;
+
+	if(itor->second.lvl) {
+		itor->second.lvl->offset_solid_rects(xdiff, ydiff);
+	}
+
+	if(itor->second.streamed && !itor->second.active) {
+		//a sub-level placed far from the screen is made active once the
+		//screen nears it.
+		const rect screen_area(last_draw_position().x/100, last_draw_position().y/100, graphics::screen_width(), graphics::screen_height());
+		if(distance_between_rects(sub_level_area(lvl, itor->second, true), screen_area) > SubLevelActivateDistance) {
+			return;
+		}
+
+		load_sub_level(lvl, itor->second, true);
+	}
 
 	std::cerr << "ADDING SUB LEVEL: " << lvl << "(" << itor->second.lvl->boundaries() << ") " << itor->second.xbase << ", " << itor->second.ybase << " -> " << itor->second.xoffset << ", " << itor->second.yoffset << "\n";
 
-	itor->second.active = true;
-	level& sub = *itor->second.lvl;
+	activate_sub_level(itor->second, add_objects);
+}
+
+void level::remove_sub_level(const std::string& lvl)
+{
+	const std::map<std::string, sub_level_data>::iterator itor = sub_levels_.find(lvl);
+	ASSERT_LOG(itor != sub_levels_.end(), "SUB LEVEL NOT FOUND: " << lvl);
+
+	if(itor->second.active) {
+		deactivate_sub_level(itor->second, false);
+	}
+
+	itor->second.placed = false;
+}
+
+void level::stream_sub_levels(const rect& screen_area)
+{
+	for(std::map<std::string, sub_level_data>::iterator i = sub_levels_.begin(); i != sub_levels_.end(); ++i) {
+		sub_level_data& data = i->second;
+		if(!data.streamed) {
+			continue;
+		}
+
+		int distance = INT_MAX;
+		if(data.placed) {
+			const rect area = sub_level_area(i->first, data, false);
+			if(area.w() == 0) {
+				//its WML is still being read.
+				continue;
+			}
+
+			distance = distance_between_rects(area, screen_area);
+		}
+
+		if(data.active) {
+			if(distance > SubLevelDeactivateDistance) {
+				//its objects are made again when it's next activated, so
+				//none of them may be left behind.
+				deactivate_sub_level(data, true);
+			}
+		} else if(distance <= SubLevelActivateDistance) {
+			//the sub-level is about to come into view, so if it's still
+			//loading in the background, wait for it.
+			load_sub_level(i->first, data, true);
+			activate_sub_level(data, true);
+		} else if(distance <= SubLevelPreloadDistance) {
+			load_sub_level(i->first, data, false);
+		}
+
+		if(!data.active && data.lvl && distance > SubLevelUnloadDistance) {
+			data.lvl.reset();
+		}
+	}
+}
+
+rect level::sub_level_area(const std::string& name, sub_level_data& data, bool wait)
+{
+	if(data.bounds.w() == 0) {
+		wml::const_node_ptr node = wait ? load_level_wml(name + ".cfg") : load_level_wml_nowait(name + ".cfg");
+		if(!node) {
+			return rect();
+		}
+
+		data.bounds = rect(node->attr("dimensions"));
+	}
+
+	return offset_rect(data.bounds, data.xoffset, data.yoffset);
+}
+
+bool level::load_sub_level(const std::string& name, sub_level_data& data, bool wait)
+{
+	if(data.lvl) {
+		return true;
+	}
+
+	level* lvl = take_preloaded_level(name + ".cfg", wait);
+	if(!lvl) {
+		preload_level(name + ".cfg");
+		return false;
+	}
+
+	data.lvl.reset(lvl);
+	data.bounds = lvl->boundaries();
+	foreach(int layer, lvl->layers_) {
+		layers_.insert(layer);
+	}
+
+	//the solid rects of the sub-level are drawn where it's placed.
+	lvl->offset_solid_rects(data.xoffset, data.yoffset);
+	return true;
+}
+
+void level::activate_sub_level(sub_level_data& data, bool add_objects)
+{
+	bool any_active = false;
+	for(std::map<std::string, sub_level_data>::const_iterator i = sub_levels_.begin(); i != sub_levels_.end(); ++i) {
+		any_active = any_active || i->second.active;
+	}
+
+	if(!any_active) {
+		//once a sub-level is added, the solid map is made only of the
+		//active sub-levels.
+		solid_.clear();
+		standable_.clear();
+	}
+
+	data.active = true;
+	level& sub = *data.lvl;
 
 	if(add_objects) {
 		const int difficulty = current_difficulty();
@@ -3498,57 +4200,72 @@ void level::add_sub_level(const std::string& lvl, int xoffset, int yoffset, bool
 				continue;
 			}
 
-			relocate_object(c, c->x() + itor->second.xoffset, c->y() + itor->second.yoffset);
+			relocate_object(c, c->x() + data.xoffset, c->y() + data.yoffset);
 			if(c->appears_at_difficulty(difficulty)) {
 				add_character(c);
 				c->handle_event(OBJECT_EVENT_START_LEVEL);
 
-				itor->second.objects.push_back(c);
+				data.objects.push_back(c);
 			}
 		}
 	}
 
-	foreach(solid_color_rect& r, sub.solid_color_rects_) {
-		r.area = rect(r.area.x() + xdiff, r.area.y() + ydiff, r.area.w(), r.area.h());
-	}
-
-	build_solid_data_from_sub_levels();
+	merge_sub_level_solid(data);
 }
 
-void level::remove_sub_level(const std::string& lvl)
+void level::deactivate_sub_level(sub_level_data& data, bool remove_active_objects)
 {
-	const std::map<std::string, sub_level_data>::iterator itor = sub_levels_.find(lvl);
-	ASSERT_LOG(itor != sub_levels_.end(), "SUB LEVEL NOT FOUND: " << lvl);
-
-	if(itor->second.active) {
-		foreach(entity_ptr& e, itor->second.objects) {
-			if(std::find(active_chars_.begin(), active_chars_.end(), e) == active_chars_.end()) {
-				remove_character(e);
-			}
+	foreach(entity_ptr& e, data.objects) {
+		if(remove_active_objects || std::find(active_chars_.begin(), active_chars_.end(), e) == active_chars_.end()) {
+			remove_character(e);
 		}
-
-		itor->second.objects.clear();
 	}
 
-	itor->second.active = false;
+	data.objects.clear();
+
+	remove_sub_level_solid(data);
+	data.active = false;
 }
 
-void level::build_solid_data_from_sub_levels()
+void level::merge_sub_level_solid(const sub_level_data& data)
 {
-	solid_ = solid_base_;
-	standable_ = standable_base_;
-	solid_.clear();
-	standable_.clear();
+	const int xoffset = data.xoffset/TileSize;
+	const int yoffset = data.yoffset/TileSize;
+	solid_.merge(data.lvl->solid_, xoffset, yoffset);
+	standable_.merge(data.lvl->standable_, xoffset, yoffset);
+}
+
+void level::remove_sub_level_solid(const sub_level_data& data)
+{
+	//clear the area the sub-level covers, then merge back in what other
+	//active sub-levels have in the same area.
+	const int xoffset = data.xoffset/TileSize;
+	const int yoffset = data.yoffset/TileSize;
+	const rect solid_area = offset_rect(data.lvl->solid_.bounds(), xoffset, yoffset);
+	const rect standable_area = offset_rect(data.lvl->standable_.bounds(), xoffset, yoffset);
+	solid_.erase_area(solid_area);
+	standable_.erase_area(standable_area);
 
 	for(std::map<std::string, sub_level_data>::const_iterator i = sub_levels_.begin(); i != sub_levels_.end(); ++i) {
-		if(!i->second.active) {
+		if(!i->second.active || &i->second == &data) {
 			continue;
 		}
 
-		const int xoffset = i->second.xoffset/TileSize;
-		const int yoffset = i->second.yoffset/TileSize;
-		solid_.merge(i->second.lvl->solid_, xoffset, yoffset);
-		standable_.merge(i->second.lvl->standable_, xoffset, yoffset);
+		const int x = i->second.xoffset/TileSize;
+		const int y = i->second.yoffset/TileSize;
+		solid_.merge_area(i->second.lvl->solid_, x, y, solid_area);
+		standable_.merge_area(i->second.lvl->standable_, x, y, standable_area);
+	}
+}
+
+void level::offset_solid_rects(int xdiff, int ydiff)
+{
+	for(std::map<int, layer_chunk_map>::iterator i = blit_cache_.begin(); i != blit_cache_.end(); ++i) {
+		for(layer_chunk_map::iterator j = i->second.begin(); j != i->second.end(); ++j) {
+			foreach(solid_color_rect& r, j->second.solid_rects) {
+				r.area = offset_rect(r.area, xdiff, ydiff);
+			}
+		}
 	}
 }
 
@@ -3569,6 +4286,13 @@ void level::adjust_level_offset(int xoffset, int yoffset)
 	    i != sub_levels_.end(); ++i) {
 		if(i->second.active) {
 			add_sub_level(i->first, i->second.xoffset + xoffset + i->second.xbase, i->second.yoffset + yoffset + i->second.ybase, false);
+		} else if(i->second.placed) {
+			//sub-levels waiting to be streamed in are moved too.
+			i->second.xoffset += xoffset;
+			i->second.yoffset += yoffset;
+			if(i->second.lvl) {
+				i->second.lvl->offset_solid_rects(xoffset, yoffset);
+			}
 		}
 	}
 
@@ -3646,6 +4370,40 @@ int level::current_difficulty() const
 	return p->difficulty();
 }
 
+UNIT_TEST(find_tiles_in_rect)
+{
+	std::vector<level_tile> tiles;
+	for(int zorder = 0; zorder != 2; ++zorder) {
+		for(int y = -4; y != 4; ++y) {
+			for(int x = -4; x != 4; ++x) {
+				tiles.push_back(tile_search_key(zorder, x*TileSize, y*TileSize));
+			}
+		}
+	}
+
+	std::vector<level_tile*> result;
+	find_tiles_in_rect(tiles, 1, rect(-TileSize, -2*TileSize, TileSize*3, TileSize*2), result);
+	CHECK_EQ(result.size(), 6);
+	foreach(const level_tile* t, result) {
+		CHECK_EQ(t->zorder, 1);
+		CHECK_GE(t->x, -TileSize);
+		CHECK_LT(t->x, TileSize*2);
+		CHECK_GE(t->y, -TileSize*2);
+		CHECK_LT(t->y, 0);
+	}
+
+	result.clear();
+	find_tiles_in_rect(tiles, 2, rect(0, 0, TileSize, TileSize), result);
+	CHECK_EQ(result.size(), 0);
+
+	CHECK_EQ(tile_chunk_coord(0), 0);
+	CHECK_EQ(tile_chunk_coord(TileChunkSize - 1), 0);
+	CHECK_EQ(tile_chunk_coord(TileChunkSize), 1);
+	CHECK_EQ(tile_chunk_coord(-1), -1);
+	CHECK_EQ(tile_chunk_coord(-TileChunkSize), -1);
+	CHECK_EQ(tile_chunk_coord(-TileChunkSize - 1), -2);
+}
+
 UTILITY(correct_solidity)
 {
 	std::vector<std::string> files;
@@ -3672,9 +4430,7 @@ UTILITY(correct_solidity)
 			c->handle_event("editor_added");
 		}
 
-		std::string data;
-		wml::write(lvl->write(), data);
-		sys::write_file(preferences::level_path() + file, data);
+		wml::write_file(preferences::level_path() + file, lvl->write());
 	}
 }
 
@@ -3694,9 +4450,7 @@ UTILITY(compile_levels)
 		boost::intrusive_ptr<level> lvl(new level(file));
 		lvl->finish_loading();
 		lvl->record_zorders();
-		std::string data;
-		wml::write(lvl->write(), data);
-		sys::write_file("data/compiled/level/" + file, data);
+		wml::write_file("data/compiled/level/" + file, lvl->write());
 
 		wml::node_ptr node(new wml::node("level"));
 		node->set_attr("level", lvl->id());
@@ -3705,9 +4459,7 @@ UTILITY(compile_levels)
 		index_node->add_child(node);
 	}
 
-	std::string index_data;
-	wml::write(index_node, index_data);
-	sys::write_file("data/compiled/level_index.cfg", index_data);
+	wml::write_file("data/compiled/level_index.cfg", index_node);
 
 	level_object::write_compiled();
 }
@@ -3721,6 +4473,51 @@ BENCHMARK(level_solid)
 	}
 }
 
+//paints tiles one at a time over a wide area of a level, as the editor
+//does, waiting each time for the tiles to be rebuilt.
+BENCHMARK(level_paint_tiles)
+{
+	const int Width = 400, Height = 100;
+	static level* lvl = NULL;
+	static int zorder = 0;
+	static std::string tile;
+	if(lvl == NULL) {
+		lvl = new level("stairway-to-heaven.cfg");
+		lvl->set_editor();
+
+		//find a tile to paint with.
+		const rect& area = lvl->boundaries();
+		std::map<int, std::vector<std::string> > tiles;
+		lvl->get_all_tiles_rect(area.x(), area.y(), area.x2(), area.y2(), tiles);
+		for(std::map<int, std::vector<std::string> >::const_iterator i = tiles.begin(); i != tiles.end() && tile.empty(); ++i) {
+			foreach(const std::string& t, i->second) {
+				if(!t.empty()) {
+					zorder = i->first;
+					tile = t;
+					break;
+				}
+			}
+		}
+
+		ASSERT_LOG(!tile.empty(), "NO TILES FOUND TO PAINT WITH");
+
+		//make the level much bigger than usual.
+		lvl->add_tile_rect(zorder, 0, 0, Width*TileSize, Height*TileSize, tile);
+		lvl->rebuild_tiles();
+	}
+
+	const std::vector<int> layers(1, zorder);
+	BENCHMARK_LOOP {
+		const int x = (rng::generate()%Width)*TileSize;
+		const int y = (rng::generate()%Height)*TileSize;
+		lvl->add_tile_rect(zorder, x, y, x, y, rng::generate()%2 ? tile : "");
+		lvl->start_rebuild_tiles_in_background(layers);
+		while(lvl->rebuilding_tiles_in_background()) {
+			lvl->complete_rebuild_tiles_in_background();
+		}
+	}
+}
+
 BENCHMARK(load_nene)
 {
 	BENCHMARK_LOOP {
@@ -3739,6 +4536,160 @@ BENCHMARK(load_all_levels)
 	}
 }
 
+//plays a level as a two player game twice over, as each player's game
+//would, with the local camera somewhere different each time, and checks
+//the checksum of every cycle is the same both times. This shows which
+//objects are active only depends on the state the games share.
+UTILITY(multiplayer_activation_checksums)
+{
+	if(args.size() < 1 || args.size() > 2) {
+		std::cerr << "multiplayer_activation_checksums usage: <level> [cycles]\n";
+		return;
+	}
+
+	const int ncycles = std::max(1, args.size() > 1 ? atoi(args[1].c_str()) : 500);
+
+	std::vector<int> checksums[2];
+	for(int game = 0; game != 2; ++game) {
+		boost::intrusive_ptr<level> lvl(new level(args[0]));
+		lvl->finish_loading();
+		lvl->set_as_current_level();
+
+		entity_ptr second_player;
+		foreach(const entity_ptr& e, lvl->get_chars()) {
+			if(e->is_human()) {
+				second_player = e->clone();
+				break;
+			}
+		}
+
+		ASSERT_LOG(second_player, "LEVEL HAS NO PLAYER: " << args[0]);
+		second_player->set_pos(second_player->x() + 2000, second_player->y());
+		lvl->add_multi_player(second_player);
+
+		controls::new_level(lvl->cycle(), 2, 0);
+
+		//the other player does nothing, and their controls are confirmed
+		//in advance so we never wait for them.
+		controls::control_packet packet;
+		packet.slot = 1;
+		packet.to_slot = 0;
+		packet.current_cycle = ncycles + 1;
+		packet.controls.resize(ncycles + 2);
+		std::vector<char> buf;
+		controls::encode_control_packet(packet, buf);
+		controls::read_control_packet(&buf[0], buf.size());
+
+		const controls::local_controls_lock lock;
+
+		int active = 0;
+		for(int n = 0; n != ncycles; ++n) {
+			//the first game's camera follows the player, while the second
+			//one's is somewhere else entirely.
+			const entity& player = lvl->player()->get_entity();
+			screen_position& pos = last_draw_position();
+			pos.x = (game == 0 ? player.x() - graphics::screen_width()/2 : -100000)*100;
+			pos.y = (game == 0 ? player.y() - graphics::screen_height()/2 : -100000)*100;
+
+			lvl->process();
+			checksums[game].push_back(controls::get_checksum(lvl->cycle()));
+			active += lvl->num_active_chars();
+		}
+
+		std::cerr << "GAME " << game << ": " << active/ncycles << " of " << lvl->get_chars().size() << " objects active on average\n";
+	}
+
+	for(int n = 0; n != ncycles; ++n) {
+		ASSERT_LOG(checksums[0][n] == checksums[1][n], "CHECKSUMS DIFFER AT CYCLE " << n << ": " << checksums[0][n] << " VS " << checksums[1][n]);
+	}
+
+	std::cerr << "CHECKSUMS MATCH FOR " << ncycles << " CYCLES\n";
+}
+
+//simulates a level with a large population of objects spread out over
+//it, to show that processing a cycle depends on how many objects are near
+//the screen rather than on how many objects there are in the level.
+BENCHMARK_ARG(level_process_population, int population)
+{
+	boost::intrusive_ptr<level> lvl(new level("to-nenes-house.cfg"));
+	lvl->finish_loading();
+	lvl->set_as_current_level();
+
+	const std::vector<entity_ptr> originals = lvl->get_chars();
+	int n = 0;
+	while(n < population) {
+		const int start = n;
+		foreach(const entity_ptr& e, originals) {
+			if(n == population || e->is_human() || e->always_active()) {
+				continue;
+			}
+
+			entity_ptr c = e->clone();
+			if(!c) {
+				continue;
+			}
+
+			c->set_pos(e->x() + 4000 + (n%100)*2000, e->y() + (n/100)*2000);
+			c->set_distinct_label();
+			lvl->add_character(c);
+			++n;
+		}
+
+		if(n == start) {
+			break;
+		}
+	}
+
+	BENCHMARK_LOOP {
+		lvl->process();
+	}
+}
+
+BENCHMARK_ARG_CALL(level_process_population, hundred, 100);
+BENCHMARK_ARG_CALL(level_process_population, ten_thousand, 10000);
+
+//adds and removes characters, as when projectiles are fired and destroyed,
+//in levels with few and with many other characters.
+BENCHMARK_ARG(level_add_remove_chars, int population)
+{
+	boost::intrusive_ptr<level> lvl(new level("to-nenes-house.cfg"));
+	lvl->finish_loading();
+
+	entity_ptr proto;
+	foreach(const entity_ptr& e, lvl->get_chars()) {
+		if(!e->is_human() && e->clone()) {
+			proto = e;
+			break;
+		}
+	}
+
+	if(!proto) {
+		return;
+	}
+
+	for(int n = 0; n != population; ++n) {
+		entity_ptr c = proto->clone();
+		c->set_distinct_label();
+		lvl->add_character(c);
+	}
+
+	std::vector<entity_ptr> spawned(100);
+	BENCHMARK_LOOP {
+		foreach(entity_ptr& e, spawned) {
+			e = proto->clone();
+			e->set_distinct_label();
+			lvl->add_character(e);
+		}
+
+		foreach(const entity_ptr& e, spawned) {
+			lvl->remove_character(e);
+		}
+	}
+}
+
+BENCHMARK_ARG_CALL(level_add_remove_chars, few_chars, 100);
+BENCHMARK_ARG_CALL(level_add_remove_chars, many_chars, 10000);
+
 #include "wml_writer.hpp"
 
 BENCHMARK(load_and_save_all_levels)
@@ -3751,9 +4702,7 @@ BENCHMARK(load_and_save_all_levels)
 			boost::intrusive_ptr<level> lvl(new level(file));
 			lvl->finish_loading();
 
-			std::string data;
-			wml::write(lvl->write(), data);
-			sys::write_file(preferences::level_path() + file, data);
+			wml::write_file(preferences::level_path() + file, lvl->write());
 		}
 	}
 }
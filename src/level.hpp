@@ -10,8 +10,12 @@
 #include <vector>
 
 #include "boost/array.hpp"
+#include "boost/function.hpp"
 #include "boost/scoped_ptr.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/unordered_map.hpp"
 
+#include "activation_index.hpp"
 #include "background.hpp"
 #include "color_utils.hpp"
 #include "entity.hpp"
@@ -32,6 +36,25 @@
 
 class tile_corner;
 
+//a level as it was when level::snapshot() was called, which can be
+//written on another thread while the game carries on.
+struct level_snapshot
+{
+	//the level, without its objects.
+	wml::node_ptr node;
+
+	//copies of the level's objects, each with the address it's written
+	//with, which is the address of the object it was copied from.
+	std::vector<std::pair<entity_ptr, std::string> > chars;
+
+	//adds the objects to the end of the level's node and returns it. Their
+	//order among themselves is kept. May be called from any thread, but
+	//only once. The snapshot must be destroyed on the thread which took it.
+	wml::node_ptr write();
+};
+
+typedef boost::shared_ptr<level_snapshot> level_snapshot_ptr;
+
 class level : public game_logic::formula_callable
 {
 public:
@@ -65,6 +88,11 @@ public:
 	std::string package() const;
 
 	wml::node_ptr write() const;
+
+	//takes a snapshot of the level, which only copies its objects rather
+	//than writing them.
+	level_snapshot_ptr snapshot() const;
+
 	void draw(int x, int y, int w, int h) const;
 	void draw_status() const;
 	void draw_debug_solid(int x, int y, int w, int h) const;
@@ -138,6 +166,9 @@ public:
 	//the portal the character has entered (if any)
 	const portal* get_portal() const;
 
+	//the levels the player may go to next, most likely first.
+	std::vector<std::string> predicted_levels() const;
+
 	int xscale() const { return xscale_; }
 	int yscale() const { return yscale_; }
 
@@ -170,6 +201,10 @@ public:
 	//with the new tiles.
 	void complete_rebuild_tiles_in_background();
 
+	//true while tiles are being built in the background, until
+	//complete_rebuild_tiles_in_background() takes them.
+	bool rebuilding_tiles_in_background() const;
+
 	//stop calls to start_rebuild_tiles_in_background from proceeding
 	//until unfreeze_rebuild_tiles_in_background() is called.
 	void freeze_rebuild_tiles_in_background();
@@ -268,6 +303,10 @@ public:
 	void remove_sub_level(const std::string& lvl);
 	void adjust_level_offset(int xoffset, int yoffset);
 
+	//if the level streams its sub-levels, loads and activates those which
+	//are placed near the screen, and unloads those far from it.
+	void stream_sub_levels(const rect& screen_area);
+
 	bool relocate_object(entity_ptr e, int x, int y);
 
 	int segment_width() const { return segment_width_; }
@@ -296,6 +335,10 @@ public:
 
 private:
 
+	//writes the level. If snapshot is given, objects are copied into it
+	//rather than written.
+	wml::node_ptr write_level(level_snapshot* snapshot) const;
+
 	void read_compiled_tiles(wml::const_node_ptr node, std::vector<level_tile>::iterator& out);
 
 	void complete_tiles_refresh();
@@ -308,7 +351,6 @@ private:
 	bool add_tile_rect_vector_internal(int zorder, int x1, int y1, int x2, int y2, const std::vector<std::string>& tiles);
 
 	void draw_layer(int layer, int x, int y, int w, int h) const;
-	void draw_layer_solid(int layer, int x, int y, int w, int h) const;
 
 	void rebuild_tiles_rect(const rect& r);
 	void add_tile_solid(const level_tile& t);
@@ -335,9 +377,6 @@ private:
 	level_solid_map solid_;
 	level_solid_map standable_;
 
-	level_solid_map solid_base_;
-	level_solid_map standable_base_;
-
 	bool is_solid(const level_solid_map& map, int x, int y, int* friction, int* traction, int* damage) const;
 	bool is_solid(const level_solid_map& map, const entity& e, const std::vector<point>& points, int* friction, int* traction, int* damage) const;
 
@@ -363,6 +402,20 @@ private:
 	std::set<int> hidden_layers_; //layers hidden in the editor.
 	int highlight_layer_;
 
+	struct solid_color_rect {
+		graphics::color color;
+		rect area;
+		int layer;
+	};
+
+	struct solid_color_rect_empty {
+		bool operator()(const solid_color_rect& r) const { return r.area.w() == 0; }
+	};
+
+	//the vertexes and solid colored rects used to draw the tiles in one
+	//layer of a square chunk of the level. Tiles are cached for drawing a
+	//chunk at a time, so editing tiles only needs the chunks around the
+	//edit to be prepared again.
 	struct layer_blit_info {
 		layer_blit_info() : texture_id(0), xbase(-1), ybase(-1)
 		{}
@@ -401,38 +454,69 @@ private:
 		std::vector<IndexType> opaque_indexes, translucent_indexes;
 
 		rect tile_positions;
+
+		//tiles with a solid color are drawn as rects rather than as
+		//textures.
+		std::vector<solid_color_rect> solid_rects;
 	};
 
-	mutable std::map<int, layer_blit_info> blit_cache_;
+	//the chunks of each layer, by the position of the chunk.
+	typedef std::map<tile_pos, layer_blit_info> layer_chunk_map;
+	mutable std::map<int, layer_chunk_map> blit_cache_;
 
-	struct solid_color_rect {
-		graphics::color color;
-		rect area;
-		int layer;
-	};
+	//prepares the chunks touching the given area of the level, or the
+	//chunk at the given position, to be drawn.
+	void prepare_tiles_for_drawing(const rect& area);
+	void prepare_tile_chunk(const tile_pos& chunk);
 
-	struct solid_color_rect_empty {
-		bool operator()(const solid_color_rect& r) const { return r.area.w() == 0; }
-	};
+	//builds the solid cells of a chunk again, from the tiles in it.
+	void rebuild_tile_chunk_solid(const tile_pos& chunk);
 
-	struct solid_color_rect_cmp {
-		bool operator()(const solid_color_rect& r, int zorder) const { return r.layer < zorder; }
-		bool operator()(int zorder, const solid_color_rect& r) const { return zorder < r.layer; }
-		bool operator()(const solid_color_rect& a, const solid_color_rect& b) const { return a.layer < b.layer; }
-	};
+	//replaces the tiles for which replaced() is true with the given
+	//tiles, and prepares only the chunks in which they differ again.
+	void replace_tiles(std::vector<level_tile>& tiles, const boost::function<bool(const level_tile&)>& replaced);
 
-	std::vector<solid_color_rect> solid_color_rects_;
+	void draw_layer_chunk(layer_blit_info& blit_info, int x, int y, int w, int h) const;
+	void draw_layer_chunk_translucent(const layer_blit_info& blit_info) const;
+	void draw_layer_solid(const layer_blit_info& blit_info, int x, int y, int w, int h) const;
 
 	std::vector<rect> opaque_rects_;
 
+	//marks a character to be removed at the end of the cycle. Characters
+	//destroyed during a cycle are all removed at once, by erase_dead_chars.
+	//Until then they can't be found by label, aren't solid, and aren't in
+	//level.chars.
 	void erase_char(entity_ptr c);
+	void erase_dead_chars();
+	bool is_char_erased(const entity_ptr& c) const;
+	std::set<entity_ptr> chars_to_erase_;
+
+	//add and remove characters from chars_, keeping the activation index
+	//up to date. chars_ keeps the order characters were added in, which is
+	//the order they're saved in, so removing one searches for it.
+	void add_char_to_list(const entity_ptr& e);
+	void remove_char_from_list(const entity_ptr& e);
+
 	std::vector<entity_ptr> chars_;
 	std::vector<entity_ptr> active_chars_;
+
+	//in multiplayer games, which characters are active is decided by
+	//views around each player, which every player's game agrees on. The
+	//characters drawn are those and any others on the local screen.
+	void find_visible_chars(const rect& screen_area, int active_query);
+	std::vector<entity_ptr> visible_chars_;
+
+	//an index of chars_ used to find which are active, and buffers for
+	//the areas it's queried with and the candidates it finds.
+	activation_index activation_index_;
+	std::vector<rect> activation_areas_;
+	std::vector<entity_ptr> activation_buf_;
 	mutable std::vector<entity_ptr> solid_chars_;
 
 	std::vector<entity_ptr> chars_immune_from_time_freeze_;
 
-	std::map<std::string, entity_ptr> chars_by_label_;
+	typedef boost::unordered_map<std::string, entity_ptr> label_map;
+	label_map chars_by_label_;
 	entity_ptr player_;
 	entity_ptr last_touched_player_;
 
@@ -522,17 +606,47 @@ private:
 	int segment_width_, segment_height_;
 
 	struct sub_level_data {
+		sub_level_data() : xbase(0), ybase(0), xoffset(0), yoffset(0), active(false), placed(false), streamed(false)
+		{}
 		boost::intrusive_ptr<level> lvl;
 		int xbase, ybase;
 		int xoffset, yoffset;
 		bool active;
+
+		//if add_sub_level() has put the sub-level somewhere. A streamed
+		//sub-level is loaded, and active, only while it's placed near
+		//the screen.
+		bool placed, streamed;
+
+		//the boundaries of the sub-level before it's offset. For a
+		//streamed sub-level they're read from its WML before it's loaded.
+		rect bounds;
 		std::vector<entity_ptr> objects;
 	};
 
-	void build_solid_data_from_sub_levels();
+	//the area a sub-level covers, or an empty rect if its WML hasn't been
+	//read yet, and wait is false.
+	rect sub_level_area(const std::string& name, sub_level_data& data, bool wait);
+
+	//loads a streamed sub-level, in the background unless wait is true.
+	//Returns true if it's loaded.
+	bool load_sub_level(const std::string& name, sub_level_data& data, bool wait);
+
+	//deactivating a sub-level removes the objects it added. Objects which
+	//are active are left in the level unless remove_active_objects is set.
+	void activate_sub_level(sub_level_data& data, bool add_objects);
+	void deactivate_sub_level(sub_level_data& data, bool remove_active_objects);
+
+	//the level's solid map is made of its active sub-levels. These add
+	//one to it, and take it out, without rebuilding the rest.
+	void merge_sub_level_solid(const sub_level_data& data);
+	void remove_sub_level_solid(const sub_level_data& data);
+
+	void offset_solid_rects(int xdiff, int ydiff);
 
 	std::string sub_level_str_;
 	std::map<std::string, sub_level_data> sub_levels_;
+	bool stream_sub_levels_;
 };
 
 bool entity_in_current_level(const entity* e);
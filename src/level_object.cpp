@@ -586,9 +586,7 @@ void level_object::write_compiled()
 			tiles_node->add_child(wml::deep_copy(level_object_index[m]));
 		}
 
-		std::string data;
-		wml::write(tiles_node, data);
-		sys::write_file("data/compiled/tiles/" + filename, data);
+		wml::write_file("data/compiled/tiles/" + filename, tiles_node);
 	}
 }
 
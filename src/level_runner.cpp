@@ -10,6 +10,7 @@
 #include "custom_object.hpp"
 #include "custom_object_functions.hpp"
 #include "draw_scene.hpp"
+#include "draw_stats.hpp"
 #ifndef NO_EDITOR
 #include "editor.hpp"
 #endif
@@ -31,11 +32,14 @@
 #include "player_info.hpp"
 #include "preferences.hpp"
 #include "raster.hpp"
+#include "save_writer.hpp"
 #include "settings_dialog.hpp"
 #include "sound.hpp"
 #include "stats.hpp"
 #include "surface_cache.hpp"
 #include "text_entry_widget.hpp"
+#include "texture.hpp"
+#include "thread.hpp"
 #include "utils.hpp"
 #include "wml_node.hpp"
 #include "wml_writer.hpp"
@@ -179,6 +183,7 @@ void iris_scene(const level& lvl, screen_position& screen_pos, float amount) {
 		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 
 		glVertexPointer(2, GL_FLOAT, 0, &varray.front());
+		draw_stats::draw_call(varray.size()/2);
 		glDrawArrays(GL_TRIANGLE_STRIP, 0, varray.size()/2);
 
 		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
@@ -296,6 +301,8 @@ void load_level_thread(const std::string& lvl, level** res) {
 bool level_runner::play_cycle()
 {
 	static settings_dialog settings_dialog;
+	threading::process_completed_tasks();
+
 	if(controls::first_invalid_cycle() >= 0) {
 		lvl_->replay_from_cycle(controls::first_invalid_cycle());
 		controls::mark_valid();
@@ -605,14 +612,7 @@ bool level_runner::play_cycle()
 					#endif
 				} else if(key == SDLK_s && (mod&KMOD_CTRL)) {
 					std::cerr << "SAVING...\n";
-					std::string data;
-					
-					wml::node_ptr lvl_node = wml::deep_copy(lvl_->write());
-					if(sound::current_music().empty() == false) {
-						lvl_node->set_attr("music", sound::current_music());
-					}
-					wml::write(lvl_node, data);
-					sys::write_file(preferences::save_file_path(), data);
+					save_writer::save_async(*lvl_, preferences::save_file_path());
 				} else if(key == SDLK_s && (mod&KMOD_ALT)) {
 					IMG_SaveFrameBuffer((std::string(preferences::user_data_path()) + "screenshot.png").c_str(), 5);
 				} else if(key == SDLK_w && (mod&KMOD_CTRL)) {
@@ -706,7 +706,7 @@ bool level_runner::play_cycle()
 
 		draw_scene(*lvl_, last_draw_position(), NULL, !is_skipping_game());
 
-		performance_data perf = { current_fps_, current_cycles_, current_delay_, current_draw_, current_process_, current_flip_, cycle, current_events_, profiling_summary_ };
+		performance_data perf = { current_fps_, current_cycles_, current_delay_, current_draw_, current_process_, current_flip_, cycle, current_events_, profiling_summary_, preferences::show_fps() ? draw_stats::get_summary() : std::string() };
 #if TARGET_IPHONE_SIMULATOR || TARGET_OS_HARMATTAN || TARGET_OS_IPHONE
 		if( ! is_achievement_displayed() ){
 			settings_dialog.draw(in_speech_dialog());
@@ -718,6 +718,8 @@ bool level_runner::play_cycle()
 		}
 
 		next_draw_ += (SDL_GetTicks() - start_draw);
+		draw_stats::end_frame();
+		graphics::texture::manage_residency();
 
 		const int start_flip = SDL_GetTicks();
 		if(!is_skipping_game()) {
@@ -1,7 +1,11 @@
+#include <algorithm>
 #include <iostream>
 
+#include <limits.h>
+
 #include "foreach.hpp"
 #include "level_solid_map.hpp"
+#include "unit_test.hpp"
 
 level_solid_map::level_solid_map()
 {
@@ -134,76 +138,87 @@ void level_solid_map::clear()
 
 void level_solid_map::merge(const level_solid_map& map, int xoffset, int yoffset)
 {
-	for(int n = 0; n != map.negative_rows_.size(); ++n) {
-		for(int m = 0; m != map.negative_rows_[n].negative_cells.size(); ++m) {
-			const tile_pos pos(-m - 1 + xoffset, -n - 1 + yoffset);
-			tile_solid_info& dst = insert_or_find(pos);
-			const tile_solid_info* src = map.negative_rows_[n].negative_cells[m];
-			if(!src) {
-				continue;
-			}
+	merge_area(map, xoffset, yoffset, rect(INT_MIN/2, INT_MIN/2, INT_MAX, INT_MAX));
+}
 
-			dst.all_solid = dst.all_solid || src->all_solid;
-			dst.friction = std::max<int>(src->friction, dst.friction);
-			dst.traction = std::max<int>(src->traction, dst.traction);
-			dst.damage = std::max<int>(src->damage, dst.damage);
-			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
+void level_solid_map::merge_area(const level_solid_map& map, int xoffset, int yoffset, const rect& area)
+{
+	const rect src_area = intersection_rect(map.bounds(), rect(area.x() - xoffset, area.y() - yoffset, area.w(), area.h()));
+	for(int y = src_area.y(); y < src_area.y2(); ++y) {
+		for(int x = src_area.x(); x < src_area.x2(); ++x) {
+			const tile_solid_info* src = map.find(tile_pos(x, y));
+			if(src) {
+				merge_tile(tile_pos(x + xoffset, y + yoffset), *src);
 			}
 		}
+	}
+}
 
-		for(int m = 0; m != map.negative_rows_[n].positive_cells.size(); ++m) {
-			const tile_pos pos(m + xoffset, -n - 1 + yoffset);
-			tile_solid_info& dst = insert_or_find(pos);
-			const tile_solid_info* src = map.negative_rows_[n].positive_cells[m];
-			if(!src) {
-				continue;
-			}
+void level_solid_map::merge_tile(const tile_pos& pos, const tile_solid_info& src)
+{
+	tile_solid_info& dst = insert_or_find(pos);
+	dst.all_solid = dst.all_solid || src.all_solid;
+	dst.friction = std::max<int>(src.friction, dst.friction);
+	dst.traction = std::max<int>(src.traction, dst.traction);
+	dst.damage = std::max<int>(src.damage, dst.damage);
+	if(!dst.all_solid) {
+		dst.bitmap = dst.bitmap | src.bitmap;
+	}
+}
 
-			dst.all_solid = dst.all_solid || src->all_solid;
-			dst.friction = std::max<int>(src->friction, dst.friction);
-			dst.traction = std::max<int>(src->traction, dst.traction);
-			dst.damage = std::max<int>(src->damage, dst.damage);
-			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
+void level_solid_map::erase_area(const rect& area)
+{
+	const rect r = intersection_rect(bounds(), area);
+	for(int y = r.y(); y < r.y2(); ++y) {
+		for(int x = r.x(); x < r.x2(); ++x) {
+			if(find(tile_pos(x, y))) {
+				erase(tile_pos(x, y));
 			}
 		}
 	}
+}
 
-	for(int n = 0; n != map.positive_rows_.size(); ++n) {
-		for(int m = 0; m != map.positive_rows_[n].negative_cells.size(); ++m) {
-			const tile_pos pos(-m - 1 + xoffset, n + yoffset);
-			tile_solid_info& dst = insert_or_find(pos);
-			const tile_solid_info* src = map.positive_rows_[n].negative_cells[m];
-			if(!src) {
-				continue;
-			}
-
-			dst.all_solid = dst.all_solid || src->all_solid;
-			dst.friction = std::max<int>(src->friction, dst.friction);
-			dst.traction = std::max<int>(src->traction, dst.traction);
-			dst.damage = std::max<int>(src->damage, dst.damage);
-			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
-			}
-		}
+rect level_solid_map::bounds() const
+{
+	int min_x = 0, max_x = 0;
+	foreach(const row& r, positive_rows_) {
+		min_x = std::min<int>(min_x, -r.negative_cells.size());
+		max_x = std::max<int>(max_x, r.positive_cells.size());
+	}
 
-		for(int m = 0; m != map.positive_rows_[n].positive_cells.size(); ++m) {
-			const tile_pos pos(m + xoffset, n + yoffset);
-			const tile_solid_info* src = map.positive_rows_[n].positive_cells[m];
-			if(!src) {
-				continue;
-			}
+	foreach(const row& r, negative_rows_) {
+		min_x = std::min<int>(min_x, -r.negative_cells.size());
+		max_x = std::max<int>(max_x, r.positive_cells.size());
+	}
 
-			tile_solid_info& dst = insert_or_find(pos);
+	const int min_y = -static_cast<int>(negative_rows_.size());
+	const int max_y = positive_rows_.size();
+	return rect(min_x, min_y, max_x - min_x, max_y - min_y);
+}
 
-			dst.all_solid = dst.all_solid || src->all_solid;
-			dst.friction = std::max<int>(src->friction, dst.friction);
-			dst.traction = std::max<int>(src->traction, dst.traction);
-			dst.damage = std::max<int>(src->damage, dst.damage);
-			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
-			}
-		}
-	}
+UNIT_TEST(level_solid_map_merge_area)
+{
+	level_solid_map a, b;
+	a.insert_or_find(tile_pos(-2, 0)).all_solid = true;
+	a.insert_or_find(tile_pos(3, -1)).friction = 5;
+	b.insert_or_find(tile_pos(0, 0)).all_solid = true;
+
+	CHECK_EQ(a.bounds(), rect(-2, -1, 6, 2));
+
+	level_solid_map m;
+	m.merge(a, 10, 10);
+	m.merge(b, 8, 10);
+	CHECK(m.find(tile_pos(8, 10)) && m.find(tile_pos(8, 10))->all_solid, "tile not merged");
+	CHECK_EQ(m.find(tile_pos(13, 9))->friction, 5);
+
+	//removing a from the map and merging back what b has in the same
+	//area leaves only b.
+	const rect area(8, 9, 6, 2);
+	m.erase_area(area);
+	m.merge_area(b, 8, 10, area);
+	CHECK(m.find(tile_pos(8, 10)) && m.find(tile_pos(8, 10))->all_solid, "tile erased");
+	CHECK(!m.find(tile_pos(13, 9)), "tile not erased");
+
+	m.erase_area(rect(9, 9, 10, 10));
+	CHECK(m.find(tile_pos(8, 10)), "tile outside the area erased");
 }
@@ -5,6 +5,8 @@
 #include <map>
 #include <vector>
 
+#include "geometry.hpp"
+
 static const int TileSize = 32;
 
 typedef std::pair<int,int> tile_pos;
@@ -32,9 +34,20 @@ public:
 	void clear();
 
 	void merge(const level_solid_map& m, int xoffset, int yoffset);
+
+	//merges only the part of m which, once offset, lies in area. area
+	//is in tiles.
+	void merge_area(const level_solid_map& m, int xoffset, int yoffset, const rect& area);
+
+	//erases every tile in area, which is in tiles.
+	void erase_area(const rect& area);
+
+	//the area, in tiles, which may have tiles in it.
+	rect bounds() const;
 private:
 
 	tile_solid_info** insert_raw(const tile_pos& pos);
+	void merge_tile(const tile_pos& pos, const tile_solid_info& src);
 
 	struct row {
 		std::vector<tile_solid_info*> positive_cells, negative_cells;
@@ -9,6 +9,7 @@
 
 class custom_object;
 class light;
+class light_map;
 
 typedef boost::intrusive_ptr<light> light_ptr;
 typedef boost::intrusive_ptr<const light> const_light_ptr;
@@ -24,7 +25,9 @@ public:
 	virtual ~light();
 	virtual void process() = 0;
 	virtual bool on_screen(const rect& screen_area) const = 0;
-	virtual void draw(const rect& screen_area, const unsigned char* color) const = 0;
+
+	//adds the light to a map of the light falling on the screen.
+	virtual void add_to_map(light_map& map) const = 0;
 protected:
 	const custom_object& object() const { return obj_; }
 private:
@@ -40,7 +43,7 @@ public:
 	wml::node_ptr write() const;
 	void process();
 	bool on_screen(const rect& screen_area) const;
-	void draw(const rect& screen_area, const unsigned char* color) const;
+	void add_to_map(light_map& map) const;
 private:
 	point center_;
 	int radius_;
@@ -0,0 +1,265 @@
+#include <math.h>
+
+#include <algorithm>
+
+#include "foreach.hpp"
+#include "light_map.hpp"
+#include "unit_test.hpp"
+
+namespace {
+const int TileSize = light_map::CellSize*light_map::TileCells;
+
+//the tile containing the given level coordinate, rounding down.
+int tile_coord(int n)
+{
+	return n >= 0 ? n/TileSize : -((-n - 1)/TileSize) - 1;
+}
+}
+
+light_map::tile::tile() : composed(false)
+{
+	std::fill(color, color + 4, 0);
+}
+
+light_map::light_map()
+  : tx1_(0), ty1_(0), tx2_(-1), ty2_(-1), width_(0), height_(0), tiles_composed_(0)
+{
+	std::fill(color_, color_ + 4, 0);
+}
+
+void light_map::begin(const rect& area, const unsigned char* dark_color)
+{
+	std::copy(dark_color, dark_color + 4, color_);
+
+	tx1_ = tile_coord(area.x());
+	ty1_ = tile_coord(area.y());
+	tx2_ = tile_coord(area.x() + std::max(area.w(), 1) - 1);
+	ty2_ = tile_coord(area.y() + std::max(area.h(), 1) - 1);
+
+	//tiles which have scrolled out of view won't be needed again soon.
+	for(tile_map::iterator i = tiles_.begin(); i != tiles_.end(); ) {
+		const tile_pos& pos = i->first;
+		if(pos.first < tx1_ - 1 || pos.first > tx2_ + 1 ||
+		   pos.second < ty1_ - 1 || pos.second > ty2_ + 1) {
+			tiles_.erase(i++);
+		} else {
+			i->second.next_lights.clear();
+			++i;
+		}
+	}
+}
+
+void light_map::add_circle(const point& center, int radius, int fade)
+{
+	const circle c = { center.x, center.y, radius, fade };
+	const int reach = std::max(radius, 0) + std::max(fade, 0);
+	const int x1 = std::max(tx1_, tile_coord(center.x - reach));
+	const int y1 = std::max(ty1_, tile_coord(center.y - reach));
+	const int x2 = std::min(tx2_, tile_coord(center.x + reach));
+	const int y2 = std::min(ty2_, tile_coord(center.y + reach));
+	for(int y = y1; y <= y2; ++y) {
+		for(int x = x1; x <= x2; ++x) {
+			tiles_[tile_pos(x, y)].next_lights.push_back(c);
+		}
+	}
+}
+
+void light_map::end()
+{
+	tiles_composed_ = 0;
+
+	width_ = (tx2_ - tx1_ + 1)*TileCells;
+	height_ = (ty2_ - ty1_ + 1)*TileCells;
+	origin_ = point(tx1_*TileSize, ty1_*TileSize);
+	pixels_.resize(width_*height_*4);
+
+	for(int ty = ty1_; ty <= ty2_; ++ty) {
+		for(int tx = tx1_; tx <= tx2_; ++tx) {
+			tile& t = tiles_[tile_pos(tx, ty)];
+			if(!t.composed || t.lights != t.next_lights || !std::equal(color_, color_ + 4, t.color)) {
+				t.lights.swap(t.next_lights);
+				std::copy(color_, color_ + 4, t.color);
+				compose(tx, ty, t);
+				t.composed = true;
+				++tiles_composed_;
+			}
+
+			const int row_size = TileCells*4;
+			for(int y = 0; y != TileCells; ++y) {
+				const unsigned char* src = &t.pixels[y*row_size];
+				unsigned char* dst = &pixels_[(((ty - ty1_)*TileCells + y)*width_ + (tx - tx1_)*TileCells)*4];
+				std::copy(src, src + row_size, dst);
+			}
+		}
+	}
+}
+
+void light_map::clear()
+{
+	tiles_.clear();
+}
+
+void light_map::compose(int tx, int ty, tile& t) const
+{
+	t.pixels.resize(TileCells*TileCells*4);
+
+	unsigned char* p = &t.pixels[0];
+	for(int y = 0; y != TileCells; ++y) {
+		//values are sampled at the middle of the square they cover.
+		const int ypos = (ty*TileCells + y)*CellSize + CellSize/2;
+		for(int x = 0; x != TileCells; ++x) {
+			const int xpos = (tx*TileCells + x)*CellSize + CellSize/2;
+
+			//lights are added together, with the color of the darkness
+			//added once for each light covering this spot, as they were
+			//when drawn additively into a frame buffer.
+			int alpha = t.color[3];
+			int count = 1;
+			foreach(const circle& c, t.lights) {
+				const int dx = xpos - c.x;
+				const int dy = ypos - c.y;
+				const int dist_sq = dx*dx + dy*dy;
+				const int outer = c.radius + c.fade;
+				if(dist_sq <= c.radius*c.radius) {
+					alpha += 255;
+					++count;
+				} else if(dist_sq < outer*outer) {
+					const float dist = sqrtf(static_cast<float>(dist_sq));
+					alpha += static_cast<int>(255*(outer - dist)/c.fade);
+					++count;
+				}
+			}
+
+			for(int n = 0; n != 3; ++n) {
+				*p++ = std::min(255, t.color[n]*count);
+			}
+
+			*p++ = std::min(255, alpha);
+		}
+	}
+}
+
+UNIT_TEST(light_map_compose)
+{
+	const unsigned char dark[] = { 10, 20, 30, 40 };
+	light_map m;
+	m.begin(rect(0, 0, 256, 256), dark);
+	m.add_circle(point(100, 100), 20, 64);
+	m.end();
+
+	CHECK_EQ(m.width(), 32);
+	CHECK_EQ(m.height(), 32);
+	CHECK_EQ(m.origin().x, 0);
+	CHECK_EQ(m.origin().y, 0);
+	CHECK_EQ(m.tiles_composed(), 4);
+
+	//the value covering (100, 100) is fully lit, with the light adding
+	//the dark color once more.
+	const unsigned char* lit = &m.pixels()[((100/light_map::CellSize)*m.width() + 100/light_map::CellSize)*4];
+	CHECK_EQ(int(lit[0]), 20);
+	CHECK_EQ(int(lit[1]), 40);
+	CHECK_EQ(int(lit[2]), 60);
+	CHECK_EQ(int(lit[3]), 255);
+
+	//a value far away from the light is just dark.
+	const unsigned char* unlit = &m.pixels()[(31*m.width() + 31)*4];
+	CHECK_EQ(int(unlit[0]), 10);
+	CHECK_EQ(int(unlit[3]), 40);
+
+	//the fade is between the two, and decreases moving away from the light.
+	const int row = 100/light_map::CellSize;
+	const int near_col = 132/light_map::CellSize, far_col = 164/light_map::CellSize;
+	const int near_alpha = m.pixels()[(row*m.width() + near_col)*4 + 3];
+	const int far_alpha = m.pixels()[(row*m.width() + far_col)*4 + 3];
+	CHECK_LT(near_alpha, 255);
+	CHECK_GT(near_alpha, far_alpha);
+	CHECK_GT(far_alpha, 40);
+}
+
+UNIT_TEST(light_map_caching)
+{
+	const unsigned char dark[] = { 0, 0, 0, 0 };
+	light_map m;
+	m.begin(rect(0, 0, 512, 512), dark);
+	m.add_circle(point(64, 64), 10, 20);
+	m.add_circle(point(448, 448), 10, 20);
+	m.end();
+	CHECK_EQ(m.tiles_composed(), 16);
+	const std::vector<unsigned char> first = m.pixels();
+
+	//nothing changed, so nothing is composed.
+	m.begin(rect(0, 0, 512, 512), dark);
+	m.add_circle(point(64, 64), 10, 20);
+	m.add_circle(point(448, 448), 10, 20);
+	m.end();
+	CHECK_EQ(m.tiles_composed(), 0);
+	CHECK(m.pixels() == first, "cached light map differs");
+
+	//moving one light only composes the tiles it was and is in.
+	m.begin(rect(0, 0, 512, 512), dark);
+	m.add_circle(point(64, 64), 10, 20);
+	m.add_circle(point(320, 448), 10, 20);
+	m.end();
+	CHECK_EQ(m.tiles_composed(), 2);
+
+	//and the result is the same as composing it from scratch.
+	const std::vector<unsigned char> moved = m.pixels();
+	m.clear();
+	m.begin(rect(0, 0, 512, 512), dark);
+	m.add_circle(point(64, 64), 10, 20);
+	m.add_circle(point(320, 448), 10, 20);
+	m.end();
+	CHECK_EQ(m.tiles_composed(), 16);
+	CHECK(m.pixels() == moved, "cached light map differs from a fresh one");
+
+	//scrolling only composes the tiles coming into view.
+	m.begin(rect(128, 0, 512, 512), dark);
+	m.add_circle(point(64, 64), 10, 20);
+	m.add_circle(point(320, 448), 10, 20);
+	m.end();
+	CHECK_EQ(m.tiles_composed(), 4);
+	CHECK_EQ(m.origin().x, 128);
+	CHECK_EQ(m.origin().y, 0);
+
+	//changing the darkness composes everything.
+	const unsigned char darker[] = { 0, 0, 0, 10 };
+	m.begin(rect(128, 0, 512, 512), darker);
+	m.add_circle(point(64, 64), 10, 20);
+	m.add_circle(point(320, 448), 10, 20);
+	m.end();
+	CHECK_EQ(m.tiles_composed(), 16);
+}
+
+namespace {
+//a screenful of lights which don't move, and one which does, like a dark
+//level with torches on the walls and a player carrying a lamp.
+void light_map_frame(light_map& m, int frame)
+{
+	const unsigned char dark[] = { 0, 0, 0, 32 };
+	m.begin(rect(0, 0, 800, 600), dark);
+	for(int y = 0; y < 600; y += 150) {
+		for(int x = 0; x < 800; x += 160) {
+			m.add_circle(point(x + 40, y + 40), 40, 64);
+		}
+	}
+
+	m.add_circle(point(100 + frame%600, 300), 60, 64);
+	m.end();
+}
+}
+
+BENCHMARK_ARG(light_map_frame, bool recompose_everything)
+{
+	light_map m;
+	int frame = 0;
+	BENCHMARK_LOOP {
+		if(recompose_everything) {
+			m.clear();
+		}
+
+		light_map_frame(m, frame++);
+	}
+}
+
+BENCHMARK_ARG_CALL(light_map_frame, recompose_all, true);
+BENCHMARK_ARG_CALL(light_map_frame, recompose_changed, false);
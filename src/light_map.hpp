@@ -0,0 +1,90 @@
+#ifndef LIGHT_MAP_HPP_INCLUDED
+#define LIGHT_MAP_HPP_INCLUDED
+
+#include <map>
+#include <vector>
+
+#include "geometry.hpp"
+
+//a low resolution map of how much light falls on the visible part of a
+//dark level, built on the CPU. Each value in the map covers a small square
+//of the level, and the map is drawn scaled up over the screen.
+//
+//The level is divided into tiles of values which are kept between frames.
+//A tile is only composed again if the lights touching it, or the darkness,
+//have changed, so a level full of lights which don't move costs little
+//more than copying the tiles.
+//
+//Values are in the same form the lights used to be rendered into a frame
+//buffer: RGBA, with the level's dark color where there is no light, and
+//with alpha saturating to 255 where it is fully lit.
+class light_map
+{
+public:
+	//the size of the square of the level covered by each value, and the
+	//number of values along each side of a tile.
+	enum { CellSize = 8, TileCells = 16 };
+
+	light_map();
+
+	//starts building the map of the given area of the level.
+	void begin(const rect& area, const unsigned char* dark_color);
+
+	//adds a light which is fully lit out to radius from center, and fades
+	//out over the next fade pixels.
+	void add_circle(const point& center, int radius, int fade);
+
+	//composes any tiles which have changed and fills in the map.
+	void end();
+
+	//the map, as width()*height() RGBA values. The first value covers the
+	//square of the level starting at origin(), which may be slightly above
+	//and to the left of the area given to begin().
+	const std::vector<unsigned char>& pixels() const { return pixels_; }
+	int width() const { return width_; }
+	int height() const { return height_; }
+	const point& origin() const { return origin_; }
+
+	//the number of tiles composed by the last call to end().
+	int tiles_composed() const { return tiles_composed_; }
+
+	//discards every tile, so they're all composed again.
+	void clear();
+
+private:
+	struct circle {
+		int x, y, radius, fade;
+		bool operator==(const circle& c) const {
+			return x == c.x && y == c.y && radius == c.radius && fade == c.fade;
+		}
+		bool operator!=(const circle& c) const { return !(*this == c); }
+	};
+
+	struct tile {
+		tile();
+
+		//the lights the tile was composed with, and those touching it in
+		//the frame being built.
+		std::vector<circle> lights, next_lights;
+		unsigned char color[4];
+		bool composed;
+		std::vector<unsigned char> pixels;
+	};
+
+	void compose(int tx, int ty, tile& t) const;
+
+	typedef std::pair<int, int> tile_pos;
+	typedef std::map<tile_pos, tile> tile_map;
+	tile_map tiles_;
+
+	//the tiles covered by the frame being built, inclusive.
+	int tx1_, ty1_, tx2_, ty2_;
+	unsigned char color_[4];
+
+	std::vector<unsigned char> pixels_;
+	int width_, height_;
+	point origin_;
+	int tiles_composed_;
+};
+
+#endif
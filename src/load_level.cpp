@@ -1,5 +1,7 @@
 #include <assert.h>
 
+#include <algorithm>
+
 #include "asserts.hpp"
 #include "concurrent_cache.hpp"
 #include "filesystem.hpp"
@@ -9,6 +11,8 @@
 #include "package.hpp"
 #include "preferences.hpp"
 #include "preprocessor.hpp"
+#include "save_writer.hpp"
+#include "stats.hpp"
 #include "string_utils.hpp"
 #include "texture.hpp"
 #include "thread.hpp"
@@ -21,9 +25,9 @@ level_wml_map& wml_cache() {
 	return instance;
 }
 
-std::map<std::string, threading::thread*>& wml_threads()
+std::map<std::string, threading::task_ptr>& wml_tasks()
 {
-	static std::map<std::string, threading::thread*> instance;
+	static std::map<std::string, threading::task_ptr> instance;
 	return instance;
 }
 
@@ -75,7 +79,7 @@ void preload_level_wml(const std::string& lvl)
 	}
 
 	wml_cache().put(lvl, wml::const_node_ptr());
-	wml_threads()[lvl] = new threading::thread(wml_loader(lvl));
+	wml_tasks()[lvl] = threading::run_task(wml_loader(lvl));
 }
 
 wml::const_node_ptr load_level_wml(const std::string& lvl)
@@ -88,14 +92,14 @@ wml::const_node_ptr load_level_wml(const std::string& lvl)
 			filename = preferences::auto_save_file_path();
 		}
 
-		return wml::parse_wml(preprocess(sys::read_file(filename)));
+		return wml::parse_wml(preprocess(save_writer::read_file(filename)));
 	}
 
 	if(wml_cache().count(lvl)) {
-		std::map<std::string, threading::thread*>::iterator t = wml_threads().find(lvl);
-		if(t != wml_threads().end()) {
-			delete t->second;
-			wml_threads().erase(t);
+		std::map<std::string, threading::task_ptr>::iterator t = wml_tasks().find(lvl);
+		if(t != wml_tasks().end()) {
+			t->second->wait();
+			wml_tasks().erase(t);
 		}
 
 		return wml_cache().get(lvl);
@@ -112,32 +116,62 @@ wml::const_node_ptr load_level_wml_nowait(const std::string& lvl)
 }
 
 namespace {
-typedef std::map<std::string, std::pair<threading::thread*, level*> > level_map;
+//at most this many levels predicted to be needed are kept loading or
+//loaded, since each takes several megabytes.
+const int MaxLevelsPredicted = 3;
+
+struct level_preload {
+	level_preload() : predicted(false)
+	{}
+
+	//the level, loaded on the worker pool. It's NULL if the level couldn't
+	//be loaded off the main thread, or its loading was cancelled.
+	threading::future<level*> lvl;
+
+	//if the level was preloaded by predict_levels(), rather than asked
+	//for with preload_level(), so it can be cancelled.
+	bool predicted;
+};
+
+typedef std::map<std::string, level_preload> level_map;
 level_map levels_loading;
 
-threading::mutex& levels_loading_mutex() {
-	static threading::mutex m;
-	return m; 
-}
+//how many levels were loaded by the time they were needed, how many were
+//still loading, and how many were never preloaded.
+int preload_hits = 0, preload_waits = 0, preload_misses = 0;
 
-class level_loader {
-	std::string lvl_;
-public:
-	level_loader(const std::string& lvl) : lvl_(lvl)
-	{}
-	void operator()() {
-		level* lvl = NULL;
-		try {
-			lvl = new level(lvl_);
-		} catch(const graphics::texture::worker_thread_error&) {
-			//we can't load the level in here, we must do it in the main thread.
-			std::cerr << "LOAD LEVEL FAILURE: " << lvl << " MUST LOAD IN "
-			             "MAIN THREAD\n";
-		}
-		threading::lock lck(levels_loading_mutex());
-		levels_loading[lvl_].second = lvl;
+level* load_level_in_background(const std::string& lvl)
+{
+	try {
+		return new level(lvl);
+	} catch(const graphics::texture::worker_thread_error&) {
+		//we can't load the level in here, we must do it in the main thread.
+		std::cerr << "LOAD LEVEL FAILURE: " << lvl << " MUST LOAD IN "
+		             "MAIN THREAD\n";
+		return NULL;
 	}
-};
+}
+
+threading::future<level*> start_loading_level(const std::string& lvl, threading::TASK_PRIORITY priority)
+{
+	return threading::async<level*>(boost::bind(load_level_in_background, lvl), priority, true);
+}
+
+//removes a level from the preloads, and returns it, waiting for it if it's
+//still loading.
+level* take_level(level_map::iterator itor)
+{
+	const threading::future<level*> f = itor->second.lvl;
+	levels_loading.erase(itor);
+	return f.valid() ? f.get() : NULL;
+}
+
+//writes to the log, and records for the level, whether it was preloaded.
+void record_preload(const std::string& lvl, const char* result, int wait_ms)
+{
+	std::cerr << "LEVEL PRELOAD " << result << ": " << lvl << " (" << wait_ms << "ms) HITS: " << preload_hits << " WAITS: " << preload_waits << " MISSES: " << preload_misses << "\n";
+	stats::record_event(lvl, stats::const_record_ptr(new stats::preload_record(result, wait_ms)));
+}
 
 }
 
@@ -147,9 +181,10 @@ load_level_manager::load_level_manager()
 load_level_manager::~load_level_manager()
 {
 	for(level_map::iterator i = levels_loading.begin(); i != levels_loading.end(); ++i) {
-		i->second.first->join();
-		delete i->second.first;
-		delete i->second.second;
+		if(i->second.lvl.valid()) {
+			i->second.lvl.cancel();
+			delete i->second.lvl.get();
+		}
 	}
 
 	levels_loading.clear();
@@ -160,39 +195,106 @@ void preload_level(const std::string& lvl)
 	//--TODO: Currently multi-threaded pre-loading causes weird crashes.
 	//--      need to fix this!!
 	assert(!lvl.empty());
-	threading::lock lck(levels_loading_mutex());
-	if(levels_loading.count(lvl) == 0) {
-		levels_loading[lvl].first = new threading::thread(level_loader(lvl));
+	level_preload& preload = levels_loading[lvl];
+
+	//levels asked for are loaded before those which are predicted, so a
+	//predicted level which hasn't started is started again ahead of them.
+	if(preload.predicted && preload.lvl.valid() && preload.lvl.cancel()) {
+		preload.lvl = threading::future<level*>();
+	}
+
+	preload.predicted = false;
+	if(!preload.lvl.valid()) {
+		preload.lvl = start_loading_level(lvl, threading::PRIORITY_HIGH);
+	}
+}
+
+void predict_levels(const std::vector<std::string>& levels)
+{
+	std::vector<std::string> predicted;
+	foreach(const std::string& lvl, levels) {
+		if(predicted.size() < MaxLevelsPredicted && !lvl.empty() && std::count(predicted.begin(), predicted.end(), lvl) == 0) {
+			predicted.push_back(lvl);
+		}
+	}
+
+	//levels which are no longer predicted are cancelled if they're
+	//waiting, or discarded once they've loaded.
+	std::vector<std::string> discarded;
+	for(level_map::iterator i = levels_loading.begin(); i != levels_loading.end(); ++i) {
+		if(i->second.predicted && std::count(predicted.begin(), predicted.end(), i->first) == 0 && (i->second.lvl.cancel() || i->second.lvl.done())) {
+			discarded.push_back(i->first);
+		}
+	}
+
+	foreach(const std::string& lvl, discarded) {
+		delete take_level(levels_loading.find(lvl));
+	}
+
+	//predicted levels are loaded in the order they're predicted, after any
+	//which were asked for.
+	foreach(const std::string& lvl, predicted) {
+		if(levels_loading.count(lvl) == 0) {
+			level_preload& preload = levels_loading[lvl];
+			preload.predicted = true;
+			preload.lvl = start_loading_level(lvl, threading::PRIORITY_LOW);
+		}
 	}
 }
 
 level* load_level(const std::string& lvl)
 {
 	std::cerr << "START LOAD LEVEL\n";
-	level_map::iterator itor;
-	{
-		threading::lock lck(levels_loading_mutex());
-		itor = levels_loading.find(lvl);
-		if(itor == levels_loading.end()) {
-			level* res = new level(lvl);
-			res->finish_loading();
-			fprintf(stderr, "LOADED LEVEL: %p\n", res);
-			return res;
-		}
+	const int start_time = SDL_GetTicks();
+	level_map::iterator itor = levels_loading.find(lvl);
+	if(itor == levels_loading.end()) {
+		level* res = new level(lvl);
+		res->finish_loading();
+		++preload_misses;
+		record_preload(lvl, "miss", SDL_GetTicks() - start_time);
+		fprintf(stderr, "LOADED LEVEL: %p\n", res);
+		return res;
 	}
 
-	itor->second.first->join();
-	delete itor->second.first;
-	level* res = itor->second.second;
+	const bool loaded = itor->second.lvl.done();
+	level* res = take_level(itor);
 	if(res == NULL) {
 		res = new level(lvl);
 	}
 	res->finish_loading();
-	levels_loading.erase(itor);
+
+	if(loaded) {
+		++preload_hits;
+		record_preload(lvl, "hit", SDL_GetTicks() - start_time);
+	} else {
+		++preload_waits;
+		record_preload(lvl, "wait", SDL_GetTicks() - start_time);
+	}
+
 	std::cerr << "FINISH LOAD LEVEL\n";
 	return res;
 }
 
+level* take_preloaded_level(const std::string& lvl, bool wait)
+{
+	level_map::iterator itor = levels_loading.find(lvl);
+	if(itor == levels_loading.end()) {
+		return wait ? new level(lvl) : NULL;
+	}
+
+	if(!wait && !itor->second.lvl.done()) {
+		return NULL;
+	}
+
+	level* res = take_level(itor);
+	if(res == NULL) {
+		//the level couldn't be loaded in the background.
+		res = new level(lvl);
+	}
+
+	return res;
+}
+
 namespace {
 bool hidden_file(const std::string& filename) {
 	return !filename.empty() && filename[0] == '.';
@@ -21,6 +21,17 @@ wml::const_node_ptr load_level_wml_nowait(const std::string& lvl);
 void preload_level(const std::string& lvl);
 level* load_level(const std::string& lvl);
 
+//preloads the levels which are predicted to be needed next, most likely
+//first, in place of those predicted before. Levels no longer predicted
+//are cancelled, or discarded if they've loaded already.
+void predict_levels(const std::vector<std::string>& levels);
+
+//returns a level started with preload_level(), without finishing loading
+//it, as is done for sub-levels. If the level isn't loaded yet, returns
+//NULL, unless wait is true, in which case it waits for the level, or
+//loads it now if it was never preloaded.
+level* take_preloaded_level(const std::string& lvl, bool wait);
+
 std::vector<std::string> get_known_levels();
 
 #endif
@@ -7,6 +7,7 @@
 #include "package.hpp"
 #include "preferences.hpp"
 #include "preprocessor.hpp"
+#include "save_writer.hpp"
 #include "string_utils.hpp"
 #include "wml_parser.hpp"
 
@@ -65,7 +66,7 @@ wml::const_node_ptr load_level_wml(const std::string& lvl)
 			filename = preferences::auto_save_file_path();
 		}
 
-		return wml::parse_wml(preprocess(sys::read_file(filename)));
+		return wml::parse_wml(preprocess(save_writer::read_file(filename)));
 	}
 
 	if(wml_cache().count(lvl)) {
@@ -94,6 +95,10 @@ void preload_level(const std::string& lvl)
 {
 }
 
+void predict_levels(const std::vector<std::string>& levels)
+{
+}
+
 level* load_level(const std::string& lvl)
 {
 	level* res = new level(lvl);
@@ -101,6 +106,11 @@ level* load_level(const std::string& lvl)
 	return res;
 }
 
+level* take_preloaded_level(const std::string& lvl, bool wait)
+{
+	return wait ? new level(lvl) : NULL;
+}
+
 namespace {
 bool not_cfg_file(const std::string& filename) {
 	return filename.size() < 4 || !std::equal(filename.end() - 4, filename.end(), ".cfg");
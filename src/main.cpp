@@ -59,12 +59,14 @@
 #include "preferences.hpp"
 #include "preprocessor.hpp"
 #include "raster.hpp"
+#include "save_writer.hpp"
 #include "sound.hpp"
 #include "stats.hpp"
 #include "string_utils.hpp"
 #include "surface_cache.hpp"
 #include "texture.hpp"
 #include "texture_frame_buffer.hpp"
+#include "thread.hpp"
 #include "tile_map.hpp"
 #include "unit_test.hpp"
 #include "wml_node.hpp"
@@ -125,6 +127,9 @@ void print_help(const std::string& argv0)
 "      --potonly                use power of two-sized textures only\n" <<
 "      --textures16             use 16 bpp textures only (default on iPhone)\n" <<
 "      --textures32             use 32 bpp textures (default on PC/Mac)\n" <<
+"      --texture-budget=MB      keeps at most MB megabytes of textures on the\n" <<
+"                                 GPU, reloading others as needed (0 for no\n" <<
+"                                 limit)\n" <<
 
 "\n" <<
 "Developer options:\n" <<
@@ -359,6 +364,9 @@ extern "C" int main(int argc, char** argv)
 
 //	srand(time(NULL));
 
+	//the worker pool outlives the stats and level managers, which wait
+	//on its tasks as they're destroyed.
+	const threading::manager thread_manager;
 	const stats::manager stats_manager;
 
 	std::cerr
@@ -534,6 +542,9 @@ extern "C" int main(int argc, char** argv)
 		}
 	}
 
+	//make sure any save still being written in the background is finished.
+	save_writer::wait();
+
 	} //end manager scope, make managers destruct before calling SDL_Quit
 
 //	controls::debug_dump_controls();
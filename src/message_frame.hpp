@@ -0,0 +1,106 @@
+#ifndef MESSAGE_FRAME_HPP_INCLUDED
+#define MESSAGE_FRAME_HPP_INCLUDED
+
+#include <string>
+#include <vector>
+
+//messages sent over TCP between the game and the server are framed by
+//their length as a four byte integer in network order, followed by the
+//message itself. This is header only so the server can use it without
+//linking against the game.
+namespace message_frame {
+
+//messages larger than this are treated as a protocol error.
+const size_t MaxMessageSize = 65536;
+
+//appends msg, with its frame header, to out.
+inline void write(const std::string& msg, std::vector<char>& out)
+{
+	const size_t len = msg.size();
+	out.push_back(static_cast<char>((len >> 24)&0xFF));
+	out.push_back(static_cast<char>((len >> 16)&0xFF));
+	out.push_back(static_cast<char>((len >> 8)&0xFF));
+	out.push_back(static_cast<char>(len&0xFF));
+	out.insert(out.end(), msg.begin(), msg.end());
+}
+
+inline std::vector<char> write(const std::string& msg)
+{
+	std::vector<char> result;
+	write(msg, result);
+	return result;
+}
+
+//accumulates data as it's read from a stream and splits it up into the
+//messages it contains.
+class reader
+{
+public:
+	reader() : pos_(0), error_(false)
+	{}
+
+	void add_data(const char* data, size_t len) {
+		buf_.insert(buf_.end(), data, data + len);
+	}
+
+	//if a complete message has been received, sets msg to it and returns
+	//true. Returns false if more data is needed or there was an error.
+	bool next(std::string* msg) {
+		if(error_ || buf_.size() - pos_ < 4) {
+			return false;
+		}
+
+		const size_t len = message_length();
+		if(len > MaxMessageSize) {
+			error_ = true;
+			return false;
+		}
+
+		if(buf_.size() - pos_ - 4 < len) {
+			return false;
+		}
+
+		msg->assign(buf_.begin() + pos_ + 4, buf_.begin() + pos_ + 4 + len);
+		pos_ += 4 + len;
+
+		//drop consumed data once it's all been used, so the buffer doesn't
+		//grow without bound on a long lived connection.
+		if(pos_ == buf_.size()) {
+			buf_.clear();
+			pos_ = 0;
+		} else if(pos_ > MaxMessageSize) {
+			buf_.erase(buf_.begin(), buf_.begin() + pos_);
+			pos_ = 0;
+		}
+
+		return true;
+	}
+
+	//true if a complete message has been received, so next() will
+	//return it without more data being added.
+	bool has_message() const {
+		if(error_ || buf_.size() - pos_ < 4) {
+			return false;
+		}
+
+		const size_t len = message_length();
+		return len <= MaxMessageSize && buf_.size() - pos_ - 4 >= len;
+	}
+
+	//true if the stream contained a message header which is invalid.
+	bool error() const { return error_; }
+
+private:
+	size_t message_length() const {
+		const unsigned char* header = reinterpret_cast<const unsigned char*>(&buf_[pos_]);
+		return (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+	}
+
+	std::vector<char> buf_;
+	size_t pos_;
+	bool error_;
+};
+
+}
+
+#endif
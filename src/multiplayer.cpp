@@ -11,8 +11,10 @@
 
 #include "asserts.hpp"
 #include "controls.hpp"
+#include "foreach.hpp"
 #include "formatter.hpp"
 #include "level.hpp"
+#include "message_frame.hpp"
 #include "multiplayer.hpp"
 #include "preferences.hpp"
 #include "random.hpp"
@@ -46,16 +48,58 @@ bool udp_packet_waiting()
 	return command.get() != 0;
 }
 
+message_frame::reader tcp_reader;
+
 bool tcp_packet_waiting()
 {
 	if(!tcp_socket) {
 		return false;
 	}
 
+	//a read may have brought in more than one message, so the next one
+	//can already be waiting in the reader.
+	if(tcp_reader.has_message()) {
+		return true;
+	}
+
 	boost::asio::socket_base::bytes_readable command(true);
 	tcp_socket->io_control(command);
 	return command.get() != 0;
 }
+
+//blocks until a complete message arrives from the server.
+std::string read_tcp_message()
+{
+	std::string msg;
+	while(!tcp_reader.next(&msg)) {
+		if(tcp_reader.error()) {
+			fprintf(stderr, "BAD MESSAGE FRAME FROM SERVER\n");
+			throw multiplayer::error();
+		}
+
+		boost::array<char, 1024> buf;
+		boost::system::error_code error;
+		const size_t len = tcp_socket->read_some(boost::asio::buffer(buf), error);
+		if(error) {
+			fprintf(stderr, "ERROR READING FROM SOCKET\n");
+			throw multiplayer::error();
+		}
+
+		tcp_reader.add_data(&buf[0], len);
+	}
+
+	return msg;
+}
+
+void write_tcp_message(const std::string& msg)
+{
+	boost::system::error_code error;
+	boost::asio::write(*tcp_socket, boost::asio::buffer(message_frame::write(msg)), error);
+	if(error) {
+		fprintf(stderr, "NETWORK ERROR: Could not send data\n");
+		throw multiplayer::error();
+	}
+}
 }
 
 int slot()
@@ -101,19 +145,14 @@ void setup_networked_game(const std::string& server)
 		throw multiplayer::error();
 	}
 
-	boost::array<char, 4> initial_response;
-	size_t len = socket.read_some(boost::asio::buffer(initial_response), error);
-	if(error) {
-		fprintf(stderr, "ERROR READING INITIAL RESPONSE\n");
+	tcp_reader = message_frame::reader();
+	const std::string initial_response = read_tcp_message();
+	if(initial_response.size() != 4) {
+		fprintf(stderr, "INITIAL RESPONSE HAS THE WRONG SIZE: %d\n", (int)initial_response.size());
 		throw multiplayer::error();
 	}
 
-	if(len != 4) {
-		fprintf(stderr, "INITIAL RESPONSE HAS THE WRONG SIZE: %d\n", (int)len);
-		throw multiplayer::error();
-	}
-
-	memcpy(&id, &initial_response[0], 4);
+	memcpy(&id, initial_response.c_str(), 4);
 
 	fprintf(stderr, "ID: %d\n", id);
 
@@ -121,42 +160,33 @@ void setup_networked_game(const std::string& server)
     udp::resolver::query udp_query(udp::v4(), server, "17001");
 	udp_endpoint.reset(new udp::endpoint);
     *udp_endpoint = *udp_resolver.resolve(udp_query);
-    udp::endpoint& receiver_endpoint = *udp_endpoint;
 
 	udp_socket.reset(new udp::socket(io_service));
     udp_socket->open(udp::v4());
 
-	boost::array<char, 4> udp_msg;
-	memcpy(&udp_msg[0], &id, 4);
-
-//	udp_socket->send_to(boost::asio::buffer(udp_msg), receiver_endpoint);
-
-	fprintf(stderr, "SENT UDP PACKET\n");
-
-	udp::endpoint sender_endpoint;
-//	len = udp_socket->receive_from(boost::asio::buffer(udp_msg), sender_endpoint);
-	fprintf(stderr, "GOT UDP PACKET: %d\n", (int)len);
-
-	std::string msg = "greetings!";
-	socket.write_some(boost::asio::buffer(msg), error);
-	if(error) {
-		fprintf(stderr, "NETWORK ERROR: Could not send data\n");
-		throw multiplayer::error();
-	}
+	write_tcp_message("greetings!");
 }
 
 namespace {
-void send_confirm_packet(int nplayer, std::vector<char>& msg, bool has_confirm) {
-	boost::array<char, 4096> udp_msg;
-	msg.resize(6);
-	msg[0] = has_confirm ? 'a' : 'A';
+//packets between players start with their type, our ID, our slot and the
+//slot of the player they're for, so the server can relay them to just
+//that player.
+void write_packet_header(char type, int to_slot, std::vector<char>& msg)
+{
+	msg.resize(7);
+	msg[0] = type;
 	memcpy(&msg[1], &id, 4);
-	msg.back() = player_slot;
+	msg[5] = player_slot;
+	msg[6] = to_slot;
+}
 
+void send_confirm_packet(int nplayer, std::vector<char>& msg, bool has_confirm) {
 	if(nplayer == player_slot || nplayer < 0 || nplayer >= udp_endpoint_peers.size()) {
 		return;
 	}
 
+	write_packet_header(has_confirm ? 'a' : 'A', nplayer, msg);
+
 	std::cerr << "SENDING CONFIRM TO " << udp_endpoint_peers[nplayer]->port() << ": " << nplayer << "\n";
 	udp_socket->send_to(boost::asio::buffer(msg), *udp_endpoint_peers[nplayer]);
 }
@@ -189,12 +219,7 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 
 	std::ostringstream s;
 	s << "READY/" << lvl.id() << "/" << lvl.players().size() << "/" << local_host << " " << local_port;
-	boost::system::error_code error = boost::asio::error::host_not_found;
-	tcp_socket->write_some(boost::asio::buffer(s.str()), error);
-	if(error) {
-		fprintf(stderr, "ERROR WRITING TO SOCKET\n");
-		throw multiplayer::error();
-	}
+	write_tcp_message(s.str());
 
 	while(!tcp_packet_waiting()) {
 		if(idle_fn) {
@@ -211,15 +236,8 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 		udp_socket->send_to(boost::asio::buffer(send_buf), *udp_endpoint);
 	}
 
-	boost::array<char, 1024> response;
-	size_t len = tcp_socket->read_some(boost::asio::buffer(response), error);
-	if(error) {
-		fprintf(stderr, "ERROR READING FROM SOCKET\n");
-		throw multiplayer::error();
-	}
-
-	std::string str(&response[0], &response[0] + len);
-	if(std::string(str.begin(), str.begin() + 5) != "START") {
+	const std::string str = read_tcp_message();
+	if(str.size() < 6 || std::string(str.begin(), str.begin() + 5) != "START") {
 		fprintf(stderr, "UNEXPECTED RESPONSE: '%s'\n", str.c_str());
 		throw multiplayer::error();
 	}
@@ -236,6 +254,8 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 
 	udp_endpoint_peers.clear();
 
+	std::set<int> relayed_players;
+
 	for(int n = 0; n != nplayers; ++n) {
 		const char* end = strchr(ptr, '\n');
 		ASSERT_LOG(end != NULL, "ERROR PARSING RESPONSE: " << str);
@@ -264,6 +284,7 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 
 		if(preferences::relay_through_server()) {
 			*udp_endpoint_peers.back() = *udp_endpoint;
+			relayed_players.insert(n);
 		}
 	}
 
@@ -274,6 +295,14 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 
 	int confirmation_point = 1000;
 
+	//if we haven't had a packet straight from a player by their deadline,
+	//hole punching to them has failed, so we send to them through the
+	//server, which relays packets to the player they're addressed to.
+	//Players we've heard from directly keep being sent to directly.
+	const int RelayTimeout = 5000;
+	std::vector<int> relay_deadline(nplayers, SDL_GetTicks() + RelayTimeout);
+	std::set<int> direct_players;
+
 	for(int m = 0; m != 1000 && confirmed_players.size() < nplayers || m < confirmation_point + 50; ++m) {
 
 		std::vector<char> msg;
@@ -286,13 +315,22 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 			boost::array<char, 4096> udp_msg;
 			udp::endpoint endpoint;
 			size_t len = udp_socket->receive_from(boost::asio::buffer(udp_msg), endpoint);
-			if(len == 6 && toupper(udp_msg[0]) == 'A') {
-				confirmed_players.insert(udp_msg[5]);
-				if(udp_msg[5] >= 0 && udp_msg[5] < udp_endpoint_peers.size()) {
-					if(endpoint.port() != udp_endpoint_peers[udp_msg[5]]->port()) {
-						std::cerr << "REASSIGNING PORT " << endpoint.port() << " TO " << udp_endpoint_peers[udp_msg[5]]->port() << "\n";
+			if(len == 7 && toupper(udp_msg[0]) == 'A') {
+				const int nplayer = udp_msg[5];
+				if(nplayer < 0 || nplayer >= nplayers || nplayer == player_slot) {
+					continue;
+				}
+
+				confirmed_players.insert(nplayer);
+
+				//a packet relayed by the server comes from the server's
+				//address, which tells us nothing about where the player is.
+				if(endpoint != *udp_endpoint && !relayed_players.count(nplayer)) {
+					if(endpoint.port() != udp_endpoint_peers[nplayer]->port()) {
+						std::cerr << "REASSIGNING PORT " << endpoint.port() << " TO " << udp_endpoint_peers[nplayer]->port() << "\n";
 					}
-					*udp_endpoint_peers[udp_msg[5]] = endpoint;
+					*udp_endpoint_peers[nplayer] = endpoint;
+					direct_players.insert(nplayer);
 				}
 
 				if(confirmed_players.size() >= nplayers && m < confirmation_point) {
@@ -303,16 +341,29 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 			}
 		}
 
+		const int ticks = SDL_GetTicks();
+		for(int n = 0; n != nplayers; ++n) {
+			if(n == player_slot || direct_players.count(n) || relayed_players.count(n) || ticks < relay_deadline[n]) {
+				continue;
+			}
+
+			std::cerr << "FALLING BACK TO RELAY FOR PLAYER " << n << "\n";
+			*udp_endpoint_peers[n] = *udp_endpoint;
+			relayed_players.insert(n);
+		}
+
 		//we haven't had any luck so far, so start port scanning, in case
 		//it's on another port.
 		if(m > 100 && (m%100) == 0) {
 			for(int n = 0; n != nplayers; ++n) {
-				if(n == player_slot || confirmed_players.count(n)) {
+				if(n == player_slot || direct_players.count(n) || relayed_players.count(n)) {
 					continue;
 				}
 
 				std::cerr << "PORTSCANNING FOR PORTS...\n";
 
+				write_packet_header(confirmed_players.count(n) ? 'a' : 'A', n, msg);
+
 				for(int port_offset=-5; port_offset != 100; ++port_offset) {
 					udp::endpoint peer_endpoint;
 					const int port = udp_endpoint_peers[n]->port() + port_offset;
@@ -402,13 +453,14 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 
 					fprintf(stderr, "SENDING ADVISORY TO START IN %d - %d\n", start_in, (start_in - start_advisory));
 
-					const int buf_len = sprintf(buf, "PXXXX%d %d %d", ping_id, start_advisory, delay);
-					memcpy(&buf[1], &id, 4);
+					const int buf_len = sprintf(buf, "%d %d %d", ping_id, start_advisory, delay);
 
-					std::string msg(buf, buf + buf_len);
+					std::vector<char> msg;
+					write_packet_header('P', n, msg);
+					msg.insert(msg.end(), buf, buf + buf_len);
 					udp_socket->send_to(boost::asio::buffer(msg), *udp_endpoint_peers[n]);
 					ping_sent_at[ping_id] = ticks;
-					contents_ping[std::string(msg.begin()+5, msg.end())] = ping_id;
+					contents_ping[std::string(buf, buf + buf_len)] = ping_id;
 					ping_player[ping_id] = n;
 					ping_id++;
 				}
@@ -416,9 +468,9 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 
 			while(udp_packet_waiting()) {
 				size_t len = udp_socket->receive(boost::asio::buffer(receive_buf));
-				if(len > 5 && receive_buf[0] == 'P') {
+				if(len > 7 && receive_buf[0] == 'P') {
 					std::string msg(&receive_buf[0], &receive_buf[0] + len);
-					std::string msg_content(msg.begin()+5, msg.end());
+					std::string msg_content(msg.begin()+7, msg.end());
 					ASSERT_LOG(contents_ping.count(msg_content), "UNRECOGNIZED PING: " << msg);
 					const int ping = contents_ping[msg_content];
 					const int latency = ticks - ping_sent_at[ping];
@@ -429,7 +481,7 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 
 					fprintf(stderr, "RECEIVED PING FROM %d IN %d AVG LATENCY %d\n", nplayer, latency, player_latency[nplayer]/player_nresponses[nplayer]);
 				} else {
-					if(len == 6 && receive_buf[0] == 'A') {
+					if(len == 7 && receive_buf[0] == 'A') {
 						std::vector<char> msg;
 						const int player_num = receive_buf[5];
 						send_confirm_packet(player_num, msg, true);
@@ -448,11 +500,15 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 			while(udp_packet_waiting()) {
 				size_t len = udp_socket->receive(boost::asio::buffer(buf));
 				std::cerr << "GOT MESSAGE: " << buf[0] << "\n";
-				if(len > 5 && buf[0] == 'P') {
-					memcpy(&buf[1], &id, 4); //write our ID for the return msg.
+				if(len > 7 && buf[0] == 'P') {
+					//write our ID and slot for the return msg, which goes
+					//back to player 0.
+					memcpy(&buf[1], &id, 4);
+					buf[5] = player_slot;
+					buf[6] = 0;
 					const std::string s(&buf[0], &buf[0] + len);
 
-					std::string::const_iterator begin_start_time = std::find(s.begin() + 5, s.end(), ' ');
+					std::string::const_iterator begin_start_time = std::find(s.begin() + 7, s.end(), ' ');
 					ASSERT_LOG(begin_start_time != s.end(), "NO WHITE SPACE FOUND IN PING MESSAGE: " << s);
 					std::string::const_iterator begin_delay = std::find(begin_start_time + 1, s.end(), ' ');
 					ASSERT_LOG(begin_delay != s.end(), "NO WHITE SPACE FOUND IN PING MESSAGE: " << s);
@@ -472,7 +528,7 @@ void sync_start_time(const level& lvl, boost::function<bool()> idle_fn)
 					}
 					udp_socket->send_to(boost::asio::buffer(s), *udp_endpoint_peers[0]);
 				} else {
-					if(len == 6 && buf[0] == 'A') {
+					if(len == 7 && buf[0] == 'A') {
 						std::vector<char> msg;
 						const int player_num = buf[5];
 						send_confirm_packet(player_num, msg, true);
@@ -500,17 +556,19 @@ void send_and_receive()
 		return;
 	}
 
-	//send our ID followed by the send packet.
-	std::vector<char> send_buf(5);
-	send_buf[0] = 'C';
-	memcpy(&send_buf[1], &id, 4);
-	controls::write_control_packet(send_buf);
-
+	//send our ID followed by a packet for each player, so each only gets
+	//the cycles it hasn't acknowledged.
+	static std::vector<char> send_buf;
 	for(int n = 0; n != udp_endpoint_peers.size(); ++n) {
 		if(n == player_slot) {
 			continue;
 		}
 
+		send_buf.resize(5);
+		send_buf[0] = 'C';
+		memcpy(&send_buf[1], &id, 4);
+		controls::write_control_packet(send_buf, n);
+
 		udp_socket->send_to(boost::asio::buffer(send_buf), *udp_endpoint_peers[n]);
 	}
 
@@ -520,8 +578,10 @@ void send_and_receive()
 void receive()
 {
 	while(udp_packet_waiting()) {
-		udp::endpoint sender_endpoint;
-		boost::array<char, 4096> udp_msg;
+		//big enough for the largest datagram there can be, so packets are
+		//never truncated. What's readable isn't always the size of the
+		//next datagram, so we can't size it from that.
+		static std::vector<char> udp_msg(65536);
 		size_t len = udp_socket->receive(boost::asio::buffer(udp_msg));
 		if(len == 0 || udp_msg[0] != 'C') {
 			continue;
@@ -538,6 +598,49 @@ void receive()
 
 }
 
+UNIT_TEST(message_frame_reader)
+{
+	std::vector<char> stream;
+	message_frame::write("READY/level/2/127.0.0.1 5000", stream);
+	message_frame::write("", stream);
+	message_frame::write("greetings!", stream);
+
+	//feed the stream in a byte at a time, as a worst case of fragmentation.
+	message_frame::reader reader;
+	std::vector<std::string> messages;
+	std::string msg;
+	foreach(char c, stream) {
+		reader.add_data(&c, 1);
+		while(reader.next(&msg)) {
+			messages.push_back(msg);
+		}
+	}
+
+	CHECK_EQ(messages.size(), 3);
+	CHECK_EQ(messages[0], "READY/level/2/127.0.0.1 5000");
+	CHECK_EQ(messages[1], "");
+	CHECK_EQ(messages[2], "greetings!");
+	CHECK_EQ(reader.error(), false);
+	CHECK_EQ(reader.has_message(), false);
+
+	//two messages read at once are both waiting after the first is taken.
+	std::vector<char> both;
+	message_frame::write("START 2", both);
+	message_frame::write("PING", both);
+	reader.add_data(&both[0], both.size());
+	CHECK_EQ(reader.has_message(), true);
+	CHECK_EQ(reader.next(&msg), true);
+	CHECK_EQ(reader.has_message(), true);
+	CHECK_EQ(reader.next(&msg), true);
+	CHECK_EQ(msg, "PING");
+	CHECK_EQ(reader.has_message(), false);
+
+	const char bad_header[] = { 0x7F, 0, 0, 0 };
+	reader.add_data(bad_header, 4);
+	CHECK_EQ(reader.next(&msg), false);
+	CHECK_EQ(reader.error(), true);
+}
+
 namespace {
 struct Peer {
 	std::string host, port;
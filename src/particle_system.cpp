@@ -5,6 +5,7 @@
 
 #include "asserts.hpp"
 #include "color_utils.hpp"
+#include "draw_stats.hpp"
 #include "entity.hpp"
 #include "foreach.hpp"
 #include "formula.hpp"
@@ -496,6 +497,7 @@ void simple_particle_system::draw(const rect& area, const entity& e) const
 	
 	glVertexPointer(2, GL_FLOAT, 0, &varray.front());
 	glTexCoordPointer(2, GL_FLOAT, 0, &tcarray.front());
+	draw_stats::draw_call(varray.size()/2);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, varray.size()/2);
 
 	if(info_.delta_a_){
@@ -710,6 +712,7 @@ public:
 
 		glVertexPointer(2, GL_SHORT, 0, &vertex[0]);
 		glColorPointer(4, GL_UNSIGNED_BYTE, 0, &colors[0]);
+		draw_stats::draw_call(particles_.size());
 		glDrawArrays(GL_POINTS, 0, particles_.size());
 
 		glDisableClientState(GL_COLOR_ARRAY);
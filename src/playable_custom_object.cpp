@@ -58,6 +58,15 @@ entity_ptr playable_custom_object::backup() const
 	return entity_ptr(new playable_custom_object(*this));
 }
 
+entity_ptr playable_custom_object::save_copy() const
+{
+	entity_ptr res = custom_object::save_copy();
+	playable_custom_object& copy = static_cast<playable_custom_object&>(*res);
+	copy.difficulty_ = difficulty_;
+	copy.underwater_controls_ = underwater_controls_;
+	return res;
+}
+
 entity_ptr playable_custom_object::clone() const
 {
 	return entity_ptr(new playable_custom_object(*this));
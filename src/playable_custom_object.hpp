@@ -28,6 +28,7 @@ public:
 
 	virtual entity_ptr backup() const;
 	virtual entity_ptr clone() const;
+	virtual entity_ptr save_copy() const;
 
 	virtual int vertical_look() const { return vertical_look_; }
 
@@ -153,6 +153,14 @@ namespace preferences {
 		
 		bool force_no_npot_textures_ = false;
 
+		//megabytes of textures kept on the GPU. Phones and handhelds have
+		//little memory to share between the CPU and GPU.
+#if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR || defined(TARGET_OS_HARMATTAN) || defined(TARGET_PANDORA) || defined(TARGET_TEGRA)
+		int texture_budget_ = 64;
+#else
+		int texture_budget_ = 256;
+#endif
+
 		bool run_failing_unit_tests_ = false;
 	}
 
@@ -379,6 +387,11 @@ namespace preferences {
 	{
 		return force_no_npot_textures_;
 	}
+
+	int texture_budget()
+	{
+		return texture_budget_;
+	}
 	
 	bool screen_rotated()
 	{
@@ -471,7 +484,7 @@ namespace preferences {
 		wml::node_ptr registry_node(new wml::node("registry"));
 		game_registry::instance().write_contents(registry_node);
 		node->add_child(registry_node);
-		sys::write_file(preferences_path_ + "preferences.cfg", wml::output(node));
+		wml::write_file(preferences_path_ + "preferences.cfg", node);
 	}
 
 	editor_screen_size_scope::editor_screen_size_scope() : width_(virtual_screen_width_), height_(virtual_screen_height_) {
@@ -576,6 +589,8 @@ namespace preferences {
 		} else if(arg_name == "--set-fps" && !arg_value.empty()) {
 			frame_time_millis_ = 1000/boost::lexical_cast<int, std::string>(arg_value);
 			std::cerr << "FPS: " << arg_value << " = " << frame_time_millis_ << "ms/frame\n";
+		} else if(arg_name == "--texture-budget" && !arg_value.empty()) {
+			texture_budget_ = boost::lexical_cast<int, std::string>(arg_value);
 		} else if(arg_name == "--config-path" && !arg_value.empty()) {
 			set_preferences_path(arg_value);
 		} else if(s == "--send-stats") {
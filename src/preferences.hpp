@@ -98,6 +98,9 @@ void set_bequ( bool value );
 	
 	bool force_no_npot_textures();
 
+	//the megabytes of textures to keep loaded on the GPU, or 0 for no limit.
+	int texture_budget();
+
 	bool use_16bpp_textures();
 
 	bool sim_iphone();
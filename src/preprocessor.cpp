@@ -1,64 +1,294 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <map>
 #include <sstream>
 #include <string>
 
+#include <boost/shared_ptr.hpp>
+
 #include "preprocessor.hpp"
 #include "filesystem.hpp"
-std::string preprocess(const std::string& input){
-	std::string output_string;
+#include "foreach.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+
+namespace {
+
+//an included file with its directives expanded.
+struct expanded_file {
+	time_t mod_time;
+	std::string text;
+
+	//every file this file includes, directly or indirectly, with the
+	//modification time it had when this file was expanded.
+	std::vector<std::pair<std::string, time_t> > dependencies;
+};
 
+typedef boost::shared_ptr<const expanded_file> const_expanded_file_ptr;
+typedef std::map<std::string, const_expanded_file_ptr> expanded_file_map;
+
+//files are preprocessed from several threads at once, so the cache and
+//its mutex are made before any threads are started.
+expanded_file_map file_cache_instance;
+threading::mutex file_cache_mutex_instance;
+
+expanded_file_map& file_cache()
+{
+	return file_cache_instance;
+}
+
+threading::mutex& file_cache_mutex()
+{
+	return file_cache_mutex_instance;
+}
+
+bool up_to_date(const expanded_file& f, time_t mod_time)
+{
+	if(f.mod_time != mod_time) {
+		return false;
+	}
+
+	typedef std::pair<std::string, time_t> dependency;
+	foreach(const dependency& dep, f.dependencies) {
+		if(sys::file_mod_time(dep.first) != dep.second) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//the files found to be up to date during one call to preprocess(), so a
+//file included many times only has to be checked once.
+typedef std::map<std::string, const_expanded_file_ptr> checked_file_map;
+
+const_expanded_file_ptr get_expanded_file(const std::string& fname, checked_file_map& checked);
+
+const std::string IncludeString = "@include";
+
+//expands input onto the end of output, copying everything between
+//directives across in one go, and adds every file included to deps.
+void expand(const std::string& input, std::string& output, std::vector<std::pair<std::string, time_t> >* deps, checked_file_map& checked)
+{
 	std::string::const_iterator i = input.begin();
-	
-	while(i != input.end()){
-		//std::cerr << "test";
-		if(*i == '@'){
-
-
-			// process pre-processing directive here. See what comes after the '@' and do something appropriate
-			static const std::string IncludeString = "@include";
-			if(input.end() - i > IncludeString.size() && std::equal(IncludeString.begin(), IncludeString.end(), i)) {
-					std::string filename_string;
-
-					i += IncludeString.size(); //skip past the directive - we've tested that it exists
-					
-					//test for an argument to @include - e.g. "filename.cfg".  First the open quote:
-					std::string::const_iterator quote = std::find(i, input.end(), '"');
-					if(quote == input.end()) {
-						std::cerr << "we didn't find a opening quote. Syntax error." << std::endl;
-					}
-					if(std::count_if(i, quote, isspace) != quote - i) {
-					// # of whitespaces != number of intervening chars => something else was present.  Syntax Error. 
-						std::cerr << "# of whitespaces != number of intervening chars." << std::endl;
-					}
-					i = quote + 1; //we've found a quote, advance past it
-					//now the closing quote, and use it to find what's inbetween:
-					std::string::const_iterator endQuote = std::find(i, input.end(), '"');
-					if(endQuote == input.end()) {
-						std::cerr << "we didn't find a closing quote. Syntax error." << std::endl;
-					}
-					
-					
-					filename_string = std::string(i, endQuote);
-					
-					i = endQuote + 1;
-					
-															
-					output_string += preprocess(sys::read_file(filename_string));
+	for(;;) {
+		std::string::const_iterator directive = std::find(i, input.end(), '@');
+		output.append(i, directive);
+		i = directive;
+		if(i == input.end()) {
+			break;
+		}
+
+		if(input.end() - i > IncludeString.size() && std::equal(IncludeString.begin(), IncludeString.end(), i)) {
+			i += IncludeString.size();
+
+			//the argument to @include is a quoted filename, e.g. "filename.cfg"
+			std::string::const_iterator quote = std::find(i, input.end(), '"');
+			if(quote == input.end()) {
+				std::cerr << "we didn't find a opening quote. Syntax error." << std::endl;
+				break;
+			}
+
+			if(std::count_if(i, quote, isspace) != quote - i) {
+				std::cerr << "# of whitespaces != number of intervening chars." << std::endl;
+			}
+
+			i = quote + 1;
+			std::string::const_iterator end_quote = std::find(i, input.end(), '"');
+			if(end_quote == input.end()) {
+				std::cerr << "we didn't find a closing quote. Syntax error." << std::endl;
+				break;
 			}
+
+			const std::string filename(i, end_quote);
+			i = end_quote + 1;
+
+			const_expanded_file_ptr f = get_expanded_file(filename, checked);
+			output += f->text;
+			if(deps) {
+				deps->push_back(std::make_pair(filename, f->mod_time));
+				deps->insert(deps->end(), f->dependencies.begin(), f->dependencies.end());
+			}
+		}
+
+		//the character following a directive is dropped, as is an '@'
+		//which doesn't begin a directive.
+		if(i != input.end()) {
+			++i;
+		}
+	}
+}
+
+const_expanded_file_ptr get_expanded_file(const std::string& fname, checked_file_map& checked)
+{
+	checked_file_map::const_iterator checked_itor = checked.find(fname);
+	if(checked_itor != checked.end()) {
+		return checked_itor->second;
+	}
+
+	const time_t mod_time = sys::file_mod_time(fname);
+	const_expanded_file_ptr cached;
+	{
+		threading::lock lck(file_cache_mutex());
+		expanded_file_map::const_iterator itor = file_cache().find(fname);
+		if(itor != file_cache().end()) {
+			cached = itor->second;
+		}
+	}
+
+	if(cached && up_to_date(*cached, mod_time)) {
+		checked[fname] = cached;
+		return cached;
+	}
+
+	boost::shared_ptr<expanded_file> f(new expanded_file);
+	f->mod_time = mod_time;
+	expand(sys::read_file(fname), f->text, &f->dependencies, checked);
+
+	{
+		threading::lock lck(file_cache_mutex());
+		file_cache()[fname] = f;
+	}
+
+	checked[fname] = f;
+	return f;
+}
+
+}
+
+std::string preprocess(const std::string& input)
+{
+	return preprocess(input, NULL);
+}
+
+std::string preprocess(const std::string& input, std::vector<std::string>* includes)
+{
+	std::string output;
+	output.reserve(input.size());
+
+	std::vector<std::pair<std::string, time_t> > deps;
+	checked_file_map checked;
+	expand(input, output, includes ? &deps : NULL, checked);
+
+	if(includes) {
+		typedef std::pair<std::string, time_t> dependency;
+		foreach(const dependency& dep, deps) {
+			if(std::find(includes->begin(), includes->end(), dep.first) == includes->end()) {
+				includes->push_back(dep.first);
+			}
+		}
+	}
+
+	return output;
+}
+
+void invalidate_preprocessed_file(const std::string& fname)
+{
+	threading::lock lck(file_cache_mutex());
+	expanded_file_map& cache = file_cache();
+	cache.erase(fname);
+
+	typedef std::pair<std::string, time_t> dependency;
+	for(expanded_file_map::iterator i = cache.begin(); i != cache.end(); ) {
+		bool depends = false;
+		foreach(const dependency& dep, i->second->dependencies) {
+			if(dep.first == fname) {
+				depends = true;
+				break;
+			}
+		}
+
+		if(depends) {
+			cache.erase(i++);
 		} else {
-			//nothing special to process, just copy the chars across
-			output_string.push_back(*i);
+			++i;
+		}
+	}
+}
+
+namespace {
+std::string test_file_path(const std::string& name)
+{
+	return sys::get_dir(sys::get_user_data_dir() + "/preprocess_test") + "/" + name;
+}
+}
+
+UNIT_TEST(preprocess_includes)
+{
+	const std::string inner = test_file_path("inner.cfg");
+	const std::string outer = test_file_path("outer.cfg");
+	sys::write_file(inner, "x=1\n");
+	sys::write_file(outer, "[a]\n@include \"" + inner + "\"\n[/a]\n");
+
+	std::vector<std::string> includes;
+	CHECK_EQ(preprocess("[doc]\n@include \"" + outer + "\"\ny=a@b\n[/doc]\n", &includes), "[doc]\n[a]\nx=1\n[/a]\ny=ab\n[/doc]\n");
+	CHECK_EQ(includes.size(), 2);
+	CHECK_EQ(includes[0], outer);
+	CHECK_EQ(includes[1], inner);
+
+	//changing a file which is included indirectly is picked up.
+	sys::write_file(inner, "x=2\n");
+	invalidate_preprocessed_file(inner);
+	CHECK_EQ(preprocess("@include \"" + outer + "\"\n"), "[a]\nx=2\n[/a]\n");
+
+	remove(inner.c_str());
+	remove(outer.c_str());
+}
+
+namespace {
+//a level which includes many files, each of which includes more.
+std::string create_heavy_include_level()
+{
+	std::string lvl = "[level]\n";
+	for(int n = 0; n != 50; ++n) {
+		std::ostringstream inner;
+		inner << "[character]\ntype=\"ant_black\"\nx=" << n*32 << "\ny=100\n";
+		for(int m = 0; m != 50; ++m) {
+			inner << "on_event" << m << "=\"[set(velocity_x, 100), spawn('ant', x, y, 1)]\"\n";
+		}
+		inner << "[/character]\n";
+
+		std::ostringstream name;
+		name << "inner" << n << ".cfg";
+		sys::write_file(test_file_path(name.str()), inner.str());
+
+		std::ostringstream outer;
+		outer << "@include \"" << test_file_path(name.str()) << "\"\n";
+		outer << "@include \"" << test_file_path(name.str()) << "\"\n";
+
+		std::ostringstream outer_name;
+		outer_name << "outer" << n << ".cfg";
+		sys::write_file(test_file_path(outer_name.str()), outer.str());
+
+		for(int m = 0; m != 4; ++m) {
+			lvl += "@include \"" + test_file_path(outer_name.str()) + "\"\n";
 		}
-		++i;
 	}
 
-	return output_string;
+	lvl += "[/level]\n";
+	return lvl;
+}
 }
 
+//preprocesses a level with many includes, with the included files
+//cached, and with them having to be read and expanded each time as they
+//always used to be.
+BENCHMARK_ARG(preprocess_heavy_includes, bool cached)
+{
+	static const std::string lvl = create_heavy_include_level();
+	BENCHMARK_LOOP {
+		if(!cached) {
+			threading::lock lck(file_cache_mutex());
+			file_cache().clear();
+		}
 
+		preprocess(lvl);
+	}
+}
 
+BENCHMARK_ARG_CALL(preprocess_heavy_includes, uncached, false);
+BENCHMARK_ARG_CALL(preprocess_heavy_includes, cached, true);
 
 #ifdef BUILD_PREPROCESSOR_TOOL
 
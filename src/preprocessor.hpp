@@ -1,7 +1,21 @@
 #ifndef PREPROCESSOR_HPP_INCLUDED
 #define PREPROCESSOR_HPP_INCLUDED
 
+#include <string>
+#include <vector>
+
+//expands the @include directives in input. Included files are expanded
+//once and cached, and only expanded again when they, or a file they
+//include, have been modified.
 std::string preprocess(const std::string& input);
 
+//as preprocess(), and also adds the path of every file input includes,
+//directly or indirectly, to includes.
+std::string preprocess(const std::string& input, std::vector<std::string>* includes);
+
+//forgets the cached expansion of the file and of every file which includes
+//it, for when a file has been written too recently for its modification
+//time to show it has changed.
+void invalidate_preprocessed_file(const std::string& fname);
 
 #endif
@@ -193,7 +193,7 @@ void property_editor_dialog::toggle_property(const std::string& id)
 {
 	game_logic::formula_callable* vars = entity_->vars();
 	if(vars) {
-		vars->mutate_value(id, variant(!vars->query_value(id).as_bool()));
+		editor_.edit_object_value(entity_, id, variant(!vars->query_value(id).as_bool()));
 		init();
 	}
 }
@@ -203,7 +203,7 @@ void property_editor_dialog::change_property(const std::string& id, int change)
 	std::cerr << "CHANGE PROPERTY: " << change << "\n";
 	game_logic::formula_callable* vars = entity_->vars();
 	if(vars) {
-		vars->mutate_value(id, vars->query_value(id) + variant(change));
+		editor_.edit_object_value(entity_, id, vars->query_value(id) + variant(change));
 		init();
 	}
 }
@@ -247,7 +247,7 @@ void property_editor_dialog::change_text_property(const std::string& id)
 	//set the variable to the new value
 	game_logic::formula_callable* vars = entity_->vars();
 	if(vars) {
-		vars->mutate_value(id, variant(entry->text()));
+		editor_.edit_object_value(entity_, id, variant(entry->text()));
 		init();
 	}
 }
@@ -19,6 +19,7 @@
 #endif
 
 #include "asserts.hpp"
+#include "draw_stats.hpp"
 #include "foreach.hpp"
 #include "preferences.hpp"
 #include "raster.hpp"
@@ -227,6 +228,7 @@ SDL_Surface* set_video_mode(int w, int h, int bitsperpixel, int flags)
 		};
 		glVertexPointer(2, GL_FLOAT, 0, varray);
 		glTexCoordPointer(2, GL_FLOAT, 0, tcarray);
+		draw_stats::draw_call(4);
 		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 		
 		glPopMatrix();
@@ -302,6 +304,7 @@ SDL_Surface* set_video_mode(int w, int h, int bitsperpixel, int flags)
 			};
 			glVertexPointer(2, GL_FLOAT, 0, varray);
 			glTexCoordPointer(2, GL_FLOAT, 0, tcarray);
+			draw_stats::draw_call(4);
 			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 			glPopMatrix();
 		}
@@ -379,6 +382,7 @@ SDL_Surface* set_video_mode(int w, int h, int bitsperpixel, int flags)
 					
 					glVertexPointer(2, GL_FLOAT, 0, points);
 					glTexCoordPointer(2, GL_FLOAT, 0, uv);
+					draw_stats::draw_call(4);
 					glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 				}
 			}
@@ -556,6 +560,7 @@ void flush_blit_texture()
 	blit_current_texture->set_as_current_texture();
 	glVertexPointer(2, GL_SHORT, 0, &blit_vqueue.front());
 	glTexCoordPointer(2, GL_FLOAT, 0, &blit_tcqueue.front());
+	draw_stats::draw_call(blit_tcqueue.size()/2);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, blit_tcqueue.size()/2);
 
 	blit_current_texture = NULL;
@@ -580,6 +585,7 @@ void blit_queue::do_blit() const
 
 	glVertexPointer(2, GL_SHORT, 0, &vertex_.front());
 	glTexCoordPointer(2, GL_FLOAT, 0, &uv_.front());
+	draw_stats::draw_call(uv_.size()/2);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, uv_.size()/2);
 }
 
@@ -593,6 +599,7 @@ void blit_queue::do_blit_range(short begin, short end) const
 
 	glVertexPointer(2, GL_SHORT, 0, &vertex_[begin]);
 	glTexCoordPointer(2, GL_FLOAT, 0, &uv_[begin]);
+	draw_stats::draw_call((end - begin)/2);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, (end - begin)/2);
 }
 
@@ -620,6 +627,23 @@ bool blit_queue::merge(const blit_queue& q, short begin, short end)
 
 	return true;
 }
+
+rect blit_queue::bounding_rect() const
+{
+	if(vertex_.empty()) {
+		return rect();
+	}
+
+	int x1 = vertex_[0], y1 = vertex_[1], x2 = x1, y2 = y1;
+	for(int n = 2; n < vertex_.size(); n += 2) {
+		x1 = std::min<int>(x1, vertex_[n]);
+		x2 = std::max<int>(x2, vertex_[n]);
+		y1 = std::min<int>(y1, vertex_[n+1]);
+		y2 = std::max<int>(y2, vertex_[n+1]);
+	}
+
+	return rect(x1, y1, x2 - x1, y2 - y1);
+}
 	
 	void set_draw_detection_rect(const rect& rect, char* buf)
 	{
@@ -662,6 +686,7 @@ bool blit_queue::merge(const blit_queue& q, short begin, short end)
 			r.x+r.w, r.y+r.h
 		};
 		glVertexPointer(2, GL_FLOAT, 0, varray);
+		draw_stats::draw_call(4);
 		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 		//glRecti(r.x,r.y,r.x+r.w,r.y+r.h);
 		glColor4ub(255, 255, 255, 255);
@@ -681,6 +706,7 @@ bool blit_queue::merge(const blit_queue& q, short begin, short end)
 			r.x()+r.w(), r.y()+r.h()
 		};
 		glVertexPointer(2, GL_FLOAT, 0, varray);
+		draw_stats::draw_call(4);
 		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 		//glRecti(r.x(),r.y(),r.x()+r.w(),r.y()+r.h());
 		glColor4ub(255, 255, 255, 255);
@@ -702,6 +728,7 @@ bool blit_queue::merge(const blit_queue& q, short begin, short end)
 			r.x, r.y + r.h
 		};
 		glVertexPointer(2, GL_FLOAT, 0, varray);
+		draw_stats::draw_call(sizeof(varray)/sizeof(GLfloat)/2);
 		glDrawArrays(GL_LINE_LOOP, 0, sizeof(varray)/sizeof(GLfloat)/2);
 		glColor4ub(255, 255, 255, 255);
 		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
@@ -728,6 +755,7 @@ bool blit_queue::merge(const blit_queue& q, short begin, short end)
 		varray.push_back(varray[3]);
 
 		glVertexPointer(2, GL_FLOAT, 0, &varray.front());
+		draw_stats::draw_call(varray.size()/2);
 		glDrawArrays(GL_TRIANGLE_FAN, 0, varray.size()/2);
 		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 		glEnable(GL_TEXTURE_2D);
@@ -91,6 +91,9 @@ public:
 
 	bool merge(const blit_queue& q, short begin, short end);
 
+	//the smallest rectangle containing every vertex in the queue.
+	rect bounding_rect() const;
+
 	void reserve(size_t n) {
 		vertex_.reserve(n);
 		uv_.reserve(n);
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+#include "SDL.h"
+
+#include "filesystem.hpp"
+#include "level.hpp"
+#include "preferences.hpp"
+#include "save_writer.hpp"
+#include "sound.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+#include "wml_node.hpp"
+#include "wml_writer.hpp"
+
+namespace save_writer
+{
+
+namespace {
+//the task writing the most recently requested save. Each save continues
+//from the one before it, so saves are written in order.
+threading::task_ptr last_save;
+
+//the snapshots of saves which are being written. They hold copies of the
+//level's objects, so they're kept here to be destroyed on the game
+//thread once they're written, rather than by the task writing them.
+std::vector<std::pair<threading::task_ptr, level_snapshot_ptr> > snapshots;
+
+int last_snapshot_ms = 0;
+int last_write_ms = 0;
+
+threading::mutex& stats_mutex()
+{
+	static threading::mutex m;
+	return m;
+}
+
+//guards last_save, since saves are read by level loading tasks.
+threading::mutex& save_mutex()
+{
+	static threading::mutex m;
+	return m;
+}
+
+bool is_compressed(const std::string& data)
+{
+	return data.size() >= 2 && static_cast<unsigned char>(data[0]) == 0x1f && static_cast<unsigned char>(data[1]) == 0x8b;
+}
+
+std::string decompress(const std::string& data)
+{
+	std::istringstream in(data);
+	boost::iostreams::filtering_istream filter;
+	filter.push(boost::iostreams::gzip_decompressor());
+	filter.push(in);
+
+	std::ostringstream out;
+	boost::iostreams::copy(filter, out);
+	return out.str();
+}
+
+struct write_job
+{
+	write_job() : snapshot(NULL)
+	{}
+
+	//what to write: either a node, or a snapshot of a level.
+	wml::const_node_ptr node;
+	level_snapshot* snapshot;
+	std::string path;
+
+	void operator()() const {
+		const int start_time = SDL_GetTicks();
+
+		const wml::const_node_ptr out = snapshot ? snapshot->write() : node;
+
+		//write to a temporary file and move it into place, so if we're
+		//interrupted, or the disk is full, the old save is still intact.
+		const std::string tmp_path = path + ".tmp";
+		if(!wml::write_file(tmp_path, out, true)) {
+			std::cerr << "ERROR: COULD NOT WRITE SAVE TO " << tmp_path << "\n";
+			remove(tmp_path.c_str());
+		} else if(!sys::replace_file(tmp_path, path)) {
+			std::cerr << "ERROR: COULD NOT MOVE SAVE " << tmp_path << " TO " << path << "\n";
+		}
+
+		threading::lock lck(stats_mutex());
+		last_write_ms = SDL_GetTicks() - start_time;
+	}
+};
+
+threading::task_ptr start_write(const write_job& job)
+{
+	threading::lock lck(save_mutex());
+	if(last_save) {
+		last_save = last_save->then(job, threading::PRIORITY_NORMAL, true);
+	} else {
+		last_save = threading::run_task(job, threading::PRIORITY_NORMAL, true);
+	}
+
+	return last_save;
+}
+
+//waits for every save requested so far. May be called from any thread.
+void wait_for_writes()
+{
+	threading::task_ptr t;
+	{
+		threading::lock lck(save_mutex());
+		t = last_save;
+	}
+
+	if(t) {
+		t->wait();
+	}
+}
+
+void release_written_snapshots()
+{
+	for(int n = 0; n != snapshots.size(); ) {
+		if(snapshots[n].first->done()) {
+			snapshots.erase(snapshots.begin() + n);
+		} else {
+			++n;
+		}
+	}
+}
+}
+
+level_snapshot_ptr snapshot(const level& lvl)
+{
+	level_snapshot_ptr res = lvl.snapshot();
+	if(sound::current_music().empty() == false) {
+		res->node->set_attr("music", sound::current_music());
+	}
+
+	return res;
+}
+
+void write_async(wml::const_node_ptr node, const std::string& path)
+{
+	write_job job;
+	job.node = node;
+	job.path = path;
+	start_write(job);
+}
+
+void save_async(const level& lvl, const std::string& path)
+{
+	const int start_time = SDL_GetTicks();
+
+	write_job job;
+	const level_snapshot_ptr s = snapshot(lvl);
+	job.snapshot = s.get();
+	job.path = path;
+
+	{
+		threading::lock lck(stats_mutex());
+		last_snapshot_ms = SDL_GetTicks() - start_time;
+	}
+
+	release_written_snapshots();
+	const threading::task_ptr t = start_write(job);
+	snapshots.push_back(std::make_pair(t, s));
+	t->on_complete(release_written_snapshots);
+}
+
+void wait()
+{
+	wait_for_writes();
+	release_written_snapshots();
+}
+
+std::string read_file(const std::string& path)
+{
+	wait_for_writes();
+
+	const std::string data = sys::read_file(path);
+	return is_compressed(data) ? decompress(data) : data;
+}
+
+int last_snapshot_time()
+{
+	threading::lock lck(stats_mutex());
+	return last_snapshot_ms;
+}
+
+int last_write_time()
+{
+	threading::lock lck(stats_mutex());
+	return last_write_ms;
+}
+
+}
+
+UNIT_TEST(save_writer_compression)
+{
+	wml::node_ptr node(new wml::node("level"));
+	for(int n = 0; n != 1000; ++n) {
+		wml::node_ptr character(new wml::node("character"));
+		character->set_attr("type", "frogatto_playable");
+		node->add_child(character);
+	}
+
+	const std::string dir = sys::make_temp_dir();
+	CHECK_EQ(dir.empty(), false);
+
+	const std::string path = dir + "save_writer_test.cfg";
+	save_writer::write_async(node, path);
+	save_writer::wait();
+
+	const std::string data = wml::output(node);
+	const std::string compressed = sys::read_file(path);
+	CHECK_LT(compressed.size(), data.size()/10);
+	CHECK_EQ(save_writer::is_compressed(compressed), true);
+	CHECK_EQ(save_writer::is_compressed(data), false);
+	CHECK_EQ(save_writer::read_file(path), data);
+
+	remove(path.c_str());
+	sys::remove_dir(dir);
+}
+
+//compares the time the game is stalled for by writing a saved game on the
+//game thread, as saving used to, with snapshotting it and writing it in
+//the background.
+UTILITY(save_hitch)
+{
+	if(args.size() < 1 || args.size() > 2) {
+		std::cerr << "save_hitch usage: <level> [iterations]\n";
+		return;
+	}
+
+	const int iterations = std::max(1, args.size() > 1 ? atoi(args[1].c_str()) : 10);
+
+	boost::intrusive_ptr<level> lvl(new level(args[0]));
+	lvl->finish_loading();
+	lvl->set_as_current_level();
+
+	const std::string path = std::string(preferences::user_data_path()) + "save_hitch_test.cfg";
+
+	//tile maps cache what they write, so only the first save of each kind
+	//pays for writing the tiles; the maximum shows that cost.
+	int sync_total = 0, sync_max = 0;
+	for(int n = 0; n != iterations; ++n) {
+		const int start_time = SDL_GetTicks();
+		sys::write_file(path, wml::output(lvl->write()));
+		const int t = SDL_GetTicks() - start_time;
+		sync_total += t;
+		sync_max = std::max(sync_max, t);
+	}
+
+	int async_total = 0, async_max = 0, write_total = 0;
+	for(int n = 0; n != iterations; ++n) {
+		save_writer::save_async(*lvl, path);
+		save_writer::wait();
+
+		const int t = save_writer::last_snapshot_time();
+		async_total += t;
+		async_max = std::max(async_max, t);
+		write_total += save_writer::last_write_time();
+	}
+
+	remove(path.c_str());
+
+	std::cerr << "SAVE HITCH: " << args[0] << " over " << iterations << " saves\n"
+	          << "  game thread save:  " << sync_total/iterations << "ms average, " << sync_max << "ms max\n"
+	          << "  background save:   " << async_total/iterations << "ms average, " << async_max << "ms max on the game thread; "
+	          << write_total/iterations << "ms average in the background\n";
+}
@@ -0,0 +1,48 @@
+#ifndef SAVE_WRITER_HPP_INCLUDED
+#define SAVE_WRITER_HPP_INCLUDED
+
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+#include "wml_node_fwd.hpp"
+
+class level;
+struct level_snapshot;
+typedef boost::shared_ptr<level_snapshot> level_snapshot_ptr;
+
+//writes saved games without stalling the game. Only taking a snapshot of
+//the level's state happens on the game thread: its objects are copied,
+//and the rest of it is written. Writing the objects, converting the level
+//to text, compressing it and writing it to disk happen on the task pool.
+namespace save_writer
+{
+
+//takes a snapshot of the level, including the current music, ready to be
+//written as a saved game. Must be called from the game thread.
+level_snapshot_ptr snapshot(const level& lvl);
+
+//writes a node to the given path in the background. The node must not
+//be modified afterwards. Saves are written in the order requested.
+void write_async(wml::const_node_ptr node, const std::string& path);
+
+//snapshots the level and writes it to path in the background. Must be
+//called from the game thread.
+void save_async(const level& lvl, const std::string& path);
+
+//blocks until every save requested so far has been written. Must be
+//called from the game thread.
+void wait();
+
+//reads a saved game, waiting for any save in progress and decompressing
+//it if necessary.
+std::string read_file(const std::string& path);
+
+//the time the last save spent on the game thread, and in the background,
+//in milliseconds.
+int last_snapshot_time();
+int last_write_time();
+
+}
+
+#endif
@@ -1,285 +1,859 @@
 #include <assert.h>
+#include <stdlib.h>
 
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/regex.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include <iostream>
 #ifdef _MSC_VER
 #include <boost/cstdint.hpp>
+using boost::int64_t;
+using boost::uint32_t;
 #else
 #include <inttypes.h>
 #endif
 
-#include "asserts.hpp"
 #include "foreach.hpp"
+#include "message_frame.hpp"
 
 using boost::asio::ip::tcp;
 using boost::asio::ip::udp;
 
-typedef boost::shared_ptr<tcp::socket> socket_ptr;
-typedef boost::shared_ptr<boost::array<char, 1024> > buffer_ptr;
+namespace {
+int64_t get_micros()
+{
+	static const boost::posix_time::ptime epoch = boost::posix_time::microsec_clock::universal_time();
+	return (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds();
+}
+}
 
+//the lobby and relay server. Clients connect over TCP, are given an ID,
+//and announce the game they want to join with a READY message. Once all
+//of a game's players have sent a UDP packet, so we know their public
+//addresses, everyone is sent the START message with each other's
+//addresses, after which UDP packets sent to the server are relayed to the
+//rest of the game, for players who can't connect to each other directly.
+//
+//The server runs on several threads. Each connection's socket is only
+//used from its session's strand, and each game's state is only touched
+//from its game's strand, so games are handled in parallel with each other
+//without any locking. The UDP socket is shared by every game, so all
+//reads and writes on it happen on udp_strand_. The lobby_mutex_ guards
+//the maps used to find sessions and games, which are only changed when
+//players join and leave.
 class server
 {
 public:
-	explicit server(boost::asio::io_service& io_service)
-	  : acceptor_(io_service, tcp::endpoint(tcp::v4(), 17002)),
+	server(boost::asio::io_service& io_service, int tcp_port, int udp_port)
+	  : io_service_(io_service),
+	    acceptor_(io_service, tcp::endpoint(tcp::v4(), tcp_port)),
 	    next_id_(0),
-		udp_socket_(io_service, udp::endpoint(udp::v4(), 17001))
+	    packets_dropped_(0),
+	    udp_socket_(io_service, udp::endpoint(udp::v4(), udp_port)),
+	    udp_strand_(io_service),
+	    metrics_timer_(io_service)
 	{
+		//every game's packets arrive on the one socket, so give it
+		//room for bursts while the threads are busy. The OS may cap this.
+		boost::system::error_code ignored;
+		udp_socket_.set_option(boost::asio::socket_base::receive_buffer_size(UdpReceiveBufferSize), ignored);
+
 		start_accept();
 		start_udp_receive();
+		start_metrics_timer();
+	}
+
+	//writes the metrics of every game which is in progress.
+	void report_metrics()
+	{
+		std::vector<game_ptr> games;
+		int nsessions, packets_dropped;
+		{
+			boost::mutex::scoped_lock lock(lobby_mutex_);
+			games.assign(active_games_.begin(), active_games_.end());
+			nsessions = sessions_.size();
+			packets_dropped = packets_dropped_;
+		}
+
+		std::ostringstream s;
+		s << "SERVER: " << nsessions << " connections; " << games.size() << " games; " << packets_dropped << " UDP packets from unknown IDs\n";
+		std::cerr << s.str();
+
+		foreach(const game_ptr& g, games) {
+			g->strand.post(boost::bind(&server::report_game, this, g, "IN PROGRESS"));
+		}
 	}
 
 private:
+	struct game;
+	typedef boost::shared_ptr<game> game_ptr;
+
+	typedef boost::shared_ptr<udp::endpoint> udp_endpoint_ptr;
+	typedef boost::array<char, 1024> udp_buffer;
+	typedef boost::shared_ptr<udp_buffer> udp_buffer_ptr;
+
+	static const int UdpReceiveBufferSize = 4*1024*1024;
+
+	struct session {
+		explicit session(boost::asio::io_service& io_service)
+		  : socket(io_service), strand(io_service), id(0),
+		    writing(false), closed(false), has_udp_endpoint(false), slot(-1)
+		{}
+
+		tcp::socket socket;
+
+		//socket reads and writes all happen on this strand.
+		boost::asio::io_service::strand strand;
+
+		uint32_t id;
+
+		message_frame::reader reader;
+		boost::array<char, 1024> read_buf;
+
+		//framed messages waiting to be sent; only the front one is
+		//being written at any time.
+		std::deque<std::vector<char> > outgoing;
+		bool writing;
+		bool closed;
+
+		//guarded by the strand of the game the session is in.
+		udp::endpoint udp_endpoint;
+		bool has_udp_endpoint;
+		std::string local_addr;
+		int slot;
+
+		//guarded by lobby_mutex_.
+		game_ptr game;
+	};
+
+	typedef boost::shared_ptr<session> session_ptr;
+
+	struct game {
+		game(boost::asio::io_service& io_service, const std::string& level_id)
+		  : strand(io_service), level(level_id), nplayers(0), started(false),
+		    created_at(get_micros()), started_at(0),
+		    packets_received(0), packets_relayed(0), bytes_relayed(0), relay_errors(0)
+		{}
+
+		//everything below is only used on this strand.
+		boost::asio::io_service::strand strand;
+
+		std::string level;
+		std::vector<session_ptr> players;
+
+		//the players in the order the START message gave them, which is
+		//how packets address each other. A player who leaves leaves an
+		//empty slot, so everyone else keeps theirs.
+		std::vector<session_ptr> slots;
+		int nplayers;
+		bool started;
+
+		int64_t created_at, started_at;
+		int packets_received, packets_relayed;
+		int64_t bytes_relayed;
+		int relay_errors;
+	};
+
 	void start_accept()
 	{
-		socket_ptr socket(new tcp::socket(acceptor_.get_io_service()));
-		acceptor_.async_accept(*socket, boost::bind(&server::handle_accept, this, socket, boost::asio::placeholders::error));
+		session_ptr s(new session(io_service_));
+		acceptor_.async_accept(s->socket, boost::bind(&server::handle_accept, this, s, boost::asio::placeholders::error));
+	}
+
+	void handle_accept(session_ptr s, const boost::system::error_code& error)
+	{
+		start_accept();
+
+		if(error) {
+			std::cerr << "ERROR IN ACCEPT: " << error.message() << "\n";
+			return;
+		}
+
+		{
+			boost::mutex::scoped_lock lock(lobby_mutex_);
+			s->id = next_id_++;
+			sessions_[s->id] = s;
+		}
+
+		send(s, std::string(reinterpret_cast<const char*>(&s->id), 4));
+		s->strand.dispatch(boost::bind(&server::start_read, this, s));
+	}
+
+	void send(session_ptr s, const std::string& msg)
+	{
+		s->strand.dispatch(boost::bind(&server::queue_write, this, s, message_frame::write(msg)));
+	}
+
+	void queue_write(session_ptr s, const std::vector<char>& data)
+	{
+		if(s->closed) {
+			return;
+		}
+
+		s->outgoing.push_back(data);
+		if(!s->writing) {
+			start_write(s);
+		}
+	}
+
+	void start_write(session_ptr s)
+	{
+		s->writing = true;
+		boost::asio::async_write(s->socket, boost::asio::buffer(s->outgoing.front()),
+		    s->strand.wrap(boost::bind(&server::handle_write, this, s, _1, _2)));
+	}
+
+	void handle_write(session_ptr s, const boost::system::error_code& e, size_t nbytes)
+	{
+		s->writing = false;
+		if(e) {
+			disconnect(s);
+			return;
+		}
+
+		s->outgoing.pop_front();
+		if(!s->outgoing.empty() && !s->closed) {
+			start_write(s);
+		}
+	}
+
+	void start_read(session_ptr s)
+	{
+		s->socket.async_read_some(boost::asio::buffer(s->read_buf),
+		    s->strand.wrap(boost::bind(&server::handle_read, this, s, _1, _2)));
+	}
+
+	void handle_read(session_ptr s, const boost::system::error_code& e, size_t nbytes)
+	{
+		if(e) {
+			disconnect(s);
+			return;
+		}
+
+		s->reader.add_data(s->read_buf.data(), nbytes);
+
+		std::string msg;
+		while(s->reader.next(&msg)) {
+			handle_message(s, msg);
+		}
+
+		if(s->reader.error()) {
+			std::cerr << "BAD MESSAGE FRAME FROM " << s->id << "\n";
+			disconnect(s);
+			return;
+		}
+
+		start_read(s);
+	}
+
+	void handle_message(session_ptr s, const std::string& msg)
+	{
+		static const boost::regex ready("READY/(.+)/(\\d+)/(.* \\d+)");
+
+		boost::smatch match;
+		if(!boost::regex_match(msg, match, ready)) {
+			return;
+		}
+
+		const std::string level_id(match[1].first, match[1].second);
+		const int nplayers = atoi(std::string(match[2].first, match[2].second).c_str());
+		const std::string local_addr(match[3].first, match[3].second);
+
+		game_ptr g, old_game;
+		{
+			boost::mutex::scoped_lock lock(lobby_mutex_);
+			game_ptr& waiting = games_[level_id];
+			if(!waiting) {
+				waiting.reset(new game(io_service_, level_id));
+				active_games_.insert(waiting);
+			}
+
+			g = waiting;
+			old_game = s->game;
+			s->game = g;
+		}
+
+		if(old_game && old_game != g) {
+			//if the player is already in a game, remove them from it.
+			old_game->strand.post(boost::bind(&server::remove_player, this, old_game, s));
+		}
+
+		g->strand.post(boost::bind(&server::add_player, this, g, s, nplayers, local_addr));
+	}
+
+	void disconnect(session_ptr s)
+	{
+		if(s->closed) {
+			return;
+		}
+
+		s->closed = true;
+		boost::system::error_code ignored;
+		s->socket.close(ignored);
+
+		game_ptr g;
+		{
+			boost::mutex::scoped_lock lock(lobby_mutex_);
+			sessions_.erase(s->id);
+			g.swap(s->game);
+		}
+
+		if(g) {
+			g->strand.post(boost::bind(&server::remove_player, this, g, s));
+		}
+	}
+
+	void add_player(game_ptr g, session_ptr s, int nplayers, const std::string& local_addr)
+	{
+		g->players.erase(std::remove(g->players.begin(), g->players.end(), s), g->players.end());
+		g->players.push_back(s);
+		g->nplayers = nplayers;
+		s->local_addr = local_addr;
 	}
 
-	void handle_accept(socket_ptr socket, const boost::system::error_code& error)
+	void remove_player(game_ptr g, session_ptr s)
 	{
-		if(!error) {
-			SocketInfo info;
-			info.id = next_id_++;
+		g->players.erase(std::remove(g->players.begin(), g->players.end(), s), g->players.end());
+		std::replace(g->slots.begin(), g->slots.end(), s, session_ptr());
+		if(!g->players.empty()) {
+			return;
+		}
 
-			boost::array<char, 4> buf;
-			memcpy(&buf[0], &info.id, 4);
+		report_game(g, "ENDED");
 
-			boost::asio::async_write(*socket, boost::asio::buffer(buf),
-			                         boost::bind(&server::handle_send, this, socket, _1, _2));
+		boost::mutex::scoped_lock lock(lobby_mutex_);
+		active_games_.erase(g);
+		std::map<std::string, game_ptr>::iterator i = games_.find(g->level);
+		if(i != games_.end() && i->second == g) {
+			games_.erase(i);
+		}
+	}
 
-			sockets_info_[socket] = info;
-			id_to_socket_[info.id] = socket;
+	void report_game(game_ptr g, const char* status)
+	{
+		const int64_t now = get_micros();
+		const int64_t running_for = g->started ? now - g->started_at : 0;
 
-			sockets_.push_back(socket);
-			start_receive(socket);
-			start_accept();
+		std::ostringstream s;
+		s << "GAME " << g->level << " " << status << ": " << g->players.size() << "/" << g->nplayers << " players; ";
+		if(g->started) {
+			s << "started after " << (g->started_at - g->created_at)/1000 << "ms; ";
 		} else {
-			std::cerr << "ERROR IN ACCEPT!\n";
+			s << "waiting for " << (now - g->created_at)/1000 << "ms; ";
+		}
+
+		s << g->packets_received << " packets received; " << g->packets_relayed << " relayed (" << g->bytes_relayed << " bytes, " << g->relay_errors << " errors)";
+		if(running_for > 0) {
+			s << "; " << (g->packets_relayed*int64_t(1000000))/running_for << " relayed/s";
 		}
+
+		s << "\n";
+		std::cerr << s.str();
+	}
+
+	void start_metrics_timer()
+	{
+		metrics_timer_.expires_from_now(boost::posix_time::seconds(30));
+		metrics_timer_.async_wait(boost::bind(&server::handle_metrics_timer, this, _1));
 	}
 
-	void handle_send(socket_ptr socket, const boost::system::error_code& e, size_t nbytes)
+	void handle_metrics_timer(const boost::system::error_code& e)
 	{
 		if(e) {
-			disconnect(socket);
+			return;
 		}
+
+		report_metrics();
+		start_metrics_timer();
 	}
 
-	void start_receive(socket_ptr socket)
+	void start_udp_receive()
 	{
-		buffer_ptr buf(new boost::array<char, 1024>);
-		socket->async_read_some(boost::asio::buffer(*buf), boost::bind(&server::handle_receive, this, socket, buf, _1, _2));
+		udp_endpoint_ptr endpoint(new udp::endpoint);
+		udp_buffer_ptr buf(new udp_buffer);
+		udp_socket_.async_receive_from(
+		  boost::asio::buffer(*buf), *endpoint,
+		  udp_strand_.wrap(boost::bind(&server::handle_udp_receive, this, endpoint, buf, _1, _2)));
 	}
 
-	void handle_receive(socket_ptr socket, buffer_ptr buf, const boost::system::error_code& e, size_t nbytes)
+	void handle_udp_receive(udp_endpoint_ptr endpoint, udp_buffer_ptr buf, const boost::system::error_code& error, size_t len)
 	{
-		if(!e) {
-			std::string str(buf->data(), buf->data() + nbytes);
-			std::cerr << "RECEIVE {{{" << str << "}}}\n";
+		//get the next receive going straight away. The packet itself is
+		//handled on its game's strand, leaving this one free for the
+		//socket.
+		start_udp_receive();
 
-			static boost::regex ready("READY/(.+)/(\\d+)/(.* \\d+)");
+		if(error || len < 5) {
+			return;
+		}
 
-			boost::cmatch match;
-			if(boost::regex_match(str.c_str(), match, ready)) {
-				std::string level_id(match[1].first, match[1].second);
+		uint32_t id;
+		memcpy(&id, &(*buf)[1], 4);
+
+		session_ptr s;
+		game_ptr g;
+		{
+			boost::mutex::scoped_lock lock(lobby_mutex_);
+			std::map<uint32_t, session_ptr>::const_iterator i = sessions_.find(id);
+			if(i == sessions_.end()) {
+				++packets_dropped_;
+				return;
+			}
 
-				GameInfoPtr& game = games_[level_id];
-				if(!game) {
-					game.reset(new GameInfo);
-				}
+			s = i->second;
+			g = s->game;
+		}
 
-				SocketInfo& info = sockets_info_[socket];
-				info.local_addr = std::string(match[3].first, match[3].second);
-				if(info.game) {
-					//if the player is already in a game, remove them from it.
-					std::vector<socket_ptr>& v = info.game->players;
-					v.erase(std::remove(v.begin(), v.end(), socket), v.end());
-				}
+		if(g) {
+			g->strand.post(boost::bind(&server::handle_game_packet, this, g, s, endpoint, buf, len));
+		}
+	}
 
-				info.game = game;
+	void handle_game_packet(game_ptr g, session_ptr s, udp_endpoint_ptr endpoint, udp_buffer_ptr buf, size_t len)
+	{
+		s->udp_endpoint = *endpoint;
+		s->has_udp_endpoint = true;
+		++g->packets_received;
 
-				fprintf(stderr, "ADDING PLAYER TO GAME: %p\n", socket.get());
-				game->players.push_back(socket);
+		if((*buf)[0] == 'Z') {
+			if(!g->started) {
+				try_start_game(g);
+			}
 
+			return;
+		}
 
-				const int nplayers = atoi(match[2].first);
-				game->nplayers = nplayers;
+		//control, confirm and ping packets are written for one player,
+		//whose slot follows the sender's id and slot, so they're only
+		//sent to them.
+		if(is_addressed_packet((*buf)[0])) {
+			if(len < 7) {
+				return;
+			}
 
+			const int to_slot = static_cast<unsigned char>((*buf)[6]);
+			if(to_slot < g->slots.size() && g->slots[to_slot]) {
+				relay_game_packet(g, s, g->slots[to_slot], buf, len);
 			}
 
-			start_receive(socket);
-		} else {
-			disconnect(socket);
+			return;
+		}
+
+		foreach(const session_ptr& player, g->players) {
+			relay_game_packet(g, s, player, buf, len);
 		}
 	}
 
-	void disconnect(socket_ptr socket) {
+	static bool is_addressed_packet(char type)
+	{
+		return type == 'C' || type == 'A' || type == 'a' || type == 'P';
+	}
 
-		SocketInfo& info = sockets_info_[socket];
-		if(info.game) {
-			std::vector<socket_ptr>& v = info.game->players;
-			v.erase(std::remove(v.begin(), v.end(), socket), v.end());
+	void relay_game_packet(game_ptr g, session_ptr from, session_ptr to, udp_buffer_ptr buf, size_t len)
+	{
+		if(to == from || !to->has_udp_endpoint) {
+			return;
 		}
 
-		std::cerr << "CLOSING SOCKET: ";
-		socket->close();
-		id_to_socket_.erase(sockets_info_[socket].id);
-		sockets_.erase(std::remove(sockets_.begin(), sockets_.end(), socket), sockets_.end());
+		++g->packets_relayed;
+		g->bytes_relayed += len;
+		udp_strand_.post(boost::bind(&server::send_udp_packet, this, g, buf, len, to->udp_endpoint));
+	}
 
-		sockets_info_.erase(socket);
+	//a synchronous send, since a datagram send never waits for the peer,
+	//and the buffer is kept alive by the handler until it's done.
+	void send_udp_packet(game_ptr g, udp_buffer_ptr buf, size_t len, const udp::endpoint& to)
+	{
+		boost::system::error_code e;
+		udp_socket_.send_to(boost::asio::buffer(&(*buf)[0], len), to, 0, e);
+		if(e) {
+			g->strand.post(boost::bind(&server::count_relay_error, this, g, len));
+		}
 	}
 
-	tcp::acceptor acceptor_;
+	void count_relay_error(game_ptr g, size_t len)
+	{
+		--g->packets_relayed;
+		g->bytes_relayed -= len;
+		++g->relay_errors;
+	}
 
-	std::vector<socket_ptr> sockets_;
+	void try_start_game(game_ptr g)
+	{
+		if(g->players.size() < g->nplayers) {
+			return;
+		}
 
-	typedef boost::shared_ptr<udp::endpoint> udp_endpoint_ptr;
+		foreach(const session_ptr& s, g->players) {
+			if(!s->has_udp_endpoint) {
+				return;
+			}
+		}
 
-	struct GameInfo;
-	typedef boost::shared_ptr<GameInfo> GameInfoPtr;
+		g->slots = g->players;
+		for(int n = 0; n != g->slots.size(); ++n) {
+			g->slots[n]->slot = n;
+		}
 
-	struct SocketInfo {
-		uint32_t id;
-		udp_endpoint_ptr udp_endpoint;
-		GameInfoPtr game;
-		std::string local_addr;
-	};
+		foreach(const session_ptr& socket, g->slots) {
+			std::ostringstream msg;
+			msg << "START " << g->slots.size() << "\n";
+			foreach(const session_ptr& s, g->slots) {
+				if(s == socket) {
+					msg << "SLOT\n";
+					continue;
+				}
 
-	std::map<socket_ptr, SocketInfo> sockets_info_;
-	std::map<uint32_t, socket_ptr> id_to_socket_;
+				if(socket->udp_endpoint.address() != s->udp_endpoint.address()) {
+					//the hosts are not from the same address,
+					//so send them each other's network address.
+					msg << s->udp_endpoint.address().to_string() << " " << s->udp_endpoint.port() << "\n";
+				} else {
+					//the hosts are from the same address,
+					//which means they are likely behind the
+					//same NAT device. Send them their local
+					//addresses, behind their devices.
+					msg << s->local_addr << "\n";
+				}
+			}
 
-	struct GameInfo {
-		GameInfo() : started(false) {}
-		std::vector<socket_ptr> players;
-		int nplayers;
-		bool started;
-	};
+			send(socket, msg.str());
+		}
 
-	std::map<std::string, GameInfoPtr> games_;
+		g->started = true;
+		g->started_at = get_micros();
 
+		//new players wanting this level get a new game.
+		boost::mutex::scoped_lock lock(lobby_mutex_);
+		std::map<std::string, game_ptr>::iterator i = games_.find(g->level);
+		if(i != games_.end() && i->second == g) {
+			games_.erase(i);
+		}
+	}
+
+	boost::asio::io_service& io_service_;
+	tcp::acceptor acceptor_;
+
+	boost::mutex lobby_mutex_;
+
+	//sessions by ID, games waiting for players by level, and every game
+	//which still has players.
+	std::map<uint32_t, session_ptr> sessions_;
+	std::map<std::string, game_ptr> games_;
+	std::set<game_ptr> active_games_;
 	uint32_t next_id_;
+	int packets_dropped_;
 
-	void start_udp_receive() {
-		udp_endpoint_ptr endpoint(new udp::endpoint);
-		udp_socket_.async_receive_from(
-		  boost::asio::buffer(udp_buf_), *endpoint,
-		  boost::bind(&server::handle_udp_receive, this, endpoint, _1, _2));
-	}
-
-	void handle_udp_receive(udp_endpoint_ptr endpoint, const boost::system::error_code& error, size_t len)
-	{
-		fprintf(stderr, "RECEIVED UDP PACKET: %d\n", len);
-		if(len >= 5) {
-			uint32_t id;
-			memcpy(&id, &udp_buf_[1], 4);
-			std::map<uint32_t, socket_ptr>::iterator socket_it = id_to_socket_.find(id);
-			if(socket_it != id_to_socket_.end()) {
-				assert(sockets_info_.count(socket_it->second));
-				sockets_info_[socket_it->second].udp_endpoint = endpoint;
-
-				GameInfoPtr& game = sockets_info_[socket_it->second].game;
-				if(udp_buf_[0] == 'Z' && game.get() != NULL && !game->started && game->players.size() >= game->nplayers) {
-					bool have_sockets = true;
-					foreach(const socket_ptr& sock, game->players) {
-						const SocketInfo& info = sockets_info_[sock];
-						if(info.udp_endpoint.get() == NULL) {
-							have_sockets = false;
-						}
-					}
+	udp::socket udp_socket_;
+	boost::asio::io_service::strand udp_strand_;
 
-					if(have_sockets) {
-
-						foreach(socket_ptr socket, game->players) {
-							const SocketInfo& send_socket_info = sockets_info_[socket];
-
-							std::ostringstream msg;
-							msg << "START " << game->players.size() << "\n";
-							foreach(socket_ptr s, game->players) {
-								if(s == socket) {
-									msg << "SLOT\n";
-									continue;
-								}
-
-								const SocketInfo& sock_info = sockets_info_[s];
-								if(send_socket_info.udp_endpoint->address().to_string() != sock_info.udp_endpoint->address().to_string()) {
-									//the hosts are not from the same address,
-									//so send them each other's network address.
-									msg << sock_info.udp_endpoint->address().to_string().c_str() << " " << sock_info.udp_endpoint->port() << "\n";
-								} else {
-									//the hosts are from the same address,
-									//which means they are likely behind the
-									//same NAT device. Send them their local
-									//addresses, behind their devices.
-									msg << sock_info.local_addr << "\n";
-								}
-							}
-
-							const std::string msg_str = msg.str();
-
-							boost::asio::async_write(*socket, boost::asio::buffer(msg_str),
-				                         boost::bind(&server::handle_send, this, socket, _1, _2));
-						}
-
-						game->started = true;
-						for(std::map<std::string, GameInfoPtr>::iterator i = games_.begin(); i != games_.end(); ++i) {
-							if(game == i->second) {
-								i->second.reset();
-							}
-						}
-					}
-				}
+	boost::asio::deadline_timer metrics_timer_;
+};
+
+namespace {
+
+//statistics gathered by the load generator's clients. Clients all run on
+//the load generator's single thread, so need no locking.
+struct load_stats {
+	load_stats() : nconnected(0), nerrors(0), nstarted(0), total_start_time(0), packets_sent(0), sending(true)
+	{}
+
+	int nconnected, nerrors, nstarted;
+	int64_t total_start_time;
+	int packets_sent;
+	std::vector<int> latencies;
+
+	//cleared at the end of the test, so packets still on their way are
+	//received before we count them.
+	bool sending;
+};
+
+//a simulated player, which goes through the same steps as the game does
+//to join a game, then sends a control packet every cycle and measures how
+//long packets relayed from the other players took to arrive.
+class load_client
+{
+public:
+	load_client(boost::asio::io_service& io_service, const tcp::endpoint& server_tcp, const udp::endpoint& server_udp, const std::string& level, int nplayers, load_stats& stats)
+	  : socket_(io_service), udp_socket_(io_service, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+	    timer_(io_service), server_udp_(server_udp), level_(level), nplayers_(nplayers),
+	    stats_(stats), id_(0), slot_(0), have_id_(false), started_(false), created_at_(get_micros())
+	{
+		//all the clients share one thread, so each may have to hold a
+		//few cycles of packets before it gets to read them.
+		boost::system::error_code ignored;
+		udp_socket_.set_option(boost::asio::socket_base::receive_buffer_size(1024*1024), ignored);
+
+		socket_.async_connect(server_tcp, boost::bind(&load_client::handle_connect, this, _1));
+		start_udp_receive();
+	}
 
-				if(udp_buf_[0] != 'Z') {
-					GameInfoPtr game = sockets_info_[socket_it->second].game;
-	
-					if(game.get() != NULL) {
-						for(int n = 0; n != game->players.size(); ++n) {
-							if(game->players[n] == socket_it->second) {
-								continue;
-							}
-
-							std::cerr << "GOT FROM: " << endpoint->port() << " RELAYING TO...\n";
-							std::map<socket_ptr, SocketInfo>::iterator socket_info = sockets_info_.find(game->players[n]);
-							if(socket_info != sockets_info_.end()) {
-								std::cerr << "  RELAY TO " << socket_info->second.udp_endpoint->port() << "\n";
-								udp_socket_.async_send_to(boost::asio::buffer(&udp_buf_[0], len), *socket_info->second.udp_endpoint,
-								    boost::bind(&server::handle_udp_send, this, socket_info->second.udp_endpoint, _1, _2));
-							}
-						}
+	void stop()
+	{
+		boost::system::error_code ignored;
+		timer_.cancel(ignored);
+		socket_.close(ignored);
+		udp_socket_.close(ignored);
+	}
+
+private:
+	void handle_connect(const boost::system::error_code& e)
+	{
+		if(e) {
+			++stats_.nerrors;
+			return;
+		}
+
+		++stats_.nconnected;
+		start_read();
+	}
+
+	void start_read()
+	{
+		socket_.async_read_some(boost::asio::buffer(read_buf_), boost::bind(&load_client::handle_read, this, _1, _2));
+	}
+
+	void handle_read(const boost::system::error_code& e, size_t nbytes)
+	{
+		if(e) {
+			return;
+		}
+
+		reader_.add_data(read_buf_.data(), nbytes);
+
+		std::string msg;
+		while(reader_.next(&msg)) {
+			if(!have_id_ && msg.size() == 4) {
+				memcpy(&id_, msg.c_str(), 4);
+				have_id_ = true;
+
+				std::ostringstream ready;
+				ready << "READY/" << level_ << "/" << nplayers_ << "/127.0.0.1 " << udp_socket_.local_endpoint().port();
+				write_buf_ = message_frame::write(ready.str());
+				boost::asio::async_write(socket_, boost::asio::buffer(write_buf_), boost::bind(&load_client::handle_write, this, _1));
+				start_timer();
+			} else if(msg.size() > 5 && std::string(msg.begin(), msg.begin() + 5) == "START") {
+				//the players are listed after the first line, with our
+				//own slot marked SLOT.
+				std::istringstream lines(msg);
+				std::string line;
+				std::getline(lines, line);
+				for(int n = 0; std::getline(lines, line); ++n) {
+					if(line == "SLOT") {
+						slot_ = n;
 					}
 				}
+
+				started_ = true;
+				++stats_.nstarted;
+				stats_.total_start_time += get_micros() - created_at_;
 			}
 		}
-		start_udp_receive();
+
+		start_read();
 	}
 
-	void handle_udp_send(udp_endpoint_ptr endpoint, const boost::system::error_code& error, size_t len)
+	void handle_write(const boost::system::error_code& e)
+	{}
+
+	void start_timer()
 	{
-		if(error) {
-			fprintf(stderr, "ERROR IN UDP SEND!\n");
-		} else {
-			fprintf(stderr, "UDP: SENT %d BYTES\n", (int)len);
+		//until the game starts we send a 'Z' packet every 100ms so the
+		//server knows our address, then a packet every 20ms cycle.
+		timer_.expires_from_now(boost::posix_time::milliseconds(started_ ? 20 : 100));
+		timer_.async_wait(boost::bind(&load_client::handle_timer, this, _1));
+	}
+
+	void handle_timer(const boost::system::error_code& e)
+	{
+		if(e || !stats_.sending) {
+			return;
+		}
+
+		boost::array<char, 15> packet;
+		packet.assign(0);
+		packet[0] = started_ ? 'C' : 'Z';
+		memcpy(&packet[1], &id_, 4);
+
+		boost::system::error_code ignored;
+		if(!started_) {
+			udp_socket_.send_to(boost::asio::buffer(&packet[0], 5), server_udp_, 0, ignored);
+			start_timer();
+			return;
 		}
+
+		//like the game, send a packet addressed to each other player,
+		//giving our slot and theirs.
+		const int64_t now = get_micros();
+		packet[5] = slot_;
+		memcpy(&packet[7], &now, sizeof(now));
+		for(int n = 0; n != nplayers_; ++n) {
+			if(n != slot_) {
+				packet[6] = n;
+				udp_socket_.send_to(boost::asio::buffer(packet), server_udp_, 0, ignored);
+			}
+		}
+
+		++stats_.packets_sent;
+		start_timer();
 	}
 
+	void start_udp_receive()
+	{
+		udp_socket_.async_receive(boost::asio::buffer(udp_buf_), boost::bind(&load_client::handle_udp_receive, this, _1, _2));
+	}
+
+	void handle_udp_receive(const boost::system::error_code& e, size_t len)
+	{
+		if(e) {
+			return;
+		}
+
+		if(len >= 15 && udp_buf_[0] == 'C') {
+			int64_t sent_at;
+			memcpy(&sent_at, &udp_buf_[7], sizeof(sent_at));
+			stats_.latencies.push_back(static_cast<int>(get_micros() - sent_at));
+		}
+
+		start_udp_receive();
+	}
+
+	tcp::socket socket_;
 	udp::socket udp_socket_;
+	boost::asio::deadline_timer timer_;
+	udp::endpoint server_udp_;
+	std::string level_;
+	int nplayers_;
+	load_stats& stats_;
+
+	message_frame::reader reader_;
+	boost::array<char, 1024> read_buf_;
+	std::vector<char> write_buf_;
 	boost::array<char, 1024> udp_buf_;
+
+	uint32_t id_;
+	int slot_;
+	bool have_id_, started_;
+	int64_t created_at_;
 };
 
-int main(int argc, char** argv)
+void stop_sending(load_stats* stats, const boost::system::error_code& e)
+{
+	stats->sending = false;
+}
+
+//runs nclients simulated players, in games of nplayers, against the
+//server on the local machine for the given number of seconds, then reports
+//how long games took to start and the latency of relayed packets.
+void run_load_test(int tcp_port, int udp_port, int nclients, int nplayers, int seconds)
 {
 	boost::asio::io_service io_service;
+	const tcp::endpoint server_tcp(boost::asio::ip::address_v4::loopback(), tcp_port);
+	const udp::endpoint server_udp(boost::asio::ip::address_v4::loopback(), udp_port);
+
+	load_stats stats;
+	std::vector<boost::shared_ptr<load_client> > clients;
+	for(int n = 0; n != nclients; ++n) {
+		std::ostringstream level;
+		level << "load_test_" << (n/nplayers);
+		clients.push_back(boost::shared_ptr<load_client>(new load_client(io_service, server_tcp, server_udp, level.str(), nplayers, stats)));
+	}
 
-	server srv(io_service);
+	boost::asio::deadline_timer end_timer(io_service, boost::posix_time::seconds(seconds));
+	end_timer.async_wait(boost::bind(&stop_sending, &stats, _1));
+
+	boost::asio::deadline_timer drain_timer(io_service, boost::posix_time::seconds(seconds + 1));
+	drain_timer.async_wait(boost::bind(&boost::asio::io_service::stop, &io_service));
 	io_service.run();
+
+	foreach(const boost::shared_ptr<load_client>& c, clients) {
+		c->stop();
+	}
+
+	std::vector<int>& latencies = stats.latencies;
+	std::sort(latencies.begin(), latencies.end());
+
+	int64_t total_latency = 0;
+	foreach(int latency, latencies) {
+		total_latency += latency;
+	}
+
+	const int expected = stats.packets_sent*(nplayers - 1);
+
+	std::cout << nclients << " clients in games of " << nplayers << " for " << seconds << "s\n"
+	          << stats.nconnected << " connected; " << stats.nerrors << " failed to connect; " << stats.nstarted << " started games";
+	if(stats.nstarted) {
+		std::cout << " after " << (stats.total_start_time/stats.nstarted)/1000 << "ms average";
+	}
+
+	std::cout << "\n" << stats.packets_sent << " packets sent; " << latencies.size() << "/" << expected << " relayed packets received\n";
+	if(!latencies.empty()) {
+		std::cout << "relay latency: " << total_latency/latencies.size() << "us average; "
+		          << latencies[latencies.size()/2] << "us median; "
+		          << latencies[(latencies.size()*99)/100] << "us 99th percentile; "
+		          << latencies.back() << "us max\n";
+	}
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	int nthreads = boost::thread::hardware_concurrency();
+	int tcp_port = 17002, udp_port = 17001;
+	int load_clients = 0, load_players = 2, load_seconds = 10;
+
+	for(int n = 1; n < argc; ++n) {
+		const std::string arg(argv[n]);
+		if(arg == "--threads" && n+1 < argc) {
+			nthreads = atoi(argv[++n]);
+		} else if(arg == "--tcp-port" && n+1 < argc) {
+			tcp_port = atoi(argv[++n]);
+		} else if(arg == "--udp-port" && n+1 < argc) {
+			udp_port = atoi(argv[++n]);
+		} else if(arg == "--load-test" && n+3 < argc) {
+			load_clients = atoi(argv[++n]);
+			load_players = atoi(argv[++n]);
+			load_seconds = atoi(argv[++n]);
+		} else {
+			std::cerr << "usage: " << argv[0] << " [--threads n] [--tcp-port port] [--udp-port port] [--load-test clients players_per_game seconds]\n";
+			return 1;
+		}
+	}
+
+	if(nthreads < 1) {
+		nthreads = 1;
+	}
+
+	boost::asio::io_service io_service;
+	server srv(io_service, tcp_port, udp_port);
+
+	boost::thread_group threads;
+	for(int n = 0; n != nthreads; ++n) {
+		threads.create_thread(boost::bind(&boost::asio::io_service::run, &io_service));
+	}
+
+	if(load_clients > 0) {
+		run_load_test(tcp_port, udp_port, load_clients, std::max(2, load_players), load_seconds);
+		srv.report_metrics();
+
+		//give the server's threads a moment to write the game reports.
+		boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+		io_service.stop();
+	}
+
+	threads.join_all();
 }
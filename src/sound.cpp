@@ -2,8 +2,10 @@
 #include <map>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 
+#include "foreach.hpp"
 #include "preferences.hpp"
 #include "filesystem.hpp"
 #include "SDL.h"
@@ -12,6 +14,8 @@
 #endif
 
 #include "sound.hpp"
+#include "sound_mixer.hpp"
+#include "thread.hpp"
 
 #if TARGET_IPHONE_SIMULATOR || TARGET_OS_IPHONE
 #include "iphone_sound.h"
@@ -37,6 +41,13 @@ const size_t BufferSize = 4096;
 const size_t BufferSize = 1024;
 #endif
 
+//the most memory decoded sound effects may take up, in bytes.
+#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
+const size_t SampleCacheBytes = 32*1024*1024;
+#else
+const size_t SampleCacheBytes = 8*1024*1024;
+#endif
+
 bool sound_ok = false;
 bool mute_ = false;
 std::string& current_music_name() {
@@ -88,176 +99,150 @@ void on_sound_finished(int channel)
 	}
 }
 
+//sound effects are mixed by our own mixer on every platform. Where
+//SDL_mixer is used it still plays the music, and the sound effects are
+//added to what it produces.
+boost::scoped_ptr<mixer> sfx_mixer;
+
 #if TARGET_IPHONE_SIMULATOR || TARGET_OS_IPHONE
+SDL_AudioSpec output_spec;
+#endif
+
+sample_cache& cache()
+{
+	static sample_cache c(SampleCacheBytes);
+	return c;
+}
 
-class sound; //so mixer can make pointers to it
+//the mixer is used from the audio callback, so anything changing it
+//from the game thread must hold the audio lock.
+struct audio_lock {
+	audio_lock() { SDL_LockAudio(); }
+	~audio_lock() { SDL_UnlockAudio(); }
+};
 
-struct mixer
+void mix_sound_effects(void* userdata, Uint8* stream, int len)
 {
-	/* channel array holds information about currently playing sounds */
-	struct
-	{
-		Uint8 *position; /* what is the current position in the buffer of this sound ? */
-		Uint32 remaining; /* how many bytes remaining before we're done playing the sound ? */
-		Uint32 timestamp; /* when did this sound start playing ? */
-		int volume;
-		int loops;
-		sound *s;
-	} channels[NumChannels];
-	SDL_AudioSpec outputSpec; /* what audio format are we using for output? */
-	int numSoundsPlaying; /* how many sounds are currently playing */
-} mixer;
-
-class sound
+	sfx_mixer->mix(reinterpret_cast<short*>(stream), len/(sizeof(short)*sfx_mixer->output_channels()));
+}
+
+#if TARGET_IPHONE_SIMULATOR || TARGET_OS_IPHONE
+void sdl_audio_callback(void* userdata, Uint8* stream, int len)
 {
-	public:
-	boost::shared_ptr<Uint8> buffer; /* audio buffer for sound file */
-	Uint32 length; /* length of the buffer (in bytes) */
-	sound (const std::string& file = "") : length(0)
-	{
-		if (file == "") return;
-		SDL_AudioSpec spec; /* the audio format of the .wav file */
-		SDL_AudioCVT cvt; /* used to convert .wav to output format when formats differ */
-		Uint8 *tmp_buffer;
-		if (SDL_LoadWAV(file.c_str(), &spec, &tmp_buffer, &length) == NULL)
-		{
-			std::cerr << "Could not load sound: " << file << "\n";
-			return; //should maybe die
-		}
-		buffer = boost::shared_ptr<Uint8>(tmp_buffer, SDL_free);
-		return; // don't convert the audio, assume it's already in the right format
-		/* build the audio converter */
-		int result = SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq,
-			mixer.outputSpec.format, mixer.outputSpec.channels, mixer.outputSpec.freq);
-		if (result == -1)
-		{
-			std::cerr << "Could not build audio CVT for: " << file << "\n";
-			return; //should maybe die
-		} else if (result != 0) {
-			/* 
-			 this happens when the .wav format differs from the output format.
-			 we convert the .wav buffer here
-			 */
-			cvt.buf = (Uint8 *) SDL_malloc(length * cvt.len_mult); /* allocate conversion buffer */
-			cvt.len = length; /* set conversion buffer length */
-			SDL_memcpy(cvt.buf, buffer.get(), length); /* copy sound to conversion buffer */
-			if (SDL_ConvertAudio(&cvt) == -1) /* convert the sound */
-			{
-				std::cerr << "Could not convert sound: " << file << "\n";
-				SDL_free(cvt.buf);
-				return; //should maybe die
-			}
-			buffer = boost::shared_ptr<Uint8>(cvt.buf, SDL_free); /* point sound buffer to converted buffer */
-			length = cvt.len_cvt; /* set sound buffer's new length */
-		}
+	SDL_memset(stream, output_spec.silence, len);
+	mix_sound_effects(userdata, stream, len);
+	if(sfx_mixer->num_playing() == 0) {
+		//pause the audio callback until there's a sound to play again.
+		SDL_PauseAudio(1);
 	}
-	
-	bool operator==(void *p) {return buffer.get() == p;}
-};
-	
-void sdl_stop_channel (int channel)
+}
+#endif
+
+//decodes a sound effect into the format the mixer is using.
+const_sample_ptr decode(const std::string& file)
 {
-	if (mixer.channels[channel].position == NULL) return; // if the sound was playing in the first place
-	mixer.channels[channel].position = NULL;  /* indicates no sound playing on channel anymore */
-	mixer.numSoundsPlaying--;
-	if (mixer.numSoundsPlaying == 0)
-	{
-		/* if no sounds left playing, pause audio callback */
-		SDL_PauseAudio(1);
+	boost::shared_ptr<sample> result(new sample);
+
+#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
+	Mix_Chunk* chunk = Mix_LoadWAV(("sounds/" + file).c_str());
+	if(chunk == NULL) {
+		return const_sample_ptr();
+	}
+
+	const short* begin = reinterpret_cast<const short*>(chunk->abuf);
+	result->data.assign(begin, begin + chunk->alen/sizeof(short));
+	Mix_FreeChunk(chunk);
+#else
+	std::string wav_file = file;
+	wav_file.replace(wav_file.length()-3, wav_file.length(), "wav");
+
+	//the .wav files are assumed to already be in the output format.
+	SDL_AudioSpec spec;
+	Uint8* buf = NULL;
+	Uint32 length = 0;
+	if(SDL_LoadWAV(("sounds_wav/" + wav_file).c_str(), &spec, &buf, &length) == NULL) {
+		std::cerr << "Could not load sound: " << file << "\n";
+		return const_sample_ptr();
 	}
+
+	const short* begin = reinterpret_cast<const short*>(buf);
+	result->data.assign(begin, begin + length/sizeof(short));
+	SDL_FreeWAV(buf);
+#endif
+
+	return result;
 }
 
-void sdl_audio_callback (void *userdata, Uint8 * stream, int len)
+const_sample_ptr get_sample(const std::string& file)
 {
-	int i;
-	int copy_amt;
-	SDL_memset(stream, mixer.outputSpec.silence, len);  /* initialize buffer to silence */
-	/* for each channel, mix in whatever is playing on that channel */
-	for (i = 0; i < NumChannels; i++)
-	{
-		if (mixer.channels[i].position == NULL)
-		{
-			/* if no sound is playing on this channel */
-			continue;           /* nothing to do for this channel */
+	const_sample_ptr result = cache().get(file);
+	if(!result) {
+		result = decode(file);
+		if(result) {
+			cache().put(file, result);
 		}
-		
-		/* copy len bytes to the buffer, unless we have fewer than len bytes remaining */
-		copy_amt = mixer.channels[i].remaining < len ? mixer.channels[i].remaining : len;
-		
-		/* mix this sound effect with the output */
-		SDL_MixAudioFormat(stream, mixer.channels[i].position, mixer.outputSpec.format, copy_amt, sfx_volume * mixer.channels[i].volume);
-		
-		/* update buffer position in sound effect and the number of bytes left */
-		mixer.channels[i].position += copy_amt;
-		mixer.channels[i].remaining -= copy_amt;
-		
-		/* did we finish playing the sound effect ? */
-		if (mixer.channels[i].remaining == 0)
-		{
-			if (mixer.channels[i].loops != 0)
+	}
+
+	return result;
+}
+
+//sounds are preloaded on the task pool. Starting to preload another set
+//of sounds abandons the previous set.
+threading::task_ptr preload_task;
+bool preload_cancelled = false;
+
+threading::mutex& preload_mutex()
+{
+	static threading::mutex m;
+	return m;
+}
+
+struct preload_job
+{
+	std::vector<std::string> files;
+
+	void operator()() const {
+		foreach(const std::string& file, files) {
 			{
-				mixer.channels[i].position = mixer.channels[i].s->buffer.get();
-				mixer.channels[i].remaining = mixer.channels[i].s->length;
-				if (mixer.channels[i].loops != -1) mixer.channels[i].loops--;
-			} else {
-				sdl_stop_channel(i);
+				threading::lock lck(preload_mutex());
+				if(preload_cancelled) {
+					return;
+				}
+			}
+
+			//don't push sounds which are already loaded out of the cache.
+			if(cache().size_in_bytes() >= cache().budget()) {
+				return;
+			}
+
+			if(!cache().contains(file)) {
+				const_sample_ptr s = decode(file);
+				if(s) {
+					cache().put(file, s);
+				}
 			}
 		}
 	}
-}
+};
 
-int sdl_play_sound (sound *s, int loops)
+void cancel_preload()
 {
-	/*
-	 find an empty channel to play on.
-	 if no channel is available, use oldest channel
-	 */
-	int i;
-	int selected_channel = -1;
-	int oldest_channel = 0;
-	
-	if (mixer.numSoundsPlaying == 0) {
-		/* we're playing a sound now, so start audio callback back up */
-		SDL_PauseAudio(0);
+	{
+		threading::lock lck(preload_mutex());
+		preload_cancelled = true;
 	}
-	
-	/* find a sound channel to play the sound on */
-	for (i = 0; i < NumChannels; i++) {
-		if (mixer.channels[i].position == NULL) {
-			/* if no sound on this channel, select it */
-			selected_channel = i;
-			break;
+
+	if(preload_task) {
+		if(!preload_task->cancel()) {
+			preload_task->wait();
 		}
-		/* if this channel's sound is older than the oldest so far, set it to oldest */
-		if (mixer.channels[i].timestamp < mixer.channels[oldest_channel].timestamp)
-			oldest_channel = i;
+
+		preload_task.reset();
 	}
-	
-	/* no empty channels, take the oldest one */
-	if (selected_channel == -1)
-		selected_channel = oldest_channel;
-	else
-		mixer.numSoundsPlaying++;
-	
-	/* point channel data to wav data */
-	mixer.channels[selected_channel].position = s->buffer.get();
-	mixer.channels[selected_channel].remaining = s->length;
-	mixer.channels[selected_channel].timestamp = SDL_GetTicks();
-	mixer.channels[selected_channel].volume = SDL_MIX_MAXVOLUME;
-	mixer.channels[selected_channel].loops = loops;
-	mixer.channels[selected_channel].s = s;
-	
-	return selected_channel;
-}
 
-#endif
-	
-#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
-typedef std::map<std::string, Mix_Chunk*> cache_map;
-#else
-typedef std::map<std::string, sound> cache_map;
-#endif
-cache_map cache;
+	threading::lock lck(preload_mutex());
+	preload_cancelled = false;
+}
 
 bool sound_init = false;
 
@@ -286,33 +271,47 @@ manager::manager()
 		return;
 	}
 
-	Mix_AllocateChannels(NumChannels);
 	sound_ok = true;
 
-	Mix_ChannelFinished(on_sound_finished);
 	Mix_HookMusicFinished(on_music_finished);
 	Mix_VolumeMusic(MIX_MAX_VOLUME);
+
+	int frequency = 0, output_channels = 0;
+	Uint16 format = 0;
+	Mix_QuerySpec(&frequency, &format, &output_channels);
+	if(format == AUDIO_S16SYS && (output_channels == 1 || output_channels == 2)) {
+		sfx_mixer.reset(new mixer(output_channels, NumChannels));
+	} else {
+		std::cerr << "audio device isn't 16 bit mono or stereo; sound effects disabled\n";
+	}
 #else
 	iphone_init_music(on_music_finished);
 	sound_ok = true;
-	
-	/* initialize the mixer */
-	SDL_memset(&mixer, 0, sizeof(mixer));
-	/* setup output format */
-	mixer.outputSpec.freq = SampleRate;
-	mixer.outputSpec.format = AUDIO_S16LSB;
-	mixer.outputSpec.channels = 1;
-	mixer.outputSpec.samples = 256;
-	mixer.outputSpec.callback = sdl_audio_callback;
-	mixer.outputSpec.userdata = NULL;
-	
-	/* open audio for output */
-    if (SDL_OpenAudio(&mixer.outputSpec, NULL) != 0)
-	{
+
+	SDL_memset(&output_spec, 0, sizeof(output_spec));
+	output_spec.freq = SampleRate;
+	output_spec.format = AUDIO_S16LSB;
+	output_spec.channels = 1;
+	output_spec.samples = 256;
+	output_spec.callback = sdl_audio_callback;
+	output_spec.userdata = NULL;
+
+	sfx_mixer.reset(new mixer(output_spec.channels, NumChannels));
+
+	if(SDL_OpenAudio(&output_spec, NULL) != 0) {
 		std::cerr << "Opening audio failed\n";
 		sound_ok = false;
-    }
+	}
+#endif
+
+	channels_to_sounds_playing.resize(NumChannels);
+	if(sfx_mixer) {
+		sfx_mixer->set_finished_callback(on_sound_finished);
+		sfx_mixer->set_master_volume(sfx_volume);
+#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
+		Mix_SetPostMix(mix_sound_effects, NULL);
 #endif
+	}
 
 	set_music_volume(recorded_music_volume);
 }
@@ -323,13 +322,20 @@ manager::~manager()
 		return;
 	}
 
+	cancel_preload();
+
 #if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
+	Mix_SetPostMix(NULL, NULL);
 	Mix_HookMusicFinished(NULL);
 	next_music().clear();
 	Mix_CloseAudio();
 #else
+	SDL_CloseAudio();
 	iphone_kill_music();
 #endif
+
+	sfx_mixer.reset();
+	cache().clear();
 }
 
 bool ok() { return sound_ok; }
@@ -347,35 +353,23 @@ namespace {
 
 int play_internal(const std::string& file, int loops, const void* object)
 {
-	if(!sound_ok) {
+	if(!sound_ok || !sfx_mixer) {
 		return -1;
 	}
 
-#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
-	Mix_Chunk*& chunk = cache[file];
-	if(chunk == NULL) {
-		chunk = Mix_LoadWAV(("sounds/" + file).c_str());
-		if(chunk == NULL) {
-			return -1;
-		}
+	const_sample_ptr s = get_sample(file);
+	if(!s) {
+		return -1;
 	}
 
-	int result = Mix_PlayChannel(-1, chunk, loops);
-
-#else
-	sound& s = cache[file];
-	if (s == NULL)
+	int result = -1;
 	{
-		std::string wav_file = file;
-		wav_file.replace(wav_file.length()-3, wav_file.length(), "wav");
-		s = sound("sounds_wav/" + wav_file);
-		if (s == NULL)
-		{
-			return -1;
-		}
+		audio_lock lck;
+		result = sfx_mixer->play(s, loops);
 	}
-	
-	int result = sdl_play_sound(&s, loops);
+
+#if TARGET_IPHONE_SIMULATOR || TARGET_OS_IPHONE
+	SDL_PauseAudio(0);
 #endif
 
 	//record which channel the sound is playing on.
@@ -383,9 +377,6 @@ int play_internal(const std::string& file, int loops, const void* object)
 		if(channels_to_sounds_playing.size() <= result) {
 			channels_to_sounds_playing.resize(result + 1);
 		}
-#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
-		Mix_Volume(result, sfx_volume*MIX_MAX_VOLUME); //start sound at full volume
-#endif
 
 		channels_to_sounds_playing[result].file = file;
 		channels_to_sounds_playing[result].object = object;
@@ -395,6 +386,14 @@ int play_internal(const std::string& file, int loops, const void* object)
 	return result;
 }
 
+void stop_channel(int channel)
+{
+	if(sfx_mixer) {
+		audio_lock lck;
+		sfx_mixer->stop(channel);
+	}
+}
+
 }
 
 void play(const std::string& file, const void* object)
@@ -412,11 +411,7 @@ void stop_sound(const std::string& file, const void* object)
 		if(channels_to_sounds_playing[n].object == object &&
 		   channels_to_sounds_playing[n].file == file) {
 			channels_to_sounds_playing[n].object = NULL;
-#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
-			Mix_HaltChannel(n);
-#else
-			sdl_stop_channel(n);
-#endif
+			stop_channel(n);
 		}
 	}
 }
@@ -427,11 +422,7 @@ void stop_looped_sounds(const void* object)
 		if((object == NULL && channels_to_sounds_playing[n].object != NULL
 		   || channels_to_sounds_playing[n].object == object) &&
 		   (channels_to_sounds_playing[n].loops != 0)) {
-#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
-			Mix_HaltChannel(n);
-#else
-			sdl_stop_channel(n);
-#endif
+			stop_channel(n);
 			channels_to_sounds_playing[n].object = NULL;
 		} else if(channels_to_sounds_playing[n].object == object) {
 			//this sound is a looped sound, but make sure it keeps going
@@ -465,12 +456,9 @@ void change_volume(const void* object, int volume)
 	
 	//find the channel associated with this object.
 	for(int n = 0; n != channels_to_sounds_playing.size(); ++n) {
-		if(channels_to_sounds_playing[n].object == object) {
-#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
-			Mix_Volume(n, sfx_volume*volume);
-#else
-			mixer.channels[n].volume = sfx_volume*volume;
-#endif
+		if(channels_to_sounds_playing[n].object == object && sfx_mixer) {
+			audio_lock lck;
+			sfx_mixer->set_volume(n, volume/128.0);
 		} //else, we just do nothing
 	}
 }
@@ -483,6 +471,10 @@ float get_sound_volume()
 void set_sound_volume(float volume)
 {
 	sfx_volume = volume;
+	if(sfx_mixer) {
+		audio_lock lck;
+		sfx_mixer->set_master_volume(volume);
+	}
 }
 
 float get_music_volume()
@@ -513,11 +505,27 @@ void cancel_looped(int handle)
 		channels_to_sounds_playing[handle].object = NULL;
 	}
 
-#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_IPHONE
-	Mix_HaltChannel(handle);
-#else
-	sdl_stop_channel(handle);
-#endif
+	stop_channel(handle);
+}
+
+void preload(const std::vector<std::string>& files)
+{
+	if(preferences::no_sound() || !sound_ok || !sfx_mixer) {
+		return;
+	}
+
+	cancel_preload();
+
+	preload_job job;
+	foreach(const std::string& file, files) {
+		if(!cache().contains(file)) {
+			job.files.push_back(file);
+		}
+	}
+
+	if(!job.files.empty()) {
+		preload_task = threading::run_task(job, threading::PRIORITY_LOW, true);
+	}
 }
 
 void play_music(const std::string& file)
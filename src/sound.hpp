@@ -2,6 +2,7 @@
 #define SOUND_HPP_INCLUDED
 
 #include <string>
+#include <vector>
 
 namespace sound {
 
@@ -40,6 +41,11 @@ void set_music_volume(float volume);
 int play_looped(const std::string& file, const void* object=0);
 void cancel_looped(int handle);
 
+//decodes sound effects in the background, so they're ready by the time
+//they're first played. Sounds which are decoded are kept in a cache of
+//limited size, so this only helps for sounds which will be played soon.
+void preload(const std::vector<std::string>& files);
+
 void play_music(const std::string& file);
 void play_music_interrupt(const std::string& file);
 
@@ -0,0 +1,400 @@
+#include <algorithm>
+
+#include "asserts.hpp"
+#include "foreach.hpp"
+#include "sound_mixer.hpp"
+#include "unit_test.hpp"
+
+namespace sound {
+
+namespace {
+//volumes are applied as fixed point multipliers, with this many
+//fractional bits, so mixing is done entirely in integers. The loops below
+//are kept simple enough for the compiler to vectorize.
+const int VolumeBits = 8;
+const int FullVolume = 1 << VolumeBits;
+
+int fixed_volume(float volume)
+{
+	return std::max(0, std::min(FullVolume, static_cast<int>(volume*FullVolume + 0.5)));
+}
+
+void add_samples(int* dst, const short* src, int count, int volume)
+{
+	for(int n = 0; n < count; ++n) {
+		dst[n] += src[n]*volume;
+	}
+}
+
+void add_stereo_samples(int* dst, const short* src, int frames, int left, int right)
+{
+	for(int n = 0; n < frames; ++n) {
+		dst[n*2] += src[n*2]*left;
+		dst[n*2 + 1] += src[n*2 + 1]*right;
+	}
+}
+}
+
+mixer::mixer(int output_channels, int num_channels)
+  : output_channels_(output_channels), channels_(num_channels),
+    master_volume_(1.0), play_counter_(0), finished_(NULL)
+{
+	ASSERT_LOG(output_channels == 1 || output_channels == 2, "Mixer only supports mono or stereo output: " << output_channels);
+}
+
+int mixer::num_playing() const
+{
+	int result = 0;
+	foreach(const channel& c, channels_) {
+		if(c.s) {
+			++result;
+		}
+	}
+
+	return result;
+}
+
+int mixer::play(const_sample_ptr s, int loops)
+{
+	if(channels_.empty()) {
+		return -1;
+	}
+
+	int selected = 0;
+	for(int n = 0; n != channels_.size(); ++n) {
+		if(!channels_[n].s) {
+			selected = n;
+			break;
+		}
+
+		if(channels_[n].started < channels_[selected].started) {
+			selected = n;
+		}
+	}
+
+	channel& c = channels_[selected];
+	c = channel();
+	c.s = s;
+	c.loops = loops;
+	c.started = ++play_counter_;
+	return selected;
+}
+
+void mixer::stop(int channel)
+{
+	if(channel >= 0 && channel < channels_.size()) {
+		channels_[channel].s.reset();
+	}
+}
+
+bool mixer::playing(int channel) const
+{
+	return channel >= 0 && channel < channels_.size() && channels_[channel].s;
+}
+
+void mixer::set_volume(int channel, float volume)
+{
+	if(channel >= 0 && channel < channels_.size()) {
+		channels_[channel].volume = volume;
+	}
+}
+
+void mixer::set_pan(int channel, float pan)
+{
+	if(channel >= 0 && channel < channels_.size()) {
+		channels_[channel].pan = std::max(-1.0f, std::min(1.0f, pan));
+	}
+}
+
+void mixer::set_master_volume(float volume)
+{
+	master_volume_ = volume;
+}
+
+void mixer::set_finished_callback(void (*fn)(int channel))
+{
+	finished_ = fn;
+}
+
+void mixer::mix(short* out, int frames)
+{
+	const int count = frames*output_channels_;
+	accum_.resize(count);
+	int* accum = accum_.empty() ? NULL : &accum_[0];
+	for(int n = 0; n < count; ++n) {
+		accum[n] = out[n]*FullVolume;
+	}
+
+	for(int n = 0; n != channels_.size(); ++n) {
+		if(channels_[n].s) {
+			mix_channel(n, frames);
+		}
+	}
+
+	for(int n = 0; n < count; ++n) {
+		out[n] = std::max(-32768, std::min(32767, accum[n] >> VolumeBits));
+	}
+}
+
+void mixer::mix_channel(int index, int frames)
+{
+	channel& c = channels_[index];
+
+	const int volume = fixed_volume(c.volume*master_volume_);
+	const int left = c.pan > 0.0 ? fixed_volume(c.volume*master_volume_*(1.0 - c.pan)) : volume;
+	const int right = c.pan < 0.0 ? fixed_volume(c.volume*master_volume_*(1.0 + c.pan)) : volume;
+
+	int frame = 0;
+	while(frame < frames && c.s) {
+		const int length = c.s->data.size()/output_channels_;
+		const int count = std::min(frames - frame, length - c.pos);
+		if(count > 0) {
+			const short* src = &c.s->data[c.pos*output_channels_];
+			int* dst = &accum_[frame*output_channels_];
+			if(output_channels_ == 2 && left != right) {
+				add_stereo_samples(dst, src, count, left, right);
+			} else {
+				add_samples(dst, src, count*output_channels_, volume);
+			}
+
+			frame += count;
+			c.pos += count;
+		}
+
+		if(c.pos >= length) {
+			if(c.loops != 0 && length > 0) {
+				c.pos = 0;
+				if(c.loops > 0) {
+					--c.loops;
+				}
+			} else {
+				c.s.reset();
+				if(finished_) {
+					finished_(index);
+				}
+			}
+		}
+	}
+}
+
+sample_cache::sample_cache(size_t budget) : bytes_(0), budget_(budget)
+{
+}
+
+const_sample_ptr sample_cache::get(const std::string& name)
+{
+	threading::lock lck(mutex_);
+	std::map<std::string, entry>::iterator i = entries_.find(name);
+	if(i == entries_.end()) {
+		return const_sample_ptr();
+	}
+
+	lru_.splice(lru_.begin(), lru_, i->second.lru);
+	return i->second.s;
+}
+
+void sample_cache::put(const std::string& name, const_sample_ptr s)
+{
+	threading::lock lck(mutex_);
+	std::map<std::string, entry>::iterator i = entries_.find(name);
+	if(i != entries_.end()) {
+		bytes_ -= i->second.s->data.size()*sizeof(short);
+		lru_.erase(i->second.lru);
+		entries_.erase(i);
+	}
+
+	lru_.push_front(name);
+	entry& e = entries_[name];
+	e.s = s;
+	e.lru = lru_.begin();
+	bytes_ += s->data.size()*sizeof(short);
+
+	enforce_budget();
+}
+
+bool sample_cache::contains(const std::string& name) const
+{
+	threading::lock lck(mutex_);
+	return entries_.count(name) != 0;
+}
+
+size_t sample_cache::size_in_bytes() const
+{
+	threading::lock lck(mutex_);
+	return bytes_;
+}
+
+void sample_cache::clear()
+{
+	threading::lock lck(mutex_);
+	entries_.clear();
+	lru_.clear();
+	bytes_ = 0;
+}
+
+void sample_cache::enforce_budget()
+{
+	lru_list::iterator i = lru_.end();
+	while(bytes_ > budget_ && i != lru_.begin()) {
+		--i;
+		std::map<std::string, entry>::iterator e = entries_.find(*i);
+		if(e->second.s.use_count() > 1) {
+			continue;
+		}
+
+		bytes_ -= e->second.s->data.size()*sizeof(short);
+		entries_.erase(e);
+		i = lru_.erase(i);
+	}
+}
+
+}
+
+namespace {
+sound::const_sample_ptr make_sample(int size, short value)
+{
+	boost::shared_ptr<sound::sample> s(new sound::sample);
+	s->data.resize(size, value);
+	return s;
+}
+}
+
+UNIT_TEST(sound_mixer_volume_and_pan)
+{
+	sound::mixer m(2, 4);
+	const int channel = m.play(make_sample(8, 1000), 0);
+	CHECK_EQ(m.playing(channel), true);
+
+	short out[4] = { 0, 0, 0, 0 };
+	m.set_volume(channel, 0.5);
+	m.mix(out, 1);
+	CHECK_EQ(out[0], 500);
+	CHECK_EQ(out[1], 500);
+
+	m.set_pan(channel, 1.0);
+	m.mix(out + 2, 1);
+	CHECK_EQ(out[2], 0);
+	CHECK_EQ(out[3], 500);
+
+	//sounds are added to what's already in the buffer.
+	m.set_pan(channel, -0.5);
+	m.mix(out, 1);
+	CHECK_EQ(out[0], 1000);
+	CHECK_EQ(out[1], 750);
+}
+
+UNIT_TEST(sound_mixer_saturates)
+{
+	sound::mixer m(1, 4);
+	m.play(make_sample(4, 30000), 0);
+	m.play(make_sample(4, 30000), 0);
+	m.play(make_sample(4, -20000), -1);
+
+	short out[4] = { 0, 0, -30000, -30000 };
+	m.mix(out, 2);
+	CHECK_EQ(out[0], 32767);
+	CHECK_EQ(out[1], 32767);
+
+	m.set_master_volume(0.5);
+	m.mix(out + 2, 2);
+	CHECK_EQ(out[2], -30000 + 15000 + 15000 - 10000);
+
+	m.set_master_volume(1.0);
+	m.mix(out + 2, 2);
+	m.mix(out + 2, 2);
+	CHECK_EQ(out[2], -32768);
+}
+
+namespace {
+std::vector<int> finished_channels;
+void record_finished(int channel)
+{
+	finished_channels.push_back(channel);
+}
+}
+
+UNIT_TEST(sound_mixer_loops_and_finishes)
+{
+	finished_channels.clear();
+
+	sound::mixer m(1, 2);
+	m.set_finished_callback(record_finished);
+	const int once = m.play(make_sample(3, 1), 0);
+	const int twice = m.play(make_sample(3, 2), 1);
+	CHECK_NE(once, twice);
+
+	short out[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	m.mix(out, 8);
+	CHECK_EQ(out[0], 3);
+	CHECK_EQ(out[2], 3);
+	CHECK_EQ(out[3], 2);
+	CHECK_EQ(out[5], 2);
+	CHECK_EQ(out[6], 0);
+	CHECK_EQ(m.num_playing(), 0);
+	CHECK_EQ(finished_channels.size(), 2);
+	CHECK_EQ(finished_channels[0], once);
+	CHECK_EQ(finished_channels[1], twice);
+
+	//with every channel busy, the oldest sound makes way.
+	m.play(make_sample(3, 1), -1);
+	const int second = m.play(make_sample(3, 1), -1);
+	const int third = m.play(make_sample(3, 1), -1);
+	CHECK_NE(third, second);
+	CHECK_EQ(m.num_playing(), 2);
+}
+
+UNIT_TEST(sample_cache_budget)
+{
+	const size_t sample_bytes = 100*sizeof(short);
+	sound::sample_cache cache(sample_bytes*3);
+	cache.put("a", make_sample(100, 0));
+	cache.put("b", make_sample(100, 0));
+	cache.put("c", make_sample(100, 0));
+	CHECK_EQ(cache.size_in_bytes(), sample_bytes*3);
+
+	//using a makes b the least recently used.
+	CHECK(cache.get("a"), "sound not cached");
+	cache.put("d", make_sample(100, 0));
+	CHECK_EQ(cache.contains("b"), false);
+	CHECK_EQ(cache.contains("a"), true);
+	CHECK_EQ(cache.size_in_bytes(), sample_bytes*3);
+
+	//sounds in use aren't discarded, even if it puts the cache over budget.
+	sound::const_sample_ptr playing = cache.get("c");
+	cache.get("a");
+	cache.get("d");
+	cache.put("e", make_sample(100, 0));
+	CHECK_EQ(cache.contains("c"), true);
+	CHECK_EQ(cache.contains("a"), false);
+
+	cache.put("f", make_sample(300, 0));
+	CHECK_EQ(cache.contains("c"), true);
+	CHECK_EQ(cache.size_in_bytes(), sample_bytes*4);
+}
+
+//mixes a second of sound into a buffer the size of the one used by the
+//audio device, with the given number of sounds playing.
+BENCHMARK_ARG(sound_mixer_mix, int playing)
+{
+	const int Frames = 1024;
+	sound::mixer m(2, 16);
+	for(int n = 0; n != playing; ++n) {
+		boost::shared_ptr<sound::sample> s(new sound::sample);
+		for(int i = 0; i != 44100*2; ++i) {
+			s->data.push_back(static_cast<short>((i*(n + 1)*37)%20000 - 10000));
+		}
+
+		const int channel = m.play(s, -1);
+		m.set_volume(channel, 0.8);
+		m.set_pan(channel, (n%3 - 1)*0.5);
+	}
+
+	std::vector<short> out(Frames*2);
+	BENCHMARK_LOOP {
+		std::fill(out.begin(), out.end(), 0);
+		m.mix(&out[0], Frames);
+	}
+}
+
+BENCHMARK_ARG_CALL(sound_mixer_mix, one_sound, 1);
+BENCHMARK_ARG_CALL(sound_mixer_mix, sixteen_sounds, 16);
@@ -0,0 +1,120 @@
+#ifndef SOUND_MIXER_HPP_INCLUDED
+#define SOUND_MIXER_HPP_INCLUDED
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "thread.hpp"
+
+namespace sound {
+
+//a decoded sound, as interleaved signed 16 bit samples with as many
+//channels as the mixer's output.
+struct sample {
+	std::vector<short> data;
+};
+
+typedef boost::shared_ptr<const sample> const_sample_ptr;
+
+//mixes sound effects in software. The mixer doesn't know about any sound
+//device: it mixes into a buffer it is given, so it can be driven by an
+//audio callback, or used offline. It isn't synchronized itself; when used
+//from an audio callback, calls from other threads should hold the audio
+//lock.
+class mixer
+{
+public:
+	//output_channels is 1 for mono output, or 2 for stereo.
+	mixer(int output_channels, int num_channels);
+
+	int output_channels() const { return output_channels_; }
+	int num_channels() const { return channels_.size(); }
+	int num_playing() const;
+
+	//starts playing a sound, at full volume in the middle, and returns the
+	//channel it's playing on. If every channel is busy, the sound which
+	//was started longest ago is stopped to make room. loops is the number
+	//of times to repeat the sound, or -1 to repeat it until stopped.
+	int play(const_sample_ptr s, int loops);
+	void stop(int channel);
+	bool playing(int channel) const;
+
+	//volume is from 0 to 1, and pan is from -1 (left) to 1 (right).
+	void set_volume(int channel, float volume);
+	void set_pan(int channel, float pan);
+	void set_master_volume(float volume);
+
+	//sets a function which is called, from within mix(), with the channel
+	//of each sound which reaches its end.
+	void set_finished_callback(void (*fn)(int channel));
+
+	//mixes the next frames of every sound playing into out, adding them to
+	//what's there already.
+	void mix(short* out, int frames);
+
+private:
+	struct channel {
+		channel() : pos(0), loops(0), volume(1.0), pan(0.0), started(0) {}
+		const_sample_ptr s;
+		int pos;
+		int loops;
+		float volume, pan;
+		unsigned int started;
+	};
+
+	void mix_channel(int index, int frames);
+
+	int output_channels_;
+	std::vector<channel> channels_;
+	std::vector<int> accum_;
+	float master_volume_;
+	unsigned int play_counter_;
+	void (*finished_)(int);
+};
+
+//a cache of decoded sounds which keeps their total size within a budget,
+//by discarding the sounds used least recently. Sounds which are still in
+//use elsewhere, such as by a mixer playing them, are never discarded.
+//Safe to use from several threads at once.
+class sample_cache
+{
+public:
+	explicit sample_cache(size_t budget);
+
+	//returns the sound, or NULL if it's not cached, counting it as used.
+	const_sample_ptr get(const std::string& name);
+	void put(const std::string& name, const_sample_ptr s);
+
+	//returns true if the sound is cached, without counting it as used.
+	bool contains(const std::string& name) const;
+
+	size_t size_in_bytes() const;
+	size_t budget() const { return budget_; }
+
+	void clear();
+
+private:
+	void enforce_budget();
+
+	typedef std::list<std::string> lru_list;
+	struct entry {
+		const_sample_ptr s;
+		lru_list::iterator lru;
+	};
+
+	std::map<std::string, entry> entries_;
+
+	//names of the cached sounds, most recently used first.
+	lru_list lru_;
+
+	size_t bytes_, budget_;
+	mutable threading::mutex mutex_;
+};
+
+}
+
+#endif
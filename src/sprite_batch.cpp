@@ -0,0 +1,131 @@
+#include "draw_stats.hpp"
+#include "foreach.hpp"
+#include "sprite_batch.hpp"
+#include "unit_test.hpp"
+
+namespace graphics
+{
+
+namespace {
+//how many batches back we search for one a new quad can join. Bounds
+//the cost of adding a quad in scenes with many different textures.
+const int MaxBatchLookback = 8;
+}
+
+sprite_batch::sprite_batch() : nbatches_(0), nquads_(0)
+{}
+
+void sprite_batch::add(const blit_queue& quad, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+	if(quad.empty()) {
+		return;
+	}
+
+	const unsigned int color = (r << 24) | (g << 16) | (b << 8) | a;
+	const rect area = quad.bounding_rect();
+
+	++nquads_;
+
+	for(int n = nbatches_ - 1; n >= 0 && n >= nbatches_ - MaxBatchLookback; --n) {
+		batch& candidate = batches_[n];
+		if(candidate.texture == quad.texture() && candidate.color == color) {
+			candidate.queue.merge(quad, 0, quad.position());
+			candidate.bounds = rect_union(candidate.bounds, area);
+			candidate.areas.push_back(area);
+			draw_stats::batched_quad();
+			return;
+		}
+
+		//we can't move the quad in front of anything it overlaps.
+		if(rects_intersect(candidate.bounds, area)) {
+			bool overlaps = false;
+			foreach(const rect& r, candidate.areas) {
+				if(rects_intersect(r, area)) {
+					overlaps = true;
+					break;
+				}
+			}
+
+			if(overlaps) {
+				break;
+			}
+		}
+	}
+
+	if(nbatches_ == batches_.size()) {
+		batches_.push_back(batch());
+	}
+
+	batch& result = batches_[nbatches_++];
+	result.texture = quad.texture();
+	result.color = color;
+	result.queue.clear();
+	result.queue.merge(quad, 0, quad.position());
+	result.bounds = area;
+	result.areas.clear();
+	result.areas.push_back(area);
+}
+
+void sprite_batch::flush()
+{
+	if(nbatches_ == 0) {
+		return;
+	}
+
+	for(int n = 0; n != nbatches_; ++n) {
+		const batch& b = batches_[n];
+		glColor4ub(b.color >> 24, (b.color >> 16)&0xFF, (b.color >> 8)&0xFF, b.color&0xFF);
+		b.queue.do_blit();
+		draw_stats::sprite_batch_drawn();
+	}
+
+	glColor4ub(255, 255, 255, 255);
+
+	nbatches_ = 0;
+	nquads_ = 0;
+}
+
+}
+
+namespace {
+graphics::blit_queue make_quad(GLuint texture, int x, int y, int w, int h)
+{
+	graphics::blit_queue q;
+	q.set_texture(texture);
+	q.add(x, y, 0.0, 0.0);
+	q.add(x + w, y, 1.0, 0.0);
+	q.add(x, y + h, 0.0, 1.0);
+	q.add(x + w, y + h, 1.0, 1.0);
+	return q;
+}
+}
+
+UNIT_TEST(sprite_batch_merges_same_state)
+{
+	graphics::sprite_batch batch;
+	batch.add(make_quad(1, 0, 0, 10, 10), 255, 255, 255, 255);
+	batch.add(make_quad(1, 20, 0, 10, 10), 255, 255, 255, 255);
+	batch.add(make_quad(1, 40, 0, 10, 10), 255, 255, 255, 255);
+	CHECK_EQ(batch.num_batches(), 1);
+	CHECK_EQ(batch.num_quads(), 3);
+
+	//a different color can't share the batch.
+	batch.add(make_quad(1, 60, 0, 10, 10), 255, 0, 0, 255);
+	CHECK_EQ(batch.num_batches(), 2);
+}
+
+UNIT_TEST(sprite_batch_preserves_overlap_order)
+{
+	graphics::sprite_batch batch;
+	batch.add(make_quad(1, 0, 0, 10, 10), 255, 255, 255, 255);
+	batch.add(make_quad(2, 100, 0, 10, 10), 255, 255, 255, 255);
+
+	//doesn't overlap the texture 2 quad, so may join the first batch.
+	batch.add(make_quad(1, 20, 0, 10, 10), 255, 255, 255, 255);
+	CHECK_EQ(batch.num_batches(), 2);
+
+	//overlaps the texture 2 quad, so must be drawn after it.
+	batch.add(make_quad(1, 105, 5, 10, 10), 255, 255, 255, 255);
+	CHECK_EQ(batch.num_batches(), 3);
+	CHECK_EQ(batch.num_quads(), 4);
+}
@@ -0,0 +1,57 @@
+#ifndef SPRITE_BATCH_HPP_INCLUDED
+#define SPRITE_BATCH_HPP_INCLUDED
+
+#include <vector>
+
+#include "geometry.hpp"
+#include "raster.hpp"
+
+namespace graphics
+{
+
+//collects textured quads which are drawn with the default blend mode and
+//merges quads which share a texture and color into a single blit_queue,
+//so they can be submitted in one draw call.
+//
+//quads are assumed to be added in drawing order. A quad may be moved
+//forward to join an earlier batch with the same state only if it does
+//not overlap anything queued in the batches it would jump over, so the
+//result is identical to drawing the quads one at a time.
+class sprite_batch
+{
+public:
+	sprite_batch();
+
+	//adds the quads in 'quad' (which must all use the same texture) to
+	//the batch. 'color' is the RGBA color the quads are drawn with.
+	void add(const blit_queue& quad, unsigned char r, unsigned char g, unsigned char b, unsigned char a);
+
+	//draws everything queued so far, in order, and empties the batch.
+	//Must be called before anything is drawn which isn't in the batch.
+	void flush();
+
+	bool empty() const { return nbatches_ == 0; }
+
+	//the number of batches, and the number of quads in them, currently
+	//queued.
+	int num_batches() const { return nbatches_; }
+	int num_quads() const { return nquads_; }
+private:
+	struct batch {
+		GLuint texture;
+		unsigned int color;
+		blit_queue queue;
+		rect bounds;
+		std::vector<rect> areas;
+	};
+
+	//batches in the order they must be drawn. Only the first nbatches_
+	//are in use; the rest are kept to reuse their allocations.
+	std::vector<batch> batches_;
+	int nbatches_;
+	int nquads_;
+};
+
+}
+
+#endif
@@ -72,12 +72,13 @@ threading::mutex& write_queue_mutex() {
 	return m;
 }
 
-threading::condition& send_stats_signal() {
-	static threading::condition c;
-	return c;
-}
+//stats are sent at least this often while they're being recorded.
+const Uint32 SendStatsInterval = 600000;
+Uint32 last_send_time = 0;
 
-bool send_stats_done = false;
+//the task sending stats on the worker pool, if any. Guarded by
+//write_queue_mutex().
+threading::task_ptr send_task;
 
 void send_stats(const std::map<std::string, std::vector<const_record_ptr> >& queue) {
 	if(queue.empty()) {
@@ -105,23 +106,21 @@ void send_stats(const std::map<std::string, std::vector<const_record_ptr> >& que
 		summary->add_child(summary_data);
 		msg->add_child(summary);
 
-		std::string commands;
+		//append the records to the level's stats file.
+		wml::file_writer commands(get_stats_dir() + i->first, false, true);
 		wml::node_ptr cmd(new wml::node("level"));
 		cmd->set_attr("id", i->first);
 		for(std::vector<const_record_ptr>::const_iterator j = i->second.begin(); j != i->second.end(); ++j) {
 			wml::node_ptr node((*j)->write());
 			cmd->add_child(node);
-			wml::write(node, commands);
+			commands.write(node);
 		}
 
-		msg->add_child(cmd);
-
-		const std::string fname = get_stats_dir() + i->first;
-		if(sys::file_exists(fname)) {
-			commands = sys::read_file(fname) + commands;
+		if(!commands.close()) {
+			fprintf(stderr, "STATS ERROR: COULD NOT WRITE STATS FOR %s\n", i->first.c_str());
 		}
 
-		sys::write_file(fname, commands);
+		msg->add_child(cmd);
 	}
 
 	std::string msg_str;
@@ -133,28 +132,40 @@ void send_stats(const std::map<std::string, std::vector<const_record_ptr> >& que
 	}
 }
 
-void send_stats_thread() {
-	if(preferences::send_stats() == false) {
-		return;
+void send_queued_stats() {
+	std::map<std::string, std::vector<const_record_ptr> > queue;
+	{
+		threading::lock lck(write_queue_mutex());
+		queue.swap(write_queue);
 	}
 
-	for(;;) {
-		std::map<std::string, std::vector<const_record_ptr> > queue;
-		{
-			threading::lock lck(write_queue_mutex());
-			if(!send_stats_done && write_queue.empty()) {
-				send_stats_signal().wait_timeout(write_queue_mutex(), 600000);
-			}
+	send_stats(queue);
+}
 
-			if(send_stats_done && write_queue.empty()) {
-				break;
-			}
+//starts sending the stats which are queued, unless a send is still waiting
+//to start. Sends never overlap: if one is running, the next follows it.
+//Must be called with write_queue_mutex() locked.
+void start_sending_stats() {
+	//currently stats are disabled on the iPhone, due to causing crashes
+	//there. Need to investigate.
+#if !TARGET_OS_IPHONE
+	if(preferences::send_stats() == false) {
+		return;
+	}
 
-			queue.swap(write_queue);
-		}
+	const threading::task::STATE state = send_task ? send_task->state() : threading::task::TASK_FINISHED;
+	if(state == threading::task::TASK_WAITING || state == threading::task::TASK_QUEUED) {
+		return;
+	}
 
-		send_stats(queue);
+	if(state == threading::task::TASK_RUNNING) {
+		send_task = send_task->then(send_queued_stats, threading::PRIORITY_LOW, true);
+	} else {
+		send_task = threading::run_task(send_queued_stats, threading::PRIORITY_LOW, true);
 	}
+
+	last_send_time = SDL_GetTicks();
+#endif
 }
 
 }
@@ -237,15 +248,22 @@ bool download(const std::string& lvl) {
 }
 
 manager::manager()
-#if !TARGET_OS_IPHONE
-  : background_thread_(send_stats_thread)
-#endif
-{}
+{
+	last_send_time = SDL_GetTicks();
+}
 
 manager::~manager() {
-	threading::lock lck(write_queue_mutex());
-	send_stats_done = true;
-	send_stats_signal().notify_one();
+	threading::task_ptr task;
+	{
+		threading::lock lck(write_queue_mutex());
+		start_sending_stats();
+		task = send_task;
+	}
+
+	//the last of the stats are sent before we exit.
+	if(task) {
+		task->wait();
+	}
 }
 
 record_ptr record::read(wml::const_node_ptr node) {
@@ -259,6 +277,8 @@ record_ptr record::read(wml::const_node_ptr node) {
 		return record_ptr(new custom_record(std::string(node->attr("key")), std::string(node->attr("value")), point(node->attr("src"))));
 	} else if(node->name() == "load") {
 		return record_ptr(new load_level_record(wml::get_int(node, "ms")));
+	} else if(node->name() == "preload") {
+		return record_ptr(new preload_record(node->attr("result"), wml::get_int(node, "ms")));
 	} else {
 		fprintf(stderr, "UNRECOGNIZED STATS NODE: '%s'\n", node->name().c_str());
 		return record_ptr();
@@ -390,6 +410,17 @@ wml::node_ptr load_level_record::write() const
 	return result;
 }
 
+preload_record::preload_record(const std::string& result, int ms) : result_(result), ms_(ms)
+{}
+
+wml::node_ptr preload_record::write() const
+{
+	wml::node_ptr result(new wml::node("preload"));
+	result->set_attr("result", result_);
+	result->set_attr("ms", formatter() << ms_);
+	return result;
+}
+
 void prepare_draw(const std::vector<record_ptr>& records)
 {
 	player_move_record_vertex_array.clear();
@@ -440,11 +471,15 @@ void record_event(const std::string& lvl, const_record_ptr r)
 {
 	threading::lock lck(write_queue_mutex());
 	write_queue[lvl].push_back(r);
+	if(SDL_GetTicks() - last_send_time >= SendStatsInterval) {
+		start_sending_stats();
+	}
 }
 
 void flush()
 {
-	send_stats_signal().notify_one();
+	threading::lock lck(write_queue_mutex());
+	start_sending_stats();
 }
 
 }
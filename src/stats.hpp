@@ -19,13 +19,9 @@ bool download(const std::string& lvl);
 class manager {
 public:
 	manager();
+
+	//sends any stats which are still queued, and waits for them.
 	~manager();
-private:
-	//currently the stats thread (and thus stats) are disabled, due to
-	//causing crashes on the iPhone. Need to investigate.
-#if !TARGET_OS_IPHONE
-	threading::thread background_thread_;
-#endif
 };
 
 class record;
@@ -78,6 +74,20 @@ private:
 	int ms_;
 };
 
+//whether a level was preloaded by the time it was needed: result is "hit"
+//if it was, "wait" if it was still loading, or "miss" if it wasn't
+//preloaded.
+class preload_record : public record {
+public:
+	preload_record(const std::string& result, int ms);
+	wml::node_ptr write() const;
+	const char* id() const { return "preload"; }
+	point location() const { return point(0,0); }
+private:
+	std::string result_;
+	int ms_;
+};
+
 class player_move_record : public record {
 public:
 	player_move_record(const point& src, const point& dst);
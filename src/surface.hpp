@@ -15,6 +15,8 @@
 
 #include <iostream>
 
+#include <boost/functional/hash.hpp>
+
 #include "SDL.h"
 #include "scoped_resource.hpp"
 
@@ -103,6 +105,11 @@ inline bool operator<(const surface& a, const surface& b)
 	return a.get() < b.get();
 }
 
+inline size_t hash_value(const surface& s)
+{
+	return boost::hash<SDL_Surface*>()(s.get());
+}
+
 }
 
 #endif
@@ -28,12 +28,29 @@ namespace surface_cache
 namespace {
 
 typedef concurrent_cache<std::string,surface> surface_map;
+
+//images are kept within this many bytes. Those used least recently are
+//loaded from disk again if they're needed.
+const size_t CacheBudget = 64*1024*1024;
+
+size_t surface_bytes(const std::string& key, const surface& surf)
+{
+	return surf.null() ? 0 : surf->h*surf->pitch;
+}
+
 surface_map& cache() {
-	static surface_map c;
+	static surface_map c(CacheBudget, surface_bytes);
 	return c;
 }
 
 const std::string path = "./images/";
+
+//true if only the cache is using the surface.
+bool surface_unused(const std::string& key, const surface& surf)
+{
+	//std::cerr << "CACHE REF " << key << " -> " << surf->refcount << "\n";
+	return surf->refcount == 1;
+}
 }
 
 surface get(const std::string& key)
@@ -63,20 +80,9 @@ surface get_no_cache(const std::string& key)
 
 void clear_unused()
 {
-	surface_map::lock lck(cache());
-	std::map<std::string, surface>& map = lck.map();
-	std::map<std::string, surface>::iterator i = map.begin();
-	while(i != map.end()) {
-		//std::cerr << "CACHE REF " << i->first << " -> " << i->second->refcount << "\n";
-		if(i->second->refcount == 1) {
-			//std::cerr << "CACHE FREE " << i->first << "\n";
-			map.erase(i++);
-		} else {
-			++i;
-		}
-	}
+	cache().erase_if(surface_unused);
 
-	//std::cerr << "CACHE ITEMS: " << map.size() << "\n";
+	//std::cerr << "CACHE ITEMS: " << cache().size() << "\n";
 }
 
 void clear()
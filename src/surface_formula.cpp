@@ -26,8 +26,16 @@ namespace {
 typedef std::pair<surface, std::string> cache_key;
 typedef concurrent_cache<cache_key, surface> cache_map;
 
+//surfaces made by formulas are kept within this many bytes, since they're
+//made for every palette and effect an object is drawn with.
+const size_t CacheBudget = 64*1024*1024;
+
+size_t surface_bytes(const cache_key& key, const surface& surf) {
+	return surf.null() ? 0 : surf->w*surf->h*surf->format->BytesPerPixel;
+}
+
 cache_map& cache() {
-	static cache_map instance;
+	static cache_map instance(CacheBudget, surface_bytes);
 	return instance;
 }
 
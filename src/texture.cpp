@@ -17,9 +17,13 @@
 #include <GL/glu.h>
 #endif
 
+#include <boost/bind.hpp>
+
 #include "asserts.hpp"
 #include "concurrent_cache.hpp"
+#include "draw_stats.hpp"
 #include "foreach.hpp"
+#include "formatter.hpp"
 #include "preferences.hpp"
 #include "raster.hpp"
 #include "surface_cache.hpp"
@@ -28,6 +32,7 @@
 #include "texture.hpp"
 #include "thread.hpp"
 #include "unit_test.hpp"
+#include <algorithm>
 #include <map>
 #include <set>
 #include <iostream>
@@ -86,6 +91,13 @@ namespace {
 
 	unsigned int current_texture = 0;
 
+	//counts frames for manage_residency(), so we know which textures were
+	//drawn least recently.
+	int draw_frame = 0;
+
+	//the bytes of the textures on the GPU.
+	size_t total_resident_bytes = 0;
+
 	unsigned int get_texture_id() {
 		if(!avail_textures.empty()) {
 			const unsigned int res = avail_textures.back();
@@ -209,15 +221,6 @@ texture::manager::~manager() {
 void texture::clear_textures()
 {
 	//std::cerr << "TEXTURES LOADING...\n";
-	texture_map::lock lck(texture_cache());
-	for(texture_map::map_type::const_iterator i = lck.map().begin(); i != lck.map().end(); ++i) {
-		if(!i->second.id_) {
-			continue;
-		}
-
-		//std::cerr << "TEXTURE: '" << i->first << "': " << (i->second.id_->init() ? "INIT" : "UNINIT") << "\n";
-	}
-
 	//std::cerr << "DONE TEXTURES LOADING\n";
 /*
 	//go through all the textures and clear out the ID's. We only want to
@@ -304,30 +307,20 @@ void set_alpha_for_transparent_colors_in_rgba_surface(SDL_Surface* s)
 	}
 }
 
-void texture::initialize(const key& k)
+namespace {
+//makes the surface a texture is loaded onto the GPU from, combining the
+//surfaces it's made from, with an alpha channel, at a power of two size
+//if need be.
+surface make_texture_surface(const texture::key& k)
 {
-	assert(graphics_initialized);
-	if(k.empty() ||
-	   std::find(k.begin(),k.end(),surface()) != k.end()) {
-		return;
-	}
-
-	npot_allowed = is_npot_allowed();
-
-	width_ = k.front()->w;
-	height_ = k.front()->h;
-	alpha_map_.reset(new std::vector<bool>(width_*height_));
-
-	unsigned int surf_width = width_;
-	unsigned int surf_height = height_;
+	unsigned int surf_width = k.front()->w;
+	unsigned int surf_height = k.front()->h;
 	if(!npot_allowed) {
 		surf_width = next_power_of_2(surf_width);
 		surf_height = next_power_of_2(surf_height);
 //		surf_width = surf_height =
 //		   std::max(next_power_of_2(surf_width),
 //		            next_power_of_2(surf_height));
-		ratio_w_ = GLfloat(width_)/GLfloat(surf_width);
-		ratio_h_ = GLfloat(height_)/GLfloat(surf_height);
 	}
 
 	surface s(SDL_CreateRGBSurface(SDL_SWSURFACE,surf_width,surf_height,32,SURFACE_MASK));
@@ -337,7 +330,7 @@ void texture::initialize(const key& k)
 		//alpha channel already exists, so no conversion necessary.
 		s = k.front();
 	} else {
-		for(key::const_iterator i = k.begin(); i != k.end(); ++i) {
+		for(texture::key::const_iterator i = k.begin(); i != k.end(); ++i) {
 			if(i == k.begin()) {
 				SDL_SetAlpha(i->get(), 0, SDL_ALPHA_OPAQUE);
 			} else {
@@ -349,6 +342,30 @@ void texture::initialize(const key& k)
 	}
 
 	set_alpha_for_transparent_colors_in_rgba_surface(s.get());
+	return s;
+}
+}
+
+void texture::initialize(const key& k)
+{
+	assert(graphics_initialized);
+	if(k.empty() ||
+	   std::find(k.begin(),k.end(),surface()) != k.end()) {
+		return;
+	}
+
+	npot_allowed = is_npot_allowed();
+
+	width_ = k.front()->w;
+	height_ = k.front()->h;
+	alpha_map_.reset(new std::vector<bool>(width_*height_));
+
+	if(!npot_allowed) {
+		ratio_w_ = GLfloat(width_)/GLfloat(next_power_of_2(width_));
+		ratio_h_ = GLfloat(height_)/GLfloat(next_power_of_2(height_));
+	}
+
+	surface s = make_texture_surface(k);
 
 	const int npixels = s->w*s->h;
 	for(int n = 0; n != npixels; ++n) {
@@ -367,10 +384,19 @@ void texture::initialize(const key& k)
 	}
 
 	id_->s = s;
+	id_->alpha_bytes = alpha_map_->size()/8;
 
 	current_texture = 0;
 }
 
+void texture::set_source(const std::string& name, boost::function<key()> source)
+{
+	if(id_) {
+		id_->name = name;
+		id_->source = source;
+	}
+}
+
 int next_pot (int n)
 {
 	int num = 1;
@@ -391,7 +417,19 @@ unsigned int texture::get_id() const
 		return 0;
 	}
 
+	id_->last_drawn = draw_frame;
+
 	if(id_->init() == false) {
+		if(!id_->s && id_->source) {
+			//the texture was unloaded to save memory, so make it again.
+			const key k = id_->source();
+			if(k.empty() || std::find(k.begin(), k.end(), surface()) != k.end()) {
+				return 0;
+			}
+
+			id_->s = make_texture_surface(k);
+		}
+
 		id_->id = get_texture_id();
 		if(preferences::use_pretty_scaling()) {
 			id_->s = scale_surface(id_->s);
@@ -408,6 +446,13 @@ unsigned int texture::get_id() const
 	return id_->id;
 }
 
+void texture::keep_resident() const
+{
+	if(id_) {
+		id_->keep_resident = true;
+	}
+}
+
 void texture::build_textures_from_worker_threads()
 {
 	ASSERT_LOG(SDL_ThreadID() == graphics_thread_id, "CALLED build_textures_from_worker_threads from thread other than the main one");
@@ -427,6 +472,7 @@ void texture::set_current_texture(unsigned int id)
 
 	glBindTexture(GL_TEXTURE_2D,id);
 	current_texture = id;
+	draw_stats::texture_bind();
 }
 
 void texture::set_as_current_texture() const
@@ -442,18 +488,42 @@ void texture::set_as_current_texture() const
 	current_texture = id;
 
 	glBindTexture(GL_TEXTURE_2D,id);
+	draw_stats::texture_bind();
 	//std::cerr << gluErrorString(glGetError()) << "~set_as_current_texture~\n";
 }
 
+namespace {
+//functions which make the surfaces for textures from images. They're kept
+//by the textures, to make them again if they're unloaded.
+texture::key load_image(const std::string& str)
+{
+	return texture::key(1, surface_cache::get_no_cache(str));
+}
+
+texture::key load_image_with_algorithm(const std::string& str, const std::string& algorithm)
+{
+	return texture::key(1, get_surface_formula(surface_cache::get_no_cache(str), algorithm));
+}
+
+texture::key load_palette_mapped_image(const std::string& str, int palette)
+{
+	surface s = surface_cache::get_no_cache(str);
+	if(s.get() == NULL) {
+		return texture::key(1, s);
+	}
+
+	return texture::key(1, map_palette(s, palette));
+}
+}
+
 texture texture::get(const std::string& str)
 {
 	texture result = texture_cache().get(str);
 	ASSERT_LOG(result.width() % 2 == 0, "\nIMAGE WIDTH IS NOT AN EVEN NUMBER OF PIXELS:" << str);
 	
 	if(!result.valid()) {
-		key surfs;
-		surfs.push_back(surface_cache::get_no_cache(str));
-		result = texture(surfs);
+		result = texture(load_image(str));
+		result.set_source(str, boost::bind(load_image, str));
 		texture_cache().put(str, result);
 		//std::cerr << (next_power_of_2(result.width())*next_power_of_2(result.height())*2)/1024 << "KB TEXTURE " << str << ": " << result.width() << "x" << result.height() << "\n";
 	}
@@ -470,9 +540,8 @@ texture texture::get(const std::string& str, const std::string& algorithm)
 	std::pair<std::string,std::string> k(str, algorithm);
 	texture result = algorithm_texture_cache().get(k);
 	if(!result.valid()) {
-		key surfs;
-		surfs.push_back(get_surface_formula(surface_cache::get_no_cache(str), algorithm));
-		result = texture(surfs);
+		result = texture(load_image_with_algorithm(str, algorithm));
+		result.set_source(str + " " + algorithm, boost::bind(load_image_with_algorithm, str, algorithm));
 		algorithm_texture_cache().put(k, result);
 	}
 
@@ -485,11 +554,10 @@ texture texture::get_palette_mapped(const std::string& str, int palette)
 	std::pair<std::string,int> k(str, palette);
 	texture result = palette_texture_cache().get(k);
 	if(!result.valid()) {
-		key surfs;
-		surface s = surface_cache::get_no_cache(str);
-		if(s.get() != NULL) {
-			surfs.push_back(map_palette(s, palette));
+		const key surfs = load_palette_mapped_image(str, palette);
+		if(surfs.front().get() != NULL) {
 			result = texture(surfs);
+			result.set_source(formatter() << str << " palette " << palette, boost::bind(load_palette_mapped_image, str, palette));
 		} else {
 			std::cerr << "COULD NOT FIND IMAGE FOR PALETTE MAPPING: '" << str << "'\n";
 		}
@@ -550,10 +618,26 @@ std::set<texture::ID*>& texture_id_registry() {
 	static std::set<texture::ID*>* instance = new std::set<texture::ID*>;
 	return *instance;
 }
+
+threading::mutex& texture_id_registry_mutex() {
+	static threading::mutex* m = new threading::mutex;
+	return *m;
+}
+
+bool compare_residency_size(const texture::residency_info& a, const texture::residency_info& b)
+{
+	return a.cpu_bytes + a.gpu_bytes > b.cpu_bytes + b.gpu_bytes;
+}
+
+bool compare_last_drawn(const texture::ID* a, const texture::ID* b)
+{
+	return a->last_drawn < b->last_drawn;
+}
 }
 
 void texture::rebuild_all()
 {
+	threading::lock lck(texture_id_registry_mutex());
 	for(std::set<texture::ID*>::iterator i = texture_id_registry().begin();
 	    i != texture_id_registry().end(); ++i) {
 		if((*i)->s.get() != NULL && (*i)->id != static_cast<unsigned int>(-1)) {
@@ -564,13 +648,93 @@ void texture::rebuild_all()
 
 void texture::unbuild_all()
 {
+	threading::lock lck(texture_id_registry_mutex());
 	for(std::set<texture::ID*>::iterator i = texture_id_registry().begin();
 	    i != texture_id_registry().end(); ++i) {
 		(*i)->unbuild_id();
 	}
 }
 
-texture::ID::ID() : id(static_cast<unsigned int>(-1)), width(0), height(0) {
+void texture::manage_residency()
+{
+	++draw_frame;
+
+	const size_t budget = size_t(preferences::texture_budget())*1024*1024;
+	if(budget == 0) {
+		return;
+	}
+
+	threading::lock lck(texture_id_registry_mutex());
+	std::vector<ID*> candidates;
+	size_t total = 0;
+	foreach(ID* id, texture_id_registry()) {
+		total += id->gpu_bytes;
+
+		//textures drawn last frame are likely to be drawn again, those
+		//without a source can't be made again, and those whose GL id is
+		//kept elsewhere would leave that id dangling.
+		if(id->gpu_bytes && id->source && !id->keep_resident && id->last_drawn < draw_frame - 1) {
+			candidates.push_back(id);
+		}
+	}
+
+	if(total <= budget) {
+		return;
+	}
+
+	//textures are unloaded until we're a little under budget, so we
+	//aren't unloading more every frame.
+	const size_t target = budget - budget/8;
+	std::sort(candidates.begin(), candidates.end(), compare_last_drawn);
+	int unloaded = 0;
+	foreach(ID* id, candidates) {
+		if(total <= target) {
+			break;
+		}
+
+		total -= id->gpu_bytes;
+		id->unload();
+		++unloaded;
+	}
+
+	if(unloaded) {
+		std::cerr << "UNLOADED " << unloaded << " TEXTURES: " << (total/(1024*1024)) << "MB ON GPU, BUDGET " << (budget/(1024*1024)) << "MB\n";
+	}
+}
+
+void texture::get_residency(std::vector<residency_info>* result)
+{
+	result->clear();
+
+	threading::lock lck(texture_id_registry_mutex());
+	foreach(const ID* id, texture_id_registry()) {
+		residency_info info;
+		info.name = id->name;
+		info.width = id->s ? id->s->w : id->width;
+		info.height = id->s ? id->s->h : id->height;
+		info.cpu_bytes = id->cpu_bytes();
+		info.gpu_bytes = id->gpu_bytes;
+		info.last_drawn = id->last_drawn;
+		info.resident = id->gpu_bytes != 0;
+		result->push_back(info);
+	}
+
+	std::sort(result->begin(), result->end(), compare_residency_size);
+}
+
+size_t texture::resident_bytes()
+{
+	size_t result = 0;
+	threading::lock lck(texture_id_registry_mutex());
+	foreach(const ID* id, texture_id_registry()) {
+		result += id->gpu_bytes;
+	}
+
+	return result;
+}
+
+texture::ID::ID() : id(static_cast<unsigned int>(-1)), width(0), height(0), alpha_bytes(0), gpu_bytes(0), last_drawn(draw_frame), keep_resident(false) {
+	threading::lock lck(texture_id_registry_mutex());
 	texture_id_registry().insert(this);
 }
 
@@ -578,9 +742,15 @@ texture::ID::ID() : id(static_cast<unsigned int>(-1)), width(0), height(0) {
 texture::ID::~ID()
 {
 	destroy();
+	threading::lock lck(texture_id_registry_mutex());
 	texture_id_registry().erase(this);
 }
 
+size_t texture::ID::cpu_bytes() const
+{
+	return sizeof(*this) + alpha_bytes + (s ? s->h*s->pitch : 0);
+}
+
 namespace {
 
 //a table which maps an 8bit color channel to a 4bit one.
@@ -641,10 +811,12 @@ void texture::ID::build_id()
 			GL_UNSIGNED_BYTE, s->pixels);
 	}
 
+	width = s->w;
+	height = s->h;
+	gpu_bytes = width*height*(preferences::use_16bpp_textures() ? 2 : 4);
+
 	//free the surface.
 	if(!preferences::compiling_tiles) {
-		width = s->w;
-		height = s->h;
 		s = surface();
 	}
 }
@@ -675,6 +847,21 @@ void texture::ID::destroy()
 
 	id = static_cast<unsigned int>(-1);
 	s = surface();
+	gpu_bytes = 0;
+}
+
+void texture::ID::unload()
+{
+	if(init()) {
+		glDeleteTextures(1, &id);
+		if(current_texture == id) {
+			current_texture = 0;
+		}
+	}
+
+	id = static_cast<unsigned int>(-1);
+	s = surface();
+	gpu_bytes = 0;
 }
 
 std::vector<boost::shared_ptr<texture::ID> > texture::id_to_build_;
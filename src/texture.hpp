@@ -15,6 +15,7 @@
 
 #include <bitset>
 #include <string>
+#include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include <vector>
 
@@ -56,6 +57,11 @@ public:
 	void set_as_current_texture() const;
 	bool valid() const { return id_; }
 
+	//to be called by code which keeps the texture's GL id to bind later,
+	//rather than binding through the texture. The texture is then never
+	//unloaded, since the id it keeps would no longer be valid.
+	void keep_resident() const;
+
 	static texture get(const std::string& str);
 	static texture get(const std::string& str, const std::string& algorithm);
 	static texture get_palette_mapped(const std::string& str, int palette);
@@ -84,6 +90,29 @@ public:
 	static void rebuild_all();
 	static void unbuild_all();
 
+	//should be called once a frame, from the main thread. While the
+	//textures on the GPU take more than preferences::texture_budget(),
+	//those drawn least recently are unloaded. They're loaded again from
+	//their images when they're next drawn.
+	static void manage_residency();
+
+	//the memory one texture takes.
+	struct residency_info {
+		std::string name;
+		int width, height;
+		size_t cpu_bytes, gpu_bytes;
+
+		//the frame it was last drawn in, and whether it's on the GPU.
+		int last_drawn;
+		bool resident;
+	};
+
+	//gets the textures in use, those taking the most memory first.
+	static void get_residency(std::vector<residency_info>* result);
+
+	//the bytes of all the textures on the GPU.
+	static size_t resident_bytes();
+
 	struct ID {
 		ID();
 		~ID();
@@ -92,8 +121,13 @@ public:
 		void unbuild_id();
 		void destroy();
 
+		//frees the texture on the GPU, to be made again from source.
+		void unload();
+
 		bool init() const { return id != static_cast<unsigned int>(-1); }
 
+		size_t cpu_bytes() const;
+
 		unsigned int id;
 
 		//before we've constructed the ID, we can store the
@@ -101,11 +135,25 @@ public:
 		surface s;
 
 		int width, height;
+
+		//makes the surfaces the texture was made from, so it can be
+		//loaded again after being unloaded. Not set for textures which
+		//weren't made from images, which are never unloaded.
+		boost::function<key()> source;
+		std::string name;
+
+		size_t alpha_bytes, gpu_bytes;
+		int last_drawn;
+
+		//set if code other than the texture keeps hold of the GL id.
+		bool keep_resident;
 	};
 
 private:
 	static texture get_no_cache(const key& k);
 
+	void set_source(const std::string& name, boost::function<key()> source);
+
 	mutable boost::shared_ptr<ID> id_;
 	unsigned int width_, height_;
 	GLfloat ratio_w_, ratio_h_;
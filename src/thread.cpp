@@ -14,10 +14,14 @@
 
 #include <boost/scoped_ptr.hpp>
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
 #include <vector>
 
+#include "foreach.hpp"
 #include "thread.hpp"
+#include "unit_test.hpp"
 
 namespace {
 
@@ -27,8 +31,333 @@ std::vector<SDL_Thread*> detached_threads;
 
 namespace threading {
 
+// The pool of worker threads which run tasks. Everything in it, and the
+// state of every task, is guarded by its one mutex.
+class task_pool
+{
+public:
+	enum { NumWorkers = 3 };
+
+	// the most workers which may run long running tasks at once.
+	enum { MaxLongRunning = NumWorkers - 1 };
+
+	// The pool is made when the first task is started, which must be on
+	// the main thread. It's never destroyed, so tasks may still be
+	// waited on after shutdown.
+	static task_pool& get() {
+		static task_pool* pool = new task_pool;
+		return *pool;
+	}
+
+	task_pool() : running_long(0), shutting_down(false)
+	{}
+
+	task_ptr start(boost::function<void()> fn, TASK_PRIORITY priority, bool long_running);
+	void queue(task_ptr t);
+	void unqueue(task_ptr t);
+	void cancel(task_ptr t);
+	void finish(task_ptr t, Uint32 run_ms);
+	void shutdown();
+
+	// takes the task a worker should run next off its queue, if any.
+	task_ptr next_task();
+
+	static void worker_loop();
+
+	mutex m;
+	condition work_ready, task_done;
+	std::deque<task_ptr> queues[NUM_TASK_PRIORITIES];
+	std::vector<boost::shared_ptr<thread> > workers;
+	std::vector<boost::function<void()> > completed;
+	task_stats stats;
+
+	// long running tasks being run by workers.
+	int running_long;
+	bool shutting_down;
+};
+
+task_ptr task_pool::start(boost::function<void()> fn, TASK_PRIORITY priority, bool long_running)
+{
+	task_ptr t(new task(fn, priority, long_running));
+	{
+		lock lck(m);
+		if(!shutting_down) {
+			queue(t);
+			return t;
+		}
+
+		t->state_ = task::TASK_RUNNING;
+	}
+
+	t->run();
+	return t;
+}
+
+void task_pool::queue(task_ptr t)
+{
+	if(shutting_down) {
+		cancel(t);
+		return;
+	}
+
+	t->state_ = task::TASK_QUEUED;
+	t->queued_at_ = SDL_GetTicks();
+	queues[t->priority_].push_back(t);
+	stats.max_queued = std::max(stats.max_queued, ++stats.queued);
+
+	if(workers.size() < NumWorkers) {
+		workers.push_back(boost::shared_ptr<thread>(new thread(worker_loop)));
+	}
+
+	work_ready.notify_one();
+}
+
+void task_pool::unqueue(task_ptr t)
+{
+	std::deque<task_ptr>& q = queues[t->priority_];
+	q.erase(std::find(q.begin(), q.end(), t));
+	--stats.queued;
+}
+
+void task_pool::cancel(task_ptr t)
+{
+	if(t->state_ == task::TASK_QUEUED) {
+		unqueue(t);
+	}
+
+	t->state_ = task::TASK_CANCELLED;
+	t->fn_ = boost::function<void()>();
+	t->callbacks_.clear();
+	++stats.cancelled;
+
+	foreach(const task_ptr& c, t->continuations_) {
+		if(c->state_ == task::TASK_WAITING) {
+			cancel(c);
+		}
+	}
+
+	t->continuations_.clear();
+	task_done.notify_all();
+}
+
+void task_pool::finish(task_ptr t, Uint32 run_ms)
+{
+	t->state_ = task::TASK_FINISHED;
+	++stats.completed;
+	stats.total_run_ms += run_ms;
+
+	completed.insert(completed.end(), t->callbacks_.begin(), t->callbacks_.end());
+	t->callbacks_.clear();
+
+	foreach(const task_ptr& c, t->continuations_) {
+		if(c->state_ == task::TASK_WAITING) {
+			queue(c);
+		}
+	}
+
+	t->continuations_.clear();
+	task_done.notify_all();
+}
+
+void task_pool::shutdown()
+{
+	std::vector<boost::shared_ptr<thread> > threads;
+	{
+		lock lck(m);
+		shutting_down = true;
+		for(int n = NUM_TASK_PRIORITIES - 1; n >= 0; --n) {
+			while(!queues[n].empty()) {
+				cancel(queues[n].front());
+			}
+		}
+
+		threads.swap(workers);
+		work_ready.notify_all();
+	}
+
+	//the threads are joined as they're destroyed.
+	threads.clear();
+
+	if(stats.completed || stats.cancelled) {
+		std::cerr << "TASKS: " << stats.completed << " COMPLETED, " << stats.cancelled << " CANCELLED, MOST QUEUED: " << stats.max_queued << ", AVERAGE WAIT: " << (stats.total_wait_ms/std::max(1, stats.completed)) << "ms, AVERAGE RUN: " << (stats.total_run_ms/std::max(1, stats.completed)) << "ms\n";
+	}
+}
+
+task_ptr task_pool::next_task()
+{
+	for(int n = NUM_TASK_PRIORITIES - 1; n >= 0; --n) {
+		for(std::deque<task_ptr>::iterator i = queues[n].begin(); i != queues[n].end(); ++i) {
+			//long running tasks wait while the workers they may have are
+			//busy, leaving the last worker to short tasks.
+			if((*i)->long_running_ && running_long >= MaxLongRunning) {
+				continue;
+			}
+
+			const task_ptr t = *i;
+			queues[n].erase(i);
+			if(t->long_running_) {
+				++running_long;
+			}
+
+			return t;
+		}
+	}
+
+	return task_ptr();
+}
+
+void task_pool::worker_loop()
+{
+	task_pool& pool = get();
+	for(;;) {
+		task_ptr t;
+		{
+			lock lck(pool.m);
+			for(;;) {
+				t = pool.next_task();
+				if(t || pool.shutting_down) {
+					break;
+				}
+
+				pool.work_ready.wait(pool.m);
+			}
+
+			if(!t) {
+				return;
+			}
+
+			--pool.stats.queued;
+			pool.stats.total_wait_ms += SDL_GetTicks() - t->queued_at_;
+			t->state_ = task::TASK_RUNNING;
+		}
+
+		t->run();
+
+		if(t->long_running_) {
+			//a long running task which was waiting may start now.
+			lock lck(pool.m);
+			--pool.running_long;
+			pool.work_ready.notify_one();
+		}
+	}
+}
+
+task::task(boost::function<void()> fn, TASK_PRIORITY priority, bool long_running)
+  : fn_(fn), priority_(priority), long_running_(long_running), state_(TASK_WAITING), queued_at_(0)
+{}
+
+void task::run()
+{
+	const Uint32 start = SDL_GetTicks();
+	fn_();
+	fn_ = boost::function<void()>();
+
+	task_pool& pool = task_pool::get();
+	lock lck(pool.m);
+	pool.finish(shared_from_this(), SDL_GetTicks() - start);
+}
+
+task::STATE task::state() const
+{
+	lock lck(task_pool::get().m);
+	return state_;
+}
+
+bool task::done() const
+{
+	const STATE s = state();
+	return s == TASK_FINISHED || s == TASK_CANCELLED;
+}
+
+void task::wait()
+{
+	task_pool& pool = task_pool::get();
+	{
+		lock lck(pool.m);
+		while(state_ != TASK_QUEUED) {
+			if(state_ == TASK_FINISHED || state_ == TASK_CANCELLED) {
+				return;
+			}
+
+			pool.task_done.wait(pool.m);
+		}
+
+		pool.unqueue(shared_from_this());
+		state_ = TASK_RUNNING;
+	}
+
+	run();
+}
+
+bool task::cancel()
+{
+	task_pool& pool = task_pool::get();
+	lock lck(pool.m);
+	if(state_ != TASK_QUEUED && state_ != TASK_WAITING) {
+		return false;
+	}
+
+	pool.cancel(shared_from_this());
+	return true;
+}
+
+task_ptr task::then(boost::function<void()> fn, TASK_PRIORITY priority, bool long_running)
+{
+	task_pool& pool = task_pool::get();
+	task_ptr t(new task(fn, priority, long_running));
+	lock lck(pool.m);
+	if(state_ == TASK_FINISHED) {
+		pool.queue(t);
+	} else if(state_ == TASK_CANCELLED) {
+		t->state_ = TASK_CANCELLED;
+	} else {
+		continuations_.push_back(t);
+	}
+
+	return t;
+}
+
+void task::on_complete(boost::function<void()> fn)
+{
+	task_pool& pool = task_pool::get();
+	lock lck(pool.m);
+	if(state_ == TASK_FINISHED) {
+		pool.completed.push_back(fn);
+	} else if(state_ != TASK_CANCELLED) {
+		callbacks_.push_back(fn);
+	}
+}
+
+task_ptr run_task(boost::function<void()> fn, TASK_PRIORITY priority, bool long_running)
+{
+	return task_pool::get().start(fn, priority, long_running);
+}
+
+void process_completed_tasks()
+{
+	std::vector<boost::function<void()> > callbacks;
+	{
+		task_pool& pool = task_pool::get();
+		lock lck(pool.m);
+		callbacks.swap(pool.completed);
+	}
+
+	foreach(const boost::function<void()>& fn, callbacks) {
+		fn();
+	}
+}
+
+task_stats get_task_stats()
+{
+	task_pool& pool = task_pool::get();
+	lock lck(pool.m);
+	return pool.stats;
+}
+
 manager::~manager()
 {
+	task_pool::get().shutdown();
+
 	for(std::vector<SDL_Thread*>::iterator i = detached_threads.begin(); i != detached_threads.end(); ++i) {
 		SDL_WaitThread(*i,NULL);
 	}
@@ -138,3 +467,198 @@ bool condition::notify_all()
 }
 
 }
+
+namespace {
+// Blocks a worker until released, so tests can tell which tasks are
+// still queued.
+struct worker_gate {
+	worker_gate() : released(0) {}
+	threading::mutex m;
+	int released;
+
+	void release(int n) {
+		threading::lock lck(m);
+		released += n;
+	}
+
+	void pass() {
+		for(;;) {
+			{
+				threading::lock lck(m);
+				if(released > 0) {
+					--released;
+					return;
+				}
+			}
+
+			SDL_Delay(1);
+		}
+	}
+};
+
+void record_value(threading::mutex* m, std::vector<int>* values, int value)
+{
+	threading::lock lck(*m);
+	values->push_back(value);
+}
+
+int square(int n)
+{
+	return n*n;
+}
+
+void set_flag(bool* flag)
+{
+	*flag = true;
+}
+
+void do_nothing()
+{
+}
+}
+
+UNIT_TEST(task_priorities_and_cancellation)
+{
+	using namespace threading;
+
+	//occupy every worker, then free just one, which must take the waiting
+	//tasks in order of priority.
+	worker_gate gate;
+	std::vector<task_ptr> blockers;
+	for(int n = 0; n != task_pool::NumWorkers; ++n) {
+		blockers.push_back(run_task(boost::bind(&worker_gate::pass, &gate), PRIORITY_HIGH));
+	}
+
+	while(get_task_stats().queued) {
+		SDL_Delay(1);
+	}
+
+	mutex m;
+	std::vector<int> order;
+	task_ptr low = run_task(boost::bind(record_value, &m, &order, 0), PRIORITY_LOW);
+	task_ptr high = run_task(boost::bind(record_value, &m, &order, 2), PRIORITY_HIGH);
+	task_ptr normal = run_task(boost::bind(record_value, &m, &order, 1));
+	task_ptr cancelled = run_task(boost::bind(record_value, &m, &order, -1), PRIORITY_HIGH);
+	task_ptr continuation = cancelled->then(boost::bind(record_value, &m, &order, -2));
+
+	CHECK_EQ(low->state(), task::TASK_QUEUED);
+	CHECK_EQ(continuation->state(), task::TASK_WAITING);
+	CHECK_EQ(cancelled->cancel(), true);
+	CHECK_EQ(continuation->state(), task::TASK_CANCELLED);
+	CHECK_EQ(cancelled->cancel(), false);
+
+	gate.release(1);
+	while(!low->done()) {
+		SDL_Delay(1);
+	}
+
+	CHECK_EQ(order.size(), 3);
+	CHECK_EQ(order[0], 2);
+	CHECK_EQ(order[1], 1);
+	CHECK_EQ(order[2], 0);
+
+	gate.release(task_pool::NumWorkers);
+	foreach(const task_ptr& t, blockers) {
+		t->wait();
+	}
+
+	CHECK_EQ(high->cancel(), false);
+}
+
+UNIT_TEST(task_wait_runs_queued_task)
+{
+	using namespace threading;
+
+	worker_gate gate;
+	std::vector<task_ptr> blockers;
+	for(int n = 0; n != task_pool::NumWorkers; ++n) {
+		blockers.push_back(run_task(boost::bind(&worker_gate::pass, &gate), PRIORITY_HIGH));
+	}
+
+	//with every worker busy, waiting on a result runs it right here.
+	future<int> f = async<int>(boost::bind(square, 7), PRIORITY_LOW);
+	CHECK_EQ(f.done(), false);
+	CHECK_EQ(f.get(), 49);
+	CHECK_EQ(f.done(), true);
+
+	bool completed = false;
+	f.get_task()->on_complete(boost::bind(set_flag, &completed));
+	CHECK_EQ(completed, false);
+	process_completed_tasks();
+	CHECK_EQ(completed, true);
+
+	gate.release(task_pool::NumWorkers);
+	foreach(const task_ptr& t, blockers) {
+		t->wait();
+	}
+}
+
+UNIT_TEST(task_continuations)
+{
+	using namespace threading;
+
+	mutex m;
+	std::vector<int> order;
+	bool completed = false;
+	task_ptr first = run_task(boost::bind(record_value, &m, &order, 1));
+	task_ptr second = first->then(boost::bind(record_value, &m, &order, 2));
+	task_ptr third = second->then(boost::bind(record_value, &m, &order, 3), PRIORITY_HIGH);
+	third->on_complete(boost::bind(set_flag, &completed));
+
+	third->wait();
+	CHECK_EQ(first->done(), true);
+	CHECK_EQ(order.size(), 3);
+	CHECK_EQ(order[0], 1);
+	CHECK_EQ(order[2], 3);
+
+	//callbacks are only ever called from process_completed_tasks().
+	CHECK_EQ(completed, false);
+	process_completed_tasks();
+	CHECK_EQ(completed, true);
+
+	const task_stats stats = get_task_stats();
+	CHECK_GE(stats.completed, 3);
+	CHECK_GE(stats.max_queued, 1);
+}
+
+UNIT_TEST(task_long_running_leaves_a_worker)
+{
+	using namespace threading;
+
+	//fill the pool with long running tasks, more than it will run at once.
+	worker_gate gate;
+	std::vector<task_ptr> loads;
+	for(int n = 0; n != task_pool::NumWorkers + 1; ++n) {
+		loads.push_back(run_task(boost::bind(&worker_gate::pass, &gate), PRIORITY_HIGH, true));
+	}
+
+	while(get_task_stats().queued > task_pool::NumWorkers + 1 - task_pool::MaxLongRunning) {
+		SDL_Delay(1);
+	}
+
+	//a short task still gets a worker, rather than waiting for them.
+	mutex m;
+	std::vector<int> order;
+	task_ptr t = run_task(boost::bind(record_value, &m, &order, 1), PRIORITY_LOW);
+	while(!t->done()) {
+		SDL_Delay(1);
+	}
+
+	CHECK_EQ(order.size(), 1);
+	CHECK_EQ(loads.back()->state(), task::TASK_QUEUED);
+
+	gate.release(loads.size());
+	foreach(const task_ptr& load, loads) {
+		while(!load->done()) {
+			SDL_Delay(1);
+		}
+	}
+}
+
+//the cost of handing a task to the pool and waiting for it to finish.
+BENCHMARK(task_round_trip)
+{
+	BENCHMARK_LOOP {
+		threading::run_task(do_nothing)->wait();
+	}
+}
@@ -19,7 +19,10 @@
 #include "SDL_thread.h"
 
 #include <list>
+#include <vector>
 
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/function.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/smart_ptr.hpp>
@@ -197,6 +200,128 @@ public:
 	virtual ACTION process() = 0;
 };
 
+// Task priorities. Tasks waiting for a worker are started highest priority
+// first, and in the order they were added within a priority.
+enum TASK_PRIORITY { PRIORITY_LOW, PRIORITY_NORMAL, PRIORITY_HIGH, NUM_TASK_PRIORITIES };
+
+// Tasks which may take a long time, such as loading a level, should be
+// marked long running. Long running tasks are never given every worker,
+// so a short task never has to wait for one to finish.
+
+class task;
+typedef boost::shared_ptr<task> task_ptr;
+
+// A function run on the pool of worker threads shared by the whole
+// program, rather than on a thread of its own. Made with run_task().
+class task : public boost::enable_shared_from_this<task>
+{
+public:
+	enum STATE {
+		TASK_WAITING,   // waiting for the task it continues to finish
+		TASK_QUEUED,    // waiting for a worker
+		TASK_RUNNING,
+		TASK_FINISHED,
+		TASK_CANCELLED
+	};
+
+	STATE state() const;
+
+	// true once the task has finished or been cancelled.
+	bool done() const;
+
+	// Wait for the task to be done. If no worker has started it yet, it
+	// is run on the calling thread instead, so waiting on a task never
+	// has to wait for the pool to be free.
+	void wait();
+
+	// Cancel the task, if it hasn't started. Tasks which continue from it
+	// are cancelled too. Returns true if the task is cancelled.
+	bool cancel();
+
+	// Run fn on the pool once this task finishes.
+	task_ptr then(boost::function<void()> fn, TASK_PRIORITY priority=PRIORITY_NORMAL, bool long_running=false);
+
+	// Call fn on the main thread, from process_completed_tasks(), once this
+	// task finishes. It's not called if the task is cancelled.
+	void on_complete(boost::function<void()> fn);
+
+private:
+	task(boost::function<void()> fn, TASK_PRIORITY priority, bool long_running);
+	void run();
+
+	friend class task_pool;
+
+	boost::function<void()> fn_;
+	TASK_PRIORITY priority_;
+	bool long_running_;
+	STATE state_;
+	Uint32 queued_at_;
+	std::vector<task_ptr> continuations_;
+	std::vector<boost::function<void()> > callbacks_;
+};
+
+// Run fn on the worker pool.
+task_ptr run_task(boost::function<void()> fn, TASK_PRIORITY priority=PRIORITY_NORMAL, bool long_running=false);
+
+// Call the on_complete() functions of tasks which have finished. Should be
+// called regularly from the main thread.
+void process_completed_tasks();
+
+// The result of a function run on the worker pool by async().
+template<typename T>
+class future
+{
+public:
+	future() {}
+	future(task_ptr t, boost::shared_ptr<T> result) : task_(t), result_(result)
+	{}
+
+	bool valid() const { return task_.get() != NULL; }
+	bool done() const { return task_->done(); }
+
+	// Wait for the function to finish and return its result. If it was
+	// cancelled, the result is a default value.
+	const T& get() const { task_->wait(); return *result_; }
+
+	bool cancel() { return task_->cancel(); }
+	const task_ptr& get_task() const { return task_; }
+
+private:
+	task_ptr task_;
+	boost::shared_ptr<T> result_;
+};
+
+namespace detail {
+template<typename T>
+void store_result(const boost::function<T()>& fn, boost::shared_ptr<T> result)
+{
+	*result = fn();
+}
+}
+
+// Run fn on the worker pool, keeping what it returns.
+template<typename T>
+future<T> async(boost::function<T()> fn, TASK_PRIORITY priority=PRIORITY_NORMAL, bool long_running=false)
+{
+	boost::shared_ptr<T> result(new T());
+	return future<T>(run_task(boost::bind(detail::store_result<T>, fn, result), priority, long_running), result);
+}
+
+// Counts of how busy the worker pool has been.
+struct task_stats {
+	task_stats() : queued(0), max_queued(0), completed(0), cancelled(0), total_wait_ms(0), total_run_ms(0)
+	{}
+
+	// tasks waiting for a worker now, and the most that ever have been.
+	int queued, max_queued;
+	int completed, cancelled;
+
+	// the time finished tasks spent waiting for a worker, and running.
+	int total_wait_ms, total_run_ms;
+};
+
+task_stats get_task_stats();
+
 }
 
 #endif
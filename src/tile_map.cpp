@@ -457,6 +457,10 @@ const std::vector<const tile_pattern*>& tile_map::get_patterns() const
 
 wml::node_ptr tile_map::write() const
 {
+	if(written_) {
+		return written_;
+	}
+
 	wml::node_ptr res(new wml::node("tile_map"));
 	res->set_attr("x", formatter() << xpos_);
 	res->set_attr("y", formatter() << ypos_);
@@ -519,6 +523,7 @@ wml::node_ptr tile_map::write() const
 
 	res->set_attr("tiles", tiles.str());
 	res->set_attr("variations", variations.str());
+	written_ = res;
 	return res;
 }
 
@@ -591,6 +596,8 @@ void tile_map::flip_variation(int x, int y, int delta)
 		return;
 	}
 
+	written_.reset();
+
 	x -= xpos_/TileSize;
 	y -= ypos_/TileSize;
 
@@ -914,6 +921,8 @@ bool tile_map::set_tile(int xpos, int ypos, const std::string& str)
 		return false;
 	}
 
+	written_.reset();
+
 	tile_string empty_tile;
 	std::fill(empty_tile.begin(), empty_tile.end(), '\0');
 	if(xpos < xpos_) {
@@ -33,8 +33,8 @@ public:
 	int zorder() const { return zorder_; }
 	int x_speed() const { return x_speed_; }
 	int y_speed() const { return y_speed_; }
-	void set_zorder(int z) { zorder_ = z; }
-	void set_speed(int x_speed, int y_speed) { x_speed_ = x_speed; y_speed_ = y_speed; }
+	void set_zorder(int z) { zorder_ = z; written_.reset(); }
+	void set_speed(int x_speed, int y_speed) { x_speed_ = x_speed; y_speed_ = y_speed; written_.reset(); }
 	const char* get_tile_from_pixel_pos(int xpos, int ypos) const;
 	const char* get_tile(int y, int x) const;
 	int get_variations(int x, int y) const;
@@ -91,6 +91,11 @@ private:
 	int patterns_version_;
 
 	std::vector<std::vector<int> > variations_;
+
+	//the result of the last call to write(), which is reused until the map
+	//is changed, so saving a level only rewrites the layers that were
+	//modified. Callers must not modify the node.
+	mutable wml::node_ptr written_;
 };
 
 #endif
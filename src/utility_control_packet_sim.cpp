@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "control_packet.hpp"
+#include "foreach.hpp"
+#include "unit_test.hpp"
+
+using boost::asio::ip::udp;
+
+namespace {
+
+//how long a game cycle lasts, in milliseconds.
+const int CycleMillis = 20;
+
+//the size of the header of a packet in the old fixed size format: the
+//'C' and ID prefix, followed by the slot and four 32-bit integers.
+const int LegacyHeaderSize = 5 + 1 + 4*4;
+
+struct sim_player {
+	boost::shared_ptr<udp::socket> socket;
+	std::vector<unsigned char> controls;
+
+	//our copy of each other player's controls, as received from them.
+	std::vector<std::vector<unsigned char> > remote_controls;
+
+	//indexed by the other player: how far we've confirmed their cycles,
+	//and how far they've confirmed ours.
+	std::vector<int32_t> highest_confirmed, remote_highest_confirmed;
+
+	int bytes_sent, legacy_bytes_sent;
+};
+
+//a datagram on its way through the simulated network.
+struct in_flight {
+	int deliver_at;
+	int to;
+	std::vector<char> data;
+};
+
+bool operator<(const in_flight& a, const in_flight& b)
+{
+	return a.deliver_at < b.deliver_at;
+}
+
+int arg_or_default(const std::vector<std::string>& args, int n, int value)
+{
+	return n < args.size() ? atoi(args[n].c_str()) : value;
+}
+
+}
+
+//simulates a game between several players exchanging control packets over
+//loopback sockets, with the network's loss, reordering and latency
+//simulated in virtual time, and reports the bandwidth each player used
+//and how long it took for their cycles to be confirmed.
+UTILITY(control_packet_sim)
+{
+	if(args.size() > 5) {
+		std::cerr << "control_packet_sim usage: [players] [cycles] [loss_percent] [latency_ms] [jitter_ms]\n";
+		return;
+	}
+
+	const int nplayers = std::max(2, std::min(8, arg_or_default(args, 0, 2)));
+	const int ncycles = arg_or_default(args, 1, 3000);
+	const int loss_percent = arg_or_default(args, 2, 5);
+	const int latency = arg_or_default(args, 3, 50);
+
+	//packets are delayed by a random amount up to the jitter on top of the
+	//latency, which reorders packets sent less than that far apart.
+	const int jitter = arg_or_default(args, 4, 30);
+
+	srand(0);
+
+	boost::asio::io_service io_service;
+	std::vector<sim_player> players(nplayers);
+	foreach(sim_player& p, players) {
+		p.socket.reset(new udp::socket(io_service, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)));
+		p.remote_controls.resize(nplayers);
+		p.highest_confirmed.resize(nplayers);
+		p.remote_highest_confirmed.resize(nplayers);
+		p.bytes_sent = p.legacy_bytes_sent = 0;
+	}
+
+	std::vector<in_flight> network;
+	std::vector<char> receive_buf(65536);
+	controls::control_packet packet;
+
+	int npackets = 0, nlost = 0, nconfirmed = 0;
+	int64_t total_confirm_time = 0;
+	int max_confirm_time = 0;
+
+	for(int cycle = 0; cycle != ncycles; ++cycle) {
+		const int now = cycle*CycleMillis;
+
+		//every player runs a cycle: players hold their controls for a while
+		//before changing them, as they would in a real game.
+		for(int n = 0; n != nplayers; ++n) {
+			sim_player& p = players[n];
+			const unsigned char state = p.controls.empty() || rand()%10 == 0 ? rand()%128 : p.controls.back();
+			p.controls.push_back(state);
+			p.highest_confirmed[n] = cycle;
+		}
+
+		//each player sends a packet to each other player.
+		for(int from = 0; from != nplayers; ++from) {
+			sim_player& p = players[from];
+
+			int32_t their_lowest_confirmed = -1;
+			for(int to = 0; to != nplayers; ++to) {
+				if(to != from && (their_lowest_confirmed == -1 || p.remote_highest_confirmed[to] < their_lowest_confirmed)) {
+					their_lowest_confirmed = p.remote_highest_confirmed[to];
+				}
+			}
+
+			//the old format sent the same packet to everyone, covering all
+			//the cycles the furthest behind player was missing.
+			const int legacy_cycles = std::min<int>(p.controls.size(), 1 + cycle - their_lowest_confirmed);
+			p.legacy_bytes_sent += (nplayers - 1)*(LegacyHeaderSize + legacy_cycles);
+
+			for(int to = 0; to != nplayers; ++to) {
+				if(to == from) {
+					continue;
+				}
+
+				packet.slot = from;
+				packet.to_slot = to;
+				packet.current_cycle = cycle;
+				packet.checksum = 0;
+				packet.ack = p.highest_confirmed[to];
+
+				const int cycles_to_write = std::min<int>(p.controls.size(), 1 + cycle - p.remote_highest_confirmed[to]);
+				packet.controls.assign(p.controls.end() - cycles_to_write, p.controls.end());
+
+				in_flight msg;
+				msg.to = to;
+				msg.deliver_at = now + latency + (jitter > 0 ? rand()%jitter : 0);
+				msg.data.resize(5);
+				msg.data[0] = 'C';
+				controls::encode_control_packet(packet, msg.data);
+				p.bytes_sent += msg.data.size();
+
+				++npackets;
+				if(rand()%100 < loss_percent) {
+					++nlost;
+					continue;
+				}
+
+				network.push_back(msg);
+			}
+		}
+
+		//deliver everything which has arrived by the end of this cycle.
+		std::stable_sort(network.begin(), network.end());
+		std::vector<in_flight>::iterator arrived = network.begin();
+		while(arrived != network.end() && arrived->deliver_at < now + CycleMillis) {
+			++arrived;
+		}
+
+		for(std::vector<in_flight>::iterator i = network.begin(); i != arrived; ++i) {
+			sim_player& receiver = players[i->to];
+			players[0].socket->send_to(boost::asio::buffer(i->data), receiver.socket->local_endpoint());
+
+			const size_t len = receiver.socket->receive(boost::asio::buffer(receive_buf));
+			if(len <= 5 || !controls::decode_control_packet(&receive_buf[5], len - 5, &packet)) {
+				std::cerr << "MALFORMED PACKET IN SIMULATION\n";
+				continue;
+			}
+
+			const int from = packet.slot;
+			controls::apply_control_packet(packet, receiver.remote_controls[from], receiver.highest_confirmed[from]);
+
+			//the ack tells the receiver how far the sender has confirmed the
+			//receiver's cycles. Time how long each newly acknowledged cycle
+			//took to be confirmed.
+			int32_t& acked = receiver.remote_highest_confirmed[from];
+			for(int c = acked + 1; c <= packet.ack; ++c) {
+				const int confirm_time = i->deliver_at - c*CycleMillis;
+				total_confirm_time += confirm_time;
+				max_confirm_time = std::max(max_confirm_time, confirm_time);
+				++nconfirmed;
+			}
+
+			acked = std::max(acked, packet.ack);
+		}
+
+		network.erase(network.begin(), arrived);
+	}
+
+	//every cycle a player has confirmed must match what was sent.
+	int nmismatches = 0;
+	for(int n = 0; n != nplayers; ++n) {
+		for(int m = 0; m != nplayers; ++m) {
+			const std::vector<unsigned char>& received = players[n].remote_controls[m];
+			for(int c = 0; n != m && c <= players[n].highest_confirmed[m] && c < received.size(); ++c) {
+				if(received[c] != players[m].controls[c]) {
+					++nmismatches;
+				}
+			}
+		}
+	}
+
+	const double seconds = (ncycles*CycleMillis)/1000.0;
+	std::cout << nplayers << " players; " << ncycles << " cycles; " << loss_percent << "% loss; " << latency << "ms latency; " << jitter << "ms jitter\n";
+	std::cout << npackets << " packets sent; " << nlost << " lost; " << nmismatches << " mismatched cycles\n";
+	for(int n = 0; n != nplayers; ++n) {
+		std::cout << "player " << n << ": " << static_cast<int>(players[n].bytes_sent/seconds) << " bytes/s (old format: " << static_cast<int>(players[n].legacy_bytes_sent/seconds) << " bytes/s)\n";
+	}
+
+	std::cout << "time to confirm: " << (nconfirmed ? total_confirm_time/nconfirmed : 0) << "ms average; " << max_confirm_time << "ms max\n";
+}
@@ -332,13 +332,13 @@ UTILITY(object_compiler)
 	for(std::map<wml::node_ptr, std::string>::iterator i = nodes_to_files.begin(); i != nodes_to_files.end(); ++i) {
 		wml::node_ptr node = i->first;
 		node->strip_prettiness();
-		sys::write_file(i->second, wml::output(node));
+		wml::write_file(i->second, node);
 	}
 
-	sys::write_file("data/compiled/gui.cfg", wml::output(gui_node));
+	wml::write_file("data/compiled/gui.cfg", gui_node);
 
 	for(std::map<std::string, wml::node_ptr>::iterator i = gui_nodes.begin();
 	    i != gui_nodes.end(); ++i) {
-		sys::write_file("data/compiled/gui/" + i->first, wml::output(i->second));
+		wml::write_file("data/compiled/gui/" + i->first, i->second);
 	}
 }
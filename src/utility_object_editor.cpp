@@ -17,6 +17,7 @@
 #include "grid_widget.hpp"
 #include "label.hpp"
 #include "preferences.hpp"
+#include "preprocessor.hpp"
 #include "raster.hpp"
 #include "surface.hpp"
 #include "surface_cache.hpp"
@@ -532,6 +533,7 @@ void show_object_editor_dialog(const std::string& obj_type)
 
 	std::cerr << "OBJECT NODE2: " << obj_node->base_elements().size() << "\n";
 	sys::write_file(*fname, wml::output(obj_node));
+	invalidate_preprocessed_file(*fname);
 }
 
 namespace {
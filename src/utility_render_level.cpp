@@ -1,16 +1,18 @@
 #include <boost/intrusive_ptr.hpp>
 
+#include <fstream>
 #include <string>
 
 #include "IMG_savepng.h"
+#include "draw_stats.hpp"
 #include "level.hpp"
 #include "texture_frame_buffer.hpp"
 #include "unit_test.hpp"
 
 UTILITY(render_level)
 {
-	if(args.size() != 2) {
-		std::cerr << "render_level usage: <level> <output_file>\n";
+	if(args.size() != 2 && args.size() != 3) {
+		std::cerr << "render_level usage: <level> <output_file> [draw_stats_file]\n";
 		return;
 	}
 
@@ -31,6 +33,9 @@ UTILITY(render_level)
 
 	texture_frame_buffer::init(seg_width, seg_height);
 
+	draw_stats::frame_stats stats;
+	int nsegments = 0;
+
 	for(int y = lvl->boundaries().y(); y < lvl->boundaries().y2(); y += seg_height) {
 		for(int x = lvl->boundaries().x(); x < lvl->boundaries().x2(); x += seg_width) {
 			texture_frame_buffer::render_scope scope;
@@ -40,9 +45,14 @@ UTILITY(render_level)
 			glPushMatrix();
 	
 			glTranslatef(-x, -y, 0);
+			draw_stats::end_frame();
 			lvl->draw(x, y, seg_width, seg_height);
+			draw_stats::end_frame();
 			glPopMatrix();
 
+			stats += draw_stats::last_frame();
+			++nsegments;
+
 			SDL_GL_SwapBuffers();
 
 			graphics::surface s(SDL_CreateRGBSurface(SDL_SWSURFACE, seg_width, seg_height, 24, SURFACE_MASK_RGB));
@@ -65,4 +75,12 @@ UTILITY(render_level)
 	}
 
 	IMG_SavePNG(output.c_str(), level_surface.get());
+
+	if(args.size() == 3) {
+		std::ofstream stats_file(args[2].c_str());
+		stats_file << "draw stats for " << file << ": " << nsegments << " segments of " << seg_width << "x" << seg_height << "\n\naverage per segment:\n";
+		draw_stats::write_report(stats_file, stats, nsegments);
+		stats_file << "\ntotal:\n";
+		draw_stats::write_report(stats_file, stats);
+	}
 }
@@ -0,0 +1,62 @@
+#include <boost/intrusive_ptr.hpp>
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "foreach.hpp"
+#include "formatter.hpp"
+#include "level.hpp"
+#include "raster.hpp"
+#include "texture.hpp"
+#include "unit_test.hpp"
+
+//lists the textures which take the most memory once a level has been
+//drawn, all of it, screen by screen.
+UTILITY(texture_report)
+{
+	if(args.size() != 1 && args.size() != 2) {
+		std::cerr << "texture_report usage: <level> [number of textures]\n";
+		return;
+	}
+
+	const int count = args.size() == 2 ? atoi(args[1].c_str()) : 20;
+
+	boost::intrusive_ptr<level> lvl(new level(args[0]));
+	lvl->set_editor();
+	lvl->finish_loading();
+
+	const int seg_width = graphics::screen_width();
+	const int seg_height = graphics::screen_height();
+	for(int y = lvl->boundaries().y(); y < lvl->boundaries().y2(); y += seg_height) {
+		for(int x = lvl->boundaries().x(); x < lvl->boundaries().x2(); x += seg_width) {
+			graphics::prepare_raster();
+			glPushMatrix();
+			glTranslatef(-x, -y, 0);
+			lvl->draw(x, y, seg_width, seg_height);
+			glPopMatrix();
+		}
+	}
+
+	std::vector<graphics::texture::residency_info> textures;
+	graphics::texture::get_residency(&textures);
+
+	size_t cpu_bytes = 0, gpu_bytes = 0;
+	foreach(const graphics::texture::residency_info& info, textures) {
+		cpu_bytes += info.cpu_bytes;
+		gpu_bytes += info.gpu_bytes;
+	}
+
+	std::cout << "textures for " << args[0] << ": " << textures.size() << ", "
+	          << cpu_bytes/1024 << "KB on CPU, " << gpu_bytes/1024 << "KB on GPU\n\n"
+	          << std::setw(8) << "CPU KB" << std::setw(8) << "GPU KB" << std::setw(12) << "SIZE" << "  TEXTURE\n";
+
+	for(int n = 0; n < count && n < textures.size(); ++n) {
+		const graphics::texture::residency_info& info = textures[n];
+		std::cout << std::setw(8) << info.cpu_bytes/1024 << std::setw(8) << info.gpu_bytes/1024
+		          << std::setw(12) << (formatter() << info.width << "x" << info.height).str()
+		          << "  " << (info.name.empty() ? "(not from an image)" : info.name) << "\n";
+	}
+}
@@ -20,18 +20,17 @@
 #include "filesystem.hpp"
 #include "preferences.hpp"
 #include "raster.hpp"
+#include "save_writer.hpp"
 #include "sound.hpp"
 
 int truncate_to_char(int value) { return std::min(std::max(value, 0), 255); }
 
 void write_autosave ()
 {
-	wml::node_ptr node = level::current().write();
-	if(sound::current_music().empty() == false) {
-		node->set_attr("music", sound::current_music());
-	}
-	
-	sys::write_file(preferences::auto_save_file_path(), wml::output(node));
+	//we're about to quit, so wait for the save to finish before marking it
+	//as valid.
+	save_writer::save_async(level::current(), preferences::auto_save_file_path());
+	save_writer::wait();
 	sys::write_file(std::string(preferences::auto_save_file_path()) + ".stat", "1");
 }
 
@@ -9,6 +9,7 @@
 #include "preferences.hpp"
 #include "asserts.hpp"
 #include "color_utils.hpp"
+#include "draw_stats.hpp"
 #include "foreach.hpp"
 #include "formatter.hpp"
 #include "formula.hpp"
@@ -171,6 +172,7 @@ bool water::draw_area(const water::area& a, int x, int y, int w, int h) const
 	unsigned char water_color[] = {a.color_[0], a.color_[1], a.color_[2], a.color_[3]};
 	
 	glBlendFunc(GL_ONE, GL_ONE);
+	draw_stats::blend_change();
 	#if defined(TARGET_OS_HARMATTAN) || defined(TARGET_PANDORA) || defined(TARGET_TEGRA)
 	if (glBlendEquationOES)
 		glBlendEquationOES(GL_FUNC_REVERSE_SUBTRACT_OES);
@@ -205,6 +207,7 @@ bool water::draw_area(const water::area& a, int x, int y, int w, int h) const
 	glColor4ub(water_color[0], water_color[1], water_color[2], water_color[3]);
 #endif	
 	glVertexPointer(2, GL_FLOAT, 0, vertices);
+	draw_stats::draw_call(sizeof(vertices)/sizeof(GLfloat)/2);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, sizeof(vertices)/sizeof(GLfloat)/2);
 	#if defined(TARGET_OS_HARMATTAN) || defined(TARGET_PANDORA) || defined(TARGET_TEGRA)
 	if (glBlendEquationOES)
@@ -216,6 +219,7 @@ bool water::draw_area(const water::area& a, int x, int y, int w, int h) const
 		glBlendEquation(GL_FUNC_ADD);
 	#endif
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	draw_stats::blend_change();
 
 	glLineWidth(2.0);
 
@@ -241,6 +245,7 @@ bool water::draw_area(const water::area& a, int x, int y, int w, int h) const
 		};
 		glVertexPointer(2, GL_FLOAT, 0, varray);
 		glColorPointer(4, GL_UNSIGNED_BYTE, 0, vcolors);
+		draw_stats::draw_call(4);
 		glDrawArrays(GL_LINE_STRIP, 0, 4);
 	
 		//draw a second line, in a different color, just below the first
@@ -259,6 +264,7 @@ bool water::draw_area(const water::area& a, int x, int y, int w, int h) const
 		};
 		glVertexPointer(2, GL_FLOAT, 0, varray2);
 		glColorPointer(4, GL_UNSIGNED_BYTE, 0, vcolors2);
+		draw_stats::draw_call(4);
 		glDrawArrays(GL_LINE_STRIP, 0, 4);
 	}
 
@@ -2,6 +2,7 @@
 #include <math.h>
 #include <vector>
 
+#include "draw_stats.hpp"
 #include "preferences.hpp"
 #include "water_particle_system.hpp"
 #include "wml_utils.hpp"
@@ -118,6 +119,7 @@ void water_particle_system::draw(const rect& screen_area, const entity& e) const
 	glColor4f(info_.rgba[0]/255.0, info_.rgba[1]/255.0, info_.rgba[2]/255.0, info_.rgba[3]/255.0);
 
 	glVertexPointer(2, GL_SHORT, 0, &vertices.front());
+	draw_stats::draw_call(vertices.size()/2);
 	glDrawArrays(GL_POINTS, 0, vertices.size()/2);
 
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
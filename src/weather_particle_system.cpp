@@ -2,6 +2,7 @@
 #include <math.h>
 #include <vector>
 
+#include "draw_stats.hpp"
 #include "weather_particle_system.hpp"
 #include "wml_utils.hpp"
 
@@ -78,6 +79,7 @@ void weather_particle_system::draw(const rect& area, const entity& e) const
 		} while (my_y < area.y()+area.h());
 	}
 	glVertexPointer(2, GL_FLOAT, 0, &vertices.front());
+	draw_stats::draw_call(vertices.size()/2);
 	glDrawArrays(GL_LINES, 0, vertices.size()/2);
 	//glDisable(GL_SMOOTH);
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
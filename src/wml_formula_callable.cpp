@@ -22,13 +22,18 @@ std::stack<scope_info, std::vector<scope_info> > scopes;
 }
 
 void wml_formula_callable_serialization_scope::register_serialized_object(const_wml_serializable_formula_callable_ptr ptr, wml::node_ptr node)
+{
+	node->set_attr("_addr", register_serialized_object(ptr));
+}
+
+std::string wml_formula_callable_serialization_scope::register_serialized_object(const_wml_serializable_formula_callable_ptr ptr)
 {
 	ASSERT_LOG(scopes.empty() == false, "register_serialized_object() called when there is no wml_formula_callable_serialization_scope");
 	scopes.top().objects_written.insert(ptr);
 
 	char addr_buf[256];
 	sprintf(addr_buf, "%p", ptr.get());
-	node->set_attr("_addr", addr_buf);
+	return addr_buf;
 }
 
 std::string  wml_formula_callable_serialization_scope::require_serialized_object(const_wml_serializable_formula_callable_ptr ptr)
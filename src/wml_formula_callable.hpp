@@ -33,6 +33,10 @@ class wml_formula_callable_serialization_scope
 {
 public:
 	static void register_serialized_object(const_wml_serializable_formula_callable_ptr ptr, wml::node_ptr node);
+
+	//registers an object whose node is written later, and returns what
+	//its _addr attribute must be set to.
+	static std::string register_serialized_object(const_wml_serializable_formula_callable_ptr ptr);
 	static std::string require_serialized_object(const_wml_serializable_formula_callable_ptr ptr);
 	static bool is_active();
 
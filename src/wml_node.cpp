@@ -41,6 +41,11 @@ void node::set_attr(const std::string& key, const value& val)
 	attr_[key] = val;
 }
 
+void node::swap_attr(const std::string& key, value& val)
+{
+	attr_[key].swap(val);
+}
+
 void node::set_or_erase_attr(const std::string& key, const std::string& value)
 {
 	if(value.empty() == false) {
@@ -225,7 +230,11 @@ const std::string& node::get_attr_comment(const std::string& name) const
 
 void node::add_attr_order(const std::string& attr)
 {
-	attr_order_.push_back(attr);
+	//a node derived from a base element may set an attribute the base
+	//already has; it should still only be written once.
+	if(std::find(attr_order_.begin(), attr_order_.end(), attr) == attr_order_.end()) {
+		attr_order_.push_back(attr);
+	}
 }
 
 void node::set_base_element(const std::string& key, wml::const_node_ptr node)
@@ -40,6 +40,10 @@ public:
 	const value& operator[](const std::string& key) const;
 	const value& attr(const std::string& key) const;
 	void set_attr(const std::string& key, const value& val);
+
+	//sets an attribute by swapping val into place, leaving val with the
+	//attribute's old value; avoids copying large values.
+	void swap_attr(const std::string& key, value& val);
 	void set_or_erase_attr(const std::string& key, const std::string& value);
 	void erase_attr(const std::string& key);
 
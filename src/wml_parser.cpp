@@ -35,6 +35,7 @@
 #include "wml_parser.hpp"
 #include "wml_schema.hpp"
 #include "wml_utils.hpp"
+#include "wml_writer.hpp"
 
 namespace wml
 {
@@ -293,6 +294,314 @@ int get_line_number(const std::string& doc, std::string::const_iterator i)
 namespace {
 concurrent_cache<std::string, std::string*> filename_pool;
 
+const std::string* get_filename_ptr(const std::string& filename)
+{
+	const std::string* filename_ptr = filename_pool.get(filename);
+	if(!filename_ptr) {
+		std::string* str = new std::string(filename);
+		filename_ptr = str;
+		filename_pool.put(filename, str);
+	}
+
+	return filename_ptr;
+}
+
+enum { CHAR_SPACE = 1, CHAR_NEWLINE = 2, CHAR_NAME = 4, CHAR_QUOTED_SPECIAL = 8 };
+
+//a table of the class of each character, so the fast parser doesn't
+//have to make a locale call for every character it looks at.
+struct char_class_table {
+	char_class_table() {
+		for(int c = 0; c != 256; ++c) {
+			classes[c] = 0;
+			if(c < 128 && isspace(c)) {
+				classes[c] |= CHAR_SPACE;
+			}
+
+			if(c < 128 && (isalnum(c) || c == '_')) {
+				classes[c] |= CHAR_NAME;
+			}
+		}
+
+		classes['\n'] |= CHAR_NEWLINE;
+		classes['\r'] |= CHAR_NEWLINE;
+
+		//the characters which end a run of characters in a quoted value.
+		classes['"'] |= CHAR_QUOTED_SPECIAL;
+		classes['\\'] |= CHAR_QUOTED_SPECIAL;
+		classes['\n'] |= CHAR_QUOTED_SPECIAL;
+		classes['\r'] |= CHAR_QUOTED_SPECIAL;
+	}
+
+	unsigned char operator[](char c) const { return classes[static_cast<unsigned char>(c)]; }
+
+	unsigned char classes[256];
+};
+
+const char_class_table char_classes;
+
+//the range [begin, end) with whitespace removed from both ends.
+void strip_span(const char*& begin, const char*& end)
+{
+	while(begin != end && (char_classes[*begin]&CHAR_SPACE)) {
+		++begin;
+	}
+
+	while(end != begin && (char_classes[*(end-1)]&CHAR_SPACE)) {
+		--end;
+	}
+}
+
+struct fast_frame {
+	fast_frame() : derived_frame(false) {}
+
+	node_ptr node;
+	std::map<std::string, node_ptr> base_nodes;
+	bool derived_frame;
+};
+
+//parses a document which only uses elements, attributes, comments and
+//base elements -- which covers levels, saved games and most objects --
+//straight from the document's buffer. Each key and value is copied out of
+//the buffer once, where the full parser builds them up a character at a
+//time. Produces exactly the same nodes as the full parser would.
+//
+//returns false if the document uses anything else, such as templates or
+//@include, or contains an error, in which case it should be given to the
+//full parser, which will handle it or report the error.
+bool fast_parse_wml(const std::string* filename_ptr, const std::string& doc, bool must_have_doc, node_ptr* result)
+{
+	const char* i = doc.c_str();
+	const char* const end = i + doc.size();
+
+	node_ptr res;
+	std::vector<fast_frame> nodes;
+	nodes.reserve(16);
+	std::string current_comment;
+	std::string quoted_value;
+	int line_number = 1;
+
+	while(i != end) {
+		const unsigned char char_class = char_classes[*i];
+		if(char_class&CHAR_NEWLINE) {
+			++i;
+			++line_number;
+		} else if(char_class&CHAR_SPACE) {
+			++i;
+		} else if(*i == '[') {
+			const char* element_end = static_cast<const char*>(memchr(i, ']', end - i));
+			if(element_end == NULL) {
+				return false;
+			}
+
+			const char* element_begin = i + 1;
+			i = element_end + 1;
+			strip_span(element_begin, element_end);
+			if(element_begin == element_end) {
+				return false;
+			}
+
+			if(*element_begin == '/') {
+				if(nodes.empty() || nodes.back().node->name().compare(0, std::string::npos, element_begin + 1, element_end - element_begin - 1) != 0) {
+					return false;
+				}
+
+				nodes.pop_back();
+				continue;
+			}
+
+			if(nodes.empty() && res) {
+				return false;
+			}
+
+			bool is_base = false;
+			const char* colon = std::find(element_begin, element_end, ':');
+			if(colon != element_end) {
+				if(nodes.empty() || colon - element_begin != 4 || memcmp(element_begin, "base", 4) != 0) {
+					return false;
+				}
+
+				is_base = true;
+				element_begin = colon + 1;
+			}
+
+			if(std::find(element_begin, element_end, '(') != element_end) {
+				return false;
+			}
+
+			const std::string element(element_begin, element_end);
+
+			bool derived_node = false;
+			node_ptr el;
+			if(!nodes.empty()) {
+				std::map<std::string, node_ptr>::const_iterator itor = nodes.back().base_nodes.find(element);
+				if(itor != nodes.back().base_nodes.end()) {
+					el = deep_copy(itor->second);
+					derived_node = true;
+				}
+			}
+
+			if(!el) {
+				el.reset(new node(element));
+			}
+
+			if(current_comment.empty() == false) {
+				el->set_comment(current_comment);
+				current_comment.clear();
+			}
+
+			if(is_base) {
+				el->set_prefix("base");
+				nodes.back().base_nodes[element] = el;
+				nodes.back().node->set_base_element(element, el);
+			} else if(nodes.empty()) {
+				res = el;
+			} else {
+				nodes.back().node->add_child(el);
+			}
+
+			nodes.push_back(fast_frame());
+			nodes.back().node = el;
+			nodes.back().derived_frame = derived_node;
+		} else if(char_class&CHAR_NAME) {
+			if(nodes.empty()) {
+				return false;
+			}
+
+			const char* name_begin = i;
+			const char* name_end = static_cast<const char*>(memchr(i, '=', end - i));
+			if(name_end == NULL) {
+				return false;
+			}
+
+			i = name_end + 1;
+			strip_span(name_begin, name_end);
+			for(const char* c = name_begin; c != name_end; ++c) {
+				if(!(char_classes[*c]&CHAR_NAME)) {
+					return false;
+				}
+			}
+
+			const std::string name(name_begin, name_end);
+			int attr_line = line_number;
+
+			//most values have no quotes in them, and can be taken straight
+			//from the buffer. Values with quotes have them removed into
+			//a scratch buffer.
+			const char* value_begin = i;
+			while(i != end && !(char_classes[*i]&CHAR_NEWLINE) && *i != '#' && *i != '"') {
+				++i;
+			}
+
+			const char* value_end = i;
+			if(i != end && *i == '"') {
+				quoted_value.assign(value_begin, i);
+				while(i != end && !(char_classes[*i]&CHAR_NEWLINE) && *i != '#') {
+					if(*i == '"') {
+						++i;
+						while(i != end && *i != '"') {
+							//copy runs of plain characters, such as the
+							//tiles of a tile map, all at once.
+							const char* run_end = i;
+							while(run_end != end && !(char_classes[*run_end]&CHAR_QUOTED_SPECIAL)) {
+								++run_end;
+							}
+
+							if(run_end != i) {
+								quoted_value.append(i, run_end);
+								i = run_end;
+								continue;
+							}
+
+							if(*i == '\\' && i+1 != end) {
+								++i;
+								//pass "\\n" through verbatim.
+								if(*i == 'n') {
+									quoted_value.push_back('\\');
+									continue;
+								}
+							}
+
+							if(char_classes[*i]&CHAR_NEWLINE) {
+								++line_number;
+							}
+
+							quoted_value.push_back(*i);
+							++i;
+						}
+
+						if(i == end) {
+							break;
+						}
+
+						++i;
+						continue;
+					}
+
+					quoted_value.push_back(*i);
+					++i;
+				}
+
+				value_begin = quoted_value.c_str();
+				value_end = value_begin + quoted_value.size();
+			}
+
+			if(i == end) {
+				return false;
+			}
+
+			//strip the value, but leave it untouched if it's all whitespace.
+			const char* stripped_begin = value_begin;
+			int newlines = 0;
+			while(stripped_begin != value_end && (char_classes[*stripped_begin]&CHAR_SPACE)) {
+				if(*stripped_begin == '\n') {
+					++newlines;
+				}
+				++stripped_begin;
+			}
+
+			if(stripped_begin != value_end) {
+				value_begin = stripped_begin;
+				while(char_classes[*(value_end-1)]&CHAR_SPACE) {
+					--value_end;
+				}
+
+				attr_line += newlines;
+			}
+
+			node& target = *nodes.back().node;
+			if(!nodes.back().derived_frame && target.has_attr(name)) {
+				return false;
+			}
+
+			wml::value value(value_begin, value_end, filename_ptr, attr_line);
+			target.swap_attr(name, value);
+			target.add_attr_order(name);
+
+			if(current_comment.empty() == false) {
+				target.set_attr_comment(name, current_comment);
+				current_comment.clear();
+			}
+		} else if(*i == '#') {
+			const char* begin_comment = i;
+			while(i != end && !(char_classes[*i]&CHAR_NEWLINE)) {
+				++i;
+			}
+
+			current_comment.append(begin_comment, i);
+		} else {
+			return false;
+		}
+	}
+
+	if((must_have_doc && !res) || !nodes.empty()) {
+		return false;
+	}
+
+	*result = res;
+	return true;
+}
+
 struct node_frame {
 	node_frame() : derived_frame(false) {}
 
@@ -308,7 +617,7 @@ struct node_frame {
 
 }
 
-node_ptr parse_wml_internal(const std::string& error_context, const std::string& doc, bool must_have_doc, const schema* current_schema)
+node_ptr parse_wml_full(const std::string& error_context, const std::string& doc, bool must_have_doc, const schema* current_schema)
 {
 #define PARSE_ERROR(msg, loc) throw parse_error(formatter() << error_context << " line " << line_number << ": " << msg, loc);
 	node_ptr res;
@@ -320,12 +629,7 @@ node_ptr parse_wml_internal(const std::string& error_context, const std::string&
 	std::locale loc;
 	int line_number = 1;
 
-	const std::string* filename_ptr = filename_pool.get(error_context);
-	if(!filename_ptr) {
-		std::string* str = new std::string(error_context);
-		filename_ptr = str;
-		filename_pool.put(error_context, str);
-	}
+	const std::string* filename_ptr = get_filename_ptr(error_context);
 
 	try {
 	while(i != doc.end()) {
@@ -564,6 +868,18 @@ node_ptr parse_wml_internal(const std::string& error_context, const std::string&
 #undef PARSE_ERROR
 }
 
+node_ptr parse_wml_internal(const std::string& error_context, const std::string& doc, bool must_have_doc, const schema* current_schema)
+{
+	if(current_schema == NULL) {
+		node_ptr res;
+		if(fast_parse_wml(get_filename_ptr(error_context), doc, must_have_doc, &res)) {
+			return res;
+		}
+	}
+
+	return parse_wml_full(error_context, doc, must_have_doc, current_schema);
+}
+
 }  // namespace
 
 node_ptr parse_wml(const std::string& doc, bool must_have_doc, const schema* schema)
@@ -643,3 +959,83 @@ UNIT_TEST(wml_parser_test) {
 	CHECK_EQ(test_node->attr("x").str(), "y");
 	CHECK_EQ(test_node->attr("a").str(), "b");
 }
+
+UNIT_TEST(wml_fast_parser_matches_full_parser) {
+	const std::string doc =
+"#the level\n"
+"[level]\n"
+"title=\"A \\\"quoted\\\" title\"\n"
+"  id = level.cfg  \n"
+"formula=\"if(x,\n"
+"   'a\\nb', 'c')\" #trailing comment\n"
+"empty=\n"
+"  [base:character]\n"
+"  type=ant\n"
+"  x=5\n"
+"  [/character]\n"
+"  #first ant\n"
+"  [character]\n"
+"  x=10\n"
+"  [/character]\n"
+"  [character]\n"
+"  type=squirrel\n"
+"  [/character]\n"
+"[/level]\n";
+
+	wml::node_ptr fast;
+	CHECK(wml::fast_parse_wml(wml::get_filename_ptr(""), doc, true, &fast), "fast parse failed");
+
+	wml::const_node_ptr full = wml::parse_wml_full("", doc, true, NULL);
+	CHECK_EQ(wml::output(fast), wml::output(full));
+	CHECK_EQ(fast->attr("title").str(), "A \"quoted\" title");
+	CHECK_EQ(fast->attr("formula").line(), full->attr("formula").line());
+	CHECK_EQ(fast->attr("formula").str(), full->attr("formula").str());
+	CHECK_EQ(fast->get_child("character")->attr("type").str(), "ant");
+	CHECK_EQ(fast->get_child("character")->get_comment(), full->get_child("character")->get_comment());
+
+	//templates aren't handled by the fast path.
+	wml::node_ptr unused;
+	CHECK_EQ(wml::fast_parse_wml(wml::get_filename_ptr(""), "[template:unit goblin(x)]\nx={x}\n[/unit]\n", true, &unused), false);
+}
+
+namespace {
+//the preprocessed contents of every level and object file.
+const std::vector<std::string>& benchmark_documents()
+{
+	static std::vector<std::string> docs;
+	if(docs.empty()) {
+		std::map<std::string, std::string> files;
+		sys::get_unique_filenames_under_dir("data/level", &files);
+		sys::get_unique_filenames_under_dir("data/objects", &files);
+
+		size_t bytes = 0;
+		for(std::map<std::string, std::string>::const_iterator i = files.begin(); i != files.end(); ++i) {
+			if(i->first.size() > 4 && std::equal(i->first.end()-4, i->first.end(), ".cfg")) {
+				docs.push_back(preprocess(sys::read_file(i->second)));
+				bytes += docs.back().size();
+			}
+		}
+
+		std::cerr << "PARSING " << docs.size() << " FILES; " << bytes << " BYTES\n";
+	}
+
+	return docs;
+}
+}
+
+BENCHMARK_ARG(wml_parse_files, bool fast)
+{
+	const std::vector<std::string>& docs = benchmark_documents();
+	BENCHMARK_LOOP {
+		foreach(const std::string& doc, docs) {
+			if(fast) {
+				wml::parse_wml(doc, false);
+			} else {
+				wml::parse_wml_full("", doc, false, NULL);
+			}
+		}
+	}
+}
+
+BENCHMARK_ARG_CALL(wml_parse_files, full, false);
+BENCHMARK_ARG_CALL(wml_parse_files, fast, true);
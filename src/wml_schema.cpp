@@ -13,6 +13,12 @@ namespace wml {
 namespace {
 std::map<std::string, schema> schemas;
 std::map<std::string, std::string> data_types;
+
+//used when validating, which may be done from several threads at once,
+//so they're made before any threads are started.
+const boost::regex int_pattern("-?[0-9]+");
+const boost::regex bool_pattern("(true|false|yes|no)");
+const std::string DefaultStr = "default";
 }
 
 void schema::init(wml::const_node_ptr node)
@@ -142,18 +148,16 @@ void schema::attribute_info::validate(const std::string& name, const std::string
 {
 	switch(type) {
 	case ATTR_INT: {
-		static const boost::regex pattern("-?[0-9]+");
 		boost::smatch match;
-		if(!boost::regex_match(value, match, pattern)) {
+		if(!boost::regex_match(value, match, int_pattern)) {
 			generate_error(formatter() << "Value for attribute " << name << " is " << value << " which is not an integer");
 		}
 		break;
 	}
 
 	case ATTR_BOOL: {
-		static const boost::regex pattern("(true|false|yes|no)");
 		boost::smatch match;
-		if(!boost::regex_match(value, match, pattern)) {
+		if(!boost::regex_match(value, match, bool_pattern)) {
 			generate_error(formatter() << "Value for attribute " << name << " is " << value << " which is not a boolean.");
 		}
 		break;
@@ -207,7 +211,6 @@ void schema::validate_attribute(const std::string& name, const std::string& valu
 	attribute_map::const_iterator itor = attributes_.find(name);
 	if(itor == attributes_.end() && name.size() <= default_prefix_.size() &&
 	 std::equal(default_prefix_.begin(), default_prefix_.end(), name.begin())) {
-		static const std::string DefaultStr = "default";
 		itor = attributes_.find(DefaultStr);
 	}
 
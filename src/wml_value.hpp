@@ -1,6 +1,7 @@
 #ifndef WML_VALUE_HPP_INCLUDED
 #define WML_VALUE_HPP_INCLUDED
 
+#include <algorithm>
 #include <sstream>
 #include <string>
 
@@ -23,6 +24,17 @@ public:
 	{
 	}
 
+	value(const char* begin, const char* end, const std::string* fname, int line)
+	  : str_(begin, end), fname_(fname), line_(line)
+	{
+	}
+
+	void swap(value& o) {
+		str_.swap(o.str_);
+		std::swap(fname_, o.fname_);
+		std::swap(line_, o.line_);
+	}
+
 	operator const std::string&() const { return str_; }
 
 	const std::string& str() const { return str_; }
@@ -1,104 +1,157 @@
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <set>
 
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
 #include "foreach.hpp"
 #include "string_utils.hpp"
+#include "unit_test.hpp"
 #include "wml_node.hpp"
+#include "wml_parser.hpp"
 #include "wml_writer.hpp"
 
 namespace wml
 {
 
 namespace {
-void write_comment(const std::string& comment, const std::string& indent, std::string& res)
+
+//how much output a file_writer collects before passing it to the file.
+const size_t FlushSize = 64*1024;
+
+//appends the WML for nodes to a buffer, one piece at a time, without
+//building up temporary strings. If given a sink, the buffer is passed on
+//to it whenever it grows large.
+class emitter
 {
-	std::vector<std::string> lines = util::split(comment, '\n');
-	foreach(const std::string& line, lines) {
-		res += indent + line + "\n";
+public:
+	explicit emitter(std::string& buf, std::ostream* sink=NULL) : buf_(buf), sink_(sink)
+	{}
+
+	void flush() {
+		if(sink_ && buf_.empty() == false) {
+			sink_->write(buf_.data(), buf_.size());
+			buf_.clear();
+		}
 	}
-}
-}
 
-void write(const wml::const_node_ptr& node, std::string& res)
-{
-	std::string indent;
-	write(node,res,indent);
-}
+	void write_node(const node& n, const node* base, int depth);
 
-namespace {
-std::string escape_quotes(const std::string& s) {
-	std::string res;
-	foreach(char c, s) {
-		if(c == '"') {
-			res.push_back('\\');
+private:
+	void write_indent(int depth) {
+		buf_.append(depth, '\t');
+	}
+
+	void write_comment(const std::string& comment, int depth) {
+		std::vector<std::string> lines = util::split(comment, '\n');
+		foreach(const std::string& line, lines) {
+			write_indent(depth);
+			buf_ += line;
+			buf_ += '\n';
+		}
+	}
+
+	void write_attr(const std::string& name, const std::string& value, int depth) {
+		write_indent(depth);
+		buf_ += name;
+		buf_ += "=\"";
+
+		//copy the value across in runs between quotes, escaping each quote.
+		const char* i = value.data();
+		const char* const end = i + value.size();
+		for(;;) {
+			const char* quote = std::find(i, end, '"');
+			buf_.append(i, quote);
+			if(quote == end) {
+				break;
+			}
+
+			buf_ += "\\\"";
+			i = quote + 1;
 		}
 
-		res.push_back(c);
+		buf_ += "\"\n";
 	}
 
-	return res;
-}
-}
+	//writes the attribute unless it has the same value in the base node.
+	void write_attr_if_not_in_base(const node& n, const std::string& name, const std::string& value, const node* base, int depth) {
+		if(base && base->attr(name).str() == value) {
+			return;
+		}
 
-void write(const wml::const_node_ptr& node, std::string& res,
-           std::string& indent, wml::const_node_ptr base)
+		const std::string& comment = n.get_attr_comment(name);
+		if(comment.empty() == false) {
+			write_comment(comment, depth);
+		}
+
+		write_attr(name, value, depth);
+	}
+
+	std::string& buf_;
+	std::ostream* sink_;
+};
+
+void emitter::write_node(const node& n, const node* base, int depth)
 {
-	if(node->get_comment().empty() == false) {
-		write_comment(node->get_comment(), indent, res);
+	if(n.get_comment().empty() == false) {
+		write_comment(n.get_comment(), depth);
 	}
-	res += indent + "[";
-	if(node->prefix().empty() == false) {
-		res += node->prefix() + ":";
+
+	write_indent(depth);
+	buf_ += '[';
+	if(n.prefix().empty() == false) {
+		buf_ += n.prefix();
+		buf_ += ':';
 	}
-	
-	res += node->name() + "]\n";
 
-	const std::vector<std::string>& attr_order = node->attr_order();
+	buf_ += n.name();
+	buf_ += "]\n";
+
+	const std::vector<std::string>& attr_order = n.attr_order();
 	foreach(const std::string& attr, attr_order) {
-		if(base && base->attr(attr).str() == node->attr(attr).str()) {
+		write_attr_if_not_in_base(n, attr, n.attr(attr).str(), base, depth);
+	}
+
+	for(wml::node::const_attr_iterator i = n.begin_attr(); i != n.end_attr(); ++i) {
+		if(!attr_order.empty() && std::find(attr_order.begin(), attr_order.end(), i->first) != attr_order.end()) {
 			continue;
 		}
 
-		const std::string& comment = node->get_attr_comment(attr);
-		if(comment.empty() == false) {
-			write_comment(comment, indent, res);
-		}
-		res += indent + attr + "=\"" + escape_quotes(node->attr(attr).str()) + "\"\n";
+		write_attr_if_not_in_base(n, i->first, i->second.str(), base, depth);
 	}
 
-	for(wml::node::const_attr_iterator i = node->begin_attr();
-	    i != node->end_attr(); ++i) {
-		if(std::find(attr_order.begin(), attr_order.end(), i->first) != attr_order.end()) {
-			continue;
+	std::set<std::string> base_written;
+	for(wml::node::const_all_child_iterator i = n.begin_children();
+	    i != n.end_children(); ++i) {
+		wml::const_node_ptr base_node;
+		if(n.base_elements().empty() == false) {
+			base_node = n.get_base_element((*i)->name());
 		}
 
-		if(base && base->attr(i->first).str() == i->second.str()) {
-			continue;
+		if(base_node && base_written.insert((*i)->name()).second) {
+			write_node(*base_node, NULL, depth + 1);
 		}
 
-		const std::string& comment = node->get_attr_comment(i->first);
-		if(comment.empty() == false) {
-			write_comment(comment, indent, res);
+		write_node(**i, base_node.get(), depth + 1);
+
+		if(buf_.size() >= FlushSize) {
+			flush();
 		}
-		res += indent + i->first + "=\"" + escape_quotes(i->second.str()) + "\"\n";
 	}
-	indent.push_back('\t');
 
-	std::set<std::string> base_written;
-	for(wml::node::const_all_child_iterator i = node->begin_children();
-	    i != node->end_children(); ++i) {
-		wml::const_node_ptr base_node = node->get_base_element((*i)->name());
-		if(base_node && base_written.count((*i)->name()) == 0) {
-			base_written.insert((*i)->name());
-			if(base_node) {
-				write(base_node, res, indent);
-			}
-		}
+	write_indent(depth);
+	buf_ += "[/";
+	buf_ += n.name();
+	buf_ += "]\n\n";
+}
 
-		write(*i, res, indent, base_node);
-	}
-	indent.resize(indent.size()-1);
-	res += indent + "[/" + node->name() + "]\n\n";
+}
+
+void write(const wml::const_node_ptr& node, std::string& res)
+{
+	emitter(res).write_node(*node, NULL, 0);
 }
 
 std::string output(const wml::const_node_ptr& node)
@@ -108,4 +161,150 @@ std::string output(const wml::const_node_ptr& node)
 	return res;
 }
 
+file_writer::file_writer(const std::string& fname, bool compress, bool append)
+  : file_(new std::ofstream(fname.c_str(), std::ios_base::binary | (append ? std::ios_base::app : std::ios_base::trunc)))
+{
+	if(compress) {
+		boost::iostreams::filtering_ostream* filter = new boost::iostreams::filtering_ostream;
+		filter->push(boost::iostreams::gzip_compressor());
+		filter->push(*file_);
+		stream_.reset(filter);
+	}
+
+	buf_.reserve(FlushSize*2);
+}
+
+file_writer::~file_writer()
+{
+	if(file_->is_open()) {
+		close();
+	}
+}
+
+void file_writer::write(const wml::const_node_ptr& node)
+{
+	emitter e(buf_, stream_ ? stream_.get() : file_.get());
+	e.write_node(*node, NULL, 0);
+	if(buf_.size() >= FlushSize) {
+		e.flush();
+	}
+}
+
+void file_writer::flush()
+{
+	emitter(buf_, stream_ ? stream_.get() : file_.get()).flush();
+}
+
+bool file_writer::ok() const
+{
+	return file_->good() && (!stream_ || stream_->good());
+}
+
+bool file_writer::close()
+{
+	flush();
+	bool result = ok();
+
+	//the compressing stream must be closed before the file, so it
+	//writes out the end of the compressed data.
+	stream_.reset();
+	file_->close();
+	return result && !file_->fail();
+}
+
+bool write_file(const std::string& fname, const wml::const_node_ptr& node, bool compress)
+{
+	file_writer writer(fname, compress);
+	writer.write(node);
+	return writer.close();
+}
+
+}
+
+UNIT_TEST(wml_writer_round_trip)
+{
+	const std::string doc =
+"[level]\n"
+"title=\"A \\\"quoted\\\" title\"\n"
+"\t[base:character]\n"
+"\ttype=\"ant\"\n"
+"\tx=\"5\"\n"
+"\t[/character]\n"
+"\t[character]\n"
+"\tx=\"10\"\n"
+"\t[/character]\n"
+"[/level]\n";
+
+	wml::const_node_ptr node = wml::parse_wml(doc);
+	const std::string out = wml::output(node);
+
+	//attributes the same as in the base element aren't written again.
+	CHECK_EQ(out,
+"[level]\n"
+"title=\"A \\\"quoted\\\" title\"\n"
+"\t[base:character]\n"
+"\ttype=\"ant\"\n"
+"\tx=\"5\"\n"
+"\t[/character]\n\n"
+"\t[character]\n"
+"\tx=\"10\"\n"
+"\t[/character]\n\n"
+"[/level]\n\n");
+
+	CHECK_EQ(wml::output(wml::parse_wml(out)), out);
+}
+
+UNIT_TEST(wml_writer_reports_failure)
+{
+	wml::const_node_ptr node(new wml::node("level"));
+	CHECK_EQ(wml::write_file("no_such_directory/level.cfg", node), false);
+	CHECK_EQ(wml::write_file("no_such_directory/level.cfg", node, true), false);
+}
+
+namespace {
+//a node as large as a big level's, with many tile maps and objects.
+wml::node_ptr create_large_level()
+{
+	wml::node_ptr lvl(new wml::node("level"));
+	lvl->set_attr("id", "benchmark.cfg");
+	lvl->set_attr("title", "Benchmark \"level\"");
+
+	std::string tiles;
+	for(int n = 0; n != 2000; ++n) {
+		tiles += n%60 == 0 ? "\n" : ",";
+		tiles += n%3 ? "grs" : "";
+	}
+
+	for(int n = 0; n != 40; ++n) {
+		wml::node_ptr tile_map(new wml::node("tile_map"));
+		tile_map->set_attr("zorder", "-10");
+		tile_map->set_attr("tiles", tiles);
+		lvl->add_child(tile_map);
+	}
+
+	for(int n = 0; n != 2000; ++n) {
+		wml::node_ptr character(new wml::node("character"));
+		character->set_attr("type", "ant_black");
+		character->set_attr("x", "1024");
+		character->set_attr("y", "768");
+		character->set_attr("face_right", "yes");
+		character->set_attr("on_process", "if(x > level.player.x, set(velocity_x, -100), set(velocity_x, 100))");
+		wml::node_ptr vars(new wml::node("vars"));
+		vars->set_attr("path", "[[0, 0], [100, 0]]");
+		character->add_child(vars);
+		lvl->add_child(character);
+	}
+
+	return lvl;
+}
+}
+
+BENCHMARK(wml_write_level)
+{
+	static const wml::const_node_ptr lvl = create_large_level();
+	std::string out;
+	BENCHMARK_LOOP {
+		out.clear();
+		wml::write(lvl, out);
+	}
 }
@@ -1,16 +1,52 @@
 #ifndef WML_WRITER_HPP_INCLUDED
 #define WML_WRITER_HPP_INCLUDED
 
+#include <iosfwd>
 #include <string>
 
+#include <boost/scoped_ptr.hpp>
+
 #include "wml_node_fwd.hpp"
 
 namespace wml
 {
+//appends the WML text for node to res.
 void write(const wml::const_node_ptr& node, std::string& res);
-void write(const wml::const_node_ptr& node, std::string& res,
-           std::string& indent, wml::const_node_ptr base=wml::const_node_ptr());
 std::string output(const wml::const_node_ptr& node);
+
+//writes WML to a file as it's generated, so a document never has to be
+//held in memory as text all at once. The file may optionally be gzip
+//compressed, or appended to, but not both.
+class file_writer
+{
+public:
+	explicit file_writer(const std::string& fname, bool compress=false, bool append=false);
+	~file_writer();
+
+	void write(const wml::const_node_ptr& node);
+
+	//writes any buffered output to the file.
+	void flush();
+
+	//false if the file couldn't be opened or written to.
+	bool ok() const;
+
+	//writes out everything and closes the file, returning false if any of
+	//it couldn't be written. Nothing may be written afterwards.
+	bool close();
+
+private:
+	file_writer(const file_writer&);
+	void operator=(const file_writer&);
+
+	std::string buf_;
+	boost::scoped_ptr<std::ofstream> file_;
+	boost::scoped_ptr<std::ostream> stream_;
+};
+
+//writes node to the file fname, optionally gzip compressed. Returns
+//false if the file couldn't be written.
+bool write_file(const std::string& fname, const wml::const_node_ptr& node, bool compress=false);
 }
 
 #endif